@@ -16,6 +16,8 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
 #include "rLog.h"
 #include "rStrings.h"
 #include "reEsp32.h"
@@ -53,6 +55,10 @@ static const uint32_t WIFI_STA_CONNECTED   = BIT6;
 static const uint32_t ETHERNET_STARTED     = BIT7;
 static const uint32_t ETHERNET_CONNECTED   = BIT8;
 
+// Active uplink (CONFIG_STATES_UPLINK)
+static const uint32_t UPLINK_WIFI          = BIT14;
+static const uint32_t UPLINK_ETHERNET      = BIT15;
+
 // Ping
 #define NETWORK_CONNECTED                  (WIFI_STA_CONNECTED | ETHERNET_CONNECTED)
 static const uint32_t INET_AVAILABLED      = BIT10;
@@ -60,6 +66,7 @@ static const uint32_t INET_SLOWDOWN        = BIT11;
 
 // System flags
 static const uint32_t SYSTEM_OTA           = BIT12;
+static const uint32_t NETWORK_FLAPPING     = BIT13;
 
 // MQTT 
 static const uint32_t MQTT_1_ENABLED       = BIT16;
@@ -83,6 +90,8 @@ static const uint32_t ERR_OPENMON          = BIT7;
 static const uint32_t ERR_NARODMON         = BIT8;
 static const uint32_t ERR_PUBLISH          = ERR_SITE | ERR_THINGSPEAK | ERR_OPENMON | ERR_NARODMON;
 
+static const uint32_t ERR_WATCHDOG         = BIT9;  // Set by the subsystem watchdogs (SWA_ERROR)
+
 static const uint32_t ERR_SENSOR_0         = BIT16;
 static const uint32_t ERR_SENSOR_1         = BIT17;
 static const uint32_t ERR_SENSOR_2         = BIT18;
@@ -93,17 +102,384 @@ static const uint32_t ERR_SENSOR_6         = BIT22;
 static const uint32_t ERR_SENSOR_7         = BIT23;
 static const uint32_t ERR_SENSORS          = ERR_SENSOR_0 | ERR_SENSOR_1 | ERR_SENSOR_2 | ERR_SENSOR_3 | ERR_SENSOR_4 | ERR_SENSOR_5 | ERR_SENSOR_6 | ERR_SENSOR_7;
 
+// Event handlers of the module (source of changes in the history of states)
+typedef enum {
+  SH_SYSTEM = 0,
+  SH_TIME,
+  SH_WIFI,
+  SH_MQTT,
+  SH_PING,
+  SH_SENSOR,
+  SH_MAX,
+  SH_NONE = 0xFF
+} states_handler_index_t;
+
+typedef enum {
+  SG_STATES = 0,
+  SG_ERRORS,
+  SG_RESTART
+} states_group_t;
+
+// Subsystem watchdogs
+typedef enum {
+  SWA_RESTART = 0,         // Restart the device with the given reason
+  SWA_EVENT,               // Post an event (e.g. a reconnect command)
+  SWA_ERROR                // Set error bits until the fault is gone (only the bits that were not set before are cleared)
+} states_wdt_action_t;
+
+typedef struct {
+  const char* name;
+  states_group_t group;    // Group whose bits describe the health of the subsystem (SG_STATES or SG_ERRORS)
+  EventBits_t ok_all;      // Fault if any of these bits is cleared...
+  EventBits_t fail_any;    // ...or any of these bits is set
+  EventBits_t armed_all;   // States that must all be set for the watchdog to run
+  EventBits_t armed_any[2];// Each non-zero mask must have at least one bit set for the watchdog to run
+  uint32_t timeout;        // Seconds
+  bool dampen;             // Network watchdog: is not cancelled by disarming while NETWORK_FLAPPING is set, recovery always cancels it
+  states_wdt_action_t action;
+  re_reset_reason_t reason;      // SWA_RESTART
+  esp_event_base_t event_base;   // SWA_EVENT
+  int32_t event_id;              // SWA_EVENT
+  EventBits_t error_bits;        // SWA_ERROR
+} states_watchdog_t;
+
+// Events of the module
+extern const char* RE_STATES_EVENTS;
+typedef enum {
+  RE_STATES_UPLINK_SWITCHED = 0,  // states_uplink_switch_t
+  RE_STATES_SENSORS_TIMEOUT       // No data; sensors have been in the error state for CONFIG_STATES_WDT_SENSORS_MINUTES
+} states_event_id_t;
+
+#if CONFIG_STATES_AVAILABILITY
+typedef enum {
+  SW_HOUR = 0,
+  SW_DAY
+} states_window_t;
+#endif // CONFIG_STATES_AVAILABILITY
+
+#if CONFIG_STATES_BOOT_TIMELINE
+// wifi_started, wifi_connected, ethernet_connected, rtc, sntp, inet, mqtt, started
+#define STATES_BOOT_MILESTONES 8
+
+typedef struct {
+  char     version[16];                              // APP_VERSION
+  uint8_t  reset_reason;
+  uint32_t init_time;                                // Milliseconds from boot to statesInit()
+  uint32_t milestones[STATES_BOOT_MILESTONES];       // Milliseconds from statesInit(), 0 - not reached
+} states_boot_timeline_t;
+#endif // CONFIG_STATES_BOOT_TIMELINE
+
+#if CONFIG_STATES_RTC_SNAPSHOT
+typedef struct {
+  time_t   saved;          // Time of the last update
+  uint32_t states;         // Last states while SYSTEM_STARTED was set
+  uint32_t errors;
+  time_t   inet_failure;   // Beginning of an open internet failure, 0 - none
+  time_t   mqtt_failure;   // Beginning of an open MQTT failure, 0 - none
+} states_snapshot_t;
+#endif // CONFIG_STATES_RTC_SNAPSHOT
+
+#if CONFIG_STATES_HISTORY
+typedef struct {
+  int64_t  timestamp;      // esp_timer_get_time() at the moment of change
+  uint32_t old_bits;
+  uint32_t new_bits;
+  int16_t  event_id;       // -1 if the change was made outside the states event handlers
+  uint8_t  handler;        // states_handler_index_t
+  uint8_t  group;          // states_group_t
+} states_history_record_t;
+
+typedef struct {
+  uint32_t position;
+} states_history_iterator_t;
+#endif // CONFIG_STATES_HISTORY
+
+#if CONFIG_STATES_EVENT_TRACE
+#ifndef CONFIG_STATES_EVENT_TRACE_PAYLOAD
+  #define CONFIG_STATES_EVENT_TRACE_PAYLOAD 48
+#endif // CONFIG_STATES_EVENT_TRACE_PAYLOAD
+
+typedef struct {
+  int64_t  timestamp;      // esp_timer_get_time() when the event was passed to the handler
+  uint32_t digest;         // CRC32 of the whole payload
+  int16_t  event_id;
+  uint16_t length;         // Length of the whole payload, 0 - no payload or its layout is unknown
+  uint8_t  payload[CONFIG_STATES_EVENT_TRACE_PAYLOAD];   // Beginning of the payload (aligned, it is passed to the handlers)
+  uint8_t  handler;        // states_handler_index_t
+} states_trace_record_t;
+#endif // CONFIG_STATES_EVENT_TRACE
+
+#ifndef CONFIG_STATES_WATCHDOGS_MAX
+  #define CONFIG_STATES_WATCHDOGS_MAX 6
+#endif // CONFIG_STATES_WATCHDOGS_MAX
+
+#if CONFIG_ENABLE_STATES_NOTIFICATIONS
+#ifndef CONFIG_STATES_HEALTH_MONITORS_MAX
+  #define CONFIG_STATES_HEALTH_MONITORS_MAX 16
+#endif // CONFIG_STATES_HEALTH_MONITORS_MAX
+
+// Notification channels, each of them has its own rate limit
+typedef enum {
+  SN_SERVICE = 0,
+  SN_SENSOR,
+  SN_MQTT_ERRORS,
+  SN_START,
+  SN_MAX
+} states_notify_channel_t;
+
+typedef struct {
+  float    tokens;
+  int64_t  updated;
+  uint32_t sent;
+  uint32_t suppressed;
+} states_notify_bucket_t;
+
+// Health monitors that the network event handlers drive directly
+typedef enum {
+  SHM_WIFI = 0,
+  SHM_ETHERNET,
+  SHM_INET,
+  SHM_MQTT,
+  SHM_MAX
+} states_monitor_role_t;
+
+typedef struct {
+  reHealthMonitor* monitor;
+  EventBits_t depends_all;   // All of these bits must be set
+  EventBits_t depends_any;   // At least one of these bits must be set
+  bool locked;
+} states_health_monitor_t;
+#endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+
+/**
+ * Context of a set of states and errors. Besides two event groups, a lock serializing the changes and a change callback, 
+ * each context has its own watchdog table, health monitor registry (including the monitors driven by the network 
+ * handlers) and notification rate limits, so that several virtual devices can live side by side in one process. 
+ * The time, WiFi, Ethernet, ping and MQTT handlers work on the context passed to statesCtxEventHandle().
+ * The module API works with the default context, which is the only one that drives what exists once per device: 
+ * system and sensor events, history, trace, availability, boot timeline, flap detection, error counters, snapshot, 
+ * OTA verification, uplink, event posts, restarts, LED and the delivery of notifications (digest, outbox, backends). 
+ * Notifications of other contexts pass their own rate limits and go to on_notify. The LED queue, the heap failure 
+ * counters and the leak buffer belong to the chip and stay process-wide. statesCtxInit() clears the whole structure, 
+ * so a context must be freed with statesCtxFree() before it is initialized again
+ * */
+typedef struct re_states_ctx_t re_states_ctx_t;
+typedef void (*states_ctx_changed_t)(re_states_ctx_t* ctx, states_group_t group, EventBits_t bits_old, EventBits_t bits_new, void* arg);
+
+typedef struct {
+  states_watchdog_t config;
+  re_restart_timer_t restart;
+  esp_timer_handle_t timer;
+  re_states_ctx_t* ctx;
+  EventBits_t owned_bits;
+  bool running;
+  bool fired;
+} states_watchdog_slot_t;
+
+#if CONFIG_ENABLE_STATES_NOTIFICATIONS
+typedef bool (*states_ctx_notify_t)(re_states_ctx_t* ctx, states_notify_channel_t channel, uint32_t msg_options, const char* text, void* arg);
+#endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+
+struct re_states_ctx_t {
+  const char* name;
+  EventGroupHandle_t states;
+  EventGroupHandle_t errors;
+  SemaphoreHandle_t lock;
+  // Recursive: changing the error bits re-enters the check
+  SemaphoreHandle_t watchdogs_lock;
+  states_watchdog_slot_t watchdogs[CONFIG_STATES_WATCHDOGS_MAX];
+  uint8_t watchdogs_count;
+  uint32_t watchdogs_fired;
+  #if CONFIG_ENABLE_STATES_NOTIFICATIONS
+    // Recursive: a monitor may change the states while it is being locked or unlocked
+    SemaphoreHandle_t monitors_lock;
+    states_health_monitor_t monitors[CONFIG_STATES_HEALTH_MONITORS_MAX];
+    uint8_t monitors_count;
+    EventBits_t monitors_mask;
+    reHealthMonitor* monitor_roles[SHM_MAX];
+    // The start channel of the default context is kept in RTC memory instead
+    states_notify_bucket_t notify[SN_MAX];
+    states_ctx_notify_t on_notify;
+  #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+  #if CONFIG_STATES_STATIC_ALLOCATION
+    StaticEventGroup_t buf_states;
+    StaticEventGroup_t buf_errors;
+    StaticSemaphore_t buf_lock;
+    StaticSemaphore_t buf_watchdogs_lock;
+    #if CONFIG_ENABLE_STATES_NOTIFICATIONS
+      StaticSemaphore_t buf_monitors_lock;
+    #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+  #endif // CONFIG_STATES_STATIC_ALLOCATION
+  states_ctx_changed_t on_changed;
+  void* arg;
+};
+
+#if CONFIG_STATES_FLEET_SIM
+// Fault model of the virtual nodes, chances are per node per simulation tick
+typedef struct {
+  uint16_t loss;               // Permille, the internet is lost while the link is up (needs the pinger)
+  uint16_t flap;               // Permille, the network link is dropped
+  uint16_t failover;           // Permille, the current MQTT broker fails and the node switches to the other one
+  uint16_t recovery;           // Permille, a lost link, internet or broker connection is restored
+  uint32_t tick_ms;            // Period of the simulation tick
+  uint32_t alert_threshold;    // Seconds, threshold of the health monitors of the nodes
+  uint32_t watchdog_timeout;   // Seconds without MQTT before the watchdog of the node sets ERR_WATCHDOG and the node restarts, 0 - disabled
+} states_fleet_model_t;
+#endif // CONFIG_STATES_FLEET_SIM
+
+#if CONFIG_STATES_ERROR_COUNTERS
+typedef struct {
+  uint32_t count;          // Number of times the error bit has been set
+  uint64_t active_time;    // Milliseconds the bit has been set, including the current period
+  time_t   first_set;      // 0 - never
+  time_t   last_set;
+  time_t   last_clear;
+} states_error_counter_t;
+#endif // CONFIG_STATES_ERROR_COUNTERS
+
+#if CONFIG_STATES_SENSOR_SEVERITY && !defined(CONFIG_NO_SENSORS)
+typedef enum {
+  SSS_OK = 0,
+  SSS_INFO,                // Not initialized yet
+  SSS_WARNING,             // Transient: timeout, CRC error, no data
+  SSS_ERROR,               // Calibration or general error, not supported
+  SSS_CRITICAL,            // Connection lost
+  SSS_MAX
+} states_sensor_severity_t;
+
+typedef struct {
+  uint8_t  sensor_id;
+  uint8_t  status;         // sensor_status_t
+  uint8_t  severity;       // states_sensor_severity_t
+  uint16_t changes;
+  time_t   time_changed;   // 0 - no change since the start
+} states_sensor_status_t;
+#endif // CONFIG_STATES_SENSOR_SEVERITY
+
+#if CONFIG_STATES_INET_QUALITY
+typedef enum {
+  SIT_DOWN = 0,
+  SIT_POOR,
+  SIT_FAIR,
+  SIT_GOOD,
+  SIT_EXCELLENT
+} states_inet_tier_t;
+
+typedef struct {
+  uint8_t  score;          // 0 - no internet, 1..100
+  uint8_t  tier;           // states_inet_tier_t
+  float    rtt;            // EWMA of the round trip time, ms
+  float    rtt_var;        // EWMA of the RTT deviation (jitter), ms
+  float    loss;           // EWMA of the packet loss, %
+  uint32_t rtt_p50;        // RTT quantiles of the recent samples, ms
+  uint32_t rtt_p90;
+  uint32_t rtt_p99;
+  uint32_t samples;
+} states_inet_quality_t;
+#endif // CONFIG_STATES_INET_QUALITY
+
+#if CONFIG_STATES_UPLINK
+typedef enum {
+  SU_NONE = 0,
+  SU_WIFI,
+  SU_ETHERNET,
+  SU_MAX
+} states_uplink_t;
+
+typedef enum {
+  SUP_PREFER_WIRED = 0,    // Ethernet whenever it is up
+  SUP_LOWEST_RTT,          // The uplink with an RTT lower by CONFIG_STATES_UPLINK_RTT_MARGIN percent (see statesUplinkReportRtt)
+  SUP_STICKY               // The active uplink is kept until it is lost
+} states_uplink_policy_t;
+
+typedef enum {
+  SUR_LOST = 0,            // The active uplink has been lost
+  SUR_PREFERRED,           // The preferred uplink has come up
+  SUR_RTT                  // The other uplink is faster
+} states_uplink_reason_t;
+
+// Event data of RE_STATES_UPLINK_SWITCHED
+typedef struct {
+  uint8_t from;            // states_uplink_t
+  uint8_t to;              // states_uplink_t, SU_NONE - no uplink left
+  uint8_t reason;          // states_uplink_reason_t
+  float   rtt_from;        // ms, 0 - unknown
+  float   rtt_to;
+} states_uplink_switch_t;
+
+#endif // CONFIG_STATES_UPLINK
+
+#if CONFIG_STATES_MQTT_STATS
+typedef enum {
+  SMB_PRIMARY = 0,
+  SMB_RESERVE,
+  SMB_MAX
+} states_mqtt_broker_t;
+
+// Times are in seconds since boot, durations in seconds
+typedef struct {
+  uint32_t attempts;               // Connection attempts (successful and failed)
+  uint32_t connects;
+  uint32_t failures;
+  uint32_t consecutive_failures;   // Failures since the last successful connection
+  uint32_t disconnects;            // Established sessions that were lost
+  uint32_t switches;               // The client has switched to this broker
+  uint32_t time_failure;           // Last failed attempt, 0 - none
+  uint32_t session_start;
+  uint32_t session_last;
+  uint32_t session_max;
+  uint32_t session_total;          // Closed sessions only
+  uint32_t connect_time_last;      // From the loss of the previous connection to this connection
+  uint32_t connect_time_max;
+  bool     reachable_known;        // The broker host is pinged
+  bool     reachable;
+  uint32_t reachable_since;
+  uint32_t reachable_changes;
+} states_mqtt_broker_stats_t;
+#endif // CONFIG_STATES_MQTT_STATS
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+re_states_ctx_t* statesCtxDefault();
+bool statesCtxInit(re_states_ctx_t* ctx, const char* name, states_ctx_changed_t on_changed, void* arg);
+void statesCtxFree(re_states_ctx_t* ctx);
+EventBits_t statesCtxGet(re_states_ctx_t* ctx);
+bool statesCtxCheck(re_states_ctx_t* ctx, EventBits_t bits, const bool clearOnExit);
+bool statesCtxCheckAny(re_states_ctx_t* ctx, EventBits_t bits, const bool clearOnExit);
+bool statesCtxClear(re_states_ctx_t* ctx, EventBits_t bits);
+bool statesCtxSet(re_states_ctx_t* ctx, EventBits_t bits);
+EventBits_t statesCtxWait(re_states_ctx_t* ctx, EventBits_t bits, BaseType_t clearOnExit, BaseType_t waitAllBits, TickType_t timeout);
+EventBits_t statesCtxGetErrors(re_states_ctx_t* ctx);
+bool statesCtxCheckErrors(re_states_ctx_t* ctx, EventBits_t bits, const bool clearOnExit);
+bool statesCtxClearErrors(re_states_ctx_t* ctx, EventBits_t bits);
+bool statesCtxSetErrors(re_states_ctx_t* ctx, EventBits_t bits);
+int8_t statesCtxWatchdogAdd(re_states_ctx_t* ctx, const states_watchdog_t* watchdog);
+void statesCtxEventHandle(re_states_ctx_t* ctx, esp_event_base_t event_base, int32_t event_id, void* event_data);
+#if CONFIG_ENABLE_STATES_NOTIFICATIONS
+void statesCtxSetNotify(re_states_ctx_t* ctx, states_ctx_notify_t on_notify);
+bool statesCtxHealthMonitorRegister(re_states_ctx_t* ctx, reHealthMonitor* monitor, EventBits_t depends_all, EventBits_t depends_any);
+void statesCtxHealthMonitorUnregister(re_states_ctx_t* ctx, reHealthMonitor* monitor);
+void statesCtxHealthMonitorAssign(re_states_ctx_t* ctx, states_monitor_role_t role, reHealthMonitor* monitor);
+bool statesCtxHealthMonitorNotify(re_states_ctx_t* ctx, hm_notify_data_t* notify_data);
+#endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+
 void statesInit(bool registerEventHandler);
 void statesFree(bool unregisterEventHandler);
 bool statesEventHandlerRegister();
 void statesEventHandlerUnregister();
 
+/**
+ * JSON functions with the "To" suffix write into the caller's buffer and return the full length of the JSON,
+ * if it is not less than the size of the buffer, the output has been truncated. The functions that return a string
+ * allocated on the heap (must be freed by the caller) are not available with CONFIG_STATES_ZERO_HEAP
+ * */
 EventBits_t statesGet();
+size_t statesGetJsonTo(char* buffer, size_t size);
+#if !CONFIG_STATES_ZERO_HEAP
 char* statesGetJson();
+#endif // CONFIG_STATES_ZERO_HEAP
 bool statesCheck(EventBits_t bits, const bool clearOnExit);
 bool statesClear(EventBits_t bits);
 bool statesSet(EventBits_t bits);
@@ -118,16 +494,98 @@ bool statesInetIsAvailabled();
 bool statesInetIsDelayed();
 bool statesInetIsGood(bool checkRssi);
 bool statesInetWait(TickType_t timeout);
+#if CONFIG_STATES_FLAP_DETECTION
+bool statesNetworkIsFlapping();
+#endif // CONFIG_STATES_FLAP_DETECTION
 bool statesInetWaitMs(TickType_t timeout);
+#if CONFIG_STATES_MQTT_STATS
+bool statesMqttBrokerStats(states_mqtt_broker_t index, states_mqtt_broker_stats_t* stats);
+// Seconds until return to the primary broker is advised, UINT32_MAX - the primary broker is unreachable
+uint32_t statesMqttFailbackDelay();
+bool statesMqttFailbackAllowed();
+#endif // CONFIG_STATES_MQTT_STATS
+#if CONFIG_STATES_UPLINK
+states_uplink_t statesUplinkActive();
+void statesUplinkSetPolicy(states_uplink_policy_t policy);
+// The pinger only measures the route through the active uplink; for SUP_LOWEST_RTT the application must probe the other 
+// uplink (e.g. a ping bound to its interface) and report it here, results older than CONFIG_STATES_UPLINK_RTT_MAX_AGE are ignored
+void statesUplinkReportRtt(states_uplink_t uplink, float rtt);
+#endif // CONFIG_STATES_UPLINK
+#if CONFIG_STATES_INET_QUALITY
+uint8_t statesInetQualityScore();
+states_inet_tier_t statesInetQualityTier();
+bool statesInetQualityGet(states_inet_quality_t* quality);
+#endif // CONFIG_STATES_INET_QUALITY
 
 EventBits_t statesGetErrors();
+size_t statesGetErrorsJsonTo(char* buffer, size_t size);
+#if !CONFIG_STATES_ZERO_HEAP
 char* statesGetErrorsJson();
+#endif // CONFIG_STATES_ZERO_HEAP
 bool statesCheckErrors(EventBits_t bits, const bool clearOnExit);
 bool statesCheckErrorsAll(const bool clearOnExit);
 bool statesSetErrors(EventBits_t bits);
 bool statesSetError(EventBits_t bit, bool state);
 bool statesClearErrors(EventBits_t bits);
 bool statesClearErrorsAll();
+#if CONFIG_STATES_SENSOR_SEVERITY && !defined(CONFIG_NO_SENSORS)
+states_sensor_severity_t statesSensorsWorstSeverity();
+uint8_t statesSensorsCount(states_sensor_severity_t severity);
+bool statesSensorStatusGet(uint8_t sensor_id, states_sensor_status_t* status);
+size_t statesSensorsJsonTo(char* buffer, size_t size);
+#if !CONFIG_STATES_ZERO_HEAP
+char* statesSensorsJson();
+#endif // CONFIG_STATES_ZERO_HEAP
+#endif // CONFIG_STATES_SENSOR_SEVERITY
+#if CONFIG_STATES_ERROR_COUNTERS
+bool statesErrorCounterGet(uint8_t bit, states_error_counter_t* counter);
+void statesErrorCountersReset();
+size_t statesGetErrorCountersJsonTo(char* buffer, size_t size);
+#if !CONFIG_STATES_ZERO_HEAP
+char* statesGetErrorCountersJson();
+#endif // CONFIG_STATES_ZERO_HEAP
+#endif // CONFIG_STATES_ERROR_COUNTERS
+
+#if CONFIG_STATES_HISTORY
+uint32_t statesHistoryCount();
+void statesHistoryClear();
+void statesHistoryIteratorInit(states_history_iterator_t* iterator);
+bool statesHistoryNext(states_history_iterator_t* iterator, states_history_record_t* record);
+size_t statesHistoryDump(uint8_t* buffer, size_t size);
+#endif // CONFIG_STATES_HISTORY
+
+#if CONFIG_STATES_EVENT_TRACE
+uint32_t statesEventTraceCount();
+void statesEventTraceClear();
+size_t statesEventTraceDump(uint8_t* buffer, size_t size);
+// Returns the number of events posted to the event loop, or -1 if the dump is invalid
+int32_t statesEventTraceReplay(const uint8_t* data, size_t size, bool realtime);
+#endif // CONFIG_STATES_EVENT_TRACE
+
+#if CONFIG_STATES_AVAILABILITY
+bool statesAvailabilityGet(EventBits_t bit, states_window_t window, float* percent, uint32_t* flaps);
+#endif // CONFIG_STATES_AVAILABILITY
+
+#if CONFIG_STATES_RTC_SNAPSHOT
+bool statesSnapshotGet(states_snapshot_t* snapshot);
+#endif // CONFIG_STATES_RTC_SNAPSHOT
+
+#if CONFIG_STATES_BOOT_TIMELINE
+size_t statesBootTimelineJsonTo(bool withHistory, char* buffer, size_t size);
+#if !CONFIG_STATES_ZERO_HEAP
+char* statesBootTimelineJson(bool withHistory);
+#endif // CONFIG_STATES_ZERO_HEAP
+uint8_t statesBootTimelineLoad(states_boot_timeline_t* timelines, uint8_t count);
+#endif // CONFIG_STATES_BOOT_TIMELINE
+
+int8_t statesWatchdogAdd(const states_watchdog_t* watchdog);
+
+#if CONFIG_MQTT_OTA_ENABLE && CONFIG_OTA_VERIFY_POLICY
+size_t statesFirmwareVerifyJsonTo(char* buffer, size_t size);
+#if !CONFIG_STATES_ZERO_HEAP
+char* statesFirmwareVerifyJson();
+#endif // CONFIG_STATES_ZERO_HEAP
+#endif // CONFIG_OTA_VERIFY_POLICY
 
 bool statesTimeIsOk();
 bool statesTimeWait(TickType_t timeout);
@@ -136,11 +594,90 @@ bool statesTimeWaitMs(TickType_t timeout);
 bool statesTimeIsSilent();
 #endif // CONFIG_SILENT_MODE_ENABLE
 
+#if CONFIG_ENABLE_STATES_NOTIFICATIONS && CONFIG_STATES_NOTIFY_OUTBOX
+size_t statesOutboxJsonTo(char* buffer, size_t size);
+#if !CONFIG_STATES_ZERO_HEAP
+char* statesOutboxJson();
+#endif // CONFIG_STATES_ZERO_HEAP
+#endif // CONFIG_STATES_NOTIFY_OUTBOX
+
+#if CONFIG_ENABLE_STATES_NOTIFICATIONS && CONFIG_STATES_NOTIFY_BACKENDS
+/**
+ * Notification backend: called from its own task for each message, returns true if the message was delivered
+ * */
+typedef bool (*states_notify_backend_cb_t)(uint32_t msg_options, const char* text, void* context);
+
+int8_t statesNotifyBackendAdd(const char* name, states_notify_backend_cb_t cb_send, void* context, uint8_t queue_depth);
+size_t statesNotifyBackendsJsonTo(char* buffer, size_t size);
+#if !CONFIG_STATES_ZERO_HEAP
+char* statesNotifyBackendsJson();
+#endif // CONFIG_STATES_ZERO_HEAP
+
+#if CONFIG_STATES_NOTIFY_BACKEND_MOCK
+typedef struct {
+  uint32_t count;
+  uint32_t last_options;
+  char last_text[128];
+} states_notify_mock_t;
+
+states_notify_mock_t* statesNotifyMock();
+#endif // CONFIG_STATES_NOTIFY_BACKEND_MOCK
+#endif // CONFIG_STATES_NOTIFY_BACKENDS
+
+#if CONFIG_ENABLE_STATES_NOTIFICATIONS
+bool statesHealthMonitorRegister(reHealthMonitor* monitor, EventBits_t depends_all, EventBits_t depends_any);
+void statesHealthMonitorUnregister(reHealthMonitor* monitor);
+#endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+
 bool statesMqttIsConnected();
 bool statesMqttIsPrimary();
 bool statesMqttIsLocal();
 bool statesMqttIsEnabled();
 
+#if CONFIG_STATES_HANDLER_STATS
+typedef int64_t (*states_post_time_cb_t)(int32_t event_id, void* event_data);
+
+size_t statesHandlerStatsJsonTo(char* buffer, size_t size);
+#if !CONFIG_STATES_ZERO_HEAP
+char* statesHandlerStatsJson();
+#endif // CONFIG_STATES_ZERO_HEAP
+void statesHandlerStatsReset();
+void statesHandlerStatsSetPostTime(esp_event_base_t event_base, states_post_time_cb_t cb_post_time);
+#endif // CONFIG_STATES_HANDLER_STATS
+
+#if CONFIG_STATES_BENCHMARK
+void statesBenchmarkRun(uint32_t iterations);
+size_t statesBenchmarkJsonTo(char* buffer, size_t size);
+#if !CONFIG_STATES_ZERO_HEAP
+char* statesBenchmarkJson();
+#endif // CONFIG_STATES_ZERO_HEAP
+#endif // CONFIG_STATES_BENCHMARK
+
+#if CONFIG_STATES_STRESS
+bool statesStressStart(uint8_t producers, uint32_t events, bool direct);
+bool statesStressRunning();
+size_t statesStressJsonTo(char* buffer, size_t size);
+#if !CONFIG_STATES_ZERO_HEAP
+char* statesStressJson();
+#endif // CONFIG_STATES_ZERO_HEAP
+#endif // CONFIG_STATES_STRESS
+
+#if CONFIG_STATES_FLEET_SIM
+bool statesFleetStart(uint16_t nodes, const states_fleet_model_t* model, uint32_t ticks);
+void statesFleetStop();
+bool statesFleetRunning();
+size_t statesFleetJsonTo(char* buffer, size_t size);
+#if !CONFIG_STATES_ZERO_HEAP
+char* statesFleetJson();
+#endif // CONFIG_STATES_ZERO_HEAP
+#endif // CONFIG_STATES_FLEET_SIM
+
+#if CONFIG_STATES_ZERO_HEAP && CONFIG_STATES_ZERO_HEAP_CHECK
+uint32_t statesZeroHeapViolations();
+// For an application that defines its own esp_heap_trace_alloc_hook()
+void statesZeroHeapAllocHook(void* ptr, size_t size, uint32_t caps);
+#endif // CONFIG_STATES_ZERO_HEAP_CHECK
+
 void heapAllocFailedInit();
 uint32_t heapAllocFailedCount();
 void heapCapsDebug(const char *function_name);
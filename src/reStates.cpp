@@ -1,80 +1,446 @@
 #include "reStates.h"
 #include "time.h"
 #include "esp_timer.h"
+#include "esp_attr.h"
+#include <stdarg.h>
+#include "freertos/semphr.h"
+#if CONFIG_STATES_ZERO_HEAP && CONFIG_STATES_ZERO_HEAP_CHECK
+  #include "esp_heap_caps.h"
+#endif // CONFIG_STATES_ZERO_HEAP_CHECK
+#if CONFIG_STATES_RTC_SNAPSHOT || CONFIG_STATES_EVENT_TRACE
+  #include "esp_rom_crc.h"
+#endif // CONFIG_STATES_RTC_SNAPSHOT || CONFIG_STATES_EVENT_TRACE
+#if CONFIG_STATES_RTC_SNAPSHOT
+  #include "esp_system.h"
+#endif // CONFIG_STATES_RTC_SNAPSHOT
+#if CONFIG_STATES_EVENT_TRACE || CONFIG_STATES_STRESS || CONFIG_STATES_FLEET_SIM
+  #include "esp_random.h"
+#endif // CONFIG_STATES_EVENT_TRACE || CONFIG_STATES_STRESS || CONFIG_STATES_FLEET_SIM
+#if CONFIG_STATES_FLEET_SIM && CONFIG_ENABLE_STATES_NOTIFICATIONS
+  #include <new>
+#endif // CONFIG_STATES_FLEET_SIM
+#if CONFIG_STATES_NOTIFY_BACKENDS || CONFIG_STATES_STRESS
+  #include "freertos/queue.h"
+#endif // CONFIG_STATES_NOTIFY_BACKENDS || CONFIG_STATES_STRESS
+#if CONFIG_STATES_NOTIFY_BACKENDS
+  #if defined(CONFIG_STATES_NOTIFY_BACKEND_SYSLOG_IP)
+    #include "lwip/sockets.h"
+  #endif // CONFIG_STATES_NOTIFY_BACKEND_SYSLOG_IP
+#endif // CONFIG_STATES_NOTIFY_BACKENDS
+#if CONFIG_STATES_BOOT_TIMELINE || CONFIG_STATES_NOTIFY_OUTBOX
+  #include "nvs.h"
+#endif // CONFIG_STATES_BOOT_TIMELINE || CONFIG_STATES_NOTIFY_OUTBOX
 #include "reWiFi.h"
 #include "reMqtt.h"
 #if !defined(CONFIG_NO_SENSORS)
   #include "reSensor.h"
 #endif // CONFIG_NO_SENSORS
 
-static EventGroupHandle_t _evgStates = nullptr;
-static EventGroupHandle_t _evgErrors = nullptr;
+static re_states_ctx_t _statesDefault;
+
+static inline bool statesCtxIsDefault(re_states_ctx_t* ctx)
+{
+  return ctx == &_statesDefault;
+}
 
 static const char* logTAG   = "STATES";
 
 #define DEBUG_LOG_EVENT_MESSAGE "Received event: event_base=[%s], event_id=[%s]"
 #define DEBUG_LOG_EVENT_MESSAGE_MODE "Received event: event_base=[%s], event_id=[%s], mode=[%d]"
 
-#if CONFIG_STATES_STATIC_ALLOCATION
-  StaticEventGroup_t _bufStates;
-  StaticEventGroup_t _bufErrors;
-#endif // CONFIG_STATES_STATIC_ALLOCATION
-
 void ledSysBlinkAuto();
+#if CONFIG_ENABLE_STATES_NOTIFICATIONS
+static void healthMonitorsInit();
+#if CONFIG_STATES_NOTIFY_DIGEST
+static void statesDigestInit();
+#endif // CONFIG_STATES_NOTIFY_DIGEST
+#if CONFIG_STATES_NOTIFY_BACKENDS
+static void statesBackendsInit();
+#endif // CONFIG_STATES_NOTIFY_BACKENDS
+#if CONFIG_STATES_NOTIFY_OUTBOX
+static void statesOutboxInit();
+static bool statesNotifyReplayAllowed();
+#endif // CONFIG_STATES_NOTIFY_OUTBOX
+#endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+#if CONFIG_STATES_EVENT_TRACE
+static void statesEventTraceInit();
+#endif // CONFIG_STATES_EVENT_TRACE
+
+// While the stress test (or a muted benchmark case) is running, the handlers do not notify, post events, 
+// run the watchdogs, drive the LED or write to NVS
+#if CONFIG_STATES_STRESS
+  static bool _statesStressMuted = false;
+  #define STATES_STRESS_MUTED __atomic_load_n(&_statesStressMuted, __ATOMIC_RELAXED)
+#else
+  #define STATES_STRESS_MUTED false
+#endif // CONFIG_STATES_STRESS
+#define statesEventLoopPost(...) (!STATES_STRESS_MUTED && eventLoopPost(__VA_ARGS__))
+#define statesEventLoopPostSystem(...) (!STATES_STRESS_MUTED && eventLoopPostSystem(__VA_ARGS__))
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- Text buffers -----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * All JSON and message texts are written by "writers" into a buffer of known size. With CONFIG_STATES_ZERO_HEAP
+ * only caller-provided or static buffers are used, otherwise the same writer also serves the functions that return
+ * a string allocated on the heap (the first pass measures the length, the second one fills the string)
+ * */
+
+#if CONFIG_STATES_ZERO_HEAP && !CONFIG_STATES_STATIC_ALLOCATION
+  #error "CONFIG_STATES_ZERO_HEAP requires CONFIG_STATES_STATIC_ALLOCATION"
+#endif // CONFIG_STATES_ZERO_HEAP
+
+typedef struct {
+  char*  data;
+  size_t size;
+  size_t len;     // Full length of the text, may exceed the size of the buffer
+} states_buf_t;
+
+typedef void (*states_buf_writer_t)(states_buf_t* buf, void* arg);
+
+static void statesBufInit(states_buf_t* buf, char* data, size_t size)
+{
+  buf->data = data;
+  buf->size = data ? size : 0;
+  buf->len = 0;
+  if (buf->size > 0) buf->data[0] = 0;
+}
+
+// Appends formatted text; the text that does not fit is only counted, the buffer always remains null-terminated
+static void statesBufPrintf(states_buf_t* buf, const char* format, ...)
+{
+  size_t available = buf->len < buf->size ? buf->size - buf->len : 0;
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(available > 0 ? buf->data + buf->len : nullptr, available, format, args);
+  va_end(args);
+  if (len > 0) buf->len += len;
+}
+
+static size_t statesBufWrite(states_buf_writer_t writer, void* arg, char* buffer, size_t size)
+{
+  states_buf_t buf;
+  statesBufInit(&buf, buffer, size);
+  writer(&buf, arg);
+  return buf.len;
+}
+
+#if !CONFIG_STATES_ZERO_HEAP
+
+static char* statesBufMalloc(states_buf_writer_t writer, void* arg)
+{
+  size_t size = statesBufWrite(writer, arg, nullptr, 0) + 1;
+  // The data may change between the passes, in this case the string is built again with the new length
+  for (uint8_t i = 0; i < 3; i++) {
+    char* text = (char*)malloc(size);
+    if (text == nullptr) return nullptr;
+    size_t len = statesBufWrite(writer, arg, text, size);
+    if (len < size) return text;
+    free(text);
+    size = len + 1;
+  };
+  return nullptr;
+}
+
+#else
+
+/**
+ * reMqtt builds the device topics on the heap, so in the zero-heap profile every topic the module publishes to
+ * is built once at initialization, for both brokers
+ * */
+
+#ifndef CONFIG_STATES_MQTT_TOPIC_SIZE
+  #define CONFIG_STATES_MQTT_TOPIC_SIZE 96
+#endif // CONFIG_STATES_MQTT_TOPIC_SIZE
+
+typedef char states_mqtt_topic_t[2][CONFIG_STATES_MQTT_TOPIC_SIZE];
+
+static void statesMqttTopicInit(states_mqtt_topic_t topic, bool local, const char* topic1)
+{
+  for (uint8_t i = 0; i < 2; i++) {
+    topic[i][0] = 0;
+    char* built = mqttGetTopicDevice1(i == 0, local, topic1);
+    if (built) {
+      if (strlen(built) < CONFIG_STATES_MQTT_TOPIC_SIZE) {
+        strcpy(topic[i], built);
+      } else {
+        rlog_e(logTAG, "Topic [%s] does not fit into CONFIG_STATES_MQTT_TOPIC_SIZE", built);
+      };
+      free(built);
+    };
+  };
+}
+
+// An empty topic could not be built at initialization
+#define statesMqttTopic(topic) (topic[statesMqttIsPrimary() ? 0 : 1])
+
+#endif // CONFIG_STATES_ZERO_HEAP
 
 // -----------------------------------------------------------------------------------------------------------------------
 // --------------------------------------------------- Watchdog timers ---------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------
 
-#if defined(CONFIG_MQTT_RESTART_DEVICE_MINUTES) && (CONFIG_MQTT_RESTART_DEVICE_MINUTES > 0)
+/**
+ * Each watchdog describes a fault condition and an action; the table of a context is evaluated whenever any of its bits 
+ * changes, the timer is started when the fault appears and is cancelled as soon as it disappears.
+ * The decision, the flag and the timer are changed in one step under the watchdogs lock of the context
+ * */
 
-re_restart_timer_t _wdtRestartMqtt;
+const char* RE_STATES_EVENTS = "REVT_STATES";
 
-void wdtRestartMqttInit()
+static bool statesWatchdogsLock(re_states_ctx_t* ctx)
 {
-  espRestartTimerInit(&_wdtRestartMqtt, RR_MQTT_TIMEOUT, "wdt_mqtt");
+  if (ctx->watchdogs_lock == nullptr) return false;
+  return xSemaphoreTakeRecursive(ctx->watchdogs_lock, portMAX_DELAY) == pdTRUE;
 }
 
-void wdtRestartMqttFree()
+static void statesWatchdogsUnlock(re_states_ctx_t* ctx)
 {
-  espRestartTimerFree(&_wdtRestartMqtt);
+  xSemaphoreGiveRecursive(ctx->watchdogs_lock);
 }
 
-void wdtRestartMqttStart()
+static void statesWatchdogTimerEnd(void* arg)
 {
-  if (statesMqttIsEnabled()) {
-    espRestartTimerStartM(&_wdtRestartMqtt, RR_MQTT_TIMEOUT, CONFIG_MQTT_RESTART_DEVICE_MINUTES, false);
-  } else {
-    espRestartTimerBreak(&_wdtRestartMqtt);
+  states_watchdog_slot_t* slot = (states_watchdog_slot_t*)arg;
+  re_states_ctx_t* ctx = slot->ctx;
+  if (!statesWatchdogsLock(ctx)) return;
+  // The watchdog could have been cancelled while the timer callback was waiting
+  if (slot->running && !slot->fired) {
+    slot->fired = true;
+    __atomic_add_fetch(&ctx->watchdogs_fired, 1, __ATOMIC_RELAXED);
+    rlog_w(logTAG, "Watchdog [%s] expired in context [%s]", slot->config.name, ctx->name);
+    if (slot->config.action == SWA_EVENT) {
+      statesEventLoopPost(slot->config.event_base, slot->config.event_id, nullptr, 0, portMAX_DELAY);
+    } else if (slot->config.action == SWA_ERROR) {
+      // Only the bits that were not set by someone else are owned (and later cleared) by the watchdog
+      slot->owned_bits = slot->config.error_bits & ~statesCtxGetErrors(ctx);
+      statesCtxSetErrors(ctx, slot->config.error_bits);
+    };
   };
+  statesWatchdogsUnlock(ctx);
 }
 
-void wdtRestartMqttBreak()
+static bool statesWatchdogIsArmed(const states_watchdog_t* wdt, EventBits_t states)
 {
-  espRestartTimerBreak(&_wdtRestartMqtt);
-};
+  return ((states & wdt->armed_all) == wdt->armed_all)
+      && (!wdt->armed_any[0] || (states & wdt->armed_any[0]))
+      && (!wdt->armed_any[1] || (states & wdt->armed_any[1]));
+}
+
+static bool statesWatchdogIsHealthy(const states_watchdog_t* wdt, EventBits_t states, EventBits_t errors)
+{
+  EventBits_t bits = wdt->group == SG_ERRORS ? errors : states;
+  return ((bits & wdt->ok_all) == wdt->ok_all) && !(bits & wdt->fail_any);
+}
+
+static void statesWatchdogStart(states_watchdog_slot_t* slot)
+{
+  rlog_d(logTAG, "Watchdog [%s] started for %d seconds", slot->config.name, slot->config.timeout);
+  if (slot->config.action == SWA_RESTART) {
+    espRestartTimerStartS(&slot->restart, slot->config.reason, slot->config.timeout, false);
+  } else if (slot->timer) {
+    if (esp_timer_is_active(slot->timer)) esp_timer_stop(slot->timer);
+    esp_timer_start_once(slot->timer, (uint64_t)slot->config.timeout * 1000000);
+  };
+}
+
+// Must be called under the lock
+static void statesWatchdogBreak(states_watchdog_slot_t* slot)
+{
+  re_states_ctx_t* ctx = slot->ctx;
+  rlog_d(logTAG, "Watchdog [%s] cancelled", slot->config.name);
+  if (slot->config.action == SWA_RESTART) {
+    espRestartTimerBreak(&slot->restart);
+  } else if (slot->timer) {
+    if (esp_timer_is_active(slot->timer)) esp_timer_stop(slot->timer);
+    if (slot->fired && (slot->config.action == SWA_ERROR)) {
+      // Bits owned by another expired watchdog stay set
+      EventBits_t held = 0;
+      for (uint8_t i = 0; i < ctx->watchdogs_count; i++) {
+        states_watchdog_slot_t* other = &ctx->watchdogs[i];
+        if ((other != slot) && other->fired && (other->config.action == SWA_ERROR)) {
+          held |= other->owned_bits;
+        };
+      };
+      EventBits_t clear = slot->owned_bits & ~held;
+      slot->owned_bits = 0;
+      slot->fired = false;
+      if (clear) statesCtxClearErrors(ctx, clear);
+    };
+  };
+  slot->fired = false;
+}
 
-void wdtRestartMqttCheck()
+static void statesWatchdogsCheck(re_states_ctx_t* ctx)
 {
-  if (statesMqttIsConnected()) {
-    wdtRestartMqttBreak();
+  if (__atomic_load_n(&ctx->watchdogs_count, __ATOMIC_ACQUIRE) == 0) return;
+  if (!statesWatchdogsLock(ctx)) return;
+  EventBits_t states = statesCtxGet(ctx);
+  EventBits_t errors = statesCtxGetErrors(ctx);
+  #if CONFIG_STATES_FLAP_DETECTION
+    bool flapping = states & NETWORK_FLAPPING;
+  #else
+    bool flapping = false;
+  #endif // CONFIG_STATES_FLAP_DETECTION
+
+  for (uint8_t i = 0; i < ctx->watchdogs_count; i++) {
+    states_watchdog_slot_t* slot = &ctx->watchdogs[i];
+    bool healthy = statesWatchdogIsHealthy(&slot->config, states, errors);
+    bool fault = !healthy && statesWatchdogIsArmed(&slot->config, states);
+    // While the link is unstable, a network watchdog is not cancelled because it has been disarmed (the link is down),
+    // but the recovery of the subsystem always cancels it
+    if (!fault && !healthy && flapping && slot->config.dampen) continue;
+    if (slot->running != fault) {
+      slot->running = fault;
+      if (fault) {
+        statesWatchdogStart(slot);
+      } else {
+        statesWatchdogBreak(slot);
+      };
+    };
+  };
+  statesWatchdogsUnlock(ctx);
+}
+
+// Restarts and events concern the whole device, the watchdogs of an additional context can only set its error bits
+int8_t statesCtxWatchdogAdd(re_states_ctx_t* ctx, const states_watchdog_t* watchdog)
+{
+  if ((ctx == nullptr) || (watchdog == nullptr) || (watchdog->timeout == 0)) return -1;
+  if (!statesCtxIsDefault(ctx) && (watchdog->action != SWA_ERROR)) {
+    rlog_e(logTAG, "Failed to add watchdog [%s]: context [%s] supports only SWA_ERROR", watchdog->name, ctx->name);
+    return -1;
+  };
+
+  if (!statesWatchdogsLock(ctx)) return -1;
+  int8_t index = -1;
+  if (ctx->watchdogs_count < CONFIG_STATES_WATCHDOGS_MAX) {
+    index = ctx->watchdogs_count;
+  };
+  if (index < 0) {
+    statesWatchdogsUnlock(ctx);
+    rlog_e(logTAG, "Failed to add watchdog [%s]: no free slots", watchdog->name);
+    return -1;
+  };
+
+  states_watchdog_slot_t* slot = &ctx->watchdogs[index];
+  memset(slot, 0, sizeof(states_watchdog_slot_t));
+  memcpy(&slot->config, watchdog, sizeof(states_watchdog_t));
+  slot->ctx = ctx;
+  if (watchdog->action == SWA_RESTART) {
+    espRestartTimerInit(&slot->restart, watchdog->reason, watchdog->name);
   } else {
-    if (statesMqttIsLocal() || statesInetIsAvailabled()) {
-      wdtRestartMqttStart();
-    } else {
-      wdtRestartMqttBreak();
+    esp_timer_create_args_t cfgTimer;
+    memset(&cfgTimer, 0, sizeof(cfgTimer));
+    cfgTimer.callback = statesWatchdogTimerEnd;
+    cfgTimer.arg = slot;
+    cfgTimer.name = watchdog->name;
+    RE_OK_CHECK(esp_timer_create(&cfgTimer, &slot->timer), statesWatchdogsUnlock(ctx); return -1);
+  };
+
+  __atomic_store_n(&ctx->watchdogs_count, index + 1, __ATOMIC_RELEASE);
+  statesWatchdogsCheck(ctx);
+  statesWatchdogsUnlock(ctx);
+  return index;
+}
+
+int8_t statesWatchdogAdd(const states_watchdog_t* watchdog)
+{
+  return statesCtxWatchdogAdd(&_statesDefault, watchdog);
+}
+
+static void statesWatchdogsFree(re_states_ctx_t* ctx)
+{
+  if (!statesWatchdogsLock(ctx)) return;
+  uint8_t count = ctx->watchdogs_count;
+  __atomic_store_n(&ctx->watchdogs_count, 0, __ATOMIC_RELEASE);
+  for (uint8_t i = 0; i < count; i++) {
+    states_watchdog_slot_t* slot = &ctx->watchdogs[i];
+    if (slot->config.action == SWA_RESTART) {
+      espRestartTimerFree(&slot->restart);
+    } else if (slot->timer) {
+      if (esp_timer_is_active(slot->timer)) esp_timer_stop(slot->timer);
+      esp_timer_delete(slot->timer);
+      slot->timer = nullptr;
     };
   };
+  statesWatchdogsUnlock(ctx);
 }
 
-#else
-  // Stubs
-  #define wdtRestartMqttInit()
-  #define wdtRestartMqttFree()
-  #define wdtRestartMqttStart()
-  #define wdtRestartMqttCheck()
-  #define wdtRestartMqttBreak()
-#endif 
+static void statesWatchdogsInit()
+{
+  if (_statesDefault.watchdogs_count > 0) return;
+
+  // MQTT: no connection to the broker while it should be reachable
+  #if defined(CONFIG_MQTT_RESTART_DEVICE_MINUTES) && (CONFIG_MQTT_RESTART_DEVICE_MINUTES > 0)
+    states_watchdog_t wdtMqtt;
+    memset(&wdtMqtt, 0, sizeof(wdtMqtt));
+    wdtMqtt.name = "wdt_mqtt";
+    wdtMqtt.group = SG_STATES;
+    wdtMqtt.ok_all = MQTT_CONNECTED;
+    wdtMqtt.armed_any[0] = NETWORK_CONNECTED;
+    wdtMqtt.armed_any[1] = MQTT_LOCAL | INET_AVAILABLED;
+    wdtMqtt.timeout = CONFIG_MQTT_RESTART_DEVICE_MINUTES * 60;
+    wdtMqtt.dampen = true;
+    wdtMqtt.action = SWA_RESTART;
+    wdtMqtt.reason = RR_MQTT_TIMEOUT;
+    statesWatchdogAdd(&wdtMqtt);
+  #endif // CONFIG_MQTT_RESTART_DEVICE_MINUTES
+
+  // Internet: the local network is up, but the internet is not available
+  #if defined(CONFIG_STATES_WDT_INET_MINUTES) && (CONFIG_STATES_WDT_INET_MINUTES > 0)
+    states_watchdog_t wdtInet;
+    memset(&wdtInet, 0, sizeof(wdtInet));
+    wdtInet.name = "wdt_inet";
+    wdtInet.group = SG_STATES;
+    wdtInet.ok_all = INET_AVAILABLED;
+    wdtInet.armed_any[0] = NETWORK_CONNECTED;
+    wdtInet.timeout = CONFIG_STATES_WDT_INET_MINUTES * 60;
+    wdtInet.dampen = true;
+    #if defined(CONFIG_STATES_WDT_INET_RESTART) && CONFIG_STATES_WDT_INET_RESTART
+      wdtInet.action = SWA_RESTART;
+      wdtInet.reason = RR_UNKNOWN;
+    #else
+      wdtInet.action = SWA_ERROR;
+      wdtInet.error_bits = ERR_WATCHDOG;
+    #endif // CONFIG_STATES_WDT_INET_RESTART
+    statesWatchdogAdd(&wdtInet);
+  #endif // CONFIG_STATES_WDT_INET_MINUTES
+
+  // Time: the internet is available, but SNTP has not synchronized the clock
+  #if defined(CONFIG_STATES_WDT_SNTP_MINUTES) && (CONFIG_STATES_WDT_SNTP_MINUTES > 0)
+    states_watchdog_t wdtSntp;
+    memset(&wdtSntp, 0, sizeof(wdtSntp));
+    wdtSntp.name = "wdt_sntp";
+    wdtSntp.group = SG_STATES;
+    wdtSntp.ok_all = TIME_SNTP_SYNC_OK;
+    wdtSntp.armed_all = INET_AVAILABLED;
+    wdtSntp.timeout = CONFIG_STATES_WDT_SNTP_MINUTES * 60;
+    wdtSntp.action = SWA_ERROR;
+    wdtSntp.error_bits = ERR_WATCHDOG;
+    statesWatchdogAdd(&wdtSntp);
+  #endif // CONFIG_STATES_WDT_SNTP_MINUTES
+
+  // Sensors: any sensor stays in the error state for too long
+  #if !defined(CONFIG_NO_SENSORS) && defined(CONFIG_STATES_WDT_SENSORS_MINUTES) && (CONFIG_STATES_WDT_SENSORS_MINUTES > 0)
+    states_watchdog_t wdtSensors;
+    memset(&wdtSensors, 0, sizeof(wdtSensors));
+    wdtSensors.name = "wdt_sensors";
+    wdtSensors.group = SG_ERRORS;
+    wdtSensors.fail_any = ERR_SENSORS;
+    wdtSensors.timeout = CONFIG_STATES_WDT_SENSORS_MINUTES * 60;
+    // A restart rarely helps a failed sensor, by default the application is told about it
+    #if defined(CONFIG_STATES_WDT_SENSORS_RESTART) && CONFIG_STATES_WDT_SENSORS_RESTART
+      wdtSensors.action = SWA_RESTART;
+      wdtSensors.reason = RR_UNKNOWN;
+    #else
+      wdtSensors.action = SWA_EVENT;
+      wdtSensors.event_base = RE_STATES_EVENTS;
+      wdtSensors.event_id = RE_STATES_SENSORS_TIMEOUT;
+    #endif // CONFIG_STATES_WDT_SENSORS_RESTART
+    statesWatchdogAdd(&wdtSensors);
+  #endif // CONFIG_STATES_WDT_SENSORS_MINUTES
+}
 
 // -----------------------------------------------------------------------------------------------------------------------
 // ------------------------------------------------- Verify OTA complete -------------------------------------------------
@@ -82,6 +448,167 @@ void wdtRestartMqttCheck()
 
 #if CONFIG_MQTT_OTA_ENABLE
 
+static void statesFirmwareVerifyComplete();
+
+#if CONFIG_OTA_VERIFY_POLICY
+
+/**
+ * After an OTA update, the new firmware is confirmed only when it has been running without problems for a while:
+ * SYSTEM_STARTED and MQTT connection held for the stable time, no critical errors, limited heap decline and
+ * no expired watchdogs. If this is not achieved within CONFIG_OTA_ROLLBACK_TIMEOUT, the firmware is rolled back
+ * */
+
+#ifndef CONFIG_OTA_VERIFY_STABLE_TIME
+  #if defined(CONFIG_OTA_ROLLBACK_TIMEOUT) && (CONFIG_OTA_ROLLBACK_TIMEOUT > 0)
+    #define CONFIG_OTA_VERIFY_STABLE_TIME (CONFIG_OTA_ROLLBACK_TIMEOUT / 2)
+  #else
+    #define CONFIG_OTA_VERIFY_STABLE_TIME 300
+  #endif // CONFIG_OTA_ROLLBACK_TIMEOUT
+#endif // CONFIG_OTA_VERIFY_STABLE_TIME
+#define STATES_OTA_VERIFY_JSON_SIZE 256
+#ifndef CONFIG_OTA_VERIFY_ERRORS
+  #define CONFIG_OTA_VERIFY_ERRORS (ERR_GENERAL | ERR_HEAP)
+#endif // CONFIG_OTA_VERIFY_ERRORS
+#ifndef CONFIG_OTA_VERIFY_HEAP_DECLINE
+  #define CONFIG_OTA_VERIFY_HEAP_DECLINE 10
+#endif // CONFIG_OTA_VERIFY_HEAP_DECLINE
+#if defined(CONFIG_OTA_ROLLBACK_TIMEOUT) && (CONFIG_OTA_ROLLBACK_TIMEOUT > 0)
+  // The stable time is measured once a minute, so there must be time left for it
+  static_assert(CONFIG_OTA_ROLLBACK_TIMEOUT > CONFIG_OTA_VERIFY_STABLE_TIME + 60, "CONFIG_OTA_ROLLBACK_TIMEOUT is too short for CONFIG_OTA_VERIFY_STABLE_TIME");
+#endif // CONFIG_OTA_ROLLBACK_TIMEOUT
+
+typedef enum {
+  OVS_NONE = 0,     // Normal boot, nothing to verify
+  OVS_PENDING,
+  OVS_PASSED,
+  OVS_FAILED
+} ota_verify_status_t;
+
+static const char* _otaVerifyStatusNames[] = { "none", "pending", "passed", "failed" };
+
+typedef struct {
+  ota_verify_status_t status;
+  int64_t  stable_since;    // 0 - conditions are not met now
+  uint32_t stable_time;     // Seconds
+  size_t   heap_start;      // Free heap at SYSTEM_STARTED
+  size_t   heap_now;
+  uint8_t  heap_decline;    // %
+  EventBits_t errors;
+  uint32_t wdt_fired;
+  uint32_t wdt_start;
+  uint8_t  score;           // 0..100
+} ota_verify_t;
+
+static ota_verify_t _otaVerify = { OVS_NONE, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+static portMUX_TYPE _otaVerifyLock = portMUX_INITIALIZER_UNLOCKED;
+
+#define OTA_VERIFY_ONLINE (SYSTEM_STARTED | MQTT_CONNECTED)
+
+// Starts the stable period or starts it over, called on the transitions of the bits that matter
+static void statesFirmwareVerifyUpdate()
+{
+  if (_otaVerify.status != OVS_PENDING) return;
+
+  EventBits_t states = statesGet();
+  EventBits_t errors = statesGetErrors() & (CONFIG_OTA_VERIFY_ERRORS);
+  bool online = ((states & OTA_VERIFY_ONLINE) == OTA_VERIFY_ONLINE) && (states & NETWORK_CONNECTED);
+  size_t heap = (online && (_otaVerify.heap_start == 0)) ? heap_caps_get_free_size(MALLOC_CAP_DEFAULT) : 0;
+  int64_t now = esp_timer_get_time();
+
+  portENTER_CRITICAL(&_otaVerifyLock);
+  _otaVerify.errors = errors;
+  if ((heap > 0) && (_otaVerify.heap_start == 0)) {
+    _otaVerify.heap_start = heap;
+  };
+  // Any error or loss of connection starts the stable period over
+  if (online && (errors == 0)) {
+    if (_otaVerify.stable_since == 0) _otaVerify.stable_since = now;
+  } else {
+    _otaVerify.stable_since = 0;
+    _otaVerify.stable_time = 0;
+  };
+  portEXIT_CRITICAL(&_otaVerifyLock);
+}
+
+static void statesFirmwareVerifyChanged(states_group_t group, EventBits_t old_bits, EventBits_t new_bits)
+{
+  EventBits_t mask = 0;
+  if (group == SG_STATES) {
+    mask = OTA_VERIFY_ONLINE | NETWORK_CONNECTED;
+  } else if (group == SG_ERRORS) {
+    mask = CONFIG_OTA_VERIFY_ERRORS;
+  };
+  if ((old_bits ^ new_bits) & mask) statesFirmwareVerifyUpdate();
+}
+
+// Called every minute: measures the stable time, the heap and the watchdogs, confirms the firmware once every criterion is met
+static void statesFirmwareVerifyCheck()
+{
+  if (_otaVerify.status != OVS_PENDING) return;
+
+  int64_t now = esp_timer_get_time();
+  uint32_t wdt_fired = __atomic_load_n(&_statesDefault.watchdogs_fired, __ATOMIC_RELAXED);
+  size_t heap_now = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+  bool passed = false;
+
+  portENTER_CRITICAL(&_otaVerifyLock);
+  if (_otaVerify.status == OVS_PENDING) {
+    _otaVerify.wdt_fired = wdt_fired - _otaVerify.wdt_start;
+    _otaVerify.heap_now = heap_now;
+    if ((_otaVerify.heap_start > 0) && (_otaVerify.heap_now < _otaVerify.heap_start)) {
+      _otaVerify.heap_decline = (uint8_t)((_otaVerify.heap_start - _otaVerify.heap_now) * 100 / _otaVerify.heap_start);
+    } else {
+      _otaVerify.heap_decline = 0;
+    };
+    _otaVerify.stable_time = _otaVerify.stable_since > 0 ? (uint32_t)((now - _otaVerify.stable_since) / 1000000) : 0;
+
+    // Score: stable time 40, no errors 20, heap 20, watchdogs 20
+    uint32_t stable_score = _otaVerify.stable_time >= CONFIG_OTA_VERIFY_STABLE_TIME ? 40 : _otaVerify.stable_time * 40 / CONFIG_OTA_VERIFY_STABLE_TIME;
+    bool heap_ok = _otaVerify.heap_decline <= CONFIG_OTA_VERIFY_HEAP_DECLINE;
+    _otaVerify.score = stable_score + (_otaVerify.errors == 0 ? 20 : 0) + (heap_ok ? 20 : 0) + (_otaVerify.wdt_fired == 0 ? 20 : 0);
+    if (_otaVerify.score >= 100) {
+      _otaVerify.status = OVS_PASSED;
+      passed = true;
+    };
+  };
+  portEXIT_CRITICAL(&_otaVerifyLock);
+
+  if (passed) {
+    rlog_i(logTAG, "Firmware verify policy met: stable %d s, heap decline %d%%", _otaVerify.stable_time, _otaVerify.heap_decline);
+    statesFirmwareVerifyComplete();
+  };
+}
+
+// Criteria without the enclosing brackets, for the states JSON
+static void statesFirmwareVerifyItems(states_buf_t* buf)
+{
+  statesBufPrintf(buf, "\"status\":\"%s\",\"score\":%d,\"stable\":%d,\"stable_required\":%d,\"errors\":%d,\"heap_start\":%d,\"heap_now\":%d,\"heap_decline\":%d,\"heap_decline_max\":%d,\"wdt_fired\":%d",
+    _otaVerifyStatusNames[_otaVerify.status], _otaVerify.score, _otaVerify.stable_time, CONFIG_OTA_VERIFY_STABLE_TIME,
+    _otaVerify.errors, _otaVerify.heap_start, _otaVerify.heap_now, _otaVerify.heap_decline, CONFIG_OTA_VERIFY_HEAP_DECLINE, 
+    _otaVerify.wdt_fired);
+}
+
+static void statesFirmwareVerifyWriter(states_buf_t* buf, void* arg)
+{
+  statesBufPrintf(buf, "{");
+  statesFirmwareVerifyItems(buf);
+  statesBufPrintf(buf, "}");
+}
+
+size_t statesFirmwareVerifyJsonTo(char* buffer, size_t size)
+{
+  return statesBufWrite(statesFirmwareVerifyWriter, nullptr, buffer, size);
+}
+
+#if !CONFIG_STATES_ZERO_HEAP
+char* statesFirmwareVerifyJson()
+{
+  return statesBufMalloc(statesFirmwareVerifyWriter, nullptr);
+}
+#endif // CONFIG_STATES_ZERO_HEAP
+
+#endif // CONFIG_OTA_VERIFY_POLICY
+
 #if defined(CONFIG_OTA_ROLLBACK_TIMEOUT) && (CONFIG_OTA_ROLLBACK_TIMEOUT > 0)
 
 esp_timer_handle_t _otaVerifyTimer = nullptr;
@@ -89,6 +616,14 @@ esp_timer_handle_t _otaVerifyTimer = nullptr;
 static void statesFirmwareVerifyTimerEnd(void* arg)
 {
   rlog_w(logTAG, "Firmware verify failed: rollback application!");
+  #if CONFIG_OTA_VERIFY_POLICY
+    portENTER_CRITICAL(&_otaVerifyLock);
+    _otaVerify.status = OVS_FAILED;
+    portEXIT_CRITICAL(&_otaVerifyLock);
+    char json[STATES_OTA_VERIFY_JSON_SIZE];
+    statesFirmwareVerifyJsonTo(json, sizeof(json));
+    rlog_w(logTAG, "Firmware verify: %s", json);
+  #endif // CONFIG_OTA_VERIFY_POLICY
   espSetResetReason(RR_OTA_FAILED);
   esp_err_t err = esp_ota_mark_app_invalid_rollback_and_reboot();
   if (err != ESP_OK) {
@@ -127,6 +662,10 @@ static void statesFirmwareVerifyTimerStop()
 void statesFirmwareVerifyStart()
 {
   if (espGetResetReason() == RR_OTA) {
+    #if CONFIG_OTA_VERIFY_POLICY
+      _otaVerify.status = OVS_PENDING;
+      _otaVerify.wdt_start = __atomic_load_n(&_statesDefault.watchdogs_fired, __ATOMIC_RELAXED);
+    #endif // CONFIG_OTA_VERIFY_POLICY
     #if defined(CONFIG_OTA_ROLLBACK_TIMEOUT) && (CONFIG_OTA_ROLLBACK_TIMEOUT > 0)
       statesFirmwareVerifyTimerStart();
     #endif // CONFIG_OTA_ROLLBACK_TIMEOUT
@@ -134,6 +673,18 @@ void statesFirmwareVerifyStart()
 }
 
 void statesFirmwareVerifyCompete()
+{
+  #if CONFIG_OTA_VERIFY_POLICY
+    // The decision is made by the policy
+    if (_otaVerify.status == OVS_PENDING) {
+      statesFirmwareVerifyCheck();
+      return;
+    };
+  #endif // CONFIG_OTA_VERIFY_POLICY
+  statesFirmwareVerifyComplete();
+}
+
+static void statesFirmwareVerifyComplete()
 {
   if (espGetResetReason() == RR_OTA) {
     rlog_i(logTAG, "Firmware verify completed");
@@ -152,1957 +703,7524 @@ void statesFirmwareVerifyCompete()
 #endif // CONFIG_MQTT_OTA_ENABLE
 
 // -----------------------------------------------------------------------------------------------------------------------
-// ---------------------------------------------------- System states ----------------------------------------------------
+// -------------------------------------------------- Transition history -------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------
 
-void heapAllocFailedInit();
+#if CONFIG_STATES_HISTORY
 
-void statesInit(bool registerEventHandler)
-{
-  statesFirmwareVerifyStart();
+#ifndef CONFIG_STATES_HISTORY_SIZE
+  #define CONFIG_STATES_HISTORY_SIZE 128
+#endif // CONFIG_STATES_HISTORY_SIZE
+static_assert((CONFIG_STATES_HISTORY_SIZE & (CONFIG_STATES_HISTORY_SIZE - 1)) == 0, "CONFIG_STATES_HISTORY_SIZE must be a power of two");
 
-  if (!_evgStates) {
-    #if CONFIG_STATES_STATIC_ALLOCATION
-      _evgStates = xEventGroupCreateStatic(&_bufStates);
-    #else
-      _evgStates = xEventGroupCreate();
-    #endif // CONFIG_STATES_STATIC_ALLOCATION
-    xEventGroupClearBits(_evgStates, 0x00FFFFFFU);
-  };
-  if (!_evgErrors) {
-    #if CONFIG_STATES_STATIC_ALLOCATION
-      _evgErrors = xEventGroupCreateStatic(&_bufErrors);
-    #else
-      _evgErrors = xEventGroupCreate();
-    #endif // CONFIG_STATES_STATIC_ALLOCATION
-    xEventGroupClearBits(_evgErrors, 0x00FFFFFFU);
-  };
+#define STATES_HISTORY_MAGIC 0x31485453U  // "STH1"
 
-  wdtRestartMqttInit();
+typedef struct {
+  uint32_t sequence;  // Index of the record + 1, 0 - the slot is empty or is being written
+  states_history_record_t data;
+} states_history_slot_t;
 
-  if ((_evgStates) && (_evgErrors)) {
-    heapAllocFailedInit();
-  };
+typedef struct {
+  uint32_t magic;
+  uint32_t head;      // Total number of records written
+  states_history_slot_t slots[CONFIG_STATES_HISTORY_SIZE];
+} states_history_t;
 
-  if ((_evgStates) && (_evgErrors) && registerEventHandler) {
-    statesEventHandlerRegister();
-  };
-}
+#if CONFIG_STATES_HISTORY_RTC
+  RTC_NOINIT_ATTR static states_history_t _statesHistory;
+#else
+  static states_history_t _statesHistory;
+#endif // CONFIG_STATES_HISTORY_RTC
 
-void statesFree(bool unregisterEventHandler)
-{
-  #if defined(CONFIG_OTA_ROLLBACK_TIMEOUT) && (CONFIG_OTA_ROLLBACK_TIMEOUT > 0)
-  statesFirmwareVerifyTimerStop();
-  #endif // CONFIG_OTA_ROLLBACK_TIMEOUT
+// Source of the changes: the event that is currently being processed by the states handlers
+static TaskHandle_t _statesEventTask = nullptr;
+static uint8_t _statesEventHandler = SH_NONE;
+static int16_t _statesEventId = -1;
 
-  if (_evgStates) {
-    if (unregisterEventHandler) {
-      statesEventHandlerUnregister();
-    };
+static void statesHistoryAdd(states_group_t group, EventBits_t old_bits, EventBits_t new_bits)
+{
+  uint32_t index = __atomic_fetch_add(&_statesHistory.head, 1, __ATOMIC_RELAXED);
+  states_history_slot_t* slot = &_statesHistory.slots[index & (CONFIG_STATES_HISTORY_SIZE - 1)];
+  __atomic_store_n(&slot->sequence, 0, __ATOMIC_RELAXED);
+  // The slot is marked as being written before any of its data is changed
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  slot->data.timestamp = esp_timer_get_time();
+  slot->data.old_bits = old_bits;
+  slot->data.new_bits = new_bits;
+  if ((_statesEventTask != nullptr) && (_statesEventTask == xTaskGetCurrentTaskHandle())) {
+    slot->data.handler = _statesEventHandler;
+    slot->data.event_id = _statesEventId;
+  } else {
+    slot->data.handler = SH_NONE;
+    slot->data.event_id = -1;
   };
+  slot->data.group = group;
+  __atomic_store_n(&slot->sequence, index + 1, __ATOMIC_RELEASE);
+}
 
-  if (_evgErrors) {
-    vEventGroupDelete(_evgErrors);
-    _evgErrors = nullptr;
+static void statesHistoryInit()
+{
+  if ((_statesHistory.magic != STATES_HISTORY_MAGIC) || (_statesHistory.slots[(_statesHistory.head - 1) & (CONFIG_STATES_HISTORY_SIZE - 1)].sequence != _statesHistory.head)) {
+    memset(&_statesHistory, 0, sizeof(_statesHistory));
+    _statesHistory.magic = STATES_HISTORY_MAGIC;
+  } else {
+    // The buffer survived the restart, we separate the previous session with a marker
+    statesHistoryAdd(SG_RESTART, 0, 0);
   };
+}
 
-  if (_evgStates) {
-    vEventGroupDelete(_evgStates);
-    _evgStates = nullptr;
-  };
+void statesHistoryClear()
+{
+  _statesHistory.head = 0;
+  memset(&_statesHistory.slots, 0, sizeof(_statesHistory.slots));
+}
 
-  wdtRestartMqttFree();
+uint32_t statesHistoryCount()
+{
+  uint32_t head = __atomic_load_n(&_statesHistory.head, __ATOMIC_ACQUIRE);
+  return head < CONFIG_STATES_HISTORY_SIZE ? head : CONFIG_STATES_HISTORY_SIZE;
 }
 
-EventBits_t statesGet() 
+void statesHistoryIteratorInit(states_history_iterator_t* iterator)
 {
-  if (_evgStates) {
-    return xEventGroupGetBits(_evgStates);
-  };
-  rlog_e(logTAG, "Failed to get status bits, event group is null!");
-  return 0;
+  uint32_t head = __atomic_load_n(&_statesHistory.head, __ATOMIC_ACQUIRE);
+  iterator->position = head > CONFIG_STATES_HISTORY_SIZE ? head - CONFIG_STATES_HISTORY_SIZE : 0;
 }
 
-bool statesCheck(EventBits_t bits, const bool clearOnExit) 
+bool statesHistoryNext(states_history_iterator_t* iterator, states_history_record_t* record)
 {
-  if (_evgStates) {
-    if (clearOnExit) {
-      return (xEventGroupClearBits(_evgStates, bits) & bits) == bits;
-    } else {
-      return (xEventGroupGetBits(_evgStates) & bits) == bits;
+  while (iterator->position != __atomic_load_n(&_statesHistory.head, __ATOMIC_ACQUIRE)) {
+    states_history_slot_t* slot = &_statesHistory.slots[iterator->position & (CONFIG_STATES_HISTORY_SIZE - 1)];
+    uint32_t sequence = iterator->position + 1;
+    iterator->position++;
+    // Records that have been overwritten or are being written at the moment are skipped
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == sequence) {
+      memcpy(record, &slot->data, sizeof(states_history_record_t));
+      // The copy must be complete before the sequence is checked again
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == sequence) {
+        return true;
+      };
     };
   };
-  rlog_e(logTAG, "Failed to check status bits: %X, event group is null!", bits);
   return false;
 }
 
-bool statesCheckAny(EventBits_t bits, const bool clearOnExit) 
+size_t statesHistoryDump(uint8_t* buffer, size_t size)
 {
-  if (_evgStates) {
-    if (clearOnExit) {
-      return (xEventGroupClearBits(_evgStates, bits) & bits) > 0;
-    } else {
-      return (xEventGroupGetBits(_evgStates) & bits) > 0;
-    };
+  // Header: magic (4), record size (2), record count (2), then records from old to new:
+  // timestamp (8), old bits (4), new bits (4), event id (2), handler (1), group (1)
+  const size_t header_size = 8;
+  const size_t record_size = 20;
+  if ((buffer == nullptr) || (size < header_size)) return 0;
+
+  size_t len = header_size;
+  uint16_t count = 0;
+  states_history_record_t rec;
+  states_history_iterator_t iterator;
+  statesHistoryIteratorInit(&iterator);
+  while (((len + record_size) <= size) && statesHistoryNext(&iterator, &rec)) {
+    memcpy(&buffer[len], &rec.timestamp, 8);
+    memcpy(&buffer[len + 8], &rec.old_bits, 4);
+    memcpy(&buffer[len + 12], &rec.new_bits, 4);
+    memcpy(&buffer[len + 16], &rec.event_id, 2);
+    buffer[len + 18] = rec.handler;
+    buffer[len + 19] = rec.group;
+    len += record_size;
+    count++;
   };
-  rlog_e(logTAG, "Failed to check status bits: %X, event group is null!", bits);
-  return false;
+
+  uint32_t magic = STATES_HISTORY_MAGIC;
+  uint16_t rsize = record_size;
+  memcpy(&buffer[0], &magic, 4);
+  memcpy(&buffer[4], &rsize, 2);
+  memcpy(&buffer[6], &count, 2);
+  return len;
 }
 
-bool statesClear(EventBits_t bits)
+#endif // CONFIG_STATES_HISTORY
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------ Availability accounting ----------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_STATES_AVAILABILITY
+
+#define STATES_AVAIL_BITS 5
+#define STATES_AVAIL_HOUR_BUCKETS 12
+#define STATES_AVAIL_HOUR_BUCKET_MS (5 * 60 * 1000U)
+#define STATES_AVAIL_DAY_BUCKETS 24
+#define STATES_AVAIL_DAY_BUCKET_MS (60 * 60 * 1000U)
+
+static const EventBits_t _statesAvailBits[STATES_AVAIL_BITS] = { WIFI_STA_CONNECTED, ETHERNET_CONNECTED, INET_AVAILABLED, INET_SLOWDOWN, MQTT_CONNECTED };
+static const char* _statesAvailNames[STATES_AVAIL_BITS] = { "wifi", "ethernet", "inet", "inet_slowdown", "mqtt" };
+
+typedef struct {
+  uint32_t period;                       // Bucket number since boot, the bucket is stale if it does not match
+  uint32_t time_up[STATES_AVAIL_BITS];   // Milliseconds
+  uint16_t flaps[STATES_AVAIL_BITS];     // Transitions in both directions
+} states_avail_bucket_t;
+
+typedef struct {
+  uint64_t time_start;                   // Milliseconds since boot
+  uint64_t time_changed[STATES_AVAIL_BITS];
+  uint64_t time_up_total[STATES_AVAIL_BITS];
+  uint32_t flaps_total[STATES_AVAIL_BITS];
+  EventBits_t bits;
+  states_avail_bucket_t hour[STATES_AVAIL_HOUR_BUCKETS];
+  states_avail_bucket_t day[STATES_AVAIL_DAY_BUCKETS];
+} states_avail_t;
+
+static states_avail_t _statesAvail;
+static portMUX_TYPE _statesAvailLock = portMUX_INITIALIZER_UNLOCKED;
+
+static inline uint64_t statesAvailNow()
 {
-  if (!_evgStates) {
-    rlog_e(logTAG, "Failed to set status bits: %X, event group is null!", bits);
-    return false;
-  };
-  EventBits_t prevClear = xEventGroupClearBits(_evgStates, bits);
-  if ((prevClear & bits) != 0) {
-    EventBits_t afterClear = xEventGroupGetBits(_evgStates);
-    if ((afterClear & bits) != 0) {
-      rlog_e(logTAG, "Failed to clear status bits: %X, current value: %X", bits, afterClear);
-      return false;
-    };
-  };
-  ledSysBlinkAuto();
-  return true;
+  return (uint64_t)esp_timer_get_time() / 1000;
 }
 
-bool statesSet(EventBits_t bits)
+static states_avail_bucket_t* statesAvailBucket(states_avail_bucket_t* buckets, uint8_t count, uint32_t period)
 {
-  if (!_evgStates) {
-    rlog_e(logTAG, "Failed to set status bits: %X, event group is null!", bits);
-    return false;
-  };
-  EventBits_t afterSet = xEventGroupSetBits(_evgStates, bits);
-  if ((afterSet & bits) != bits) {
-    rlog_e(logTAG, "Failed to set status bits: %X, current value: %X", bits, afterSet);
-    return false;
+  states_avail_bucket_t* bucket = &buckets[period % count];
+  if (bucket->period != period) {
+    if (bucket->period > period) return nullptr;
+    memset(bucket, 0, sizeof(states_avail_bucket_t));
+    bucket->period = period;
   };
-  ledSysBlinkAuto();
-  return true;
+  return bucket;
 }
 
-bool statesSetBit(EventBits_t bit, bool state)
+static void statesAvailAddUp(states_avail_bucket_t* buckets, uint8_t count, uint32_t bucket_ms, uint8_t index, uint64_t time_from, uint64_t time_to)
 {
-  if (state) {
-    return statesSet(bit);
-  } else {
-    return statesClear(bit);
+  // Only the part of the interval that falls into the window is taken into account
+  uint64_t window_start = time_to > (uint64_t)count * bucket_ms ? time_to - (uint64_t)count * bucket_ms : 0;
+  if (time_from < window_start) time_from = window_start;
+  while (time_from < time_to) {
+    uint32_t period = time_from / bucket_ms;
+    uint64_t period_end = (uint64_t)(period + 1) * bucket_ms;
+    uint64_t segment_end = period_end < time_to ? period_end : time_to;
+    states_avail_bucket_t* bucket = statesAvailBucket(buckets, count, period);
+    if (bucket) bucket->time_up[index] += (uint32_t)(segment_end - time_from);
+    time_from = segment_end;
   };
 }
 
-EventBits_t statesWait(EventBits_t bits, BaseType_t clearOnExit, BaseType_t waitAllBits, TickType_t timeout)
+static void statesAvailabilityInit()
 {
-  if (_evgStates) {
-    return xEventGroupWaitBits(_evgStates, bits, clearOnExit, waitAllBits, timeout) & bits; 
-  };  
-  return 0;
+  portENTER_CRITICAL(&_statesAvailLock);
+  memset(&_statesAvail, 0, sizeof(_statesAvail));
+  _statesAvail.time_start = statesAvailNow();
+  for (uint8_t i = 0; i < STATES_AVAIL_BITS; i++) {
+    _statesAvail.time_changed[i] = _statesAvail.time_start;
+  };
+  portEXIT_CRITICAL(&_statesAvailLock);
 }
 
-EventBits_t statesWaitMs(EventBits_t bits, BaseType_t clearOnExit, BaseType_t waitAllBits, TickType_t timeout)
+static void statesAvailabilityUpdate(EventBits_t old_bits, EventBits_t new_bits)
 {
-  if (_evgStates) {
-    if (timeout == 0) {
-      return xEventGroupWaitBits(_evgStates, bits, clearOnExit, waitAllBits, portMAX_DELAY) & bits; 
-    }
-    else {
-      return xEventGroupWaitBits(_evgStates, bits, clearOnExit, waitAllBits, pdMS_TO_TICKS(timeout)) & bits; 
+  uint64_t now = statesAvailNow();
+  portENTER_CRITICAL(&_statesAvailLock);
+  for (uint8_t i = 0; i < STATES_AVAIL_BITS; i++) {
+    EventBits_t bit = _statesAvailBits[i];
+    if ((old_bits ^ new_bits) & bit) {
+      // Close the previous interval
+      if (_statesAvail.bits & bit) {
+        _statesAvail.time_up_total[i] += now - _statesAvail.time_changed[i];
+        statesAvailAddUp(_statesAvail.hour, STATES_AVAIL_HOUR_BUCKETS, STATES_AVAIL_HOUR_BUCKET_MS, i, _statesAvail.time_changed[i], now);
+        statesAvailAddUp(_statesAvail.day, STATES_AVAIL_DAY_BUCKETS, STATES_AVAIL_DAY_BUCKET_MS, i, _statesAvail.time_changed[i], now);
+      };
+      _statesAvail.time_changed[i] = now;
+      _statesAvail.flaps_total[i]++;
+      states_avail_bucket_t* bucket = statesAvailBucket(_statesAvail.hour, STATES_AVAIL_HOUR_BUCKETS, now / STATES_AVAIL_HOUR_BUCKET_MS);
+      if (bucket) bucket->flaps[i]++;
+      bucket = statesAvailBucket(_statesAvail.day, STATES_AVAIL_DAY_BUCKETS, now / STATES_AVAIL_DAY_BUCKET_MS);
+      if (bucket) bucket->flaps[i]++;
+      if (new_bits & bit) {
+        _statesAvail.bits |= bit;
+      } else {
+        _statesAvail.bits &= ~bit;
+      };
     };
-  };  
-  return 0;
+  };
+  portEXIT_CRITICAL(&_statesAvailLock);
 }
 
-// -----------------------------------------------------------------------------------------------------------------------
-// --------------------------------------------------- Custom routines ---------------------------------------------------
-// -----------------------------------------------------------------------------------------------------------------------
-
-bool statesNetworkIsConnected()
+static int8_t statesAvailIndex(EventBits_t bit)
 {
-  return statesCheckAny(NETWORK_CONNECTED, false);
+  for (uint8_t i = 0; i < STATES_AVAIL_BITS; i++) {
+    if (_statesAvailBits[i] == bit) return i;
+  };
+  return -1;
 }
 
-bool statesNetworkWait(TickType_t timeout)
+static void statesAvailWindow(states_avail_bucket_t* buckets, uint8_t count, uint32_t bucket_ms, uint8_t index, uint64_t now, float* percent, uint32_t* flaps)
 {
-  return (statesWait(NETWORK_CONNECTED, pdFALSE, pdFALSE, timeout) & NETWORK_CONNECTED) != 0;
+  uint32_t period_now = now / bucket_ms;
+  uint32_t period_first = period_now >= count ? period_now - count + 1 : 0;
+  uint64_t window_start = (uint64_t)period_first * bucket_ms;
+  if (window_start < _statesAvail.time_start) window_start = _statesAvail.time_start;
+
+  uint64_t time_up = 0;
+  uint32_t flaps_sum = 0;
+  for (uint8_t i = 0; i < count; i++) {
+    if ((buckets[i].period >= period_first) && (buckets[i].period <= period_now)) {
+      time_up += buckets[i].time_up[index];
+      flaps_sum += buckets[i].flaps[index];
+    };
+  };
+  // The interval that is still open
+  if (_statesAvail.bits & _statesAvailBits[index]) {
+    uint64_t open_start = _statesAvail.time_changed[index] > window_start ? _statesAvail.time_changed[index] : window_start;
+    if (now > open_start) time_up += now - open_start;
+  };
+
+  if (percent) *percent = now > window_start ? 100.0f * (float)time_up / (float)(now - window_start) : 0.0f;
+  if (flaps) *flaps = flaps_sum;
 }
 
-bool statesNetworkWaitMs(TickType_t timeout)
+bool statesAvailabilityGet(EventBits_t bit, states_window_t window, float* percent, uint32_t* flaps)
 {
-  return (statesWaitMs(NETWORK_CONNECTED, pdFALSE, pdTRUE, timeout) & NETWORK_CONNECTED) != 0;
+  int8_t index = statesAvailIndex(bit);
+  if (index < 0) return false;
+  uint64_t now = statesAvailNow();
+  portENTER_CRITICAL(&_statesAvailLock);
+  if (window == SW_HOUR) {
+    statesAvailWindow(_statesAvail.hour, STATES_AVAIL_HOUR_BUCKETS, STATES_AVAIL_HOUR_BUCKET_MS, index, now, percent, flaps);
+  } else {
+    statesAvailWindow(_statesAvail.day, STATES_AVAIL_DAY_BUCKETS, STATES_AVAIL_DAY_BUCKET_MS, index, now, percent, flaps);
+  };
+  portEXIT_CRITICAL(&_statesAvailLock);
+  return true;
 }
 
-bool statesInetIsAvailabled()
+static void statesAvailabilityJson(states_buf_t* buf)
 {
-  return statesCheckAny(NETWORK_CONNECTED, false) && statesCheck(INET_AVAILABLED, false);
+  for (uint8_t i = 0; i < STATES_AVAIL_BITS; i++) {
+    float hour_percent, day_percent;
+    uint32_t hour_flaps, day_flaps, flaps_total;
+    uint64_t time_up;
+    uint64_t now = statesAvailNow();
+    portENTER_CRITICAL(&_statesAvailLock);
+    statesAvailWindow(_statesAvail.hour, STATES_AVAIL_HOUR_BUCKETS, STATES_AVAIL_HOUR_BUCKET_MS, i, now, &hour_percent, &hour_flaps);
+    statesAvailWindow(_statesAvail.day, STATES_AVAIL_DAY_BUCKETS, STATES_AVAIL_DAY_BUCKET_MS, i, now, &day_percent, &day_flaps);
+    flaps_total = _statesAvail.flaps_total[i];
+    time_up = _statesAvail.time_up_total[i];
+    if (_statesAvail.bits & _statesAvailBits[i]) time_up += now - _statesAvail.time_changed[i];
+    portEXIT_CRITICAL(&_statesAvailLock);
+
+    statesBufPrintf(buf, "%s\"%s\":{\"hour\":%.2f,\"day\":%.2f,\"flaps_hour\":%d,\"flaps_day\":%d,\"flaps\":%d,\"uptime\":%llu}",
+      i > 0 ? "," : "", _statesAvailNames[i], hour_percent, day_percent, hour_flaps, day_flaps, flaps_total, time_up / 1000);
+  };
 }
 
-bool statesInetIsDelayed()
+#endif // CONFIG_STATES_AVAILABILITY
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ----------------------------------------------------- Boot timeline ---------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_STATES_BOOT_TIMELINE
+
+#ifndef CONFIG_STATES_BOOT_TIMELINE_HISTORY
+  #define CONFIG_STATES_BOOT_TIMELINE_HISTORY 8
+#endif // CONFIG_STATES_BOOT_TIMELINE_HISTORY
+#define STATES_BOOT_NVS_NAMESPACE "states"
+#define STATES_BOOT_NVS_KEY "boot_tl"
+#define STATES_BOOT_TIMELINE_JSON_SIZE 320
+
+static const EventBits_t _statesBootBits[STATES_BOOT_MILESTONES] = { 
+  WIFI_STA_STARTED, WIFI_STA_CONNECTED, ETHERNET_CONNECTED, TIME_RTC_ENABLED, TIME_SNTP_SYNC_OK, INET_AVAILABLED, MQTT_CONNECTED, SYSTEM_STARTED };
+static const char* _statesBootNames[STATES_BOOT_MILESTONES] = { 
+  "wifi_started", "wifi_connected", "ethernet_connected", "rtc", "sntp", "inet", "mqtt", "started" };
+
+static int64_t _statesBootStart = 0;
+static EventBits_t _statesBootPending = 0;
+static states_boot_timeline_t _statesBootCurrent;
+
+#if CONFIG_STATES_ZERO_HEAP && defined(CONFIG_MQTT_BOOT_TIMELINE_TOPIC)
+  static states_mqtt_topic_t _statesBootTopic;
+#endif // CONFIG_MQTT_BOOT_TIMELINE_TOPIC
+
+static void statesBootTimelineInit()
 {
-  return statesCheckAny(NETWORK_CONNECTED, false) && statesCheck(INET_AVAILABLED | INET_SLOWDOWN, false);
+  #if CONFIG_STATES_ZERO_HEAP && defined(CONFIG_MQTT_BOOT_TIMELINE_TOPIC)
+    statesMqttTopicInit(_statesBootTopic, CONFIG_MQTT_BOOT_TIMELINE_LOCAL, CONFIG_MQTT_BOOT_TIMELINE_TOPIC);
+  #endif // CONFIG_MQTT_BOOT_TIMELINE_TOPIC
+  memset(&_statesBootCurrent, 0, sizeof(_statesBootCurrent));
+  strncpy(_statesBootCurrent.version, APP_VERSION, sizeof(_statesBootCurrent.version) - 1);
+  _statesBootCurrent.reset_reason = (uint8_t)espGetResetReason();
+  _statesBootStart = esp_timer_get_time();
+  _statesBootCurrent.init_time = (uint32_t)(_statesBootStart / 1000);
+  _statesBootPending = 0;
+  for (uint8_t i = 0; i < STATES_BOOT_MILESTONES; i++) {
+    _statesBootPending |= _statesBootBits[i];
+  };
 }
 
-bool statesInetIsGood(bool checkRssi)
+static void statesBootTimelineUpdate(EventBits_t set_bits)
 {
-  bool ret = statesInetIsAvailabled() && !statesCheck(INET_SLOWDOWN, false); 
-  #if !defined(CONFIG_WIFI_ENABLED) || (CONFIG_WIFI_ENABLED == 1)
-  ret = ret && (!checkRssi || wifiRSSIIsOk());
-  #endif // CONFIG_WIFI_ENABLED
+  if (set_bits & _statesBootPending) {
+    uint32_t offset = (uint32_t)((esp_timer_get_time() - _statesBootStart) / 1000);
+    for (uint8_t i = 0; i < STATES_BOOT_MILESTONES; i++) {
+      if (set_bits & _statesBootPending & _statesBootBits[i]) {
+        // Zero means "not reached", so the first millisecond is rounded up
+        _statesBootCurrent.milestones[i] = offset > 0 ? offset : 1;
+      };
+    };
+    _statesBootPending &= ~set_bits;
+  };
+}
+
+uint8_t statesBootTimelineLoad(states_boot_timeline_t* timelines, uint8_t count)
+{
+  uint8_t ret = 0;
+  nvs_handle_t nvs_handle;
+  if (nvs_open(STATES_BOOT_NVS_NAMESPACE, NVS_READONLY, &nvs_handle) == ESP_OK) {
+    size_t size = sizeof(states_boot_timeline_t) * count;
+    if (nvs_get_blob(nvs_handle, STATES_BOOT_NVS_KEY, timelines, &size) == ESP_OK) {
+      ret = size / sizeof(states_boot_timeline_t);
+    #if !CONFIG_STATES_ZERO_HEAP
+    } else if (size > sizeof(states_boot_timeline_t) * count) {
+      // The stored history is longer than requested, read everything and take the newest entries
+      states_boot_timeline_t* buffer = (states_boot_timeline_t*)malloc(size);
+      if (buffer) {
+        if (nvs_get_blob(nvs_handle, STATES_BOOT_NVS_KEY, buffer, &size) == ESP_OK) {
+          uint8_t stored = size / sizeof(states_boot_timeline_t);
+          memcpy(timelines, &buffer[stored - count], sizeof(states_boot_timeline_t) * count);
+          ret = count;
+        };
+        free(buffer);
+      };
+    #endif // CONFIG_STATES_ZERO_HEAP
+    };
+    nvs_close(nvs_handle);
+  };
   return ret;
 }
 
-bool statesInetWait(TickType_t timeout)
+static void statesBootTimelineSave()
 {
-  return statesNetworkWait(timeout) && statesCheck(INET_AVAILABLED, false); 
+  states_boot_timeline_t history[CONFIG_STATES_BOOT_TIMELINE_HISTORY];
+  uint8_t count = statesBootTimelineLoad(history, CONFIG_STATES_BOOT_TIMELINE_HISTORY);
+  if (count >= CONFIG_STATES_BOOT_TIMELINE_HISTORY) {
+    memmove(&history[0], &history[1], sizeof(states_boot_timeline_t) * (CONFIG_STATES_BOOT_TIMELINE_HISTORY - 1));
+    count = CONFIG_STATES_BOOT_TIMELINE_HISTORY - 1;
+  };
+  memcpy(&history[count], &_statesBootCurrent, sizeof(states_boot_timeline_t));
+  count++;
+
+  nvs_handle_t nvs_handle;
+  esp_err_t err = nvs_open(STATES_BOOT_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+  if (err == ESP_OK) {
+    err = nvs_set_blob(nvs_handle, STATES_BOOT_NVS_KEY, history, sizeof(states_boot_timeline_t) * count);
+    if (err == ESP_OK) {
+      err = nvs_commit(nvs_handle);
+    };
+    nvs_close(nvs_handle);
+  };
+  if (err != ESP_OK) {
+    rlog_e(logTAG, "Failed to save boot timeline: %d, %s", err, esp_err_to_name(err));
+  };
 }
 
-bool statesInetWaitMs(TickType_t timeout)
+static void statesBootTimelineItemJson(states_buf_t* buf, states_boot_timeline_t* timeline)
 {
-  return statesNetworkWaitMs(timeout) && statesCheck(INET_AVAILABLED, false); 
+  statesBufPrintf(buf, "{\"version\":\"%s\",\"reset_reason\":%d,\"init\":%d", 
+    timeline->version, timeline->reset_reason, timeline->init_time);
+  for (uint8_t i = 0; i < STATES_BOOT_MILESTONES; i++) {
+    if (timeline->milestones[i] > 0) {
+      statesBufPrintf(buf, ",\"%s\":%d", _statesBootNames[i], timeline->milestones[i]);
+    };
+  };
+  statesBufPrintf(buf, "}");
 }
 
-// Time
-bool statesTimeIsOk()
+static void statesBootTimelineWriter(states_buf_t* buf, void* arg)
 {
-  return statesCheck(TIME_SNTP_SYNC_OK, false) || statesCheck(TIME_RTC_ENABLED, false);
+  if (*(bool*)arg) {
+    states_boot_timeline_t history[CONFIG_STATES_BOOT_TIMELINE_HISTORY];
+    uint8_t count = statesBootTimelineLoad(history, CONFIG_STATES_BOOT_TIMELINE_HISTORY);
+    statesBufPrintf(buf, "{\"current\":");
+    statesBootTimelineItemJson(buf, &_statesBootCurrent);
+    statesBufPrintf(buf, ",\"history\":[");
+    for (uint8_t i = 0; i < count; i++) {
+      if (i > 0) statesBufPrintf(buf, ",");
+      statesBootTimelineItemJson(buf, &history[i]);
+    };
+    statesBufPrintf(buf, "]}");
+  } else {
+    statesBootTimelineItemJson(buf, &_statesBootCurrent);
+  };
 }
 
-bool statesTimeWait(TickType_t timeout)
+size_t statesBootTimelineJsonTo(bool withHistory, char* buffer, size_t size)
 {
-  return (statesWait(TIME_SNTP_SYNC_OK | TIME_RTC_ENABLED, pdFALSE, pdFALSE, timeout) & (TIME_SNTP_SYNC_OK | TIME_RTC_ENABLED)) != 0;
+  return statesBufWrite(statesBootTimelineWriter, &withHistory, buffer, size);
 }
 
-bool statesTimeWaitMs(TickType_t timeout)
+#if !CONFIG_STATES_ZERO_HEAP
+char* statesBootTimelineJson(bool withHistory)
 {
-  return (statesWaitMs(TIME_SNTP_SYNC_OK | TIME_RTC_ENABLED, pdFALSE, pdFALSE, timeout) & (TIME_SNTP_SYNC_OK | TIME_RTC_ENABLED)) != 0;
+  return statesBufMalloc(statesBootTimelineWriter, &withHistory);
 }
+#endif // CONFIG_STATES_ZERO_HEAP
 
-#if CONFIG_SILENT_MODE_ENABLE
-bool statesTimeIsSilent()
+static void statesBootTimelineComplete()
 {
-  return (statesCheck(TIME_SNTP_SYNC_OK, false) || statesCheck(TIME_RTC_ENABLED, false)) && (statesCheck(TIME_SILENT_MODE, false));
+  statesBootTimelineSave();
+  char json[STATES_BOOT_TIMELINE_JSON_SIZE];
+  statesBootTimelineJsonTo(false, json, sizeof(json));
+  rlog_i(logTAG, "Boot timeline: %s", json);
+  #if defined(CONFIG_MQTT_BOOT_TIMELINE_TOPIC)
+    if (statesMqttIsEnabled()) {
+      #if CONFIG_STATES_ZERO_HEAP
+        if (statesMqttTopic(_statesBootTopic)[0] != 0) {
+          mqttPublish(statesMqttTopic(_statesBootTopic), json, 
+            CONFIG_MQTT_BOOT_TIMELINE_QOS, CONFIG_MQTT_BOOT_TIMELINE_RETAINED, false, false);
+        };
+      #else
+        mqttPublish(
+          mqttGetTopicDevice1(statesMqttIsPrimary(), CONFIG_MQTT_BOOT_TIMELINE_LOCAL, CONFIG_MQTT_BOOT_TIMELINE_TOPIC), 
+          malloc_string(json), CONFIG_MQTT_BOOT_TIMELINE_QOS, CONFIG_MQTT_BOOT_TIMELINE_RETAINED, true, true);
+      #endif // CONFIG_STATES_ZERO_HEAP
+    };
+  #endif // CONFIG_MQTT_BOOT_TIMELINE_TOPIC
 }
-#endif // CONFIG_SILENT_MODE_ENABLE
 
-// MQTT
-bool statesMqttIsConnected()
+#endif // CONFIG_STATES_BOOT_TIMELINE
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ----------------------------------------------------- RTC snapshot ----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_STATES_RTC_SNAPSHOT
+
+/**
+ * The last good states (while SYSTEM_STARTED is set) are kept in RTC memory, which survives a soft restart and 
+ * deep sleep. On the next start, a fresh snapshot is used as a hint: the clock is considered valid and the 
+ * previously selected MQTT server is restored, without waiting for the full connection sequence
+ * */
+
+#ifndef CONFIG_STATES_RTC_SNAPSHOT_MAX_AGE
+  #define CONFIG_STATES_RTC_SNAPSHOT_MAX_AGE 3600
+#endif // CONFIG_STATES_RTC_SNAPSHOT_MAX_AGE
+#ifndef CONFIG_STATES_RTC_SNAPSHOT_RESTORE
+  #define CONFIG_STATES_RTC_SNAPSHOT_RESTORE (MQTT_1_ENABLED | MQTT_2_ENABLED | MQTT_PRIMARY | MQTT_LOCAL)
+#endif // CONFIG_STATES_RTC_SNAPSHOT_RESTORE
+#define STATES_SNAPSHOT_MAGIC 0x31535453U     // "STS1"
+#define STATES_SNAPSHOT_TIME_MIN 1577836800   // 2020-01-01, the clock was not set before that
+
+typedef struct {
+  uint32_t magic;
+  uint32_t crc;
+  states_snapshot_t data;
+} states_snapshot_rtc_t;
+
+RTC_NOINIT_ATTR static states_snapshot_rtc_t _statesSnapshotRtc;
+static states_snapshot_t _statesSnapshotPrev;
+static bool _statesSnapshotValid = false;
+static portMUX_TYPE _statesSnapshotLock = portMUX_INITIALIZER_UNLOCKED;
+
+static uint32_t statesSnapshotCrc(states_snapshot_t* data)
 {
-  return statesCheck(MQTT_CONNECTED, false);
+  return esp_rom_crc32_le(0, (const uint8_t*)data, sizeof(states_snapshot_t));
 }
 
-bool statesMqttIsPrimary()
+// Must be called under the lock
+static void statesSnapshotCommit()
 {
-  return statesCheck(MQTT_PRIMARY, false);
+  _statesSnapshotRtc.data.saved = time(nullptr);
+  _statesSnapshotRtc.crc = statesSnapshotCrc(&_statesSnapshotRtc.data);
 }
 
-bool statesMqttIsLocal()
+// The snapshot is refreshed every minute and before a software restart, so a stable device does not look stale
+static void statesSnapshotRefresh()
 {
-  return statesCheck(MQTT_LOCAL, false);
+  if (!statesCheck(SYSTEM_STARTED, false)) return;
+  portENTER_CRITICAL(&_statesSnapshotLock);
+  statesSnapshotCommit();
+  portEXIT_CRITICAL(&_statesSnapshotLock);
 }
 
-bool statesMqttIsEnabled()
+static void statesSnapshotShutdown()
 {
-  if (statesMqttIsLocal()) {
-    return statesNetworkIsConnected();
+  statesSnapshotRefresh();
+}
+
+static void statesSnapshotLoad()
+{
+  static bool registered = false;
+  if (!registered) {
+    registered = esp_register_shutdown_handler(statesSnapshotShutdown) == ESP_OK;
+  };
+
+  time_t now = time(nullptr);
+  _statesSnapshotValid = (_statesSnapshotRtc.magic == STATES_SNAPSHOT_MAGIC)
+    && (_statesSnapshotRtc.crc == statesSnapshotCrc(&_statesSnapshotRtc.data))
+    && (_statesSnapshotRtc.data.saved > STATES_SNAPSHOT_TIME_MIN)
+    && (now >= _statesSnapshotRtc.data.saved)
+    && (now - _statesSnapshotRtc.data.saved <= CONFIG_STATES_RTC_SNAPSHOT_MAX_AGE);
+  if (_statesSnapshotValid) {
+    memcpy(&_statesSnapshotPrev, &_statesSnapshotRtc.data, sizeof(states_snapshot_t));
   } else {
-    return statesNetworkIsConnected() && statesInetIsAvailabled();
+    memset(&_statesSnapshotPrev, 0, sizeof(states_snapshot_t));
+    memset(&_statesSnapshotRtc, 0, sizeof(_statesSnapshotRtc));
+    _statesSnapshotRtc.magic = STATES_SNAPSHOT_MAGIC;
   };
 }
 
-// -----------------------------------------------------------------------------------------------------------------------
-// --------------------------------------------------- Errors routines ---------------------------------------------------
-// -----------------------------------------------------------------------------------------------------------------------
+// Applies the hints from the previous session, called when the event groups are ready
+static void statesSnapshotRestore()
+{
+  if (!_statesSnapshotValid) return;
+  EventBits_t bits = _statesSnapshotPrev.states & (CONFIG_STATES_RTC_SNAPSHOT_RESTORE);
+  // The age check has already passed with the current clock, so it kept running
+  if (_statesSnapshotPrev.states & TIME_IS_OK) {
+    bits |= TIME_RTC_ENABLED;
+  };
+  rlog_i(logTAG, "Warm start from RTC snapshot (age %d s): states=0x%.8x, errors=0x%.8x, restored=0x%.8x", 
+    (uint32_t)(time(nullptr) - _statesSnapshotPrev.saved), _statesSnapshotPrev.states, _statesSnapshotPrev.errors, bits);
+  if (bits) statesSet(bits);
+}
 
-EventBits_t statesGetErrors() 
+static void statesSnapshotUpdate(EventBits_t states, EventBits_t errors)
 {
-  if (_evgErrors) {
-    return xEventGroupGetBits(_evgErrors);
+  if (!(states & SYSTEM_STARTED)) return;
+  portENTER_CRITICAL(&_statesSnapshotLock);
+  _statesSnapshotRtc.data.states = states;
+  _statesSnapshotRtc.data.errors = errors;
+  statesSnapshotCommit();
+  portEXIT_CRITICAL(&_statesSnapshotLock);
+}
+
+static void statesSnapshotSetFailures(time_t inet_failure, time_t mqtt_failure)
+{
+  portENTER_CRITICAL(&_statesSnapshotLock);
+  if ((_statesSnapshotRtc.data.inet_failure != inet_failure) || (_statesSnapshotRtc.data.mqtt_failure != mqtt_failure)) {
+    _statesSnapshotRtc.data.inet_failure = inet_failure;
+    _statesSnapshotRtc.data.mqtt_failure = mqtt_failure;
+    statesSnapshotCommit();
   };
-  rlog_e(logTAG, "Failed to get errors bits, event group is null!");
-  return 0;
+  portEXIT_CRITICAL(&_statesSnapshotLock);
 }
 
-bool statesCheckErrors(EventBits_t bits, const bool clearOnExit) 
+bool statesSnapshotGet(states_snapshot_t* snapshot)
 {
-  if (_evgErrors) {
-    if (clearOnExit) {
-      return (xEventGroupClearBits(_evgErrors, bits) & bits) == bits;
-    } else {
-      return (xEventGroupClearBits(_evgErrors, 0) & bits) == bits;
-    };
+  if (_statesSnapshotValid && snapshot) {
+    memcpy(snapshot, &_statesSnapshotPrev, sizeof(states_snapshot_t));
   };
-  rlog_e(logTAG, "Failed to check error bits: %X, event group is null!", bits);
-  return false;
+  return _statesSnapshotValid;
 }
 
-bool statesCheckErrorsAll(const bool clearOnExit) 
+#endif // CONFIG_STATES_RTC_SNAPSHOT
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- Flap detection ---------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_STATES_FLAP_DETECTION
+
+#ifndef CONFIG_STATES_FLAP_WINDOW
+  #define CONFIG_STATES_FLAP_WINDOW 300
+#endif // CONFIG_STATES_FLAP_WINDOW
+#ifndef CONFIG_STATES_FLAP_ON
+  #define CONFIG_STATES_FLAP_ON 6
+#endif // CONFIG_STATES_FLAP_ON
+#ifndef CONFIG_STATES_FLAP_OFF
+  #define CONFIG_STATES_FLAP_OFF 1
+#endif // CONFIG_STATES_FLAP_OFF
+#ifndef CONFIG_STATES_FLAP_HOLD
+  #define CONFIG_STATES_FLAP_HOLD 300
+#endif // CONFIG_STATES_FLAP_HOLD
+static_assert(CONFIG_STATES_FLAP_OFF < CONFIG_STATES_FLAP_ON, "CONFIG_STATES_FLAP_OFF must be less than CONFIG_STATES_FLAP_ON");
+
+#define STATES_FLAP_BITS 3
+
+static const EventBits_t _statesFlapBits[STATES_FLAP_BITS] = { WIFI_STA_CONNECTED, ETHERNET_CONNECTED, INET_AVAILABLED };
+static const char* _statesFlapNames[STATES_FLAP_BITS] = { "wifi", "ethernet", "inet" };
+
+typedef struct {
+  uint32_t transitions[CONFIG_STATES_FLAP_ON];  // Seconds since boot of the last transitions
+  uint8_t  next;
+  bool     flapping;
+  uint32_t time_flapping;                       // Seconds since boot when flapping was detected
+  uint32_t count;                               // Number of flapping periods since boot
+} states_flap_t;
+
+static states_flap_t _statesFlap[STATES_FLAP_BITS];
+static portMUX_TYPE _statesFlapLock = portMUX_INITIALIZER_UNLOCKED;
+
+static inline uint32_t statesFlapNow()
 {
-  return statesCheckErrors(0x00FFFFFFU, clearOnExit);
+  return (uint32_t)(esp_timer_get_time() / 1000000);
 }
 
-bool statesClearErrors(EventBits_t bits)
+static uint8_t statesFlapCount(states_flap_t* flap, uint32_t now)
 {
-  if (!_evgErrors) {
-    rlog_e(logTAG, "Failed to set errors bits: %X, event group is null!", bits);
-    return false;
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < CONFIG_STATES_FLAP_ON; i++) {
+    if ((flap->transitions[i] > 0) && ((now - flap->transitions[i]) < CONFIG_STATES_FLAP_WINDOW)) count++;
   };
-  EventBits_t prevClear = xEventGroupClearBits(_evgErrors, bits);
-  if ((prevClear & bits) != 0) {
-    EventBits_t afterClear = xEventGroupGetBits(_evgErrors);
-    if ((afterClear & bits) != 0) {
-      rlog_e(logTAG, "Failed to clear errors bits: %X, current value: %X", bits, afterClear);
-      return false;
+  return count;
+}
+
+static void statesFlapUpdate(EventBits_t changed_bits)
+{
+  bool started = false;
+  uint32_t now = statesFlapNow();
+  if (now == 0) now = 1;
+  portENTER_CRITICAL(&_statesFlapLock);
+  for (uint8_t i = 0; i < STATES_FLAP_BITS; i++) {
+    if (changed_bits & _statesFlapBits[i]) {
+      states_flap_t* flap = &_statesFlap[i];
+      flap->transitions[flap->next] = now;
+      flap->next = (flap->next + 1) % CONFIG_STATES_FLAP_ON;
+      if (!flap->flapping && (statesFlapCount(flap, now) >= CONFIG_STATES_FLAP_ON)) {
+        flap->flapping = true;
+        flap->time_flapping = now;
+        flap->count++;
+        started = true;
+      };
     };
   };
-  ledSysBlinkAuto();
-  return true;
+  portEXIT_CRITICAL(&_statesFlapLock);
+
+  if (started && !statesCheck(NETWORK_FLAPPING, false)) {
+    rlog_w(logTAG, "Network state is flapping, side effects are suppressed");
+    // While the link is unstable, network watchdogs keep running (see statesWatchdogsCheck())
+    statesSet(NETWORK_FLAPPING);
+  };
 }
 
-bool statesClearErrorsAll()
+// Returns true if flapping has ended for all bits
+static bool statesFlapExpire()
 {
-  return statesClearErrors(0x00FFFFFFU);
+  bool flapping = false;
+  uint32_t now = statesFlapNow();
+  portENTER_CRITICAL(&_statesFlapLock);
+  for (uint8_t i = 0; i < STATES_FLAP_BITS; i++) {
+    states_flap_t* flap = &_statesFlap[i];
+    if (flap->flapping) {
+      if (((now - flap->time_flapping) >= CONFIG_STATES_FLAP_HOLD) && (statesFlapCount(flap, now) <= CONFIG_STATES_FLAP_OFF)) {
+        flap->flapping = false;
+      } else {
+        flapping = true;
+      };
+    };
+  };
+  portEXIT_CRITICAL(&_statesFlapLock);
+  return !flapping;
 }
 
-bool statesSetErrors(EventBits_t bits)
+bool statesNetworkIsFlapping()
 {
-  if (!_evgErrors) {
-    rlog_e(logTAG, "Failed to set errors bits: %X, event group is null!", bits);
-    return false;
-  };
-  EventBits_t afterSet = xEventGroupSetBits(_evgErrors, bits);
-  if ((afterSet & bits) != bits) {
-    rlog_e(logTAG, "Failed to set errors bits: %X, current value: %X", bits, afterSet);
-    return false;
-  };
-  ledSysBlinkAuto();
-  return true;
+  return statesCheck(NETWORK_FLAPPING, false);
 }
 
-bool statesSetError(EventBits_t bit, bool state)
+static void statesFlapJson(states_buf_t* buf)
 {
-  if (state) {
-    return statesSetErrors(bit);
-  } else {
-    return statesClearErrors(bit);
+  uint32_t now = statesFlapNow();
+  for (uint8_t i = 0; i < STATES_FLAP_BITS; i++) {
+    portENTER_CRITICAL(&_statesFlapLock);
+    bool flapping = _statesFlap[i].flapping;
+    uint8_t transitions = statesFlapCount(&_statesFlap[i], now);
+    uint32_t count = _statesFlap[i].count;
+    portEXIT_CRITICAL(&_statesFlapLock);
+
+    statesBufPrintf(buf, "%s\"%s\":{\"flapping\":%d,\"transitions\":%d,\"count\":%d}", 
+      i > 0 ? "," : "", _statesFlapNames[i], flapping, transitions, count);
   };
 }
 
+  // Only the default context detects flapping, but the bit is checked in the context at hand
+  #define STATES_FLAP_DAMPEN(ctx, action) if (statesCtxCheck(ctx, NETWORK_FLAPPING, false)) { action; }
+#else
+  #define STATES_FLAP_DAMPEN(ctx, action)
+#endif // CONFIG_STATES_FLAP_DETECTION
+
 // -----------------------------------------------------------------------------------------------------------------------
-// ---------------------------------------------------- JSON routines ----------------------------------------------------
+// ---------------------------------------------------- Error counters ---------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------
 
-char* statesGetJson()
+#if CONFIG_STATES_ERROR_COUNTERS
+
+// Only effective transitions of the error bits are counted, the bits that did not change are not touched
+#define STATES_ERROR_BITS 24
+
+static const char* _statesErrorNames[STATES_ERROR_BITS] = { 
+  "general", "heap", "mqtt", "telegram", "smtp", "site", "thingspeak", "openmon", "narodmon", nullptr, nullptr, nullptr, 
+  nullptr, nullptr, nullptr, nullptr, "sensor0", "sensor1", "sensor2", "sensor3", "sensor4", "sensor5", "sensor6", "sensor7" };
+
+typedef struct {
+  states_error_counter_t counters[STATES_ERROR_BITS];
+  int64_t active_since[STATES_ERROR_BITS];   // esp_timer_get_time() of the last set while the bit is set
+  time_t  time_reset;
+} states_error_counters_t;
+
+static states_error_counters_t _statesErrorCounters;
+static portMUX_TYPE _statesErrorCountersLock = portMUX_INITIALIZER_UNLOCKED;
+
+static void statesErrorCountersUpdate(EventBits_t old_bits, EventBits_t new_bits)
 {
-  EventBits_t states = statesGet(); 
-  return malloc_stringf("{\"ota\":%d,\"rtc_enabled\":%d,\"sntp_sync\":%d,\"silent_mode\":%d,\"wifi_sta_started\":%d,\"wifi_sta_connected\":%d,\"ethernet_started\":%d,\"ethernet_connected\":%d,\"inet_availabled\":%d,\"mqtt1_enabled\":%d,\"mqtt2_enabled\":%d,\"mqtt_connected\":%d,\"mqtt_primary\":%d,\"mqtt_local\":%d}",
-    (states & SYSTEM_OTA) == SYSTEM_OTA,
-    (states & TIME_RTC_ENABLED) == TIME_RTC_ENABLED,
-    (states & TIME_SNTP_SYNC_OK) == TIME_SNTP_SYNC_OK,
-    (states & TIME_SILENT_MODE) == TIME_SILENT_MODE,
-    (states & WIFI_STA_STARTED) == WIFI_STA_STARTED,
-    (states & WIFI_STA_CONNECTED) == WIFI_STA_CONNECTED,
-    (states & ETHERNET_STARTED) == ETHERNET_STARTED,
-    (states & ETHERNET_CONNECTED) == ETHERNET_CONNECTED,
-    (states & INET_AVAILABLED) == INET_AVAILABLED,
-    (states & MQTT_1_ENABLED) == MQTT_1_ENABLED,
-    (states & MQTT_2_ENABLED) == MQTT_2_ENABLED,
-    (states & MQTT_CONNECTED) == MQTT_CONNECTED,
-    (states & MQTT_PRIMARY) == MQTT_PRIMARY,
-    (states & MQTT_LOCAL) == MQTT_LOCAL);
-};
+  EventBits_t changed = (old_bits ^ new_bits) & 0x00FFFFFFU;
+  if (changed == 0) return;
+  int64_t now = esp_timer_get_time();
+  time_t time_now = time(nullptr);
+  portENTER_CRITICAL(&_statesErrorCountersLock);
+  while (changed) {
+    uint8_t bit = __builtin_ctz(changed);
+    changed &= changed - 1;
+    states_error_counter_t* counter = &_statesErrorCounters.counters[bit];
+    if (new_bits & BIT(bit)) {
+      counter->count++;
+      if (counter->first_set == 0) counter->first_set = time_now;
+      counter->last_set = time_now;
+      _statesErrorCounters.active_since[bit] = now;
+    } else if (_statesErrorCounters.active_since[bit] > 0) {
+      counter->active_time += (now - _statesErrorCounters.active_since[bit]) / 1000;
+      counter->last_clear = time_now;
+      _statesErrorCounters.active_since[bit] = 0;
+    };
+  };
+  portEXIT_CRITICAL(&_statesErrorCountersLock);
+}
 
-char* statesGetErrorsJson()
+bool statesErrorCounterGet(uint8_t bit, states_error_counter_t* counter)
 {
-  EventBits_t errors = statesGetErrors();
-  return malloc_stringf("{\"general\":%d,\"heap\":%d,\"mqtt\":%d,\"telegram\":%d,\"smtp\":%d,\"site\":%d,\"thingspeak\":%d,\"openmon\":%d,\"narodmon\":%d,\"sensor0\":%d,\"sensor1\":%d,\"sensor2\":%d,\"sensor3\":%d,\"sensor4\":%d,\"sensor5\":%d,\"sensor6\":%d,\"sensor7\":%d}",
-    (errors & ERR_GENERAL) == ERR_GENERAL,
-    (errors & ERR_HEAP) == ERR_HEAP,
-    (errors & ERR_MQTT) == ERR_MQTT,
-    (errors & ERR_TELEGRAM) == ERR_TELEGRAM,
-    (errors & ERR_SMTP) == ERR_SMTP,
-    (errors & ERR_SITE) == ERR_SITE,
-    (errors & ERR_THINGSPEAK) == ERR_THINGSPEAK,
-    (errors & ERR_OPENMON) == ERR_OPENMON,
-    (errors & ERR_NARODMON) == ERR_NARODMON,
-    (errors & ERR_SENSOR_0) == ERR_SENSOR_0,
-    (errors & ERR_SENSOR_1) == ERR_SENSOR_1,
-    (errors & ERR_SENSOR_2) == ERR_SENSOR_2,
-    (errors & ERR_SENSOR_3) == ERR_SENSOR_3,
-    (errors & ERR_SENSOR_4) == ERR_SENSOR_4,
-    (errors & ERR_SENSOR_5) == ERR_SENSOR_5,
-    (errors & ERR_SENSOR_6) == ERR_SENSOR_6,
-    (errors & ERR_SENSOR_7) == ERR_SENSOR_7);
-};
-  
-// -----------------------------------------------------------------------------------------------------------------------
-// ------------------------------------------- Fixing memory allocation errors -------------------------------------------
-// -----------------------------------------------------------------------------------------------------------------------
+  if ((bit >= STATES_ERROR_BITS) || (counter == nullptr)) return false;
+  int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&_statesErrorCountersLock);
+  memcpy(counter, &_statesErrorCounters.counters[bit], sizeof(states_error_counter_t));
+  if (_statesErrorCounters.active_since[bit] > 0) {
+    counter->active_time += (now - _statesErrorCounters.active_since[bit]) / 1000;
+  };
+  portEXIT_CRITICAL(&_statesErrorCountersLock);
+  return true;
+}
 
-static uint32_t heapFailsCount = 0;
+// The errors that are active now are counted again from this moment
+void statesErrorCountersReset()
+{
+  int64_t now = esp_timer_get_time();
+  time_t time_now = time(nullptr);
+  portENTER_CRITICAL(&_statesErrorCountersLock);
+  memset(&_statesErrorCounters.counters, 0, sizeof(_statesErrorCounters.counters));
+  for (uint8_t i = 0; i < STATES_ERROR_BITS; i++) {
+    if (_statesErrorCounters.active_since[i] > 0) _statesErrorCounters.active_since[i] = now;
+  };
+  _statesErrorCounters.time_reset = time_now;
+  portEXIT_CRITICAL(&_statesErrorCountersLock);
+}
 
-void heapAllocFailedHook(size_t requested_size, uint32_t caps, const char *function_name)
+static void statesErrorCountersWriter(states_buf_t* buf, void* arg)
 {
-  rlog_e("HEAP", "%s was called but failed to allocate %d bytes with 0x%X capabilities.", function_name, requested_size, caps);
-  #if CONFIG_HEAP_ABORT_WHEN_ALLOCATION_FAILS
-    espSetResetReason(RR_HEAP_ALLOCATION_FAILED);
-  #else
-    heapFailsCount++;
-    #if CONFIG_HEAP_ALLOC_FAILED_RESTART
-      espRestart(RR_HEAP_ALLOCATION_FAILED); 
-    #endif // CONFIG_HEAP_ALLOC_FAILED_RESTART
-  #endif // CONFIG_HEAP_ABORT_WHEN_ALLOCATION_FAILS
+  bool first = true;
+  statesBufPrintf(buf, "{\"reset\":%lld,\"errors\":{", (long long)_statesErrorCounters.time_reset);
+  for (uint8_t i = 0; i < STATES_ERROR_BITS; i++) {
+    states_error_counter_t counter;
+    statesErrorCounterGet(i, &counter);
+    if (counter.count == 0) continue;
+    if (_statesErrorNames[i]) {
+      statesBufPrintf(buf, "%s\"%s\":", first ? "" : ",", _statesErrorNames[i]);
+    } else {
+      statesBufPrintf(buf, "%s\"bit%d\":", first ? "" : ",", i);
+    };
+    statesBufPrintf(buf, "{\"count\":%u,\"active_ms\":%llu,\"first\":%lld,\"last\":%lld,\"cleared\":%lld}", 
+      counter.count, counter.active_time, (long long)counter.first_set, (long long)counter.last_set, (long long)counter.last_clear);
+    first = false;
+  };
+  statesBufPrintf(buf, "}}");
 }
 
-uint32_t heapAllocFailedCount() 
+size_t statesGetErrorCountersJsonTo(char* buffer, size_t size)
 {
-  return heapFailsCount;
+  return statesBufWrite(statesErrorCountersWriter, nullptr, buffer, size);
 }
 
-void heapAllocFailedInit()
+#if !CONFIG_STATES_ZERO_HEAP
+char* statesGetErrorCountersJson()
 {
-  heap_caps_register_failed_alloc_callback(heapAllocFailedHook);
-  heapFailsCount = 0;
+  return statesBufMalloc(statesErrorCountersWriter, nullptr);
 }
+#endif // CONFIG_STATES_ZERO_HEAP
 
-#if CONFIG_HEAP_TRACING_STANDALONE
+#endif // CONFIG_STATES_ERROR_COUNTERS
 
-#define CONFIG_HEAP_TRACING_NUM_RECORDS 256
-#define CONFIG_HEAP_LEAKS_NUM_RECORDS 256
-#define CONFIG_HEAP_LEAKS_MIN_SIZE 1
-#define CONFIG_HEAP_LEAKS_MIN_REPEATS 3
+// -----------------------------------------------------------------------------------------------------------------------
+// --------------------------------------------------- Internet quality --------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
 
-typedef struct {
-  uint32_t ccount;
-  void *address;
-  size_t size;
-  void *alloced_by[CONFIG_HEAP_TRACING_STACK_DEPTH];
-  uint8_t confirm;
-  uint32_t repeats;
-  time_t timestamp;
-} heap_leak_record_t;
+#if CONFIG_STATES_INET_QUALITY
+
+/**
+ * Each ping result is folded into EWMA estimates of RTT, RTT deviation and loss (as TCP does for SRTT / RTTVAR) 
+ * and into a fixed-size RTT sketch: log2 buckets with 4 sub-buckets per octave (relative error up to 25%), which
+ * are halved when the window is full, so that old samples fade out. Score: 100 minus the penalties for loss, 
+ * for slow RTT (p90) and for jitter; the tier is switched with a hysteresis
+ * */
+
+#ifndef CONFIG_STATES_INET_QUALITY_WINDOW
+  #define CONFIG_STATES_INET_QUALITY_WINDOW 256
+#endif // CONFIG_STATES_INET_QUALITY_WINDOW
+#ifndef CONFIG_STATES_INET_QUALITY_RTT_GOOD
+  #define CONFIG_STATES_INET_QUALITY_RTT_GOOD 100
+#endif // CONFIG_STATES_INET_QUALITY_RTT_GOOD
+#ifndef CONFIG_STATES_INET_QUALITY_RTT_BAD
+  #define CONFIG_STATES_INET_QUALITY_RTT_BAD 1000
+#endif // CONFIG_STATES_INET_QUALITY_RTT_BAD
+#ifndef CONFIG_STATES_INET_QUALITY_HYSTERESIS
+  #define CONFIG_STATES_INET_QUALITY_HYSTERESIS 5
+#endif // CONFIG_STATES_INET_QUALITY_HYSTERESIS
+static_assert(CONFIG_STATES_INET_QUALITY_RTT_GOOD < CONFIG_STATES_INET_QUALITY_RTT_BAD, "CONFIG_STATES_INET_QUALITY_RTT_GOOD must be less than CONFIG_STATES_INET_QUALITY_RTT_BAD");
+
+// Values up to 65535 ms: 4 exact buckets for 0..3 ms, then 4 buckets for each octave from 4 ms
+#define STATES_QUALITY_BUCKETS 60
+// Lower bounds of the score of each tier (SIT_POOR...SIT_EXCELLENT)
+static const uint8_t _statesQualityTiers[SIT_EXCELLENT] = { 1, 40, 70, 90 };
+static const char* _statesQualityTierNames[SIT_EXCELLENT + 1] = { "down", "poor", "fair", "good", "excellent" };
 
-static uint8_t leak_count = 0;
-static heap_leak_record_t leaks_buffer[CONFIG_HEAP_LEAKS_NUM_RECORDS];
-static heap_trace_record_t trace_buffer[CONFIG_HEAP_TRACING_NUM_RECORDS];
+typedef struct {
+  float    rtt;
+  float    rtt_var;
+  float    loss;
+  uint16_t buckets[STATES_QUALITY_BUCKETS];
+  uint16_t total;
+  uint32_t samples;
+  uint8_t  score;
+  uint8_t  tier;
+} states_quality_t;
+
+static states_quality_t _statesQuality;
+static portMUX_TYPE _statesQualityLock = portMUX_INITIALIZER_UNLOCKED;
+
+static uint8_t statesQualityBucket(uint32_t value)
+{
+  if (value > 0xFFFF) value = 0xFFFF;
+  if (value < 4) return value;
+  uint8_t octave = 31 - __builtin_clz(value);
+  return (octave - 1) * 4 + ((value >> (octave - 2)) & 3);
+}
 
-void heapLeaksStart()
+// Upper bound of the bucket, ms
+static uint32_t statesQualityBucketValue(uint8_t bucket)
 {
-  memset(&leaks_buffer, 0, sizeof(leaks_buffer));
-  heap_trace_init_standalone(trace_buffer, CONFIG_HEAP_TRACING_NUM_RECORDS);
-  heap_trace_start(HEAP_TRACE_LEAKS);
+  if (bucket < 4) return bucket;
+  uint8_t octave = bucket / 4 + 1;
+  return ((5 + (bucket % 4)) << (octave - 2)) - 1;
 }
 
-void heapLeaksStop()
+static uint32_t statesQualityQuantile(const states_quality_t* quality, uint32_t permille)
 {
-  heap_trace_stop();
+  if (quality->total == 0) return 0;
+  uint32_t target = ((uint32_t)quality->total * permille + 999) / 1000;
+  uint32_t count = 0;
+  for (uint8_t i = 0; i < STATES_QUALITY_BUCKETS; i++) {
+    count += quality->buckets[i];
+    if ((count >= target) && (count > 0)) return statesQualityBucketValue(i);
+  };
+  return statesQualityBucketValue(STATES_QUALITY_BUCKETS - 1);
 }
 
-void heapLeaksScan()
+static uint8_t statesQualityCalcScore(const states_quality_t* quality, bool available)
 {
-  // Mark all current entries as lost
-  for (uint16_t i = 0; i < CONFIG_HEAP_LEAKS_NUM_RECORDS; i++) {
-    leaks_buffer[i].confirm = 0;
+  if (!available) return 0;
+  float penalty = quality->loss * 2.0f;
+  if (penalty > 60.0f) penalty = 60.0f;
+  uint32_t p90 = statesQualityQuantile(quality, 900);
+  if (p90 > CONFIG_STATES_INET_QUALITY_RTT_GOOD) {
+    penalty += p90 >= CONFIG_STATES_INET_QUALITY_RTT_BAD ? 30.0f : 
+      30.0f * (p90 - CONFIG_STATES_INET_QUALITY_RTT_GOOD) / (CONFIG_STATES_INET_QUALITY_RTT_BAD - CONFIG_STATES_INET_QUALITY_RTT_GOOD);
   };
+  float jitter = quality->rtt_var / CONFIG_STATES_INET_QUALITY_RTT_GOOD * 10.0f;
+  penalty += jitter > 10.0f ? 10.0f : jitter;
+  // Available internet is never scored as "down"
+  return penalty >= 99.0f ? 1 : (uint8_t)(100.0f - penalty);
+}
 
-  // Search for new leaks and comparison with current data
-  heap_trace_record_t rec;
-  for (uint16_t j = 0; j < CONFIG_HEAP_TRACING_NUM_RECORDS; j++) {
-    if ((heap_trace_get(j, &rec) == ESP_OK) && (rec.address != NULL) && (rec.freed_by[0] == NULL) && (rec.size >= CONFIG_HEAP_LEAKS_MIN_SIZE) && ((rec.ccount & 1) > 0)) {
-      // We are looking for this entry in the main list
-      int16_t found = -1;
-      for (uint16_t i = 0; i < CONFIG_HEAP_LEAKS_NUM_RECORDS; i++) {
-        if ((leaks_buffer[i].address == rec.address) && (leaks_buffer[i].size == rec.size) && (leaks_buffer[i].ccount == rec.ccount)) {
-          found = i;
-          leaks_buffer[i].confirm = 1;
-          leaks_buffer[i].repeats++;
-          break;
-        };
-      };
-      // Entry not found, fill first free entry in buffer
-      if (found == -1) {
-        for (uint16_t i = 0; i < CONFIG_HEAP_LEAKS_NUM_RECORDS; i++) {
-          if ((leaks_buffer[i].address == NULL) || (leaks_buffer[i].size == 0)) {
-            leaks_buffer[i].ccount = rec.ccount;
-            leaks_buffer[i].address = rec.address;
-            leaks_buffer[i].size = rec.size;
-            #if CONFIG_HEAP_TRACING_STACK_DEPTH > 0
-              memcpy(&leaks_buffer[i].alloced_by, &rec.alloced_by, sizeof(void*)*CONFIG_HEAP_TRACING_STACK_DEPTH);
-            #endif // CONFIG_HEAP_TRACING_STACK_DEPTH
-            leaks_buffer[i].confirm = 1;
-            leaks_buffer[i].repeats = 1;
-            leaks_buffer[i].timestamp = time(nullptr);
-            break;
-          };
-        };
-      };
-    };
-  };
-
-  // Mark as free all records that have not been committed in this session
-  leak_count = 0;
-  for (uint16_t i = 0; i < CONFIG_HEAP_LEAKS_NUM_RECORDS; i++) {
-    if ((leaks_buffer[i].confirm == 0) && (leaks_buffer[i].address != NULL)) {
-      memset(&leaks_buffer[i], 0, sizeof(heap_leak_record_t));
-    } else {
-      leak_count++;
-    };
-  };
+static uint8_t statesQualityCalcTier(uint8_t tier, uint8_t score)
+{
+  if (score == 0) return SIT_DOWN;
+  uint8_t target = SIT_DOWN;
+  while ((target < SIT_EXCELLENT) && (score >= _statesQualityTiers[target])) target++;
+  // Upgrade only when the score is clearly inside the higher tier
+  while ((target > tier) && (target > SIT_POOR) && (score < _statesQualityTiers[target - 1] + CONFIG_STATES_INET_QUALITY_HYSTERESIS)) target--;
+  // Downgrade only when the score is clearly below the current tier
+  if ((target < tier) && (tier > SIT_POOR) && (score + CONFIG_STATES_INET_QUALITY_HYSTERESIS > _statesQualityTiers[tier - 1])) target = tier;
+  return target;
 }
 
-char* heapLeaksJson()
+// rtt < 0 - no reply (the internet is unavailable)
+static void statesQualityAdd(float rtt, float loss, bool available)
 {
-  uint16_t count = 0;
-  char* json = nullptr;
-
-  if (leak_count > 0) {
-    char* item = nullptr;
-    char* temp = nullptr;
-
-    heap_leak_record_t rec;
-    for (uint16_t i = 0; i < CONFIG_HEAP_LEAKS_NUM_RECORDS; i++) {
-      if ((leaks_buffer[i].address != NULL) && (leaks_buffer[i].size > 0) && (leaks_buffer[i].confirm > 0) && (leaks_buffer[i].repeats > CONFIG_HEAP_LEAKS_MIN_REPEATS)) {
-        count++;
-        memcpy(&rec, &leaks_buffer[i], sizeof(heap_leak_record_t));
-
-        // Create item JSON
-        char* stack = nullptr;
-        #if CONFIG_HEAP_TRACING_STACK_DEPTH == 0
-          stack = malloc_string("");
-        #elif CONFIG_HEAP_TRACING_STACK_DEPTH == 1
-          stack = malloc_stringf("%p", rec.alloced_by[0]);
-        #elif CONFIG_HEAP_TRACING_STACK_DEPTH == 2
-          stack = malloc_stringf("%p %p", rec.alloced_by[0], rec.alloced_by[1]);
-        #elif CONFIG_HEAP_TRACING_STACK_DEPTH == 3
-          stack = malloc_stringf("%p %p %p", rec.alloced_by[0], rec.alloced_by[1], rec.alloced_by[2]);
-        #elif CONFIG_HEAP_TRACING_STACK_DEPTH == 4
-          stack = malloc_stringf("%p %p %p %p", rec.alloced_by[0], rec.alloced_by[1], rec.alloced_by[2], rec.alloced_by[3]);
-        #elif CONFIG_HEAP_TRACING_STACK_DEPTH == 5
-          stack = malloc_stringf("%p %p %p %p %p", rec.alloced_by[0], rec.alloced_by[1], rec.alloced_by[2], rec.alloced_by[3], rec.alloced_by[4]);
-        #elif CONFIG_HEAP_TRACING_STACK_DEPTH == 6
-          stack = malloc_stringf("%p %p %p %p %p %p", rec.alloced_by[0], rec.alloced_by[1], rec.alloced_by[2], rec.alloced_by[3], rec.alloced_by[4], rec.alloced_by[5]);
-        #elif CONFIG_HEAP_TRACING_STACK_DEPTH == 7
-          stack = malloc_stringf("%p %p %p %p %p %p %p", rec.alloced_by[0], rec.alloced_by[1], rec.alloced_by[2], rec.alloced_by[3], rec.alloced_by[4], rec.alloced_by[5], rec.alloced_by[6]);
-        #elif CONFIG_HEAP_TRACING_STACK_DEPTH == 8
-          stack = malloc_stringf("%p %p %p %p %p %p %p %p", rec.alloced_by[0], rec.alloced_by[1], rec.alloced_by[2], rec.alloced_by[3], rec.alloced_by[4], rec.alloced_by[5], rec.alloced_by[6], rec.alloced_by[7]);
-        #elif CONFIG_HEAP_TRACING_STACK_DEPTH == 9
-          stack = malloc_stringf("%p %p %p %p %p %p %p %p %p", rec.alloced_by[0], rec.alloced_by[1], rec.alloced_by[2], rec.alloced_by[3], rec.alloced_by[4], rec.alloced_by[5], rec.alloced_by[6], rec.alloced_by[7], rec.alloced_by[8]);
-        #else 
-          stack = malloc_stringf("%p %p %p %p %p %p %p %p %p %p", rec.alloced_by[0], rec.alloced_by[1], rec.alloced_by[2], rec.alloced_by[3], rec.alloced_by[4], rec.alloced_by[5], rec.alloced_by[6], rec.alloced_by[7], rec.alloced_by[8], rec.alloced_by[9]);
-        #endif // #elif CONFIG_HEAP_TRACING_STACK_DEPTH
-
-        // 2023-02-15: fixed possible sharing error from multiple tasks
-        char ts_buffer[CONFIG_FORMAT_STRFTIME_BUFFER_SIZE];
-        time2str_empty(CONFIG_FORMAT_DTS, &(rec.timestamp), &ts_buffer[0], sizeof(ts_buffer));
-
-        if (stack) {
-          item = malloc_stringf("{\"timestamp\":\"%s\",\"repeats\":%d,\"address\":\"%p\",\"size\":%d,\"cpu\":%d,\"ccount\":\"0x%08x\",\"stack\":\"%s\"}", 
-            ts_buffer, rec.repeats, rec.address, rec.size, rec.ccount & 1, rec.ccount & ~3, stack);
-          free(stack);
-        };
-
-        // Add item to JSON array
-        if (item) {
-          if (json) {
-            temp = json;
-            json = malloc_stringf("%s,%s", temp, item);
-            free(temp);
-            free(item);
-            item = nullptr;
-          } else {
-            json = item;
-            item = nullptr;
-          };
-        };
+  if (loss < 0.0f) loss = 0.0f;
+  if (loss > 100.0f) loss = 100.0f;
+  portENTER_CRITICAL(&_statesQualityLock);
+  states_quality_t* quality = &_statesQuality;
+  if (quality->samples == 0) {
+    quality->loss = loss;
+  } else {
+    quality->loss += (loss - quality->loss) / 8.0f;
+  };
+  if (rtt >= 0.0f) {
+    if (quality->total == 0) {
+      quality->rtt = rtt;
+      quality->rtt_var = rtt / 2.0f;
+    } else {
+      float delta = rtt - quality->rtt;
+      quality->rtt_var += ((delta < 0.0f ? -delta : delta) - quality->rtt_var) / 4.0f;
+      quality->rtt += delta / 8.0f;
+    };
+    if (quality->total >= CONFIG_STATES_INET_QUALITY_WINDOW) {
+      quality->total = 0;
+      for (uint8_t i = 0; i < STATES_QUALITY_BUCKETS; i++) {
+        quality->buckets[i] /= 2;
+        quality->total += quality->buckets[i];
       };
     };
+    quality->buckets[statesQualityBucket((uint32_t)rtt)]++;
+    quality->total++;
   };
+  quality->samples++;
+  quality->score = statesQualityCalcScore(quality, available);
+  quality->tier = statesQualityCalcTier(quality->tier, quality->score);
+  portEXIT_CRITICAL(&_statesQualityLock);
+}
 
-  // Add brackets
-  if (json) {
-    char* buf = json;
-    json = malloc_stringf("{\"total\":%d,\"details\":[%s]}", count, buf);
-    free(buf);
+static void statesQualityEvent(int32_t event_id, void* event_data)
+{
+  ping_inet_data_t* data = (ping_inet_data_t*)event_data;
+  if (event_id == RE_PING_INET_UNAVAILABLE) {
+    statesQualityAdd(-1.0f, 100.0f, false);
+  } else if (data) {
+    statesQualityAdd(data->duration_ms, data->loss, true);
+  } else {
+    // No measurements in the event: the score is only recalculated
+    portENTER_CRITICAL(&_statesQualityLock);
+    _statesQuality.score = statesQualityCalcScore(&_statesQuality, true);
+    _statesQuality.tier = statesQualityCalcTier(_statesQuality.tier, _statesQuality.score);
+    portEXIT_CRITICAL(&_statesQualityLock);
   };
+}
 
-  return json;
+bool statesInetQualityGet(states_inet_quality_t* quality)
+{
+  if (quality == nullptr) return false;
+  portENTER_CRITICAL(&_statesQualityLock);
+  quality->score = _statesQuality.score;
+  quality->tier = _statesQuality.tier;
+  quality->rtt = _statesQuality.rtt;
+  quality->rtt_var = _statesQuality.rtt_var;
+  quality->loss = _statesQuality.loss;
+  quality->rtt_p50 = statesQualityQuantile(&_statesQuality, 500);
+  quality->rtt_p90 = statesQualityQuantile(&_statesQuality, 900);
+  quality->rtt_p99 = statesQualityQuantile(&_statesQuality, 990);
+  quality->samples = _statesQuality.samples;
+  portEXIT_CRITICAL(&_statesQualityLock);
+  return quality->samples > 0;
 }
 
-void heapLeaksUpdate()
+uint8_t statesInetQualityScore()
 {
-  heapLeaksScan();
-  if (statesMqttIsEnabled()) {
-    char* json = heapLeaksJson();
-    mqttPublish(
-      mqttGetTopicDevice1(statesMqttIsPrimary(), CONFIG_MQTT_HEAP_LEAKS_LOCAL, CONFIG_MQTT_HEAP_LEAKS_TOPIC), 
-      json, CONFIG_MQTT_HEAP_LEAKS_QOS, CONFIG_MQTT_HEAP_LEAKS_RETAINED, true, true);
-  };
-};
+  return statesInetIsAvailabled() ? __atomic_load_n(&_statesQuality.score, __ATOMIC_RELAXED) : 0;
+}
 
-#endif // CONFIG_HEAP_TRACING_STANDALONE
+states_inet_tier_t statesInetQualityTier()
+{
+  return statesInetIsAvailabled() ? (states_inet_tier_t)__atomic_load_n(&_statesQuality.tier, __ATOMIC_RELAXED) : SIT_DOWN;
+}
 
-void heapCapsDebug(const char *function_name)
+static void statesQualityJson(states_buf_t* buf)
 {
-  size_t free = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
-  size_t heap = heap_caps_get_total_size(MALLOC_CAP_DEFAULT);
-  rlog_w("HEAP", "Heap free %.3f% %, free size: %d, total size: %d [ %s ]", 
-    100.0 * (double)free / (double)heap, free, heap, function_name);
+  states_inet_quality_t quality;
+  statesInetQualityGet(&quality);
+  statesBufPrintf(buf, "\"score\":%d,\"tier\":\"%s\",\"rtt\":%.1f,\"jitter\":%.1f,\"loss\":%.1f,\"p50\":%u,\"p90\":%u,\"p99\":%u,\"samples\":%u",
+    quality.score, _statesQualityTierNames[quality.tier], quality.rtt, quality.rtt_var, quality.loss, 
+    quality.rtt_p50, quality.rtt_p90, quality.rtt_p99, quality.samples);
 }
 
+#endif // CONFIG_STATES_INET_QUALITY
+
 // -----------------------------------------------------------------------------------------------------------------------
-// ------------------------------------------------------ System LED -----------------------------------------------------
+// -------------------------------------------------- Uplink arbitration -------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------
 
-#if defined(CONFIG_GPIO_SYSTEM_LED)
- 
-static ledQueue_t _ledSysQueue = NULL;
+#if CONFIG_STATES_UPLINK
+
+/**
+ * One of the connected uplinks is chosen as active according to the policy and is marked with UPLINK_WIFI or 
+ * UPLINK_ETHERNET. If the active uplink is lost, the other one is taken at once; otherwise a freshly connected
+ * uplink must stay up for the hold-down time, and voluntary switchovers are made no more often than the hold-down time.
+ * The ping results are attributed to the active uplink, the RTT of the other one must be reported by the application;
+ * SUP_LOWEST_RTT compares only fresh RTTs of both uplinks. Every switchover is posted as RE_STATES_UPLINK_SWITCHED, 
+ * the owner of the network interfaces moves the default route to the new uplink. Since the internet and the MQTT 
+ * session were checked over the old route, they are dropped: RE_INET_PING_FAILED closes the MQTT session and 
+ * RE_INET_PING_OK makes the client connect again, as after GOT_IP; INET_AVAILABLED is set by the next ping result
+ * */
+
+#ifndef CONFIG_STATES_UPLINK_POLICY
+  #define CONFIG_STATES_UPLINK_POLICY SUP_PREFER_WIRED
+#endif // CONFIG_STATES_UPLINK_POLICY
+#ifndef CONFIG_STATES_UPLINK_HOLDDOWN
+  #define CONFIG_STATES_UPLINK_HOLDDOWN 60
+#endif // CONFIG_STATES_UPLINK_HOLDDOWN
+#ifndef CONFIG_STATES_UPLINK_RTT_MARGIN
+  #define CONFIG_STATES_UPLINK_RTT_MARGIN 20
+#endif // CONFIG_STATES_UPLINK_RTT_MARGIN
+#ifndef CONFIG_STATES_UPLINK_RTT_MAX_AGE
+  #define CONFIG_STATES_UPLINK_RTT_MAX_AGE 120
+#endif // CONFIG_STATES_UPLINK_RTT_MAX_AGE
+
+static const EventBits_t _statesUplinkBits[SU_MAX] = { 0, UPLINK_WIFI, UPLINK_ETHERNET };
+static const char* _statesUplinkNames[SU_MAX] = { "none", "wifi", "ethernet" };
+static const char* _statesUplinkPolicyNames[] = { "prefer_wired", "lowest_rtt", "sticky" };
 
-void ledSysInit(int8_t ledGPIO, bool ledHigh, uint32_t taskStackSize, ledCustomControl_t customControl)
+typedef struct {
+  bool     connected;
+  uint32_t time_up;        // Seconds since boot of the last connection
+  uint32_t uptime;         // Seconds connected, not including the current connection
+  uint32_t ups;
+  uint32_t downs;
+  float    rtt;            // EWMA, ms; 0 - unknown
+  uint32_t rtt_time;       // Seconds since boot of the last RTT report
+} states_uplink_health_t;
+
+typedef struct {
+  uint8_t  policy;         // states_uplink_policy_t
+  uint8_t  active;         // states_uplink_t
+  uint32_t time_switch;    // Seconds since boot of the last switchover
+  uint32_t switches;
+  states_uplink_health_t health[SU_MAX];
+} states_uplink_state_t;
+
+static states_uplink_state_t _statesUplink = { CONFIG_STATES_UPLINK_POLICY, SU_NONE, 0, 0, {} };
+static portMUX_TYPE _statesUplinkLock = portMUX_INITIALIZER_UNLOCKED;
+
+static inline uint32_t statesUplinkNow()
 {
-  if (_ledSysQueue == NULL) {
-    _ledSysQueue = ledTaskCreate(ledGPIO, ledHigh, true, "led_system", taskStackSize, customControl);
-  };
+  return (uint32_t)(esp_timer_get_time() / 1000000);
 }
 
-void ledSysFree()
+static inline bool statesUplinkSettled(states_uplink_health_t* health, uint32_t now)
 {
-  if (_ledSysQueue) { 
-    ledTaskDelete(_ledSysQueue);
-    _ledSysQueue = nullptr;
-  };
+  return health->connected && ((now - health->time_up) >= CONFIG_STATES_UPLINK_HOLDDOWN);
 }
 
-void ledSysOn(const bool fixed)
+static inline bool statesUplinkRttFresh(states_uplink_health_t* health, uint32_t now)
 {
-  if (_ledSysQueue) {
-    ledTaskSend(_ledSysQueue, lmOn, (uint16_t)fixed, 0, 0);
-  };
+  return (health->rtt > 0.0f) && ((now - health->rtt_time) <= CONFIG_STATES_UPLINK_RTT_MAX_AGE);
 }
 
-void ledSysOff(const bool fixed)
+static uint8_t statesUplinkSelect(uint32_t now, uint8_t* reason)
 {
-  if (_ledSysQueue) {
-    ledTaskSend(_ledSysQueue, lmOff, (uint16_t)fixed, 0, 0);
+  states_uplink_health_t* wifi = &_statesUplink.health[SU_WIFI];
+  states_uplink_health_t* eth = &_statesUplink.health[SU_ETHERNET];
+  uint8_t active = _statesUplink.active;
+
+  // The active uplink has been lost (or there was none): any connected uplink is better than nothing
+  if ((active == SU_NONE) || !_statesUplink.health[active].connected) {
+    *reason = SUR_LOST;
+    if (wifi->connected && eth->connected) {
+      if ((_statesUplink.policy == SUP_LOWEST_RTT) && statesUplinkRttFresh(wifi, now) && statesUplinkRttFresh(eth, now) && (wifi->rtt < eth->rtt)) {
+        return SU_WIFI;
+      };
+      return SU_ETHERNET;
+    };
+    if (eth->connected) return SU_ETHERNET;
+    if (wifi->connected) return SU_WIFI;
+    return SU_NONE;
+  };
+
+  // Voluntary switchover
+  if ((now - _statesUplink.time_switch) < CONFIG_STATES_UPLINK_HOLDDOWN) return active;
+  uint8_t other = active == SU_WIFI ? SU_ETHERNET : SU_WIFI;
+  states_uplink_health_t* current = &_statesUplink.health[active];
+  states_uplink_health_t* candidate = &_statesUplink.health[other];
+  if (!statesUplinkSettled(candidate, now)) return active;
+  switch (_statesUplink.policy) {
+    case SUP_PREFER_WIRED:
+      if (other == SU_ETHERNET) {
+        *reason = SUR_PREFERRED;
+        return other;
+      };
+      break;
+    case SUP_LOWEST_RTT:
+      if (statesUplinkRttFresh(candidate, now) && statesUplinkRttFresh(current, now)
+       && (candidate->rtt * 100.0f < current->rtt * (100 - CONFIG_STATES_UPLINK_RTT_MARGIN))) {
+        *reason = SUR_RTT;
+        return other;
+      };
+      break;
+    default:
+      break;
   };
+  return active;
 }
 
-void ledSysSet(const bool newState)
+static void statesUplinkEvaluate()
 {
-  if (_ledSysQueue) {
-    if (newState) {
-      ledTaskSend(_ledSysQueue, lmOn, 0, 0, 0);
-    }
-    else {
-      ledTaskSend(_ledSysQueue, lmOff, 0, 0, 0);
+  // The stress test changes the links at random, the route is not moved meanwhile
+  if (STATES_STRESS_MUTED) return;
+  uint32_t now = statesUplinkNow();
+  uint8_t reason = SUR_LOST;
+  states_uplink_switch_t data;
+  portENTER_CRITICAL(&_statesUplinkLock);
+  uint8_t from = _statesUplink.active;
+  uint8_t to = statesUplinkSelect(now, &reason);
+  if (to != from) {
+    _statesUplink.active = to;
+    _statesUplink.time_switch = now;
+    _statesUplink.switches++;
+    data.from = from;
+    data.to = to;
+    data.reason = reason;
+    data.rtt_from = _statesUplink.health[from].rtt;
+    data.rtt_to = _statesUplink.health[to].rtt;
+  };
+  portEXIT_CRITICAL(&_statesUplinkLock);
+
+  if (to != from) {
+    rlog_i(logTAG, "Uplink switched: %s -> %s", _statesUplinkNames[from], _statesUplinkNames[to]);
+    if (_statesUplinkBits[from]) statesClear(_statesUplinkBits[from]);
+    if (_statesUplinkBits[to]) statesSet(_statesUplinkBits[to]);
+    statesEventLoopPost(RE_STATES_EVENTS, RE_STATES_UPLINK_SWITCHED, &data, sizeof(data), portMAX_DELAY);
+    // The route has moved to another live uplink
+    if ((from != SU_NONE) && (to != SU_NONE)) {
+      statesClear(INET_AVAILABLED | INET_SLOWDOWN | MQTT_CONNECTED);
+      statesEventLoopPost(RE_WIFI_EVENTS, RE_INET_PING_FAILED, nullptr, 0, portMAX_DELAY);
+      statesEventLoopPost(RE_WIFI_EVENTS, RE_INET_PING_OK, nullptr, 0, portMAX_DELAY);
     };
   };
 }
 
-void ledSysSetEnabled(const bool newEnabled)
+static void statesUplinkLink(uint8_t uplink, bool connected)
 {
-  if (_ledSysQueue) {
-    ledTaskSend(_ledSysQueue, lmEnable, (uint16_t)newEnabled, 0, 0);
+  uint32_t now = statesUplinkNow();
+  portENTER_CRITICAL(&_statesUplinkLock);
+  states_uplink_health_t* health = &_statesUplink.health[uplink];
+  if (connected && !health->connected) {
+    health->connected = true;
+    health->time_up = now;
+    health->ups++;
+  } else if (!connected && health->connected) {
+    health->connected = false;
+    health->uptime += now - health->time_up;
+    health->downs++;
   };
+  portEXIT_CRITICAL(&_statesUplinkLock);
+  statesUplinkEvaluate();
 }
 
-void ledSysActivity()
+void statesUplinkReportRtt(states_uplink_t uplink, float rtt)
 {
-  if (_ledSysQueue) {
-    ledTaskSend(_ledSysQueue, lmFlash, CONFIG_LEDSYS_FLASH_QUANTITY, CONFIG_LEDSYS_FLASH_DURATION, CONFIG_LEDSYS_FLASH_INTERVAL);
+  if ((uplink == SU_NONE) || (uplink >= SU_MAX) || (rtt < 0.0f)) return;
+  uint32_t now = statesUplinkNow();
+  portENTER_CRITICAL(&_statesUplinkLock);
+  states_uplink_health_t* health = &_statesUplink.health[uplink];
+  // A stale average is restarted rather than blended with the new result
+  if (statesUplinkRttFresh(health, now)) {
+    health->rtt += (rtt - health->rtt) / 8.0f;
+  } else {
+    health->rtt = rtt;
   };
+  health->rtt_time = now;
+  portEXIT_CRITICAL(&_statesUplinkLock);
 }
 
-void ledSysFlashOn(const uint16_t quantity, const uint16_t duration, const uint16_t interval)
+// The pinger measures the route through the active uplink
+static void statesUplinkPing(void* event_data)
 {
-  if (_ledSysQueue) {
-    ledTaskSend(_ledSysQueue, lmFlash, quantity, duration, interval);
+  if (event_data) {
+    statesUplinkReportRtt((states_uplink_t)__atomic_load_n(&_statesUplink.active, __ATOMIC_RELAXED), ((ping_inet_data_t*)event_data)->duration_ms);
   };
+  statesUplinkEvaluate();
 }
 
-void ledSysBlinkOn(const uint16_t quantity, const uint16_t duration, const uint16_t interval)
+void statesUplinkSetPolicy(states_uplink_policy_t policy)
 {
-  if (_ledSysQueue) {
-    ledTaskSend(_ledSysQueue, lmBlinkOn, quantity, duration, interval);
-  };
+  portENTER_CRITICAL(&_statesUplinkLock);
+  _statesUplink.policy = policy;
+  portEXIT_CRITICAL(&_statesUplinkLock);
+  statesUplinkEvaluate();
 }
 
-void ledSysBlinkOff()
+states_uplink_t statesUplinkActive()
 {
-  if (_ledSysQueue) {
-    ledTaskSend(_ledSysQueue, lmBlinkOff, 0, 0, 0);
-  };
+  return (states_uplink_t)__atomic_load_n(&_statesUplink.active, __ATOMIC_RELAXED);
 }
 
-void ledSysBlinkAuto()
+static void statesUplinkJson(states_buf_t* buf)
 {
-  EventBits_t states = statesGet();
-  EventBits_t errors = statesGetErrors();
-  if (states & SYSTEM_OTA) {
-    ledSysBlinkOn(CONFIG_LEDSYS_OTA_QUANTITY, CONFIG_LEDSYS_OTA_DURATION, CONFIG_LEDSYS_OTA_INTERVAL);
-  }
-  else if (errors & ERR_GENERAL) {
-    ledSysBlinkOn(CONFIG_LEDSYS_ERROR_QUANTITY, CONFIG_LEDSYS_ERROR_DURATION, CONFIG_LEDSYS_ERROR_INTERVAL);
-  }
-  else if (errors & ERR_SENSORS) {
-    ledSysBlinkOn(CONFIG_LEDSYS_SENSOR_ERROR_QUANTITY, CONFIG_LEDSYS_SENSOR_ERROR_DURATION, CONFIG_LEDSYS_SENSOR_ERROR_INTERVAL);
-  }
-  #if !defined(CONFIG_OFFLINE_MODE) || (CONFIG_OFFLINE_MODE == 0)
-    else if (!(states & NETWORK_CONNECTED)) {
-      ledSysBlinkOn(CONFIG_LEDSYS_WIFI_INIT_QUANTITY, CONFIG_LEDSYS_WIFI_INIT_DURATION, CONFIG_LEDSYS_WIFI_INIT_INTERVAL);
-    }
-    else if (!(states & INET_AVAILABLED)) {
-      ledSysBlinkOn(CONFIG_LEDSYS_PING_FAILED_QUANTITY, CONFIG_LEDSYS_PING_FAILED_DURATION, CONFIG_LEDSYS_PING_FAILED_INTERVAL);
-    }
-    else if (!(states & TIME_IS_OK)) {
-      ledSysBlinkOn(CONFIG_LEDSYS_TIME_ERROR_QUANTITY, CONFIG_LEDSYS_TIME_ERROR_DURATION, CONFIG_LEDSYS_TIME_ERROR_INTERVAL);
-    }
-    else if (!(states & MQTT_CONNECTED) || (errors & ERR_MQTT)) {
-      ledSysBlinkOn(CONFIG_LEDSYS_MQTT_ERROR_QUANTITY, CONFIG_LEDSYS_MQTT_ERROR_DURATION, CONFIG_LEDSYS_MQTT_ERROR_INTERVAL);
-    }
-    else if (errors & ERR_PUBLISH) {
-      ledSysBlinkOn(CONFIG_LEDSYS_PUB_ERROR_QUANTITY, CONFIG_LEDSYS_PUB_ERROR_DURATION, CONFIG_LEDSYS_PUB_ERROR_INTERVAL);
-    }
-    else if (errors & ERR_TELEGRAM) {
-      ledSysBlinkOn(CONFIG_LEDSYS_TG_ERROR_QUANTITY, CONFIG_LEDSYS_TG_ERROR_DURATION, CONFIG_LEDSYS_TG_ERROR_INTERVAL);
-    }
-    else if (errors & ERR_SMTP) {
-      ledSysBlinkOn(CONFIG_LEDSYS_SMTP_ERROR_QUANTITY, CONFIG_LEDSYS_SMTP_ERROR_DURATION, CONFIG_LEDSYS_SMTP_ERROR_INTERVAL);
-    }
-  #else
-    else if (!(states & TIME_IS_OK)) {
-      ledSysBlinkOn(CONFIG_LEDSYS_TIME_ERROR_QUANTITY, CONFIG_LEDSYS_TIME_ERROR_DURATION, CONFIG_LEDSYS_TIME_ERROR_INTERVAL);
-    }
-  #endif // CONFIG_OFFLINE_MODE
-  else {
-    ledSysBlinkOn(CONFIG_LEDSYS_NORMAL_QUANTITY, CONFIG_LEDSYS_NORMAL_DURATION, CONFIG_LEDSYS_NORMAL_INTERVAL);
+  uint32_t now = statesUplinkNow();
+  states_uplink_state_t uplink;
+  portENTER_CRITICAL(&_statesUplinkLock);
+  memcpy(&uplink, &_statesUplink, sizeof(states_uplink_state_t));
+  portEXIT_CRITICAL(&_statesUplinkLock);
+
+  statesBufPrintf(buf, "\"active\":\"%s\",\"policy\":\"%s\",\"switches\":%u", 
+    _statesUplinkNames[uplink.active], _statesUplinkPolicyNames[uplink.policy], uplink.switches);
+  for (uint8_t i = SU_WIFI; i < SU_MAX; i++) {
+    states_uplink_health_t* health = &uplink.health[i];
+    statesBufPrintf(buf, ",\"%s\":{\"connected\":%d,\"uptime\":%u,\"ups\":%u,\"downs\":%u,\"rtt\":%.1f}", 
+      _statesUplinkNames[i], health->connected, health->uptime + (health->connected ? now - health->time_up : 0),
+      health->ups, health->downs, health->rtt);
   };
 }
 
-#else
+#endif // CONFIG_STATES_UPLINK
 
-void ledSysInit(int8_t ledGPIO, bool ledHigh, uint32_t taskStackSize, ledCustomControl_t customControl)
-{
-  // Stub
-}
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------- MQTT broker statistics ----------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
 
-void ledSysFree()
-{
-  // Stub
-}
+#if CONFIG_STATES_MQTT_STATS
 
-void ledSysOn(const bool fixed)
-{
-  // Stub
-}
+/**
+ * Connection attempts, failures, sessions and reachability (from the pinger) of the primary and the reserve broker.
+ * Return to the primary broker is advised only after it has been reachable and free of failures for the stable time;
+ * every consecutive session on the primary broker shorter than the minimum doubles that time (up to 8 times),
+ * so that a broker which accepts connections and then drops them does not cause ping-pong
+ * */
 
-void ledSysOff(const bool fixed)
+#ifndef CONFIG_STATES_MQTT_FAILBACK_STABLE
+  #define CONFIG_STATES_MQTT_FAILBACK_STABLE 300
+#endif // CONFIG_STATES_MQTT_FAILBACK_STABLE
+#ifndef CONFIG_STATES_MQTT_FAILBACK_MIN_SESSION
+  #define CONFIG_STATES_MQTT_FAILBACK_MIN_SESSION 600
+#endif // CONFIG_STATES_MQTT_FAILBACK_MIN_SESSION
+
+static const char* _statesMqttBrokerNames[SMB_MAX] = { "primary", "reserve" };
+
+typedef struct {
+  states_mqtt_broker_stats_t brokers[SMB_MAX];
+  uint8_t  broker;         // Broker of the current (or last) session
+  bool     connected;
+  uint32_t outage_start;   // Seconds since boot when the connection was lost, 0 - since boot
+  uint32_t short_sessions; // Consecutive short sessions on the primary broker
+} states_mqtt_stats_t;
+
+static states_mqtt_stats_t _statesMqttStats;
+static portMUX_TYPE _statesMqttStatsLock = portMUX_INITIALIZER_UNLOCKED;
+
+static inline uint32_t statesMqttStatsNow()
 {
-  // Stub
+  return (uint32_t)(esp_timer_get_time() / 1000000);
 }
 
-void ledSysSet(const bool newState)
+static void statesMqttStatsEvent(int32_t event_id, void* event_data)
 {
-  // Stub
+  uint32_t now = statesMqttStatsNow();
+  re_mqtt_event_data_t* data = (re_mqtt_event_data_t*)event_data;
+  portENTER_CRITICAL(&_statesMqttStatsLock);
+  states_mqtt_stats_t* stats = &_statesMqttStats;
+  uint8_t index = data ? (uint8_t)(data->primary ? SMB_PRIMARY : SMB_RESERVE) : (uint8_t)stats->broker;
+  states_mqtt_broker_stats_t* broker = &stats->brokers[index];
+  switch (event_id) {
+    case RE_MQTT_CONNECTED:
+      broker->attempts++;
+      broker->connects++;
+      broker->consecutive_failures = 0;
+      broker->connect_time_last = now - stats->outage_start;
+      if (broker->connect_time_last > broker->connect_time_max) broker->connect_time_max = broker->connect_time_last;
+      broker->session_start = now;
+      stats->broker = index;
+      stats->connected = true;
+      break;
+    case RE_MQTT_CONN_LOST:
+      if (stats->connected) {
+        uint32_t duration = now - stats->brokers[stats->broker].session_start;
+        broker = &stats->brokers[stats->broker];
+        broker->disconnects++;
+        broker->session_last = duration;
+        broker->session_total += duration;
+        if (duration > broker->session_max) broker->session_max = duration;
+        if (stats->broker == SMB_PRIMARY) {
+          stats->short_sessions = duration < CONFIG_STATES_MQTT_FAILBACK_MIN_SESSION ? stats->short_sessions + 1 : 0;
+        };
+        stats->connected = false;
+        stats->outage_start = now;
+      };
+      break;
+    case RE_MQTT_CONN_FAILED:
+      broker->attempts++;
+      broker->failures++;
+      broker->consecutive_failures++;
+      broker->time_failure = now;
+      if (stats->connected && (stats->broker == index)) {
+        stats->connected = false;
+        stats->outage_start = now;
+      };
+      break;
+    case RE_MQTT_SERVER_PRIMARY:
+      stats->brokers[SMB_PRIMARY].switches++;
+      break;
+    case RE_MQTT_SERVER_RESERVED:
+      stats->brokers[SMB_RESERVE].switches++;
+      break;
+    default:
+      break;
+  };
+  portEXIT_CRITICAL(&_statesMqttStatsLock);
 }
 
-void ledSysSetEnabled(const bool newEnabled)
+static void statesMqttStatsReachable(uint8_t index, bool reachable)
 {
-  // Stub
+  uint32_t now = statesMqttStatsNow();
+  portENTER_CRITICAL(&_statesMqttStatsLock);
+  states_mqtt_broker_stats_t* broker = &_statesMqttStats.brokers[index];
+  if (!broker->reachable_known || (broker->reachable != reachable)) {
+    if (broker->reachable_known) broker->reachable_changes++;
+    broker->reachable_known = true;
+    broker->reachable = reachable;
+    broker->reachable_since = now;
+  };
+  portEXIT_CRITICAL(&_statesMqttStatsLock);
 }
 
-void ledSysActivity()
+bool statesMqttBrokerStats(states_mqtt_broker_t index, states_mqtt_broker_stats_t* stats)
 {
-  // Stub
+  if ((index >= SMB_MAX) || (stats == nullptr)) return false;
+  portENTER_CRITICAL(&_statesMqttStatsLock);
+  memcpy(stats, &_statesMqttStats.brokers[index], sizeof(states_mqtt_broker_stats_t));
+  portEXIT_CRITICAL(&_statesMqttStatsLock);
+  return true;
 }
 
-void ledSysFlashOn(const uint16_t quantity, const uint16_t duration, const uint16_t interval)
+static uint32_t statesMqttFailbackDelayLocked(uint32_t now)
 {
-  // Stub
+  states_mqtt_broker_stats_t* primary = &_statesMqttStats.brokers[SMB_PRIMARY];
+  uint8_t backoff = _statesMqttStats.short_sessions > 3 ? 3 : _statesMqttStats.short_sessions;
+  uint32_t required = CONFIG_STATES_MQTT_FAILBACK_STABLE << backoff;
+  uint32_t delay = 0;
+  if (primary->reachable_known) {
+    if (!primary->reachable) return UINT32_MAX;
+    uint32_t reachable = now - primary->reachable_since;
+    if (reachable < required) delay = required - reachable;
+  };
+  if (primary->time_failure > 0) {
+    uint32_t failure = now - primary->time_failure;
+    if ((failure < required) && (required - failure > delay)) delay = required - failure;
+  };
+  return delay;
 }
 
-void ledSysBlinkOn(const uint16_t quantity, const uint16_t duration, const uint16_t interval)
+uint32_t statesMqttFailbackDelay()
 {
-  // Stub
+  uint32_t now = statesMqttStatsNow();
+  portENTER_CRITICAL(&_statesMqttStatsLock);
+  uint32_t delay = statesMqttFailbackDelayLocked(now);
+  portEXIT_CRITICAL(&_statesMqttStatsLock);
+  return delay;
 }
 
-void ledSysBlinkOff()
+bool statesMqttFailbackAllowed()
 {
-  // Stub
+  return !statesMqttIsPrimary() && (statesMqttFailbackDelay() == 0);
 }
 
-void ledSysBlinkAuto()
+static void statesMqttStatsJson(states_buf_t* buf)
 {
-  // Stub
+  uint32_t now = statesMqttStatsNow();
+  states_mqtt_stats_t stats;
+  portENTER_CRITICAL(&_statesMqttStatsLock);
+  memcpy(&stats, &_statesMqttStats, sizeof(states_mqtt_stats_t));
+  uint32_t delay = statesMqttFailbackDelayLocked(now);
+  portEXIT_CRITICAL(&_statesMqttStatsLock);
+
+  for (uint8_t i = 0; i < SMB_MAX; i++) {
+    states_mqtt_broker_stats_t* broker = &stats.brokers[i];
+    uint32_t session = (stats.connected && (stats.broker == i)) ? now - broker->session_start : 0;
+    statesBufPrintf(buf, "%s\"%s\":{\"attempts\":%u,\"connects\":%u,\"failures\":%u,\"consecutive_failures\":%u,\"disconnects\":%u,\"switches\":%u",
+      i > 0 ? "," : "", _statesMqttBrokerNames[i], broker->attempts, broker->connects, broker->failures, broker->consecutive_failures, 
+      broker->disconnects, broker->switches);
+    statesBufPrintf(buf, ",\"session\":%u,\"session_last\":%u,\"session_max\":%u,\"session_total\":%u,\"connect_time_last\":%u,\"connect_time_max\":%u",
+      session, broker->session_last, broker->session_max, broker->session_total + session, broker->connect_time_last, broker->connect_time_max);
+    if (broker->reachable_known) {
+      statesBufPrintf(buf, ",\"reachable\":%d,\"reachable_for\":%u,\"reachable_changes\":%u}", 
+        broker->reachable, now - broker->reachable_since, broker->reachable_changes);
+    } else {
+      statesBufPrintf(buf, "}");
+    };
+  };
+  statesBufPrintf(buf, ",\"short_sessions\":%u,\"failback_delay\":%d", stats.short_sessions, delay == UINT32_MAX ? -1 : (int32_t)delay);
 }
 
-#endif // CONFIG_GPIO_SYSTEM_LED
+#endif // CONFIG_STATES_MQTT_STATS
 
 // -----------------------------------------------------------------------------------------------------------------------
-// ------------------------------------------------- Event notifications -------------------------------------------------
+// ----------------------------------------------- Health monitors registry ----------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------
 
 #if CONFIG_ENABLE_STATES_NOTIFICATIONS
 
-#if CONFIG_NOTIFY_TELEGRAM_WIFI_STATUS || CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-  #define ENABLE_NOTIFY_WIFI_STATUS 1
-#else
-  #define ENABLE_NOTIFY_WIFI_STATUS 0
-#endif // CONFIG_NOTIFY_TELEGRAM_WIFI_STATUS || CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+// Each context has its own registry, the monitors are locked while their dependencies in that context are not met
 
-#if defined(CONFIG_ETH_ENABLED) && (CONFIG_ETH_ENABLED == 1)
-  #if CONFIG_NOTIFY_TELEGRAM_ETH_STATUS || CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-    #define ENABLE_NOTIFY_ETH_STATUS 1
-  #else
-    #define ENABLE_NOTIFY_ETH_STATUS 0
-  #endif // CONFIG_NOTIFY_TELEGRAM_ETH_STATUS || CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-#endif // CONFIG_ETH_ENABLED
+static bool statesHealthMonitorsLock(re_states_ctx_t* ctx)
+{
+  if (ctx->monitors_lock == nullptr) return false;
+  return xSemaphoreTakeRecursive(ctx->monitors_lock, portMAX_DELAY) == pdTRUE;
+}
 
-#if CONFIG_PINGER_ENABLE && (CONFIG_NOTIFY_TELEGRAM_INET_UNAVAILABLE || CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE)
-  #define ENABLE_NOTIFY_INET_STATUS 1
-#else
-  #define ENABLE_NOTIFY_INET_STATUS 0
-#endif // CONFIG_NOTIFY_TELEGRAM_INET_UNAVAILABLE
+static void statesHealthMonitorsUnlock(re_states_ctx_t* ctx)
+{
+  xSemaphoreGiveRecursive(ctx->monitors_lock);
+}
 
-#if CONFIG_NOTIFY_TELEGRAM_MQTT_STATUS || CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-  #define ENABLE_NOTIFY_MQTT_STATUS 1
-#else
-  #define ENABLE_NOTIFY_MQTT_STATUS 0
-#endif // CONFIG_NOTIFY_TELEGRAM_MQTT_STATUS 
+static inline bool statesHealthMonitorSatisfied(states_health_monitor_t* item, EventBits_t states)
+{
+  return ((states & item->depends_all) == item->depends_all) 
+      && ((item->depends_any == 0) || ((states & item->depends_any) != 0));
+}
 
-#if CONFIG_ENABLE_STATES_NOTIFICATIONS && (CONFIG_NOTIFY_TELEGRAM_MQTT_ERRORS || CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE)
-  #define ENABLE_NOTIFY_MQTT_ERRORS 1
-#else
-  #define ENABLE_NOTIFY_MQTT_ERRORS 0
-#endif // CONFIG_NOTIFY_TELEGRAM_MQTT_ERRORS
-
-#if defined(CONFIG_MQTT1_TYPE) && CONFIG_MQTT1_PING_CHECK && (CONFIG_NOTIFY_TELEGRAM_MQTT_STATUS || CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE)
-  #define ENABLE_NOTIFY_MQTT1_PING 1
-#else
-  #define ENABLE_NOTIFY_MQTT1_PING 0
-#endif // CONFIG_MQTT1_PING_CHECK
-
-#if defined(CONFIG_MQTT2_TYPE) && CONFIG_MQTT2_PING_CHECK && (CONFIG_NOTIFY_TELEGRAM_MQTT_STATUS || CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE)
-  #define ENABLE_NOTIFY_MQTT2_PING 1
-#else
-  #define ENABLE_NOTIFY_MQTT2_PING 0
-#endif // CONFIG_MQTT1_PING_CHECK
-
-#if CONFIG_OPENMON_ENABLE && (CONFIG_NOTIFY_TELEGRAM_OPENMON_STATUS || CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE)
-  #define ENABLE_NOTIFY_OPENMON_STATUS 1
-#else
-  #define ENABLE_NOTIFY_OPENMON_STATUS 0
-#endif // CONFIG_NOTIFY_TELEGRAM_OPENMON_STATUS
-
-#if CONFIG_NARODMON_ENABLE && (CONFIG_NOTIFY_TELEGRAM_NARODMON_STATUS || CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE)
-  #define ENABLE_NOTIFY_NARODMON_STATUS 1
-#else
-  #define ENABLE_NOTIFY_NARODMON_STATUS 0
-#endif // CONFIG_NOTIFY_TELEGRAM_NARODMON_STATUS
-
-#if CONFIG_THINGSPEAK_ENABLE && (CONFIG_NOTIFY_TELEGRAM_THINGSPEAK_STATUS || CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE)
-  #define ENABLE_NOTIFY_THINGSPEAK_STATUS 1
-#else
-  #define ENABLE_NOTIFY_THINGSPEAK_STATUS 0
-#endif // CONFIG_NOTIFY_TELEGRAM_THINGSPEAK_STATUS
-
-#if !defined(CONFIG_NO_SENSORS) && (CONFIG_NOTIFY_TELEGRAM_SENSOR_STATE || CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE)
-  #define ENABLE_NOTIFY_SENSOR_STATE 1
-#else
-  #define ENABLE_NOTIFY_SENSOR_STATE 0
-#endif // CONFIG_NOTIFY_TELEGRAM_SENSOR_STATE
-
-#if CONFIG_SILENT_MODE_ENABLE && (CONFIG_NOTIFY_TELEGRAM_SILENT_MODE || CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE)
-  #define ENABLE_NOTIFY_SILENT_MODE 1
-#else
-  #define ENABLE_NOTIFY_SILENT_MODE 0
-#endif // CONFIG_NOTIFY_TELEGRAM_SILENT_MODE
-
-static bool healthMonitorNotify(hm_notify_data_t *notify_data)
+static void statesHealthMonitorApply(states_health_monitor_t* item, EventBits_t states, bool forced)
 {
-  if (notify_data != nullptr) {
-    // Format failure start time
-    struct tm tm_failure;
-    char str_failure[CONFIG_FORMAT_STRFTIME_BUFFER_SIZE];
-    memset(&str_failure, 0, sizeof(str_failure));
-    localtime_r(&notify_data->time_failure, &tm_failure);
-    strftime(str_failure, sizeof(str_failure), CONFIG_FORMAT_DTS, &tm_failure);
-    
-    if (notify_data->state == ESP_OK) {
-      // Format failure end time
-      struct tm tm_recovery;
-      char str_recovery[CONFIG_FORMAT_STRFTIME_BUFFER_SIZE];
-      memset(&str_recovery, 0, sizeof(str_recovery));
-      localtime_r(&notify_data->time_state, &tm_recovery);
-      strftime(str_recovery, sizeof(str_recovery), CONFIG_FORMAT_DTS, &tm_recovery);
-
-      // Format failure duration time
-      time_t failure_duration = notify_data->time_state - notify_data->time_failure;
-      uint16_t duration_h = failure_duration / 3600;
-      uint16_t duration_m = failure_duration % 3600 / 60;
-      uint16_t duration_s = failure_duration % 3600 % 60;
-
-      // Send notify
-      if (notify_data->msg_template) {
-        if (notify_data->object == nullptr) {
-          return tgSendMsg(notify_data->msg_options, CONFIG_TELEGRAM_DEVICE, notify_data->msg_template, 
-            str_failure, str_recovery, duration_h, duration_m, duration_s);
-        } else {
-          return tgSendMsg(notify_data->msg_options, CONFIG_TELEGRAM_DEVICE, notify_data->msg_template, notify_data->object, 
-            str_failure, str_recovery, duration_h, duration_m, duration_s);
-        };
-      };
-    } else {
-      // Send notify
-      if (notify_data->msg_template) {
-        uint32_t err_code = notify_data->state;
-        const char* err_text = esp_err_to_name(notify_data->state);
-        if ((notify_data->state > 0x7064) && (notify_data->state < 0x8000)) {
-          // HTTP errors
-          err_code = notify_data->state - 0x7000;
-          if (err_code == 300) err_text = "Multiple Choices";
-          else if (err_code == 301) err_text = "Moved Permanently";
-          else if (err_code == 302) err_text = "Moved Temporarily";
-          else if (err_code == 307) err_text = "Temporary Redirect";
-          else if (err_code == 308) err_text = "Permanent Redirect";
-          else if (err_code == 400) err_text = "Bad Request";
-          else if (err_code == 401) err_text = "Unauthorized";
-          else if (err_code == 403) err_text = "Forbidden";
-          else if (err_code == 404) err_text = "Not Found";
-          else if (err_code == 429) err_text = "Too Many Requests";
-          else if (err_code == 431) err_text = "Request Header Fields Too Large";
-          else if (err_code == 500) err_text = "Internal Server Error";
-          else if (err_code == 501) err_text = "Not Implemented";
-          else if (err_code == 502) err_text = "Bad Gateway";
-          else if (err_code == 503) err_text = "Service Unavailable";
-          else if (err_code == 504) err_text = "Gateway Timeout";
-        };
-        if (notify_data->object == nullptr) {
-          return tgSendMsg(notify_data->msg_options, CONFIG_TELEGRAM_DEVICE, notify_data->msg_template, 
-            notify_data->state, err_code, err_text, str_failure);
-        } else {
-          return tgSendMsg(notify_data->msg_options, CONFIG_TELEGRAM_DEVICE, notify_data->msg_template, notify_data->object, 
-            notify_data->state, err_code, err_text, str_failure);
-        };
+  reHealthMonitor* monitor = item->monitor;
+  if (monitor) {
+    bool locked = !statesHealthMonitorSatisfied(item, states);
+    if (forced || (locked != item->locked)) {
+      item->locked = locked;
+      if (locked) {
+        monitor->lock();
+      } else {
+        monitor->unlock();
       };
     };
   };
-  return false;
 }
 
-// --- WiFi --------------------------------------------------------------------------------------------------------------
-#if !defined(CONFIG_WIFI_ENABLED) || (CONFIG_WIFI_ENABLED == 1)
-  #if ENABLE_NOTIFY_WIFI_STATUS
-    
-    reHealthMonitor hmWifi(nullptr, HM_RECOVERY, 
-      encMsgOptions(MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_ALERT_WIFI_STATUS, CONFIG_NOTIFY_TELEGRAM_WIFI_PRIORITY), 
-      CONFIG_MESSAGE_TG_WIFI_AVAILABLE, nullptr, CONFIG_NOTIFY_TELEGRAM_WIFI_THRESOLD, healthMonitorNotify);
-
-  #endif // ENABLE_NOTIFY_WIFI_STATUS
-#endif // CONFIG_WIFI_ENABLED
-
-// --- Ethernet ----------------------------------------------------------------------------------------------------------
-#if defined(CONFIG_ETH_ENABLED) && (CONFIG_ETH_ENABLED == 1)
-  #if ENABLE_NOTIFY_ETH_STATUS
-    
-    reHealthMonitor hmEthernet(nullptr, HM_RECOVERY, 
-      encMsgOptions(MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_ALERT_ETH_STATUS, CONFIG_NOTIFY_TELEGRAM_ETH_PRIORITY), 
-      CONFIG_MESSAGE_TG_ETH_AVAILABLE, nullptr, CONFIG_NOTIFY_TELEGRAM_ETH_THRESOLD, healthMonitorNotify);
-
-  #endif // ENABLE_NOTIFY_ETH_STATUS
-#endif // CONFIG_ETH_ENABLED
-
-// --- Ping --------------------------------------------------------------------------------------------------------------
-#if ENABLE_NOTIFY_INET_STATUS
+// One pass over all registered monitors, only those whose dependencies have changed are locked or unlocked
+static void statesHealthMonitorsApply(re_states_ctx_t* ctx, EventBits_t states)
+{
+  if (!statesHealthMonitorsLock(ctx)) return;
+  for (uint8_t i = 0; i < ctx->monitors_count; i++) {
+    statesHealthMonitorApply(&ctx->monitors[i], states, false);
+  };
+  statesHealthMonitorsUnlock(ctx);
+}
 
-  reHealthMonitor hmInet(nullptr, HM_AUTO, 
-    encMsgOptions(MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_ALERT_INET_UNAVAILABLE, CONFIG_NOTIFY_TELEGRAM_INET_PRIORITY), 
-    CONFIG_MESSAGE_TG_INET_AVAILABLE, CONFIG_MESSAGE_TG_INET_UNAVAILABLE, CONFIG_NOTIFY_TELEGRAM_INET_THRESOLD, healthMonitorNotify);
+static void statesHealthMonitorsChanged(re_states_ctx_t* ctx, states_group_t group, EventBits_t old_bits, EventBits_t new_bits)
+{
+  if ((group == SG_STATES) && ((old_bits ^ new_bits) & __atomic_load_n(&ctx->monitors_mask, __ATOMIC_ACQUIRE))) {
+    STATES_FLAP_DAMPEN(ctx, return);
+    statesHealthMonitorsApply(ctx, new_bits);
+  };
+}
 
-#endif // ENABLE_NOTIFY_INET_STATUS
+bool statesCtxHealthMonitorRegister(re_states_ctx_t* ctx, reHealthMonitor* monitor, EventBits_t depends_all, EventBits_t depends_any)
+{
+  if ((ctx == nullptr) || (monitor == nullptr)) return false;
+  if (!statesHealthMonitorsLock(ctx)) return false;
+  // Reuse a free slot or take a new one
+  states_health_monitor_t* item = nullptr;
+  for (uint8_t i = 0; i < ctx->monitors_count; i++) {
+    if (ctx->monitors[i].monitor == monitor) {
+      item = &ctx->monitors[i];
+      break;
+    } else if ((item == nullptr) && (ctx->monitors[i].monitor == nullptr)) {
+      item = &ctx->monitors[i];
+    };
+  };
+  if (item == nullptr) {
+    if (ctx->monitors_count >= CONFIG_STATES_HEALTH_MONITORS_MAX) {
+      statesHealthMonitorsUnlock(ctx);
+      rlog_e(logTAG, "Failed to register health monitor: registry of [%s] is full", ctx->name);
+      return false;
+    };
+    item = &ctx->monitors[ctx->monitors_count++];
+  };
+  item->monitor = monitor;
+  item->depends_all = depends_all;
+  item->depends_any = depends_any;
+  __atomic_or_fetch(&ctx->monitors_mask, depends_all | depends_any, __ATOMIC_RELEASE);
+  statesHealthMonitorApply(item, statesCtxGet(ctx), true);
+  statesHealthMonitorsUnlock(ctx);
+  return true;
+}
 
-// --  MQTT --------------------------------------------------------------------------------------------------------------
-#if ENABLE_NOTIFY_MQTT_STATUS
+void statesCtxHealthMonitorUnregister(re_states_ctx_t* ctx, reHealthMonitor* monitor)
+{
+  if ((ctx == nullptr) || !statesHealthMonitorsLock(ctx)) return;
+  EventBits_t mask = 0;
+  for (uint8_t i = 0; i < ctx->monitors_count; i++) {
+    if (ctx->monitors[i].monitor == monitor) {
+      ctx->monitors[i].monitor = nullptr;
+    } else if (ctx->monitors[i].monitor != nullptr) {
+      mask |= ctx->monitors[i].depends_all | ctx->monitors[i].depends_any;
+    };
+  };
+  for (uint8_t i = 0; i < SHM_MAX; i++) {
+    if (ctx->monitor_roles[i] == monitor) ctx->monitor_roles[i] = nullptr;
+  };
+  __atomic_store_n(&ctx->monitors_mask, mask, __ATOMIC_RELEASE);
+  statesHealthMonitorsUnlock(ctx);
+}
 
-  reHealthMonitor hmMqtt(nullptr, HM_AUTO, 
-    encMsgOptions(MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_ALERT_MQTT_STATUS, CONFIG_NOTIFY_TELEGRAM_MQTT_PRIORITY),
-    CONFIG_MESSAGE_TG_MQTT_CONN_OK, CONFIG_MESSAGE_TG_MQTT_CONN_LOST, CONFIG_NOTIFY_TELEGRAM_MQTT_THRESOLD, healthMonitorNotify);
+// The monitor is told about the link, internet and broker events of the context by the network handlers
+void statesCtxHealthMonitorAssign(re_states_ctx_t* ctx, states_monitor_role_t role, reHealthMonitor* monitor)
+{
+  if ((ctx == nullptr) || (role >= SHM_MAX) || !statesHealthMonitorsLock(ctx)) return;
+  ctx->monitor_roles[role] = monitor;
+  statesHealthMonitorsUnlock(ctx);
+}
 
-  #if ENABLE_NOTIFY_MQTT1_PING
-    reHealthMonitor hmMqttPing1(CONFIG_MQTT1_HOST, HM_AUTO, 
-      encMsgOptions(MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_ALERT_MQTT_STATUS, CONFIG_NOTIFY_TELEGRAM_MQTT_PRIORITY),
-      CONFIG_MESSAGE_TG_HOST_AVAILABLE, CONFIG_MESSAGE_TG_HOST_UNAVAILABLE, CONFIG_NOTIFY_TELEGRAM_MQTT_PING_THRESOLD, healthMonitorNotify);
-  #endif // ENABLE_NOTIFY_MQTT1_PING
+bool statesHealthMonitorRegister(reHealthMonitor* monitor, EventBits_t depends_all, EventBits_t depends_any)
+{
+  return statesCtxHealthMonitorRegister(&_statesDefault, monitor, depends_all, depends_any);
+}
 
-  #if ENABLE_NOTIFY_MQTT2_PING
-    reHealthMonitor hmMqttPing2(CONFIG_MQTT2_HOST, HM_AUTO, 
-      encMsgOptions(MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_ALERT_MQTT_STATUS, CONFIG_NOTIFY_TELEGRAM_MQTT_PRIORITY),
-      CONFIG_MESSAGE_TG_HOST_AVAILABLE, CONFIG_MESSAGE_TG_HOST_UNAVAILABLE, CONFIG_NOTIFY_TELEGRAM_MQTT_PING_THRESOLD, healthMonitorNotify);
-  #endif // ENABLE_NOTIFY_MQTT2_PING
-#endif // ENABLE_NOTIFY_MQTT_STATUS
+void statesHealthMonitorUnregister(reHealthMonitor* monitor)
+{
+  statesCtxHealthMonitorUnregister(&_statesDefault, monitor);
+}
 
-// -- OpenMon ------------------------------------------------------------------------------------------------------------
-#if ENABLE_NOTIFY_OPENMON_STATUS
+#endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
 
-  reHealthMonitor hmOpenMon("open-monitoring.online", HM_AUTO,
-    encMsgOptions(MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_ALERT_OPENMON_STATUS, CONFIG_NOTIFY_TELEGRAM_OPENMON_PRIORITY),
-    CONFIG_MESSAGE_TG_HOST_AVAILABLE, CONFIG_MESSAGE_TG_HOST_UNAVAILABLE, CONFIG_NOTIFY_TELEGRAM_OPENMON_THRESOLD, healthMonitorNotify);
+// Called on every effective change of status or error bits
+static void statesChanged(states_group_t group, EventBits_t old_bits, EventBits_t new_bits)
+{
+  #if CONFIG_STATES_HISTORY
+    statesHistoryAdd(group, old_bits, new_bits);
+  #endif // CONFIG_STATES_HISTORY
+  #if CONFIG_STATES_AVAILABILITY
+    if (group == SG_STATES) statesAvailabilityUpdate(old_bits, new_bits);
+  #endif // CONFIG_STATES_AVAILABILITY
+  #if CONFIG_STATES_BOOT_TIMELINE
+    if ((group == SG_STATES) && !STATES_STRESS_MUTED) statesBootTimelineUpdate(new_bits & ~old_bits);
+  #endif // CONFIG_STATES_BOOT_TIMELINE
+  #if CONFIG_STATES_FLAP_DETECTION
+    if (group == SG_STATES) statesFlapUpdate(old_bits ^ new_bits);
+  #endif // CONFIG_STATES_FLAP_DETECTION
+  #if CONFIG_STATES_ERROR_COUNTERS
+    if (group == SG_ERRORS) statesErrorCountersUpdate(old_bits, new_bits);
+  #endif // CONFIG_STATES_ERROR_COUNTERS
+  #if CONFIG_STATES_RTC_SNAPSHOT
+    statesSnapshotUpdate(statesGet(), statesGetErrors());
+  #endif // CONFIG_STATES_RTC_SNAPSHOT
+  if (!STATES_STRESS_MUTED) statesWatchdogsCheck(&_statesDefault);
+  #if CONFIG_MQTT_OTA_ENABLE && CONFIG_OTA_VERIFY_POLICY
+    statesFirmwareVerifyChanged(group, old_bits, new_bits);
+  #endif // CONFIG_OTA_VERIFY_POLICY
+  #if CONFIG_ENABLE_STATES_NOTIFICATIONS
+    statesHealthMonitorsChanged(&_statesDefault, group, old_bits, new_bits);
+  #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+}
 
-#endif // ENABLE_NOTIFY_OPENMON_STATUS
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- System states ----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
 
-// -- NarodMon -----------------------------------------------------------------------------------------------------------
-#if ENABLE_NOTIFY_NARODMON_STATUS
+void heapAllocFailedInit();
+#if CONFIG_HEAP_TRACING_STANDALONE && CONFIG_STATES_ZERO_HEAP
+static void heapLeaksTopicInit();
+#endif // CONFIG_HEAP_TRACING_STANDALONE
 
-  reHealthMonitor hmNarodMon("narodmon.ru", HM_AUTO, 
-    encMsgOptions(MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_ALERT_NARODMON_STATUS, CONFIG_NOTIFY_TELEGRAM_NARODMON_PRIORITY),
-    CONFIG_MESSAGE_TG_HOST_AVAILABLE, CONFIG_MESSAGE_TG_HOST_UNAVAILABLE, CONFIG_NOTIFY_TELEGRAM_NARODMON_THRESOLD, healthMonitorNotify);
+void statesInit(bool registerEventHandler)
+{
+  statesFirmwareVerifyStart();
 
-#endif // ENABLE_NOTIFY_NARODMON_STATUS
+  #if CONFIG_STATES_HISTORY
+    statesHistoryInit();
+  #endif // CONFIG_STATES_HISTORY
+  #if CONFIG_STATES_EVENT_TRACE
+    statesEventTraceInit();
+  #endif // CONFIG_STATES_EVENT_TRACE
+  #if CONFIG_STATES_AVAILABILITY
+    statesAvailabilityInit();
+  #endif // CONFIG_STATES_AVAILABILITY
+  #if CONFIG_STATES_BOOT_TIMELINE
+    statesBootTimelineInit();
+  #endif // CONFIG_STATES_BOOT_TIMELINE
+  #if CONFIG_STATES_RTC_SNAPSHOT
+    statesSnapshotLoad();
+  #endif // CONFIG_STATES_RTC_SNAPSHOT
+
+  bool ready = (_statesDefault.states != nullptr) || statesCtxInit(&_statesDefault, "default", nullptr, nullptr);
+
+  #if CONFIG_STATES_RTC_SNAPSHOT
+    if (ready) {
+      statesSnapshotRestore();
+    };
+  #endif // CONFIG_STATES_RTC_SNAPSHOT
 
-// --  ThingSpeak --------------------------------------------------------------------------------------------------------
-#if ENABLE_NOTIFY_THINGSPEAK_STATUS
+  statesWatchdogsInit();
 
-  reHealthMonitor hmThingSpeak("thingspeak.com", HM_AUTO,
-    encMsgOptions(MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_ALERT_THINGSPEAK_STATUS, CONFIG_NOTIFY_TELEGRAM_THINGSPEAK_PRIORITY),
-    CONFIG_MESSAGE_TG_HOST_AVAILABLE, CONFIG_MESSAGE_TG_HOST_UNAVAILABLE, CONFIG_NOTIFY_TELEGRAM_THINGSPEAK_THRESOLD, healthMonitorNotify);
+  if (ready) {
+    heapAllocFailedInit();
+    #if CONFIG_HEAP_TRACING_STANDALONE && CONFIG_STATES_ZERO_HEAP
+      heapLeaksTopicInit();
+    #endif // CONFIG_HEAP_TRACING_STANDALONE
+    #if CONFIG_ENABLE_STATES_NOTIFICATIONS
+      #if CONFIG_STATES_NOTIFY_BACKENDS
+        statesBackendsInit();
+      #endif // CONFIG_STATES_NOTIFY_BACKENDS
+      #if CONFIG_STATES_NOTIFY_OUTBOX
+        statesOutboxInit();
+      #endif // CONFIG_STATES_NOTIFY_OUTBOX
+      #if CONFIG_STATES_NOTIFY_DIGEST
+        statesDigestInit();
+      #endif // CONFIG_STATES_NOTIFY_DIGEST
+      healthMonitorsInit();
+    #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+  };
 
-#endif // ENABLE_NOTIFY_THINGSPEAK_STATUS
+  if (ready && registerEventHandler) {
+    statesEventHandlerRegister();
+  };
+}
 
-// -- Locks --------------------------------------------------------------------------------------------------------------
-static void healthMonitorsInetAvailable(bool setInetState)
+void statesFree(bool unregisterEventHandler)
 {
-  rlog_d(logTAG, "Sending notifications about the resumption of Internet access");
-
-  #if ENABLE_NOTIFY_INET_STATUS
-    if (setInetState) hmInet.setState(ESP_OK, time(nullptr));
-  #endif // ENABLE_NOTIFY_INET_STATUS
-
-  #if ENABLE_NOTIFY_MQTT_STATUS
-    hmMqtt.unlock();
-  #endif // ENABLE_NOTIFY_MQTT_STATUS
+  #if defined(CONFIG_OTA_ROLLBACK_TIMEOUT) && (CONFIG_OTA_ROLLBACK_TIMEOUT > 0)
+  statesFirmwareVerifyTimerStop();
+  #endif // CONFIG_OTA_ROLLBACK_TIMEOUT
 
-  #if ENABLE_NOTIFY_MQTT1_PING
-    hmMqttPing1.unlock();
-  #endif // ENABLE_NOTIFY_MQTT1_PING
+  if (_statesDefault.states) {
+    if (unregisterEventHandler) {
+      statesEventHandlerUnregister();
+    };
+  };
 
-  #if ENABLE_NOTIFY_MQTT2_PING
-    hmMqttPing2.unlock();
-  #endif // ENABLE_NOTIFY_MQTT2_PING
+  statesCtxFree(&_statesDefault);
+}
 
-  #if ENABLE_NOTIFY_OPENMON_STATUS
-    hmOpenMon.unlock();
-  #endif // ENABLE_NOTIFY_OPENMON_STATUS
+// -- Contexts -----------------------------------------------------------------------------------------------------------
 
-  #if ENABLE_NOTIFY_NARODMON_STATUS
-    hmNarodMon.unlock();
-  #endif // ENABLE_NOTIFY_NARODMON_STATUS
+re_states_ctx_t* statesCtxDefault()
+{
+  return &_statesDefault;
+}
 
-  #if ENABLE_NOTIFY_THINGSPEAK_STATUS
-    hmThingSpeak.unlock();
-  #endif // ENABLE_NOTIFY_THINGSPEAK_STATUS
+// The context is cleared here, so it must not be initialized again before statesCtxFree()
+bool statesCtxInit(re_states_ctx_t* ctx, const char* name, states_ctx_changed_t on_changed, void* arg)
+{
+  if (ctx == nullptr) return false;
+  memset(ctx, 0, sizeof(re_states_ctx_t));
+  ctx->name = name;
+  ctx->on_changed = on_changed;
+  ctx->arg = arg;
+  #if CONFIG_STATES_STATIC_ALLOCATION
+    ctx->states = xEventGroupCreateStatic(&ctx->buf_states);
+    ctx->errors = xEventGroupCreateStatic(&ctx->buf_errors);
+    ctx->lock = xSemaphoreCreateMutexStatic(&ctx->buf_lock);
+    ctx->watchdogs_lock = xSemaphoreCreateRecursiveMutexStatic(&ctx->buf_watchdogs_lock);
+    #if CONFIG_ENABLE_STATES_NOTIFICATIONS
+      ctx->monitors_lock = xSemaphoreCreateRecursiveMutexStatic(&ctx->buf_monitors_lock);
+    #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+  #else
+    ctx->states = xEventGroupCreate();
+    ctx->errors = xEventGroupCreate();
+    ctx->lock = xSemaphoreCreateMutex();
+    ctx->watchdogs_lock = xSemaphoreCreateRecursiveMutex();
+    #if CONFIG_ENABLE_STATES_NOTIFICATIONS
+      ctx->monitors_lock = xSemaphoreCreateRecursiveMutex();
+    #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+  #endif // CONFIG_STATES_STATIC_ALLOCATION
+  #if CONFIG_ENABLE_STATES_NOTIFICATIONS
+    bool services = (ctx->watchdogs_lock != nullptr) && (ctx->monitors_lock != nullptr);
+  #else
+    bool services = ctx->watchdogs_lock != nullptr;
+  #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+  if ((ctx->states == nullptr) || (ctx->errors == nullptr) || (ctx->lock == nullptr) || !services) {
+    rlog_e(logTAG, "Failed to create event groups for context [%s]", name);
+    statesCtxFree(ctx);
+    return false;
+  };
+  xEventGroupClearBits(ctx->states, 0x00FFFFFFU);
+  xEventGroupClearBits(ctx->errors, 0x00FFFFFFU);
+  return true;
 }
 
-static void healthMonitorsInetUnavailable(esp_err_t inetState, time_t timeState)
+void statesCtxFree(re_states_ctx_t* ctx)
 {
-  rlog_d(logTAG, "Sending notifications about the unavailability of the Internet");
+  if (ctx == nullptr) return;
+  // The timers of the watchdogs must not fire into the deleted event groups
+  statesWatchdogsFree(ctx);
+  if (ctx->errors) {
+    vEventGroupDelete(ctx->errors);
+    ctx->errors = nullptr;
+  };
+  if (ctx->states) {
+    vEventGroupDelete(ctx->states);
+    ctx->states = nullptr;
+  };
+  if (ctx->lock) {
+    vSemaphoreDelete(ctx->lock);
+    ctx->lock = nullptr;
+  };
+  if (ctx->watchdogs_lock) {
+    vSemaphoreDelete(ctx->watchdogs_lock);
+    ctx->watchdogs_lock = nullptr;
+  };
+  #if CONFIG_ENABLE_STATES_NOTIFICATIONS
+    if (ctx->monitors_lock) {
+      vSemaphoreDelete(ctx->monitors_lock);
+      ctx->monitors_lock = nullptr;
+    };
+  #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+}
 
-  #if ENABLE_NOTIFY_INET_STATUS
-    if (inetState != ESP_OK) hmInet.setState(inetState, timeState);
-  #endif // ENABLE_NOTIFY_INET_STATUS
+#if CONFIG_ENABLE_STATES_NOTIFICATIONS
+// Notifications of an additional context are handed to this callback after its own rate limits
+void statesCtxSetNotify(re_states_ctx_t* ctx, states_ctx_notify_t on_notify)
+{
+  if (ctx) ctx->on_notify = on_notify;
+}
+#endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
 
-  #if ENABLE_NOTIFY_MQTT1_PING
-    hmMqttPing1.lock();
-  #endif // ENABLE_NOTIFY_MQTT1_PING
+// Changes of the bits are serialized, so that the old bits passed to statesChanged() are exactly the bits
+// before this change and not a mix with a concurrent change
+static inline void statesCtxLock(re_states_ctx_t* ctx)
+{
+  if (ctx->lock) xSemaphoreTake(ctx->lock, portMAX_DELAY);
+}
 
-  #if ENABLE_NOTIFY_MQTT2_PING
-    hmMqttPing2.lock();
-  #endif // ENABLE_NOTIFY_MQTT2_PING
+static inline void statesCtxUnlock(re_states_ctx_t* ctx)
+{
+  if (ctx->lock) xSemaphoreGive(ctx->lock);
+}
 
-  #if ENABLE_NOTIFY_MQTT_STATUS
-    hmMqtt.lock();
-  #endif // ENABLE_NOTIFY_MQTT_STATUS
+// The default context feeds the device-wide services (history, availability, LED and so on), 
+// an additional context runs only its own watchdogs and health monitors
+static void statesCtxChanged(re_states_ctx_t* ctx, states_group_t group, EventBits_t bits_old, EventBits_t bits_new)
+{
+  if (statesCtxIsDefault(ctx)) {
+    statesChanged(group, bits_old, bits_new);
+  } else {
+    statesWatchdogsCheck(ctx);
+    #if CONFIG_ENABLE_STATES_NOTIFICATIONS
+      statesHealthMonitorsChanged(ctx, group, bits_old, bits_new);
+    #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+  };
+  if (ctx->on_changed) {
+    ctx->on_changed(ctx, group, bits_old, bits_new, ctx->arg);
+  };
+}
 
-  #if ENABLE_NOTIFY_OPENMON_STATUS
-    hmOpenMon.lock();
-  #endif // ENABLE_NOTIFY_OPENMON_STATUS
+static void statesCtxUpdated(re_states_ctx_t* ctx)
+{
+  if (statesCtxIsDefault(ctx)) {
+    ledSysBlinkAuto();
+  };
+}
 
-  #if ENABLE_NOTIFY_NARODMON_STATUS
-    hmNarodMon.lock();
-  #endif // ENABLE_NOTIFY_NARODMON_STATUS
+// -- States -------------------------------------------------------------------------------------------------------------
 
-  #if ENABLE_NOTIFY_THINGSPEAK_STATUS
-    hmThingSpeak.lock();
-  #endif // ENABLE_NOTIFY_THINGSPEAK_STATUS
+EventBits_t statesCtxGet(re_states_ctx_t* ctx) 
+{
+  if (ctx->states) {
+    return xEventGroupGetBits(ctx->states);
+  };
+  rlog_e(logTAG, "Failed to get status bits [%s], event group is null!", ctx->name);
+  return 0;
 }
 
-#if !defined(CONFIG_WIFI_ENABLED) || (CONFIG_WIFI_ENABLED == 1)
-  static void healthMonitorsWiFiAvailable(bool setWifiState)
-  {
-    rlog_d(logTAG, "Sending wifi connect notifications");
-
+bool statesCtxCheck(re_states_ctx_t* ctx, EventBits_t bits, const bool clearOnExit) 
+{
+  if (ctx->states) {
+    if (clearOnExit) {
+      statesCtxLock(ctx);
+      EventBits_t prevClear = xEventGroupClearBits(ctx->states, bits);
+      statesCtxUnlock(ctx);
+      if ((prevClear & bits) != 0) {
+        statesCtxChanged(ctx, SG_STATES, prevClear, prevClear & ~bits);
+      };
+      return (prevClear & bits) == bits;
+    } else {
+      return (xEventGroupGetBits(ctx->states) & bits) == bits;
+    };
+  };
+  rlog_e(logTAG, "Failed to check status bits [%s]: %X, event group is null!", ctx->name, bits);
+  return false;
+}
+
+bool statesCtxCheckAny(re_states_ctx_t* ctx, EventBits_t bits, const bool clearOnExit) 
+{
+  if (ctx->states) {
+    if (clearOnExit) {
+      statesCtxLock(ctx);
+      EventBits_t prevClear = xEventGroupClearBits(ctx->states, bits);
+      statesCtxUnlock(ctx);
+      if ((prevClear & bits) != 0) {
+        statesCtxChanged(ctx, SG_STATES, prevClear, prevClear & ~bits);
+      };
+      return (prevClear & bits) > 0;
+    } else {
+      return (xEventGroupGetBits(ctx->states) & bits) > 0;
+    };
+  };
+  rlog_e(logTAG, "Failed to check status bits [%s]: %X, event group is null!", ctx->name, bits);
+  return false;
+}
+
+bool statesCtxClear(re_states_ctx_t* ctx, EventBits_t bits)
+{
+  if (!ctx->states) {
+    rlog_e(logTAG, "Failed to set status bits [%s]: %X, event group is null!", ctx->name, bits);
+    return false;
+  };
+  statesCtxLock(ctx);
+  EventBits_t prevClear = xEventGroupClearBits(ctx->states, bits);
+  EventBits_t afterClear = xEventGroupGetBits(ctx->states);
+  statesCtxUnlock(ctx);
+  if ((prevClear & bits) != 0) {
+    if ((afterClear & bits) != 0) {
+      rlog_e(logTAG, "Failed to clear status bits [%s]: %X, current value: %X", ctx->name, bits, afterClear);
+      return false;
+    };
+    statesCtxChanged(ctx, SG_STATES, prevClear, prevClear & ~bits);
+  };
+  statesCtxUpdated(ctx);
+  return true;
+}
+
+bool statesCtxSet(re_states_ctx_t* ctx, EventBits_t bits)
+{
+  if (!ctx->states) {
+    rlog_e(logTAG, "Failed to set status bits [%s]: %X, event group is null!", ctx->name, bits);
+    return false;
+  };
+  statesCtxLock(ctx);
+  EventBits_t prevSet = xEventGroupGetBits(ctx->states);
+  EventBits_t afterSet = xEventGroupSetBits(ctx->states, bits);
+  statesCtxUnlock(ctx);
+  if ((afterSet & bits) != bits) {
+    rlog_e(logTAG, "Failed to set status bits [%s]: %X, current value: %X", ctx->name, bits, afterSet);
+    return false;
+  };
+  if ((prevSet & bits) != bits) {
+    statesCtxChanged(ctx, SG_STATES, prevSet, prevSet | bits);
+  };
+  statesCtxUpdated(ctx);
+  return true;
+}
+
+EventBits_t statesCtxWait(re_states_ctx_t* ctx, EventBits_t bits, BaseType_t clearOnExit, BaseType_t waitAllBits, TickType_t timeout)
+{
+  if (ctx->states) {
+    return xEventGroupWaitBits(ctx->states, bits, clearOnExit, waitAllBits, timeout) & bits; 
+  };  
+  return 0;
+}
+
+EventBits_t statesGet() 
+{
+  return statesCtxGet(&_statesDefault);
+}
+
+bool statesCheck(EventBits_t bits, const bool clearOnExit) 
+{
+  return statesCtxCheck(&_statesDefault, bits, clearOnExit);
+}
+
+bool statesCheckAny(EventBits_t bits, const bool clearOnExit) 
+{
+  return statesCtxCheckAny(&_statesDefault, bits, clearOnExit);
+}
+
+bool statesClear(EventBits_t bits)
+{
+  return statesCtxClear(&_statesDefault, bits);
+}
+
+bool statesSet(EventBits_t bits)
+{
+  return statesCtxSet(&_statesDefault, bits);
+}
+
+static bool statesCtxSetBit(re_states_ctx_t* ctx, EventBits_t bit, bool state)
+{
+  if (state) {
+    return statesCtxSet(ctx, bit);
+  } else {
+    return statesCtxClear(ctx, bit);
+  };
+}
+
+bool statesSetBit(EventBits_t bit, bool state)
+{
+  return statesCtxSetBit(&_statesDefault, bit, state);
+}
+
+EventBits_t statesWait(EventBits_t bits, BaseType_t clearOnExit, BaseType_t waitAllBits, TickType_t timeout)
+{
+  return statesCtxWait(&_statesDefault, bits, clearOnExit, waitAllBits, timeout);
+}
+
+EventBits_t statesWaitMs(EventBits_t bits, BaseType_t clearOnExit, BaseType_t waitAllBits, TickType_t timeout)
+{
+  return statesCtxWait(&_statesDefault, bits, clearOnExit, waitAllBits, timeout == 0 ? portMAX_DELAY : pdMS_TO_TICKS(timeout));
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// --------------------------------------------------- Custom routines ---------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+bool statesNetworkIsConnected()
+{
+  return statesCheckAny(NETWORK_CONNECTED, false);
+}
+
+bool statesNetworkWait(TickType_t timeout)
+{
+  return (statesWait(NETWORK_CONNECTED, pdFALSE, pdFALSE, timeout) & NETWORK_CONNECTED) != 0;
+}
+
+bool statesNetworkWaitMs(TickType_t timeout)
+{
+  return (statesWaitMs(NETWORK_CONNECTED, pdFALSE, pdTRUE, timeout) & NETWORK_CONNECTED) != 0;
+}
+
+bool statesInetIsAvailabled()
+{
+  return statesCheckAny(NETWORK_CONNECTED, false) && statesCheck(INET_AVAILABLED, false);
+}
+
+bool statesInetIsDelayed()
+{
+  return statesCheckAny(NETWORK_CONNECTED, false) && statesCheck(INET_AVAILABLED | INET_SLOWDOWN, false);
+}
+
+bool statesInetIsGood(bool checkRssi)
+{
+  bool ret = statesInetIsAvailabled() && !statesCheck(INET_SLOWDOWN, false); 
+  #if !defined(CONFIG_WIFI_ENABLED) || (CONFIG_WIFI_ENABLED == 1)
+  ret = ret && (!checkRssi || wifiRSSIIsOk());
+  #endif // CONFIG_WIFI_ENABLED
+  return ret;
+}
+
+bool statesInetWait(TickType_t timeout)
+{
+  return statesNetworkWait(timeout) && statesCheck(INET_AVAILABLED, false); 
+}
+
+bool statesInetWaitMs(TickType_t timeout)
+{
+  return statesNetworkWaitMs(timeout) && statesCheck(INET_AVAILABLED, false); 
+}
+
+// Time
+bool statesTimeIsOk()
+{
+  return statesCheck(TIME_SNTP_SYNC_OK, false) || statesCheck(TIME_RTC_ENABLED, false);
+}
+
+bool statesTimeWait(TickType_t timeout)
+{
+  return (statesWait(TIME_SNTP_SYNC_OK | TIME_RTC_ENABLED, pdFALSE, pdFALSE, timeout) & (TIME_SNTP_SYNC_OK | TIME_RTC_ENABLED)) != 0;
+}
+
+bool statesTimeWaitMs(TickType_t timeout)
+{
+  return (statesWaitMs(TIME_SNTP_SYNC_OK | TIME_RTC_ENABLED, pdFALSE, pdFALSE, timeout) & (TIME_SNTP_SYNC_OK | TIME_RTC_ENABLED)) != 0;
+}
+
+#if CONFIG_SILENT_MODE_ENABLE
+bool statesTimeIsSilent()
+{
+  return (statesCheck(TIME_SNTP_SYNC_OK, false) || statesCheck(TIME_RTC_ENABLED, false)) && (statesCheck(TIME_SILENT_MODE, false));
+}
+#endif // CONFIG_SILENT_MODE_ENABLE
+
+// MQTT
+bool statesMqttIsConnected()
+{
+  return statesCheck(MQTT_CONNECTED, false);
+}
+
+bool statesMqttIsPrimary()
+{
+  return statesCheck(MQTT_PRIMARY, false);
+}
+
+bool statesMqttIsLocal()
+{
+  return statesCheck(MQTT_LOCAL, false);
+}
+
+bool statesMqttIsEnabled()
+{
+  if (statesMqttIsLocal()) {
+    return statesNetworkIsConnected();
+  } else {
+    return statesNetworkIsConnected() && statesInetIsAvailabled();
+  };
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// --------------------------------------------------- Errors routines ---------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+EventBits_t statesCtxGetErrors(re_states_ctx_t* ctx) 
+{
+  if (ctx->errors) {
+    return xEventGroupGetBits(ctx->errors);
+  };
+  rlog_e(logTAG, "Failed to get errors bits [%s], event group is null!", ctx->name);
+  return 0;
+}
+
+bool statesCtxCheckErrors(re_states_ctx_t* ctx, EventBits_t bits, const bool clearOnExit) 
+{
+  if (ctx->errors) {
+    if (clearOnExit) {
+      statesCtxLock(ctx);
+      EventBits_t prevClear = xEventGroupClearBits(ctx->errors, bits);
+      statesCtxUnlock(ctx);
+      if ((prevClear & bits) != 0) {
+        statesCtxChanged(ctx, SG_ERRORS, prevClear, prevClear & ~bits);
+      };
+      return (prevClear & bits) == bits;
+    } else {
+      return (xEventGroupClearBits(ctx->errors, 0) & bits) == bits;
+    };
+  };
+  rlog_e(logTAG, "Failed to check error bits [%s]: %X, event group is null!", ctx->name, bits);
+  return false;
+}
+
+bool statesCtxClearErrors(re_states_ctx_t* ctx, EventBits_t bits)
+{
+  if (!ctx->errors) {
+    rlog_e(logTAG, "Failed to set errors bits [%s]: %X, event group is null!", ctx->name, bits);
+    return false;
+  };
+  statesCtxLock(ctx);
+  EventBits_t prevClear = xEventGroupClearBits(ctx->errors, bits);
+  EventBits_t afterClear = xEventGroupGetBits(ctx->errors);
+  statesCtxUnlock(ctx);
+  if ((prevClear & bits) != 0) {
+    if ((afterClear & bits) != 0) {
+      rlog_e(logTAG, "Failed to clear errors bits [%s]: %X, current value: %X", ctx->name, bits, afterClear);
+      return false;
+    };
+    statesCtxChanged(ctx, SG_ERRORS, prevClear, prevClear & ~bits);
+  };
+  statesCtxUpdated(ctx);
+  return true;
+}
+
+bool statesCtxSetErrors(re_states_ctx_t* ctx, EventBits_t bits)
+{
+  if (!ctx->errors) {
+    rlog_e(logTAG, "Failed to set errors bits [%s]: %X, event group is null!", ctx->name, bits);
+    return false;
+  };
+  statesCtxLock(ctx);
+  EventBits_t prevSet = xEventGroupGetBits(ctx->errors);
+  EventBits_t afterSet = xEventGroupSetBits(ctx->errors, bits);
+  statesCtxUnlock(ctx);
+  if ((afterSet & bits) != bits) {
+    rlog_e(logTAG, "Failed to set errors bits [%s]: %X, current value: %X", ctx->name, bits, afterSet);
+    return false;
+  };
+  if ((prevSet & bits) != bits) {
+    statesCtxChanged(ctx, SG_ERRORS, prevSet, prevSet | bits);
+  };
+  statesCtxUpdated(ctx);
+  return true;
+}
+
+EventBits_t statesGetErrors() 
+{
+  return statesCtxGetErrors(&_statesDefault);
+}
+
+bool statesCheckErrors(EventBits_t bits, const bool clearOnExit) 
+{
+  return statesCtxCheckErrors(&_statesDefault, bits, clearOnExit);
+}
+
+bool statesCheckErrorsAll(const bool clearOnExit) 
+{
+  return statesCheckErrors(0x00FFFFFFU, clearOnExit);
+}
+
+bool statesClearErrors(EventBits_t bits)
+{
+  return statesCtxClearErrors(&_statesDefault, bits);
+}
+
+bool statesClearErrorsAll()
+{
+  return statesClearErrors(0x00FFFFFFU);
+}
+
+bool statesSetErrors(EventBits_t bits)
+{
+  return statesCtxSetErrors(&_statesDefault, bits);
+}
+
+bool statesSetError(EventBits_t bit, bool state)
+{
+  if (state) {
+    return statesSetErrors(bit);
+  } else {
+    return statesClearErrors(bit);
+  };
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- JSON routines ----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+// Adds a nested object to the JSON, the content of the object is written by the function
+static void statesJsonAppend(states_buf_t* buf, const char* key, void (*items)(states_buf_t* buf))
+{
+  statesBufPrintf(buf, ",\"%s\":{", key);
+  items(buf);
+  statesBufPrintf(buf, "}");
+}
+
+static void statesGetJsonWriter(states_buf_t* buf, void* arg)
+{
+  EventBits_t states = statesGet(); 
+  statesBufPrintf(buf, "{\"ota\":%d,\"rtc_enabled\":%d,\"sntp_sync\":%d,\"silent_mode\":%d,\"wifi_sta_started\":%d,\"wifi_sta_connected\":%d,\"ethernet_started\":%d,\"ethernet_connected\":%d,\"inet_availabled\":%d,\"mqtt1_enabled\":%d,\"mqtt2_enabled\":%d,\"mqtt_connected\":%d,\"mqtt_primary\":%d,\"mqtt_local\":%d",
+    (states & SYSTEM_OTA) == SYSTEM_OTA,
+    (states & TIME_RTC_ENABLED) == TIME_RTC_ENABLED,
+    (states & TIME_SNTP_SYNC_OK) == TIME_SNTP_SYNC_OK,
+    (states & TIME_SILENT_MODE) == TIME_SILENT_MODE,
+    (states & WIFI_STA_STARTED) == WIFI_STA_STARTED,
+    (states & WIFI_STA_CONNECTED) == WIFI_STA_CONNECTED,
+    (states & ETHERNET_STARTED) == ETHERNET_STARTED,
+    (states & ETHERNET_CONNECTED) == ETHERNET_CONNECTED,
+    (states & INET_AVAILABLED) == INET_AVAILABLED,
+    (states & MQTT_1_ENABLED) == MQTT_1_ENABLED,
+    (states & MQTT_2_ENABLED) == MQTT_2_ENABLED,
+    (states & MQTT_CONNECTED) == MQTT_CONNECTED,
+    (states & MQTT_PRIMARY) == MQTT_PRIMARY,
+    (states & MQTT_LOCAL) == MQTT_LOCAL);
+
+  #if CONFIG_STATES_AVAILABILITY
+    statesJsonAppend(buf, "availability", statesAvailabilityJson);
+  #endif // CONFIG_STATES_AVAILABILITY
+  #if CONFIG_STATES_FLAP_DETECTION
+    statesJsonAppend(buf, "flapping", statesFlapJson);
+  #endif // CONFIG_STATES_FLAP_DETECTION
+  #if CONFIG_STATES_INET_QUALITY
+    statesJsonAppend(buf, "inet_quality", statesQualityJson);
+  #endif // CONFIG_STATES_INET_QUALITY
+  #if CONFIG_STATES_UPLINK
+    statesJsonAppend(buf, "uplink", statesUplinkJson);
+  #endif // CONFIG_STATES_UPLINK
+  #if CONFIG_STATES_MQTT_STATS
+    statesJsonAppend(buf, "mqtt_brokers", statesMqttStatsJson);
+  #endif // CONFIG_STATES_MQTT_STATS
+  #if CONFIG_MQTT_OTA_ENABLE && CONFIG_OTA_VERIFY_POLICY
+    if (_otaVerify.status != OVS_NONE) {
+      statesJsonAppend(buf, "ota_verify", statesFirmwareVerifyItems);
+    };
+  #endif // CONFIG_OTA_VERIFY_POLICY
+
+  // Add closing bracket
+  statesBufPrintf(buf, "}");
+};
+
+size_t statesGetJsonTo(char* buffer, size_t size)
+{
+  return statesBufWrite(statesGetJsonWriter, nullptr, buffer, size);
+};
+
+#if !CONFIG_STATES_ZERO_HEAP
+char* statesGetJson()
+{
+  return statesBufMalloc(statesGetJsonWriter, nullptr);
+};
+#endif // CONFIG_STATES_ZERO_HEAP
+
+static void statesGetErrorsJsonWriter(states_buf_t* buf, void* arg)
+{
+  EventBits_t errors = statesGetErrors();
+  statesBufPrintf(buf, "{\"general\":%d,\"heap\":%d,\"mqtt\":%d,\"telegram\":%d,\"smtp\":%d,\"site\":%d,\"thingspeak\":%d,\"openmon\":%d,\"narodmon\":%d,\"watchdog\":%d,\"sensor0\":%d,\"sensor1\":%d,\"sensor2\":%d,\"sensor3\":%d,\"sensor4\":%d,\"sensor5\":%d,\"sensor6\":%d,\"sensor7\":%d}",
+    (errors & ERR_GENERAL) == ERR_GENERAL,
+    (errors & ERR_HEAP) == ERR_HEAP,
+    (errors & ERR_MQTT) == ERR_MQTT,
+    (errors & ERR_TELEGRAM) == ERR_TELEGRAM,
+    (errors & ERR_SMTP) == ERR_SMTP,
+    (errors & ERR_SITE) == ERR_SITE,
+    (errors & ERR_THINGSPEAK) == ERR_THINGSPEAK,
+    (errors & ERR_OPENMON) == ERR_OPENMON,
+    (errors & ERR_NARODMON) == ERR_NARODMON,
+    (errors & ERR_WATCHDOG) == ERR_WATCHDOG,
+    (errors & ERR_SENSOR_0) == ERR_SENSOR_0,
+    (errors & ERR_SENSOR_1) == ERR_SENSOR_1,
+    (errors & ERR_SENSOR_2) == ERR_SENSOR_2,
+    (errors & ERR_SENSOR_3) == ERR_SENSOR_3,
+    (errors & ERR_SENSOR_4) == ERR_SENSOR_4,
+    (errors & ERR_SENSOR_5) == ERR_SENSOR_5,
+    (errors & ERR_SENSOR_6) == ERR_SENSOR_6,
+    (errors & ERR_SENSOR_7) == ERR_SENSOR_7);
+};
+
+size_t statesGetErrorsJsonTo(char* buffer, size_t size)
+{
+  return statesBufWrite(statesGetErrorsJsonWriter, nullptr, buffer, size);
+};
+
+#if !CONFIG_STATES_ZERO_HEAP
+char* statesGetErrorsJson()
+{
+  return statesBufMalloc(statesGetErrorsJsonWriter, nullptr);
+};
+#endif // CONFIG_STATES_ZERO_HEAP
+  
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------- Fixing memory allocation errors -------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+static uint32_t heapFailsCount = 0;
+
+void heapAllocFailedHook(size_t requested_size, uint32_t caps, const char *function_name)
+{
+  rlog_e("HEAP", "%s was called but failed to allocate %d bytes with 0x%X capabilities.", function_name, requested_size, caps);
+  #if CONFIG_HEAP_ABORT_WHEN_ALLOCATION_FAILS
+    espSetResetReason(RR_HEAP_ALLOCATION_FAILED);
+  #else
+    __atomic_add_fetch(&heapFailsCount, 1, __ATOMIC_RELAXED);
+    #if CONFIG_HEAP_ALLOC_FAILED_RESTART
+      espRestart(RR_HEAP_ALLOCATION_FAILED); 
+    #endif // CONFIG_HEAP_ALLOC_FAILED_RESTART
+  #endif // CONFIG_HEAP_ABORT_WHEN_ALLOCATION_FAILS
+}
+
+uint32_t heapAllocFailedCount() 
+{
+  return __atomic_load_n(&heapFailsCount, __ATOMIC_RELAXED);
+}
+
+void heapAllocFailedInit()
+{
+  heap_caps_register_failed_alloc_callback(heapAllocFailedHook);
+  heapFailsCount = 0;
+}
+
+#if CONFIG_HEAP_TRACING_STANDALONE
+
+#define CONFIG_HEAP_TRACING_NUM_RECORDS 256
+#define CONFIG_HEAP_LEAKS_NUM_RECORDS 256
+#define CONFIG_HEAP_LEAKS_MIN_SIZE 1
+#define CONFIG_HEAP_LEAKS_MIN_REPEATS 3
+
+typedef struct {
+  uint32_t ccount;
+  void *address;
+  size_t size;
+  void *alloced_by[CONFIG_HEAP_TRACING_STACK_DEPTH];
+  uint8_t confirm;
+  uint32_t repeats;
+  time_t timestamp;
+} heap_leak_record_t;
+
+static uint8_t leak_count = 0;
+static heap_leak_record_t leaks_buffer[CONFIG_HEAP_LEAKS_NUM_RECORDS];
+static heap_trace_record_t trace_buffer[CONFIG_HEAP_TRACING_NUM_RECORDS];
+
+void heapLeaksStart()
+{
+  memset(&leaks_buffer, 0, sizeof(leaks_buffer));
+  heap_trace_init_standalone(trace_buffer, CONFIG_HEAP_TRACING_NUM_RECORDS);
+  heap_trace_start(HEAP_TRACE_LEAKS);
+}
+
+void heapLeaksStop()
+{
+  heap_trace_stop();
+}
+
+void heapLeaksScan()
+{
+  // Mark all current entries as lost
+  for (uint16_t i = 0; i < CONFIG_HEAP_LEAKS_NUM_RECORDS; i++) {
+    leaks_buffer[i].confirm = 0;
+  };
+
+  // Search for new leaks and comparison with current data
+  heap_trace_record_t rec;
+  for (uint16_t j = 0; j < CONFIG_HEAP_TRACING_NUM_RECORDS; j++) {
+    if ((heap_trace_get(j, &rec) == ESP_OK) && (rec.address != NULL) && (rec.freed_by[0] == NULL) && (rec.size >= CONFIG_HEAP_LEAKS_MIN_SIZE) && ((rec.ccount & 1) > 0)) {
+      // We are looking for this entry in the main list
+      int16_t found = -1;
+      for (uint16_t i = 0; i < CONFIG_HEAP_LEAKS_NUM_RECORDS; i++) {
+        if ((leaks_buffer[i].address == rec.address) && (leaks_buffer[i].size == rec.size) && (leaks_buffer[i].ccount == rec.ccount)) {
+          found = i;
+          leaks_buffer[i].confirm = 1;
+          leaks_buffer[i].repeats++;
+          break;
+        };
+      };
+      // Entry not found, fill first free entry in buffer
+      if (found == -1) {
+        for (uint16_t i = 0; i < CONFIG_HEAP_LEAKS_NUM_RECORDS; i++) {
+          if ((leaks_buffer[i].address == NULL) || (leaks_buffer[i].size == 0)) {
+            leaks_buffer[i].ccount = rec.ccount;
+            leaks_buffer[i].address = rec.address;
+            leaks_buffer[i].size = rec.size;
+            #if CONFIG_HEAP_TRACING_STACK_DEPTH > 0
+              memcpy(&leaks_buffer[i].alloced_by, &rec.alloced_by, sizeof(void*)*CONFIG_HEAP_TRACING_STACK_DEPTH);
+            #endif // CONFIG_HEAP_TRACING_STACK_DEPTH
+            leaks_buffer[i].confirm = 1;
+            leaks_buffer[i].repeats = 1;
+            leaks_buffer[i].timestamp = time(nullptr);
+            break;
+          };
+        };
+      };
+    };
+  };
+
+  // Mark as free all records that have not been committed in this session
+  leak_count = 0;
+  for (uint16_t i = 0; i < CONFIG_HEAP_LEAKS_NUM_RECORDS; i++) {
+    if ((leaks_buffer[i].confirm == 0) && (leaks_buffer[i].address != NULL)) {
+      memset(&leaks_buffer[i], 0, sizeof(heap_leak_record_t));
+    } else {
+      leak_count++;
+    };
+  };
+}
+
+static bool heapLeaksReported(const heap_leak_record_t* rec)
+{
+  return (rec->address != NULL) && (rec->size > 0) && (rec->confirm > 0) && (rec->repeats > CONFIG_HEAP_LEAKS_MIN_REPEATS);
+}
+
+static void heapLeaksWriter(states_buf_t* buf, void* arg)
+{
+  uint16_t count = 0;
+  for (uint16_t i = 0; i < CONFIG_HEAP_LEAKS_NUM_RECORDS; i++) {
+    if (heapLeaksReported(&leaks_buffer[i])) count++;
+  };
+  if (count == 0) return;
+
+  statesBufPrintf(buf, "{\"total\":%d,\"details\":[", count);
+  count = 0;
+  heap_leak_record_t rec;
+  for (uint16_t i = 0; i < CONFIG_HEAP_LEAKS_NUM_RECORDS; i++) {
+    if (heapLeaksReported(&leaks_buffer[i])) {
+      memcpy(&rec, &leaks_buffer[i], sizeof(heap_leak_record_t));
+      // 2023-02-15: fixed possible sharing error from multiple tasks
+      char ts_buffer[CONFIG_FORMAT_STRFTIME_BUFFER_SIZE];
+      time2str_empty(CONFIG_FORMAT_DTS, &(rec.timestamp), &ts_buffer[0], sizeof(ts_buffer));
+      statesBufPrintf(buf, "%s{\"timestamp\":\"%s\",\"repeats\":%d,\"address\":\"%p\",\"size\":%d,\"cpu\":%d,\"ccount\":\"0x%08x\",\"stack\":\"", 
+        count > 0 ? "," : "", ts_buffer, rec.repeats, rec.address, rec.size, rec.ccount & 1, rec.ccount & ~3);
+      for (uint8_t j = 0; j < CONFIG_HEAP_TRACING_STACK_DEPTH; j++) {
+        statesBufPrintf(buf, j > 0 ? " %p" : "%p", rec.alloced_by[j]);
+      };
+      statesBufPrintf(buf, "\"}");
+      count++;
+    };
+  };
+  statesBufPrintf(buf, "]}");
+}
+
+// Writes nothing if no leaks have been confirmed
+size_t heapLeaksJsonTo(char* buffer, size_t size)
+{
+  return statesBufWrite(heapLeaksWriter, nullptr, buffer, size);
+}
+
+#if CONFIG_STATES_ZERO_HEAP
+
+#ifndef CONFIG_HEAP_LEAKS_JSON_SIZE
+  #define CONFIG_HEAP_LEAKS_JSON_SIZE 2048
+#endif // CONFIG_HEAP_LEAKS_JSON_SIZE
+
+static char _heapLeaksJson[CONFIG_HEAP_LEAKS_JSON_SIZE];
+static states_mqtt_topic_t _heapLeaksTopic;
+
+static void heapLeaksTopicInit()
+{
+  statesMqttTopicInit(_heapLeaksTopic, CONFIG_MQTT_HEAP_LEAKS_LOCAL, CONFIG_MQTT_HEAP_LEAKS_TOPIC);
+}
+
+void heapLeaksUpdate()
+{
+  heapLeaksScan();
+  if (statesMqttIsEnabled() && (statesMqttTopic(_heapLeaksTopic)[0] != 0)) {
+    size_t len = heapLeaksJsonTo(_heapLeaksJson, sizeof(_heapLeaksJson));
+    if (len >= sizeof(_heapLeaksJson)) {
+      rlog_w("HEAP", "Leaks JSON truncated: %d bytes required", len + 1);
+    };
+    mqttPublish(statesMqttTopic(_heapLeaksTopic), len > 0 ? _heapLeaksJson : nullptr, 
+      CONFIG_MQTT_HEAP_LEAKS_QOS, CONFIG_MQTT_HEAP_LEAKS_RETAINED, false, false);
+  };
+};
+
+#else
+
+char* heapLeaksJson()
+{
+  return heapLeaksJsonTo(nullptr, 0) > 0 ? statesBufMalloc(heapLeaksWriter, nullptr) : nullptr;
+}
+
+void heapLeaksUpdate()
+{
+  heapLeaksScan();
+  if (statesMqttIsEnabled()) {
+    char* json = heapLeaksJson();
+    mqttPublish(
+      mqttGetTopicDevice1(statesMqttIsPrimary(), CONFIG_MQTT_HEAP_LEAKS_LOCAL, CONFIG_MQTT_HEAP_LEAKS_TOPIC), 
+      json, CONFIG_MQTT_HEAP_LEAKS_QOS, CONFIG_MQTT_HEAP_LEAKS_RETAINED, true, true);
+  };
+};
+
+#endif // CONFIG_STATES_ZERO_HEAP
+
+#endif // CONFIG_HEAP_TRACING_STANDALONE
+
+void heapCapsDebug(const char *function_name)
+{
+  size_t free = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+  size_t heap = heap_caps_get_total_size(MALLOC_CAP_DEFAULT);
+  rlog_w("HEAP", "Heap free %.3f% %, free size: %d, total size: %d [ %s ]", 
+    100.0 * (double)free / (double)heap, free, heap, function_name);
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------------ System LED -----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if defined(CONFIG_GPIO_SYSTEM_LED)
+
+static ledQueue_t _ledSysQueue = NULL;
+ 
+void ledSysInit(int8_t ledGPIO, bool ledHigh, uint32_t taskStackSize, ledCustomControl_t customControl)
+{
+  if (_ledSysQueue == NULL) {
+    _ledSysQueue = ledTaskCreate(ledGPIO, ledHigh, true, "led_system", taskStackSize, customControl);
+  };
+}
+
+void ledSysFree()
+{
+  if (_ledSysQueue) { 
+    ledTaskDelete(_ledSysQueue);
+    _ledSysQueue = nullptr;
+  };
+}
+
+void ledSysOn(const bool fixed)
+{
+  if (_ledSysQueue) {
+    ledTaskSend(_ledSysQueue, lmOn, (uint16_t)fixed, 0, 0);
+  };
+}
+
+void ledSysOff(const bool fixed)
+{
+  if (_ledSysQueue) {
+    ledTaskSend(_ledSysQueue, lmOff, (uint16_t)fixed, 0, 0);
+  };
+}
+
+void ledSysSet(const bool newState)
+{
+  if (_ledSysQueue) {
+    if (newState) {
+      ledTaskSend(_ledSysQueue, lmOn, 0, 0, 0);
+    }
+    else {
+      ledTaskSend(_ledSysQueue, lmOff, 0, 0, 0);
+    };
+  };
+}
+
+void ledSysSetEnabled(const bool newEnabled)
+{
+  if (_ledSysQueue) {
+    ledTaskSend(_ledSysQueue, lmEnable, (uint16_t)newEnabled, 0, 0);
+  };
+}
+
+void ledSysActivity()
+{
+  if (_ledSysQueue) {
+    ledTaskSend(_ledSysQueue, lmFlash, CONFIG_LEDSYS_FLASH_QUANTITY, CONFIG_LEDSYS_FLASH_DURATION, CONFIG_LEDSYS_FLASH_INTERVAL);
+  };
+}
+
+void ledSysFlashOn(const uint16_t quantity, const uint16_t duration, const uint16_t interval)
+{
+  if (_ledSysQueue) {
+    ledTaskSend(_ledSysQueue, lmFlash, quantity, duration, interval);
+  };
+}
+
+void ledSysBlinkOn(const uint16_t quantity, const uint16_t duration, const uint16_t interval)
+{
+  if (_ledSysQueue) {
+    ledTaskSend(_ledSysQueue, lmBlinkOn, quantity, duration, interval);
+  };
+}
+
+void ledSysBlinkOff()
+{
+  if (_ledSysQueue) {
+    ledTaskSend(_ledSysQueue, lmBlinkOff, 0, 0, 0);
+  };
+}
+
+// While the states are driven by the stress test, the mode is chosen but not sent to the LED task
+static inline void ledSysBlinkAutoOn(const uint16_t quantity, const uint16_t duration, const uint16_t interval)
+{
+  if (!STATES_STRESS_MUTED) ledSysBlinkOn(quantity, duration, interval);
+}
+
+void ledSysBlinkAuto()
+{
+  EventBits_t states = statesGet();
+  EventBits_t errors = statesGetErrors();
+  #if CONFIG_STATES_FLAP_DETECTION
+    // The LED mode is not switched back and forth while the network is flapping
+    static bool flapping = false;
+    if (states & NETWORK_FLAPPING) {
+      if (flapping) return;
+      flapping = true;
+    } else {
+      flapping = false;
+    };
+  #endif // CONFIG_STATES_FLAP_DETECTION
+  if (states & SYSTEM_OTA) {
+    ledSysBlinkAutoOn(CONFIG_LEDSYS_OTA_QUANTITY, CONFIG_LEDSYS_OTA_DURATION, CONFIG_LEDSYS_OTA_INTERVAL);
+  }
+  else if (errors & (ERR_GENERAL | ERR_WATCHDOG)) {
+    ledSysBlinkAutoOn(CONFIG_LEDSYS_ERROR_QUANTITY, CONFIG_LEDSYS_ERROR_DURATION, CONFIG_LEDSYS_ERROR_INTERVAL);
+  }
+  else if (errors & ERR_SENSORS) {
+    ledSysBlinkAutoOn(CONFIG_LEDSYS_SENSOR_ERROR_QUANTITY, CONFIG_LEDSYS_SENSOR_ERROR_DURATION, CONFIG_LEDSYS_SENSOR_ERROR_INTERVAL);
+  }
+  #if !defined(CONFIG_OFFLINE_MODE) || (CONFIG_OFFLINE_MODE == 0)
+    else if (!(states & NETWORK_CONNECTED)) {
+      ledSysBlinkAutoOn(CONFIG_LEDSYS_WIFI_INIT_QUANTITY, CONFIG_LEDSYS_WIFI_INIT_DURATION, CONFIG_LEDSYS_WIFI_INIT_INTERVAL);
+    }
+    else if (!(states & INET_AVAILABLED)) {
+      ledSysBlinkAutoOn(CONFIG_LEDSYS_PING_FAILED_QUANTITY, CONFIG_LEDSYS_PING_FAILED_DURATION, CONFIG_LEDSYS_PING_FAILED_INTERVAL);
+    }
+    else if (!(states & TIME_IS_OK)) {
+      ledSysBlinkAutoOn(CONFIG_LEDSYS_TIME_ERROR_QUANTITY, CONFIG_LEDSYS_TIME_ERROR_DURATION, CONFIG_LEDSYS_TIME_ERROR_INTERVAL);
+    }
+    else if (!(states & MQTT_CONNECTED) || (errors & ERR_MQTT)) {
+      ledSysBlinkAutoOn(CONFIG_LEDSYS_MQTT_ERROR_QUANTITY, CONFIG_LEDSYS_MQTT_ERROR_DURATION, CONFIG_LEDSYS_MQTT_ERROR_INTERVAL);
+    }
+    else if (errors & ERR_PUBLISH) {
+      ledSysBlinkAutoOn(CONFIG_LEDSYS_PUB_ERROR_QUANTITY, CONFIG_LEDSYS_PUB_ERROR_DURATION, CONFIG_LEDSYS_PUB_ERROR_INTERVAL);
+    }
+    else if (errors & ERR_TELEGRAM) {
+      ledSysBlinkAutoOn(CONFIG_LEDSYS_TG_ERROR_QUANTITY, CONFIG_LEDSYS_TG_ERROR_DURATION, CONFIG_LEDSYS_TG_ERROR_INTERVAL);
+    }
+    else if (errors & ERR_SMTP) {
+      ledSysBlinkAutoOn(CONFIG_LEDSYS_SMTP_ERROR_QUANTITY, CONFIG_LEDSYS_SMTP_ERROR_DURATION, CONFIG_LEDSYS_SMTP_ERROR_INTERVAL);
+    }
+  #else
+    else if (!(states & TIME_IS_OK)) {
+      ledSysBlinkAutoOn(CONFIG_LEDSYS_TIME_ERROR_QUANTITY, CONFIG_LEDSYS_TIME_ERROR_DURATION, CONFIG_LEDSYS_TIME_ERROR_INTERVAL);
+    }
+  #endif // CONFIG_OFFLINE_MODE
+  else {
+    ledSysBlinkAutoOn(CONFIG_LEDSYS_NORMAL_QUANTITY, CONFIG_LEDSYS_NORMAL_DURATION, CONFIG_LEDSYS_NORMAL_INTERVAL);
+  };
+}
+
+#else
+
+void ledSysInit(int8_t ledGPIO, bool ledHigh, uint32_t taskStackSize, ledCustomControl_t customControl)
+{
+  // Stub
+}
+
+void ledSysFree()
+{
+  // Stub
+}
+
+void ledSysOn(const bool fixed)
+{
+  // Stub
+}
+
+void ledSysOff(const bool fixed)
+{
+  // Stub
+}
+
+void ledSysSet(const bool newState)
+{
+  // Stub
+}
+
+void ledSysSetEnabled(const bool newEnabled)
+{
+  // Stub
+}
+
+void ledSysActivity()
+{
+  // Stub
+}
+
+void ledSysFlashOn(const uint16_t quantity, const uint16_t duration, const uint16_t interval)
+{
+  // Stub
+}
+
+void ledSysBlinkOn(const uint16_t quantity, const uint16_t duration, const uint16_t interval)
+{
+  // Stub
+}
+
+void ledSysBlinkOff()
+{
+  // Stub
+}
+
+void ledSysBlinkAuto()
+{
+  // Stub
+}
+
+#endif // CONFIG_GPIO_SYSTEM_LED
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------- Event notifications -------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_ENABLE_STATES_NOTIFICATIONS
+
+#if CONFIG_NOTIFY_TELEGRAM_WIFI_STATUS || CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+  #define ENABLE_NOTIFY_WIFI_STATUS 1
+#else
+  #define ENABLE_NOTIFY_WIFI_STATUS 0
+#endif // CONFIG_NOTIFY_TELEGRAM_WIFI_STATUS || CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+
+#if defined(CONFIG_ETH_ENABLED) && (CONFIG_ETH_ENABLED == 1)
+  #if CONFIG_NOTIFY_TELEGRAM_ETH_STATUS || CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+    #define ENABLE_NOTIFY_ETH_STATUS 1
+  #else
+    #define ENABLE_NOTIFY_ETH_STATUS 0
+  #endif // CONFIG_NOTIFY_TELEGRAM_ETH_STATUS || CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+#endif // CONFIG_ETH_ENABLED
+
+#if CONFIG_PINGER_ENABLE && (CONFIG_NOTIFY_TELEGRAM_INET_UNAVAILABLE || CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE)
+  #define ENABLE_NOTIFY_INET_STATUS 1
+#else
+  #define ENABLE_NOTIFY_INET_STATUS 0
+#endif // CONFIG_NOTIFY_TELEGRAM_INET_UNAVAILABLE
+
+#if CONFIG_NOTIFY_TELEGRAM_MQTT_STATUS || CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+  #define ENABLE_NOTIFY_MQTT_STATUS 1
+#else
+  #define ENABLE_NOTIFY_MQTT_STATUS 0
+#endif // CONFIG_NOTIFY_TELEGRAM_MQTT_STATUS 
+
+#if CONFIG_ENABLE_STATES_NOTIFICATIONS && (CONFIG_NOTIFY_TELEGRAM_MQTT_ERRORS || CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE)
+  #define ENABLE_NOTIFY_MQTT_ERRORS 1
+#else
+  #define ENABLE_NOTIFY_MQTT_ERRORS 0
+#endif // CONFIG_NOTIFY_TELEGRAM_MQTT_ERRORS
+
+#if defined(CONFIG_MQTT1_TYPE) && CONFIG_MQTT1_PING_CHECK && (CONFIG_NOTIFY_TELEGRAM_MQTT_STATUS || CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE)
+  #define ENABLE_NOTIFY_MQTT1_PING 1
+#else
+  #define ENABLE_NOTIFY_MQTT1_PING 0
+#endif // CONFIG_MQTT1_PING_CHECK
+
+#if defined(CONFIG_MQTT2_TYPE) && CONFIG_MQTT2_PING_CHECK && (CONFIG_NOTIFY_TELEGRAM_MQTT_STATUS || CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE)
+  #define ENABLE_NOTIFY_MQTT2_PING 1
+#else
+  #define ENABLE_NOTIFY_MQTT2_PING 0
+#endif // CONFIG_MQTT1_PING_CHECK
+
+#if CONFIG_OPENMON_ENABLE && (CONFIG_NOTIFY_TELEGRAM_OPENMON_STATUS || CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE)
+  #define ENABLE_NOTIFY_OPENMON_STATUS 1
+#else
+  #define ENABLE_NOTIFY_OPENMON_STATUS 0
+#endif // CONFIG_NOTIFY_TELEGRAM_OPENMON_STATUS
+
+#if CONFIG_NARODMON_ENABLE && (CONFIG_NOTIFY_TELEGRAM_NARODMON_STATUS || CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE)
+  #define ENABLE_NOTIFY_NARODMON_STATUS 1
+#else
+  #define ENABLE_NOTIFY_NARODMON_STATUS 0
+#endif // CONFIG_NOTIFY_TELEGRAM_NARODMON_STATUS
+
+#if CONFIG_THINGSPEAK_ENABLE && (CONFIG_NOTIFY_TELEGRAM_THINGSPEAK_STATUS || CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE)
+  #define ENABLE_NOTIFY_THINGSPEAK_STATUS 1
+#else
+  #define ENABLE_NOTIFY_THINGSPEAK_STATUS 0
+#endif // CONFIG_NOTIFY_TELEGRAM_THINGSPEAK_STATUS
+
+#if !defined(CONFIG_NO_SENSORS) && (CONFIG_NOTIFY_TELEGRAM_SENSOR_STATE || CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE)
+  #define ENABLE_NOTIFY_SENSOR_STATE 1
+#else
+  #define ENABLE_NOTIFY_SENSOR_STATE 0
+#endif // CONFIG_NOTIFY_TELEGRAM_SENSOR_STATE
+
+#if CONFIG_SILENT_MODE_ENABLE && (CONFIG_NOTIFY_TELEGRAM_SILENT_MODE || CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE)
+  #define ENABLE_NOTIFY_SILENT_MODE 1
+#else
+  #define ENABLE_NOTIFY_SILENT_MODE 0
+#endif // CONFIG_NOTIFY_TELEGRAM_SILENT_MODE
+
+// The digest is the largest message producer, the outbox and the backends are sized from it
+#ifndef CONFIG_STATES_NOTIFY_DIGEST_WINDOW
+  #define CONFIG_STATES_NOTIFY_DIGEST_WINDOW 10
+#endif // CONFIG_STATES_NOTIFY_DIGEST_WINDOW
+#ifndef CONFIG_STATES_NOTIFY_DIGEST_SIZE
+  #define CONFIG_STATES_NOTIFY_DIGEST_SIZE 12
+#endif // CONFIG_STATES_NOTIFY_DIGEST_SIZE
+#ifndef CONFIG_STATES_NOTIFY_DIGEST_TEXT
+  #define CONFIG_STATES_NOTIFY_DIGEST_TEXT 192
+#endif // CONFIG_STATES_NOTIFY_DIGEST_TEXT
+// Every entry of the digest takes its text plus a line break and a repeat counter
+#define STATES_NOTIFY_DIGEST_BUFFER (CONFIG_STATES_NOTIFY_DIGEST_SIZE * (CONFIG_STATES_NOTIFY_DIGEST_TEXT + 12))
+
+// -- Backends -----------------------------------------------------------------------------------------------------------
+#if CONFIG_STATES_NOTIFY_BACKENDS
+
+/**
+ * Every delivered message is stored once and a reference to it is put into the queue of each registered backend, 
+ * the message is sent from the backend's own task, so a slow channel delays neither the event loop nor the other channels.
+ * The message is released by the last backend that has sent it. In the zero-heap profile the messages are taken 
+ * from a static pool sized for the digest
+ * */
+
+#ifndef CONFIG_STATES_NOTIFY_BACKENDS_MAX
+  #define CONFIG_STATES_NOTIFY_BACKENDS_MAX 4
+#endif // CONFIG_STATES_NOTIFY_BACKENDS_MAX
+#ifndef CONFIG_STATES_NOTIFY_BACKEND_QUEUE
+  #define CONFIG_STATES_NOTIFY_BACKEND_QUEUE 8
+#endif // CONFIG_STATES_NOTIFY_BACKEND_QUEUE
+#if CONFIG_STATES_ZERO_HEAP
+  #ifndef CONFIG_STATES_NOTIFY_BACKEND_TEXT
+    #if CONFIG_STATES_NOTIFY_DIGEST && (STATES_NOTIFY_DIGEST_BUFFER > 512)
+      #define CONFIG_STATES_NOTIFY_BACKEND_TEXT STATES_NOTIFY_DIGEST_BUFFER
+    #else
+      #define CONFIG_STATES_NOTIFY_BACKEND_TEXT 512
+    #endif // CONFIG_STATES_NOTIFY_DIGEST
+  #endif // CONFIG_STATES_NOTIFY_BACKEND_TEXT
+  #ifndef CONFIG_STATES_NOTIFY_BACKEND_POOL
+    #define CONFIG_STATES_NOTIFY_BACKEND_POOL CONFIG_STATES_NOTIFY_BACKEND_QUEUE
+  #endif // CONFIG_STATES_NOTIFY_BACKEND_POOL
+#endif // CONFIG_STATES_ZERO_HEAP
+#ifndef CONFIG_STATES_NOTIFY_BACKEND_STACK
+  #define CONFIG_STATES_NOTIFY_BACKEND_STACK 3072
+#endif // CONFIG_STATES_NOTIFY_BACKEND_STACK
+#ifndef CONFIG_STATES_NOTIFY_BACKEND_PRIORITY
+  #define CONFIG_STATES_NOTIFY_BACKEND_PRIORITY 3
+#endif // CONFIG_STATES_NOTIFY_BACKEND_PRIORITY
+
+typedef struct {
+  uint8_t  refs;
+  size_t   length;
+  char*    text;
+} states_backend_msg_t;
+
+typedef struct {
+  int64_t  queued;
+  uint32_t msg_options;
+  states_backend_msg_t* msg;
+} states_backend_item_t;
+
+typedef struct {
+  const char* name;
+  states_notify_backend_cb_t cb_send;
+  void* context;
+  QueueHandle_t queue;
+  TaskHandle_t task;
+  uint8_t  queue_depth;
+  uint8_t  queue_max;
+  uint32_t sent;
+  uint32_t failed;
+  uint32_t dropped;
+  uint32_t latency_max;
+  uint64_t latency_total;
+  #if CONFIG_STATES_STATIC_ALLOCATION
+    StaticQueue_t queue_buffer;
+    uint8_t queue_storage[CONFIG_STATES_NOTIFY_BACKEND_QUEUE * sizeof(states_backend_item_t)];
+    StaticTask_t task_buffer;
+    StackType_t task_stack[CONFIG_STATES_NOTIFY_BACKEND_STACK];
+  #endif // CONFIG_STATES_STATIC_ALLOCATION
+} states_backend_t;
+
+static states_backend_t _statesBackends[CONFIG_STATES_NOTIFY_BACKENDS_MAX];
+static uint8_t _statesBackendsCount = 0;
+static portMUX_TYPE _statesBackendsLock = portMUX_INITIALIZER_UNLOCKED;
+#if CONFIG_STATES_ZERO_HEAP
+  static states_backend_msg_t _statesBackendsPool[CONFIG_STATES_NOTIFY_BACKEND_POOL];
+  static char _statesBackendsPoolText[CONFIG_STATES_NOTIFY_BACKEND_POOL][CONFIG_STATES_NOTIFY_BACKEND_TEXT];
+#endif // CONFIG_STATES_ZERO_HEAP
+
+// Returns a message with room for length characters, held by the caller
+static states_backend_msg_t* statesBackendMsgAlloc(size_t length)
+{
+  #if CONFIG_STATES_ZERO_HEAP
+    for (uint8_t i = 0; i < CONFIG_STATES_NOTIFY_BACKEND_POOL; i++) {
+      uint8_t expected = 0;
+      if (__atomic_compare_exchange_n(&_statesBackendsPool[i].refs, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        states_backend_msg_t* msg = &_statesBackendsPool[i];
+        msg->text = _statesBackendsPoolText[i];
+        if (length > CONFIG_STATES_NOTIFY_BACKEND_TEXT - 1) {
+          rlog_w(logTAG, "Notification truncated from %d to %d bytes", length, CONFIG_STATES_NOTIFY_BACKEND_TEXT - 1);
+          length = CONFIG_STATES_NOTIFY_BACKEND_TEXT - 1;
+        };
+        msg->length = length;
+        return msg;
+      };
+    };
+    return nullptr;
+  #else
+    states_backend_msg_t* msg = (states_backend_msg_t*)malloc(sizeof(states_backend_msg_t) + length + 1);
+    if (msg) {
+      msg->refs = 1;
+      msg->length = length;
+      msg->text = (char*)(msg + 1);
+    };
+    return msg;
+  #endif // CONFIG_STATES_ZERO_HEAP
+}
+
+static void statesBackendMsgRelease(states_backend_msg_t* msg)
+{
+  if (__atomic_sub_fetch(&msg->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    #if !CONFIG_STATES_ZERO_HEAP
+      free(msg);
+    #endif // CONFIG_STATES_ZERO_HEAP
+  };
+}
+
+static void statesBackendTask(void* arg)
+{
+  states_backend_t* backend = (states_backend_t*)arg;
+  states_backend_item_t item;
+  while (true) {
+    if (xQueueReceive(backend->queue, &item, portMAX_DELAY) == pdTRUE) {
+      bool ok = backend->cb_send(item.msg_options, item.msg->text, backend->context);
+      statesBackendMsgRelease(item.msg);
+      uint32_t latency = (uint32_t)(esp_timer_get_time() - item.queued);
+      portENTER_CRITICAL(&_statesBackendsLock);
+      if (ok) {
+        backend->sent++;
+      } else {
+        backend->failed++;
+      };
+      backend->latency_total += latency;
+      if (latency > backend->latency_max) backend->latency_max = latency;
+      portEXIT_CRITICAL(&_statesBackendsLock);
+    };
+  };
+  vTaskDelete(nullptr);
+}
+
+int8_t statesNotifyBackendAdd(const char* name, states_notify_backend_cb_t cb_send, void* context, uint8_t queue_depth)
+{
+  if ((cb_send == nullptr) || (queue_depth == 0)) return -1;
+  if (queue_depth > CONFIG_STATES_NOTIFY_BACKEND_QUEUE) queue_depth = CONFIG_STATES_NOTIFY_BACKEND_QUEUE;
+
+  // The slot is reserved first and published only when it is ready to accept messages
+  int8_t index = -1;
+  portENTER_CRITICAL(&_statesBackendsLock);
+  for (uint8_t i = 0; i < CONFIG_STATES_NOTIFY_BACKENDS_MAX; i++) {
+    if (_statesBackends[i].cb_send == nullptr) {
+      _statesBackends[i].cb_send = cb_send;
+      index = i;
+      break;
+    };
+  };
+  portEXIT_CRITICAL(&_statesBackendsLock);
+  if (index < 0) {
+    rlog_e(logTAG, "Failed to add notification backend [%s]: no free slots", name);
+    return -1;
+  };
+
+  states_backend_t* backend = &_statesBackends[index];
+  backend->name = name;
+  backend->context = context;
+  backend->queue_depth = queue_depth;
+  #if CONFIG_STATES_STATIC_ALLOCATION
+    backend->queue = xQueueCreateStatic(queue_depth, sizeof(states_backend_item_t), backend->queue_storage, &backend->queue_buffer);
+    if (backend->queue) {
+      backend->task = xTaskCreateStatic(statesBackendTask, name, CONFIG_STATES_NOTIFY_BACKEND_STACK, backend, 
+        CONFIG_STATES_NOTIFY_BACKEND_PRIORITY, backend->task_stack, &backend->task_buffer);
+    };
+  #else
+    backend->queue = xQueueCreate(queue_depth, sizeof(states_backend_item_t));
+    if (backend->queue) {
+      xTaskCreate(statesBackendTask, name, CONFIG_STATES_NOTIFY_BACKEND_STACK, backend, 
+        CONFIG_STATES_NOTIFY_BACKEND_PRIORITY, &backend->task);
+    };
+  #endif // CONFIG_STATES_STATIC_ALLOCATION
+  if ((backend->queue == nullptr) || (backend->task == nullptr)) {
+    rlog_e(logTAG, "Failed to create notification backend [%s]", name);
+    if (backend->queue) vQueueDelete(backend->queue);
+    backend->queue = nullptr;
+    portENTER_CRITICAL(&_statesBackendsLock);
+    backend->cb_send = nullptr;
+    portEXIT_CRITICAL(&_statesBackendsLock);
+    return -1;
+  };
+
+  portENTER_CRITICAL(&_statesBackendsLock);
+  if (index >= _statesBackendsCount) _statesBackendsCount = index + 1;
+  portEXIT_CRITICAL(&_statesBackendsLock);
+  rlog_i(logTAG, "Notification backend [%s] added, queue depth %d", name, queue_depth);
+  return index;
+}
+
+// Hands the message over to all backends and drops the reference of the caller
+static bool statesBackendsPostMsg(uint32_t msg_options, states_backend_msg_t* msg)
+{
+  states_backend_item_t item;
+  item.queued = esp_timer_get_time();
+  item.msg_options = msg_options;
+  item.msg = msg;
+
+  bool ret = false;
+  uint8_t count = __atomic_load_n(&_statesBackendsCount, __ATOMIC_ACQUIRE);
+  for (uint8_t i = 0; i < count; i++) {
+    states_backend_t* backend = &_statesBackends[i];
+    if (backend->queue == nullptr) continue;
+    if (msg) __atomic_add_fetch(&msg->refs, 1, __ATOMIC_RELAXED);
+    // Never wait here: this is called from the event loop
+    bool queued = msg && (xQueueSend(backend->queue, &item, 0) == pdTRUE);
+    if (msg && !queued) __atomic_sub_fetch(&msg->refs, 1, __ATOMIC_RELAXED);
+    uint8_t depth = uxQueueMessagesWaiting(backend->queue);
+    portENTER_CRITICAL(&_statesBackendsLock);
+    if (queued) {
+      ret = true;
+    } else {
+      backend->dropped++;
+    };
+    if (depth > backend->queue_max) backend->queue_max = depth;
+    portEXIT_CRITICAL(&_statesBackendsLock);
+  };
+  if (msg) statesBackendMsgRelease(msg);
+  return ret;
+}
+
+static bool statesBackendsPost(uint32_t msg_options, const char* text)
+{
+  size_t length = strlen(text);
+  states_backend_msg_t* msg = statesBackendMsgAlloc(length);
+  if (msg) {
+    memcpy(msg->text, text, msg->length);
+    msg->text[msg->length] = 0;
+  };
+  return statesBackendsPostMsg(msg_options, msg);
+}
+
+static bool statesBackendsSend(uint32_t msg_options, const char* msg_template, ...)
+{
+  va_list args;
+  va_start(args, msg_template);
+  int length = vsnprintf(nullptr, 0, msg_template, args);
+  va_end(args);
+  states_backend_msg_t* msg = length < 0 ? nullptr : statesBackendMsgAlloc(length);
+  if (msg) {
+    va_start(args, msg_template);
+    vsnprintf(msg->text, msg->length + 1, msg_template, args);
+    va_end(args);
+  };
+  return statesBackendsPostMsg(msg_options, msg);
+}
+
+static void statesNotifyBackendsWriter(states_buf_t* buf, void* arg)
+{
+  bool first = true;
+  statesBufPrintf(buf, "{");
+  uint8_t count = __atomic_load_n(&_statesBackendsCount, __ATOMIC_ACQUIRE);
+  for (uint8_t i = 0; i < count; i++) {
+    states_backend_t* backend = &_statesBackends[i];
+    if (backend->queue == nullptr) continue;
+    portENTER_CRITICAL(&_statesBackendsLock);
+    uint32_t sent = backend->sent;
+    uint32_t failed = backend->failed;
+    uint32_t dropped = backend->dropped;
+    uint8_t queue_max = backend->queue_max;
+    uint32_t latency_max = backend->latency_max;
+    uint64_t latency_total = backend->latency_total;
+    portEXIT_CRITICAL(&_statesBackendsLock);
+    uint32_t processed = sent + failed;
+    statesBufPrintf(buf, "%s\"%s\":{\"depth\":%d,\"queued\":%d,\"max_queued\":%d,\"sent\":%d,\"failed\":%d,\"dropped\":%d,\"latency_avg\":%d,\"latency_max\":%d}",
+      first ? "" : ",", backend->name, backend->queue_depth, uxQueueMessagesWaiting(backend->queue), queue_max, sent, failed, dropped, 
+      processed > 0 ? (uint32_t)(latency_total / processed) : 0, latency_max);
+    first = false;
+  };
+  statesBufPrintf(buf, "}");
+}
+
+size_t statesNotifyBackendsJsonTo(char* buffer, size_t size)
+{
+  return statesBufWrite(statesNotifyBackendsWriter, nullptr, buffer, size);
+}
+
+#if !CONFIG_STATES_ZERO_HEAP
+char* statesNotifyBackendsJson()
+{
+  return statesBufMalloc(statesNotifyBackendsWriter, nullptr);
+}
+#endif // CONFIG_STATES_ZERO_HEAP
+
+// Telegram
+static bool statesBackendTelegram(uint32_t msg_options, const char* text, void* context)
+{
+  return tgSendMsg(msg_options, CONFIG_TELEGRAM_DEVICE, "%s", text);
+}
+
+// MQTT alert topic
+#if defined(CONFIG_STATES_NOTIFY_BACKEND_MQTT_TOPIC)
+#ifndef CONFIG_STATES_NOTIFY_BACKEND_MQTT_LOCAL
+  #define CONFIG_STATES_NOTIFY_BACKEND_MQTT_LOCAL 0
+#endif // CONFIG_STATES_NOTIFY_BACKEND_MQTT_LOCAL
+#ifndef CONFIG_STATES_NOTIFY_BACKEND_MQTT_QOS
+  #define CONFIG_STATES_NOTIFY_BACKEND_MQTT_QOS 1
+#endif // CONFIG_STATES_NOTIFY_BACKEND_MQTT_QOS
+
+#if CONFIG_STATES_ZERO_HEAP
+  static states_mqtt_topic_t _statesBackendMqttTopic;
+#endif // CONFIG_STATES_ZERO_HEAP
+
+static bool statesBackendMqtt(uint32_t msg_options, const char* text, void* context)
+{
+  if (!statesMqttIsConnected()) return false;
+  #if CONFIG_STATES_ZERO_HEAP
+    if (statesMqttTopic(_statesBackendMqttTopic)[0] == 0) return false;
+    return mqttPublish(statesMqttTopic(_statesBackendMqttTopic), 
+      (char*)text, CONFIG_STATES_NOTIFY_BACKEND_MQTT_QOS, false, false, false);
+  #else
+    return mqttPublish(
+      mqttGetTopicDevice1(statesMqttIsPrimary(), CONFIG_STATES_NOTIFY_BACKEND_MQTT_LOCAL, CONFIG_STATES_NOTIFY_BACKEND_MQTT_TOPIC), 
+      malloc_string(text), CONFIG_STATES_NOTIFY_BACKEND_MQTT_QOS, false, true, true);
+  #endif // CONFIG_STATES_ZERO_HEAP
+}
+#endif // CONFIG_STATES_NOTIFY_BACKEND_MQTT_TOPIC
+
+// Syslog over UDP (RFC 3164 framing, facility "user", severity "notice")
+#if defined(CONFIG_STATES_NOTIFY_BACKEND_SYSLOG_IP)
+#ifndef CONFIG_STATES_NOTIFY_BACKEND_SYSLOG_PORT
+  #define CONFIG_STATES_NOTIFY_BACKEND_SYSLOG_PORT 514
+#endif // CONFIG_STATES_NOTIFY_BACKEND_SYSLOG_PORT
+
+static bool statesBackendSyslog(uint32_t msg_options, const char* text, void* context)
+{
+  int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+  if (sock < 0) return false;
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(CONFIG_STATES_NOTIFY_BACKEND_SYSLOG_PORT);
+  addr.sin_addr.s_addr = inet_addr(CONFIG_STATES_NOTIFY_BACKEND_SYSLOG_IP);
+  // RFC 3164 limits the packet to 1024 bytes; the buffer is used only by the task of this backend
+  static char packet[1024];
+  int size = snprintf(packet, sizeof(packet), "<13>%s: %s", CONFIG_TELEGRAM_DEVICE, text);
+  if (size > (int)sizeof(packet) - 1) size = sizeof(packet) - 1;
+  bool ret = sendto(sock, packet, size, 0, (struct sockaddr*)&addr, sizeof(addr)) == size;
+  close(sock);
+  return ret;
+}
+#endif // CONFIG_STATES_NOTIFY_BACKEND_SYSLOG_IP
+
+// Mock: remembers what it was given and optionally pretends to be slow
+#if CONFIG_STATES_NOTIFY_BACKEND_MOCK
+#ifndef CONFIG_STATES_NOTIFY_BACKEND_MOCK_DELAY
+  #define CONFIG_STATES_NOTIFY_BACKEND_MOCK_DELAY 0
+#endif // CONFIG_STATES_NOTIFY_BACKEND_MOCK_DELAY
+
+static states_notify_mock_t _statesBackendMock;
+
+static bool statesBackendMock(uint32_t msg_options, const char* text, void* context)
+{
+  states_notify_mock_t* mock = (states_notify_mock_t*)context;
+  if (CONFIG_STATES_NOTIFY_BACKEND_MOCK_DELAY > 0) {
+    vTaskDelay(pdMS_TO_TICKS(CONFIG_STATES_NOTIFY_BACKEND_MOCK_DELAY));
+  };
+  mock->last_options = msg_options;
+  strncpy(mock->last_text, text, sizeof(mock->last_text) - 1);
+  mock->last_text[sizeof(mock->last_text) - 1] = 0;
+  __atomic_add_fetch(&mock->count, 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+states_notify_mock_t* statesNotifyMock()
+{
+  return &_statesBackendMock;
+}
+#endif // CONFIG_STATES_NOTIFY_BACKEND_MOCK
+
+static void statesBackendsInit()
+{
+  if (_statesBackendsCount > 0) return;
+  statesNotifyBackendAdd("ntf_telegram", statesBackendTelegram, nullptr, CONFIG_STATES_NOTIFY_BACKEND_QUEUE);
+  #if defined(CONFIG_STATES_NOTIFY_BACKEND_MQTT_TOPIC)
+    #if CONFIG_STATES_ZERO_HEAP
+      statesMqttTopicInit(_statesBackendMqttTopic, CONFIG_STATES_NOTIFY_BACKEND_MQTT_LOCAL, CONFIG_STATES_NOTIFY_BACKEND_MQTT_TOPIC);
+    #endif // CONFIG_STATES_ZERO_HEAP
+    statesNotifyBackendAdd("ntf_mqtt", statesBackendMqtt, nullptr, CONFIG_STATES_NOTIFY_BACKEND_QUEUE);
+  #endif // CONFIG_STATES_NOTIFY_BACKEND_MQTT_TOPIC
+  #if defined(CONFIG_STATES_NOTIFY_BACKEND_SYSLOG_IP)
+    statesNotifyBackendAdd("ntf_syslog", statesBackendSyslog, nullptr, CONFIG_STATES_NOTIFY_BACKEND_QUEUE);
+  #endif // CONFIG_STATES_NOTIFY_BACKEND_SYSLOG_IP
+  #if CONFIG_STATES_NOTIFY_BACKEND_MOCK
+    memset(&_statesBackendMock, 0, sizeof(_statesBackendMock));
+    statesNotifyBackendAdd("ntf_mock", statesBackendMock, &_statesBackendMock, CONFIG_STATES_NOTIFY_BACKEND_QUEUE);
+  #endif // CONFIG_STATES_NOTIFY_BACKEND_MOCK
+}
+
+  #define statesNotifyDeliver(msg_options, text) statesBackendsPost(msg_options, text)
+  #define statesNotifySend(msg_kind, msg_priority, msg_alert, title, msg_template, ...) statesBackendsSend(encMsgOptions(msg_kind, msg_alert, msg_priority), msg_template, ##__VA_ARGS__)
+#else
+  #define statesNotifyDeliver(msg_options, text) tgSendMsg(msg_options, CONFIG_TELEGRAM_DEVICE, "%s", text)
+  #define statesNotifySend tgSend
+#endif // CONFIG_STATES_NOTIFY_BACKENDS
+
+// -- Outbox -------------------------------------------------------------------------------------------------------------
+#if CONFIG_STATES_NOTIFY_OUTBOX
+
+/**
+ * Notifications that cannot be delivered right now (no internet, system not started yet) are kept in a ring
+ * that is mirrored to NVS, so they survive a restart and are sent in the original order after SYSTEM_STARTED.
+ * Every record has its own key and only new records are written, in batches, to limit flash wear.
+ * A record holds the longest single line of any producer; longer messages (digests, start message with the trace)
+ * are split over several records at line breaks and joined again on replay
+ * */
+
+#ifndef CONFIG_STATES_NOTIFY_OUTBOX_SIZE
+  #define CONFIG_STATES_NOTIFY_OUTBOX_SIZE 16
+#endif // CONFIG_STATES_NOTIFY_OUTBOX_SIZE
+#ifndef CONFIG_STATES_NOTIFY_OUTBOX_TEXT
+  #if CONFIG_STATES_NOTIFY_DIGEST && ((CONFIG_STATES_NOTIFY_DIGEST_TEXT + 16) > 256)
+    #define CONFIG_STATES_NOTIFY_OUTBOX_TEXT (CONFIG_STATES_NOTIFY_DIGEST_TEXT + 16)
+  #else
+    #define CONFIG_STATES_NOTIFY_OUTBOX_TEXT 256
+  #endif // CONFIG_STATES_NOTIFY_DIGEST_TEXT
+#endif // CONFIG_STATES_NOTIFY_OUTBOX_TEXT
+// Replay joins consecutive records into messages of up to this size, each message takes one token of the service channel
+#ifndef CONFIG_STATES_NOTIFY_OUTBOX_REPLAY_TEXT
+  #if CONFIG_STATES_NOTIFY_DIGEST
+    #define CONFIG_STATES_NOTIFY_OUTBOX_REPLAY_TEXT STATES_NOTIFY_DIGEST_BUFFER
+  #else
+    #define CONFIG_STATES_NOTIFY_OUTBOX_REPLAY_TEXT (4 * CONFIG_STATES_NOTIFY_OUTBOX_TEXT)
+  #endif // CONFIG_STATES_NOTIFY_DIGEST
+#endif // CONFIG_STATES_NOTIFY_OUTBOX_REPLAY_TEXT
+#ifndef CONFIG_STATES_NOTIFY_OUTBOX_BATCH
+  #define CONFIG_STATES_NOTIFY_OUTBOX_BATCH 4
+#endif // CONFIG_STATES_NOTIFY_OUTBOX_BATCH
+#ifndef CONFIG_STATES_NOTIFY_OUTBOX_DELAY
+  #define CONFIG_STATES_NOTIFY_OUTBOX_DELAY 30
+#endif // CONFIG_STATES_NOTIFY_OUTBOX_DELAY
+#ifndef CONFIG_NOTIFY_TELEGRAM_OUTBOX_PRIORITY
+  #if defined(CONFIG_NOTIFY_TELEGRAM_INET_PRIORITY)
+    #define CONFIG_NOTIFY_TELEGRAM_OUTBOX_PRIORITY CONFIG_NOTIFY_TELEGRAM_INET_PRIORITY
+  #else
+    #define CONFIG_NOTIFY_TELEGRAM_OUTBOX_PRIORITY 0
+  #endif // CONFIG_NOTIFY_TELEGRAM_INET_PRIORITY
+#endif // CONFIG_NOTIFY_TELEGRAM_OUTBOX_PRIORITY
+#ifndef CONFIG_MESSAGE_TG_OUTBOX_INCIDENT
+  #define CONFIG_MESSAGE_TG_OUTBOX_INCIDENT "⚠️ <b>%s</b> was unavailable since <i>%s</i> when the device was restarted"
+#endif // CONFIG_MESSAGE_TG_OUTBOX_INCIDENT
+#define STATES_OUTBOX_NVS_NAMESPACE "states"
+#define STATES_OUTBOX_NVS_HEADER "ob_hdr"
+#define STATES_OUTBOX_NVS_RECORD "ob_%02d"
+#define STATES_OUTBOX_MAGIC 0x5A01
+
+typedef enum {
+  SI_INET = 0,
+  SI_MQTT,
+  SI_MAX
+} states_incident_t;
+
+static const char* _statesIncidentNames[SI_MAX] = { "Internet", "MQTT" };
+
+typedef struct {
+  uint16_t magic;
+  uint8_t  head;
+  uint8_t  count;
+  time_t   incidents[SI_MAX];
+} states_outbox_header_t;
+
+typedef struct {
+  uint32_t msg_options;
+  char     text[CONFIG_STATES_NOTIFY_OUTBOX_TEXT];
+} states_outbox_record_t;
+
+typedef struct {
+  uint32_t appended;
+  uint32_t dropped;
+  uint32_t replayed;
+  uint32_t commits;
+  uint64_t payload_bytes;
+  uint64_t written_bytes;
+  int64_t  replay_time;
+} states_outbox_stats_t;
+
+static_assert(CONFIG_STATES_NOTIFY_OUTBOX_REPLAY_TEXT >= CONFIG_STATES_NOTIFY_OUTBOX_TEXT, "The replay buffer must hold at least one outbox record");
+
+static states_outbox_header_t _statesOutboxHeader;
+static states_outbox_record_t _statesOutbox[CONFIG_STATES_NOTIFY_OUTBOX_SIZE];
+static char _statesOutboxReplayText[CONFIG_STATES_NOTIFY_OUTBOX_REPLAY_TEXT];
+static bool _statesOutboxReplaying = false;
+static states_outbox_stats_t _statesOutboxStats;
+static uint8_t _statesOutboxUnsaved = 0;
+static bool _statesOutboxDirty = false;
+static SemaphoreHandle_t _statesOutboxLock = nullptr;
+static esp_timer_handle_t _statesOutboxTimer = nullptr;
+#if CONFIG_STATES_STATIC_ALLOCATION
+  static StaticSemaphore_t _statesOutboxLockBuffer;
+#endif // CONFIG_STATES_STATIC_ALLOCATION
+
+static size_t statesOutboxRecordSize(states_outbox_record_t* record)
+{
+  return sizeof(record->msg_options) + strlen(record->text) + 1;
+}
+
+// Writes the records appended since the last save and the header, must be called under the lock
+static void statesOutboxSaveLocked()
+{
+  if (!_statesOutboxDirty) return;
+
+  nvs_handle_t nvs_handle;
+  esp_err_t err = nvs_open(STATES_OUTBOX_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+  if (err == ESP_OK) {
+    char key[8];
+    uint8_t first = _statesOutboxHeader.count - _statesOutboxUnsaved;
+    for (uint8_t i = first; (i < _statesOutboxHeader.count) && (err == ESP_OK); i++) {
+      uint8_t index = (_statesOutboxHeader.head + i) % CONFIG_STATES_NOTIFY_OUTBOX_SIZE;
+      size_t size = statesOutboxRecordSize(&_statesOutbox[index]);
+      snprintf(key, sizeof(key), STATES_OUTBOX_NVS_RECORD, index);
+      err = nvs_set_blob(nvs_handle, key, &_statesOutbox[index], size);
+      _statesOutboxStats.written_bytes += size;
+    };
+    if (err == ESP_OK) {
+      err = nvs_set_blob(nvs_handle, STATES_OUTBOX_NVS_HEADER, &_statesOutboxHeader, sizeof(_statesOutboxHeader));
+      _statesOutboxStats.written_bytes += sizeof(_statesOutboxHeader);
+    };
+    if (err == ESP_OK) {
+      err = nvs_commit(nvs_handle);
+    };
+    nvs_close(nvs_handle);
+  };
+  if (err == ESP_OK) {
+    _statesOutboxStats.commits++;
+    _statesOutboxUnsaved = 0;
+    _statesOutboxDirty = false;
+  } else {
+    rlog_e(logTAG, "Failed to save notification outbox: %d, %s", err, esp_err_to_name(err));
+  };
+}
+
+static void statesOutboxSave()
+{
+  if ((_statesOutboxLock == nullptr) || (xSemaphoreTake(_statesOutboxLock, portMAX_DELAY) != pdTRUE)) return;
+  statesOutboxSaveLocked();
+  xSemaphoreGive(_statesOutboxLock);
+}
+
+static void statesOutboxTimerEnd(void* arg)
+{
+  statesOutboxSave();
+}
+
+// Postpones the write so that several changes are committed at once
+static void statesOutboxSchedule()
+{
+  if ((_statesOutboxTimer) && !esp_timer_is_active(_statesOutboxTimer)) {
+    esp_timer_start_once(_statesOutboxTimer, (uint64_t)CONFIG_STATES_NOTIFY_OUTBOX_DELAY * 1000000);
+  };
+}
+
+static void statesOutboxLoad()
+{
+  memset(&_statesOutboxHeader, 0, sizeof(_statesOutboxHeader));
+  nvs_handle_t nvs_handle;
+  if (nvs_open(STATES_OUTBOX_NVS_NAMESPACE, NVS_READONLY, &nvs_handle) == ESP_OK) {
+    size_t size = sizeof(_statesOutboxHeader);
+    if ((nvs_get_blob(nvs_handle, STATES_OUTBOX_NVS_HEADER, &_statesOutboxHeader, &size) != ESP_OK) 
+     || (size != sizeof(_statesOutboxHeader)) || (_statesOutboxHeader.magic != STATES_OUTBOX_MAGIC)
+     || (_statesOutboxHeader.head >= CONFIG_STATES_NOTIFY_OUTBOX_SIZE) || (_statesOutboxHeader.count > CONFIG_STATES_NOTIFY_OUTBOX_SIZE)) {
+      memset(&_statesOutboxHeader, 0, sizeof(_statesOutboxHeader));
+    };
+    char key[8];
+    uint8_t loaded = 0;
+    for (uint8_t i = 0; i < _statesOutboxHeader.count; i++) {
+      uint8_t index = (_statesOutboxHeader.head + i) % CONFIG_STATES_NOTIFY_OUTBOX_SIZE;
+      memset(&_statesOutbox[index], 0, sizeof(states_outbox_record_t));
+      snprintf(key, sizeof(key), STATES_OUTBOX_NVS_RECORD, index);
+      size = sizeof(states_outbox_record_t);
+      if (nvs_get_blob(nvs_handle, key, &_statesOutbox[index], &size) != ESP_OK) break;
+      _statesOutbox[index].text[CONFIG_STATES_NOTIFY_OUTBOX_TEXT - 1] = 0;
+      loaded++;
+    };
+    _statesOutboxHeader.count = loaded;
+    nvs_close(nvs_handle);
+  };
+  _statesOutboxHeader.magic = STATES_OUTBOX_MAGIC;
+  if (_statesOutboxHeader.count > 0) {
+    rlog_i(logTAG, "Notification outbox: %d messages restored", _statesOutboxHeader.count);
+  };
+}
+
+static void statesOutboxInit()
+{
+  if (_statesOutboxLock == nullptr) {
+    #if CONFIG_STATES_STATIC_ALLOCATION
+      _statesOutboxLock = xSemaphoreCreateMutexStatic(&_statesOutboxLockBuffer);
+    #else
+      _statesOutboxLock = xSemaphoreCreateMutex();
+    #endif // CONFIG_STATES_STATIC_ALLOCATION
+    memset(&_statesOutboxStats, 0, sizeof(_statesOutboxStats));
+    statesOutboxLoad();
+  };
+  if (_statesOutboxTimer == nullptr) {
+    esp_timer_create_args_t cfgTimer;
+    memset(&cfgTimer, 0, sizeof(cfgTimer));
+    cfgTimer.callback = statesOutboxTimerEnd;
+    cfgTimer.name = "tg_outbox";
+    RE_OK_CHECK(esp_timer_create(&cfgTimer, &_statesOutboxTimer), return);
+  };
+}
+
+// Removes the oldest records, must be called under the lock
+static void statesOutboxPopLocked(uint8_t count)
+{
+  if (count > _statesOutboxHeader.count) count = _statesOutboxHeader.count;
+  if (count == 0) return;
+  _statesOutboxHeader.head = (_statesOutboxHeader.head + count) % CONFIG_STATES_NOTIFY_OUTBOX_SIZE;
+  _statesOutboxHeader.count -= count;
+  if (_statesOutboxUnsaved > _statesOutboxHeader.count) _statesOutboxUnsaved = _statesOutboxHeader.count;
+  _statesOutboxDirty = true;
+}
+
+// Must be called under the lock
+static void statesOutboxAppendLocked(uint32_t msg_options, const char* text, size_t len)
+{
+  // The oldest message is sacrificed if the outbox is full
+  if (_statesOutboxHeader.count >= CONFIG_STATES_NOTIFY_OUTBOX_SIZE) {
+    statesOutboxPopLocked(1);
+    _statesOutboxStats.dropped++;
+  };
+  states_outbox_record_t* record = &_statesOutbox[(_statesOutboxHeader.head + _statesOutboxHeader.count) % CONFIG_STATES_NOTIFY_OUTBOX_SIZE];
+  record->msg_options = msg_options;
+  memcpy(record->text, text, len);
+  record->text[len] = 0;
+  _statesOutboxHeader.count++;
+  _statesOutboxUnsaved++;
+  _statesOutboxDirty = true;
+  _statesOutboxStats.appended++;
+  _statesOutboxStats.payload_bytes += statesOutboxRecordSize(record);
+  if (_statesOutboxUnsaved >= CONFIG_STATES_NOTIFY_OUTBOX_BATCH) {
+    statesOutboxSaveLocked();
+  };
+}
+
+static bool statesOutboxPost(uint32_t msg_options, const char* text)
+{
+  if (_statesOutboxLock == nullptr) return false;
+  if (xSemaphoreTake(_statesOutboxLock, portMAX_DELAY) != pdTRUE) return false;
+  // If there is nothing in the queue and the message can be delivered, it is sent right away
+  if ((_statesOutboxHeader.count == 0) && statesCheck(SYSTEM_STARTED | INET_AVAILABLED, false)) {
+    xSemaphoreGive(_statesOutboxLock);
+    return statesNotifyDeliver(msg_options, text);
+  };
+  // Messages longer than a record are split, preferably at a line break
+  size_t len = strlen(text);
+  do {
+    size_t part = len;
+    size_t next = len;
+    if (part > CONFIG_STATES_NOTIFY_OUTBOX_TEXT - 1) {
+      part = CONFIG_STATES_NOTIFY_OUTBOX_TEXT - 1;
+      next = part;
+      for (size_t i = part; i > 0; i--) {
+        if (text[i - 1] == '\n') {
+          next = i;
+          part = ((i > 1) && (text[i - 2] == '\r')) ? i - 2 : i - 1;
+          break;
+        };
+      };
+    };
+    if (part > 0) statesOutboxAppendLocked(msg_options, text, part);
+    text += next;
+    len -= next;
+  } while (len > 0);
+  xSemaphoreGive(_statesOutboxLock);
+  statesOutboxSchedule();
+  return true;
+}
+
+static bool statesOutboxSend(uint32_t msg_options, const char* msg_template, ...)
+{
+  char text[CONFIG_STATES_NOTIFY_OUTBOX_TEXT];
+  va_list args;
+  va_start(args, msg_template);
+  vsnprintf(text, sizeof(text), msg_template, args);
+  va_end(args);
+  return statesOutboxPost(msg_options, text);
+}
+
+// Remembers the beginning of an incident that has not been notified yet; zero closes the incident
+static void statesOutboxSetIncident(states_incident_t incident, time_t time_failure)
+{
+  if ((_statesOutboxLock == nullptr) || (xSemaphoreTake(_statesOutboxLock, portMAX_DELAY) != pdTRUE)) return;
+  bool changed = _statesOutboxHeader.incidents[incident] != time_failure;
+  if (changed) {
+    _statesOutboxHeader.incidents[incident] = time_failure;
+    _statesOutboxDirty = true;
+  };
+  xSemaphoreGive(_statesOutboxLock);
+  if (changed) statesOutboxSchedule();
+}
+
+// Sends everything accumulated in the original order, including incidents interrupted by a restart.
+// Consecutive records with the same options are joined, every joined message goes through the rate limits of the 
+// service channel; what does not fit into the limits stays in the outbox until the next call (every minute).
+// Records are removed only after the message has been delivered, what failed is retried on the next call
+static void statesOutboxReplay(bool afterRestart)
+{
+  if (STATES_STRESS_MUTED || (_statesOutboxLock == nullptr) || !statesCheck(SYSTEM_STARTED | INET_AVAILABLED, false)) return;
+  // The replay buffer is shared, a concurrent call leaves the work to the one in progress
+  if (__atomic_exchange_n(&_statesOutboxReplaying, true, __ATOMIC_ACQUIRE)) return;
+
+  int64_t start = esp_timer_get_time();
+  uint32_t replayed = 0;
+  while (xSemaphoreTake(_statesOutboxLock, portMAX_DELAY) == pdTRUE) {
+    if (_statesOutboxHeader.count == 0) {
+      // Stale records remain in NVS, only the header is rewritten
+      statesOutboxSaveLocked();
+      xSemaphoreGive(_statesOutboxLock);
+      break;
+    };
+    xSemaphoreGive(_statesOutboxLock);
+    if (!statesNotifyReplayAllowed()) break;
+
+    uint32_t msg_options = 0;
+    uint8_t joined = 0;
+    size_t len = 0;
+    if (xSemaphoreTake(_statesOutboxLock, portMAX_DELAY) != pdTRUE) break;
+    // Records dropped from the head by a concurrent append while this message is being delivered are not popped twice
+    uint32_t dropped = _statesOutboxStats.dropped;
+    while (joined < _statesOutboxHeader.count) {
+      states_outbox_record_t* record = &_statesOutbox[(_statesOutboxHeader.head + joined) % CONFIG_STATES_NOTIFY_OUTBOX_SIZE];
+      size_t size = strlen(record->text);
+      if ((joined > 0) && ((record->msg_options != msg_options) || (len + 2 + size >= sizeof(_statesOutboxReplayText)))) break;
+      if (joined > 0) {
+        _statesOutboxReplayText[len++] = '\r';
+        _statesOutboxReplayText[len++] = '\n';
+      };
+      memcpy(&_statesOutboxReplayText[len], record->text, size);
+      len += size;
+      msg_options = record->msg_options;
+      joined++;
+    };
+    _statesOutboxReplayText[len] = 0;
+    xSemaphoreGive(_statesOutboxLock);
+    if ((joined == 0) || !statesNotifyDeliver(msg_options, _statesOutboxReplayText)) break;
+    if (xSemaphoreTake(_statesOutboxLock, portMAX_DELAY) != pdTRUE) break;
+    dropped = _statesOutboxStats.dropped - dropped;
+    if (dropped < joined) statesOutboxPopLocked(joined - dropped);
+    xSemaphoreGive(_statesOutboxLock);
+    replayed += joined;
+  };
+  __atomic_store_n(&_statesOutboxReplaying, false, __ATOMIC_RELEASE);
+  if (replayed > 0) {
+    _statesOutboxStats.replayed += replayed;
+    _statesOutboxStats.replay_time += esp_timer_get_time() - start;
+    rlog_i(logTAG, "Notification outbox: %d messages replayed", replayed);
+  };
+
+  if (afterRestart) {
+    for (uint8_t i = 0; i < SI_MAX; i++) {
+      time_t time_failure = 0;
+      if (xSemaphoreTake(_statesOutboxLock, portMAX_DELAY) == pdTRUE) {
+        time_failure = _statesOutboxHeader.incidents[i];
+        _statesOutboxHeader.incidents[i] = 0;
+        if (time_failure > 0) _statesOutboxDirty = true;
+        xSemaphoreGive(_statesOutboxLock);
+      };
+      if (time_failure > 0) {
+        char str_failure[CONFIG_FORMAT_STRFTIME_BUFFER_SIZE];
+        memset(&str_failure, 0, sizeof(str_failure));
+        struct tm tm_failure;
+        localtime_r(&time_failure, &tm_failure);
+        strftime(str_failure, sizeof(str_failure), CONFIG_FORMAT_DTS, &tm_failure);
+        char text[CONFIG_STATES_NOTIFY_OUTBOX_TEXT];
+        snprintf(text, sizeof(text), CONFIG_MESSAGE_TG_OUTBOX_INCIDENT, _statesIncidentNames[i], str_failure);
+        statesOutboxPost(encMsgOptions(MK_SERVICE, false, CONFIG_NOTIFY_TELEGRAM_OUTBOX_PRIORITY), text);
+      };
+    };
+    statesOutboxSchedule();
+  };
+}
+
+static void statesOutboxWriter(states_buf_t* buf, void* arg)
+{
+  if ((_statesOutboxLock == nullptr) || (xSemaphoreTake(_statesOutboxLock, portMAX_DELAY) != pdTRUE)) return;
+  statesBufPrintf(buf, "{\"pending\":%d,\"unsaved\":%d,\"appended\":%d,\"dropped\":%d,\"replayed\":%d,\"replay_us\":%lld,\"commits\":%d,\"payload\":%llu,\"written\":%llu,\"amplification\":%.2f}",
+    _statesOutboxHeader.count, _statesOutboxUnsaved, _statesOutboxStats.appended, _statesOutboxStats.dropped, 
+    _statesOutboxStats.replayed, _statesOutboxStats.replay_time, _statesOutboxStats.commits,
+    _statesOutboxStats.payload_bytes, _statesOutboxStats.written_bytes,
+    _statesOutboxStats.payload_bytes > 0 ? (float)_statesOutboxStats.written_bytes / (float)_statesOutboxStats.payload_bytes : 0.0f);
+  xSemaphoreGive(_statesOutboxLock);
+}
+
+size_t statesOutboxJsonTo(char* buffer, size_t size)
+{
+  return statesBufWrite(statesOutboxWriter, nullptr, buffer, size);
+}
+
+#if !CONFIG_STATES_ZERO_HEAP
+char* statesOutboxJson()
+{
+  if (_statesOutboxLock == nullptr) return nullptr;
+  return statesBufMalloc(statesOutboxWriter, nullptr);
+}
+#endif // CONFIG_STATES_ZERO_HEAP
+
+#endif // CONFIG_STATES_NOTIFY_OUTBOX
+
+// -- Digest -------------------------------------------------------------------------------------------------------------
+#if CONFIG_STATES_NOTIFY_DIGEST
+
+typedef struct {
+  uint32_t msg_options;
+  uint16_t repeats;
+  char     text[CONFIG_STATES_NOTIFY_DIGEST_TEXT];
+} states_digest_item_t;
+
+static states_digest_item_t _statesDigest[CONFIG_STATES_NOTIFY_DIGEST_SIZE];
+static uint8_t _statesDigestCount = 0;
+static SemaphoreHandle_t _statesDigestLock = nullptr;
+static esp_timer_handle_t _statesDigestTimer = nullptr;
+#if CONFIG_STATES_STATIC_ALLOCATION
+  static StaticSemaphore_t _statesDigestLockBuffer;
+#endif // CONFIG_STATES_STATIC_ALLOCATION
+#if CONFIG_STATES_ZERO_HEAP
+  static char _statesDigestText[STATES_NOTIFY_DIGEST_BUFFER];
+#endif // CONFIG_STATES_ZERO_HEAP
+
+// Sends all accumulated messages as one: the kind of the first message, the highest priority and the alert of any
+// Must be called under the lock
+static uint32_t statesDigestOptions()
+{
+  bool alert = false;
+  uint32_t priority = 0;
+  for (uint8_t i = 0; i < _statesDigestCount; i++) {
+    alert |= decMsgOptionsNotify(_statesDigest[i].msg_options);
+    if ((uint32_t)decMsgOptionsPriority(_statesDigest[i].msg_options) > priority) {
+      priority = (uint32_t)decMsgOptionsPriority(_statesDigest[i].msg_options);
+    };
+  };
+  return encMsgOptions(decMsgOptionsKind(_statesDigest[0].msg_options), alert, (msg_priority_t)priority);
+}
+
+static void statesDigestWriter(states_buf_t* buf, void* arg)
+{
+  for (uint8_t i = 0; i < _statesDigestCount; i++) {
+    statesBufPrintf(buf, i > 0 ? "\r\n%s" : "%s", _statesDigest[i].text);
+    if (_statesDigest[i].repeats > 1) {
+      statesBufPrintf(buf, " (x%d)", _statesDigest[i].repeats);
+    };
+  };
+}
+
+// Takes all accumulated messages out of the digest, must be called under the lock
+static char* statesDigestTake(uint32_t* msg_options)
+{
+  if (_statesDigestCount == 0) return nullptr;
+  *msg_options = statesDigestOptions();
+  #if CONFIG_STATES_ZERO_HEAP
+    statesBufWrite(statesDigestWriter, nullptr, _statesDigestText, sizeof(_statesDigestText));
+    char* digest = _statesDigestText;
+  #else
+    char* digest = statesBufMalloc(statesDigestWriter, nullptr);
+  #endif // CONFIG_STATES_ZERO_HEAP
+  _statesDigestCount = 0;
+  return digest;
+}
+
+// Sends the messages taken out by statesDigestTake() and releases the lock
+static void statesDigestSend(uint32_t msg_options, char* digest)
+{
+  #if !CONFIG_STATES_ZERO_HEAP
+    xSemaphoreGive(_statesDigestLock);
+  #endif // CONFIG_STATES_ZERO_HEAP
+
+  if (digest) {
+    #if CONFIG_STATES_NOTIFY_OUTBOX
+      statesOutboxPost(msg_options, digest);
+    #else
+      statesNotifyDeliver(msg_options, digest);
+    #endif // CONFIG_STATES_NOTIFY_OUTBOX
+  };
+
+  #if CONFIG_STATES_ZERO_HEAP
+    // The static buffer is released only after the message has been copied by the delivery
+    xSemaphoreGive(_statesDigestLock);
+  #else
+    if (digest) free(digest);
+  #endif // CONFIG_STATES_ZERO_HEAP
+}
+
+static void statesDigestFlush()
+{
+  if ((_statesDigestLock == nullptr) || (xSemaphoreTake(_statesDigestLock, portMAX_DELAY) != pdTRUE)) return;
+  uint32_t msg_options = 0;
+  char* digest = statesDigestTake(&msg_options);
+  statesDigestSend(msg_options, digest);
+}
+
+static void statesDigestTimerEnd(void* arg)
+{
+  statesDigestFlush();
+}
+
+static void statesDigestInit()
+{
+  if (_statesDigestLock == nullptr) {
+    #if CONFIG_STATES_STATIC_ALLOCATION
+      _statesDigestLock = xSemaphoreCreateMutexStatic(&_statesDigestLockBuffer);
+    #else
+      _statesDigestLock = xSemaphoreCreateMutex();
+    #endif // CONFIG_STATES_STATIC_ALLOCATION
+  };
+  if (_statesDigestTimer == nullptr) {
+    esp_timer_create_args_t cfgTimer;
+    memset(&cfgTimer, 0, sizeof(cfgTimer));
+    cfgTimer.callback = statesDigestTimerEnd;
+    cfgTimer.name = "tg_digest";
+    RE_OK_CHECK(esp_timer_create(&cfgTimer, &_statesDigestTimer), return);
+  };
+}
+
+static bool statesDigestAdd(uint32_t msg_options, const char* msg_template, ...)
+{
+  if ((_statesDigestLock == nullptr) || (_statesDigestTimer == nullptr)) return false;
+
+  char text[CONFIG_STATES_NOTIFY_DIGEST_TEXT];
+  va_list args;
+  va_start(args, msg_template);
+  vsnprintf(text, sizeof(text), msg_template, args);
+  va_end(args);
+
+  if (xSemaphoreTake(_statesDigestLock, portMAX_DELAY) != pdTRUE) return false;
+  // Identical messages are counted instead of being added again
+  states_digest_item_t* item = nullptr;
+  for (uint8_t i = 0; i < _statesDigestCount; i++) {
+    if ((_statesDigest[i].msg_options == msg_options) && (strcmp(_statesDigest[i].text, text) == 0)) {
+      item = &_statesDigest[i];
+      item->repeats++;
+      break;
+    };
+  };
+  if (item == nullptr) {
+    if (_statesDigestCount >= CONFIG_STATES_NOTIFY_DIGEST_SIZE) {
+      xSemaphoreGive(_statesDigestLock);
+      return false;
+    };
+    item = &_statesDigest[_statesDigestCount++];
+    item->msg_options = msg_options;
+    item->repeats = 1;
+    memcpy(item->text, text, sizeof(text));
+  };
+  // The window timer is started and stopped under the same lock as the accumulated messages,
+  // and a full digest is taken out before the lock is released, so no other caller can add past its end
+  if (_statesDigestCount >= CONFIG_STATES_NOTIFY_DIGEST_SIZE) {
+    if (esp_timer_is_active(_statesDigestTimer)) esp_timer_stop(_statesDigestTimer);
+    uint32_t digest_options = 0;
+    char* digest = statesDigestTake(&digest_options);
+    statesDigestSend(digest_options, digest);
+  } else {
+    if (!esp_timer_is_active(_statesDigestTimer)) {
+      esp_timer_start_once(_statesDigestTimer, (uint64_t)CONFIG_STATES_NOTIFY_DIGEST_WINDOW * 1000000);
+    };
+    xSemaphoreGive(_statesDigestLock);
+  };
+  return true;
+}
+
+#endif // CONFIG_STATES_NOTIFY_DIGEST
+
+// -- Rate limits --------------------------------------------------------------------------------------------------------
+// Delivery without the rate limits: the digest, the outbox, the backends or directly to telegram
+#if CONFIG_STATES_NOTIFY_DIGEST
+  #define statesTgSendMsgRaw(msg_options, title, msg_template, ...) statesDigestAdd(msg_options, msg_template, ##__VA_ARGS__)
+  #define statesTgSendRaw(msg_kind, msg_priority, msg_alert, title, msg_template, ...) statesDigestAdd(encMsgOptions(msg_kind, msg_alert, msg_priority), msg_template, ##__VA_ARGS__)
+#elif CONFIG_STATES_NOTIFY_OUTBOX
+  #define statesTgSendMsgRaw(msg_options, title, msg_template, ...) statesOutboxSend(msg_options, msg_template, ##__VA_ARGS__)
+  #define statesTgSendRaw(msg_kind, msg_priority, msg_alert, title, msg_template, ...) statesOutboxSend(encMsgOptions(msg_kind, msg_alert, msg_priority), msg_template, ##__VA_ARGS__)
+#elif CONFIG_STATES_NOTIFY_BACKENDS
+  #define statesTgSendMsgRaw(msg_options, title, msg_template, ...) statesBackendsSend(msg_options, msg_template, ##__VA_ARGS__)
+  #define statesTgSendRaw(msg_kind, msg_priority, msg_alert, title, msg_template, ...) statesBackendsSend(encMsgOptions(msg_kind, msg_alert, msg_priority), msg_template, ##__VA_ARGS__)
+#else
+  #define statesTgSendMsgRaw(...) tgSendMsg(__VA_ARGS__)
+  #define statesTgSendRaw(...) tgSend(__VA_ARGS__)
+#endif // CONFIG_STATES_NOTIFY_DIGEST
+
+#if CONFIG_STATES_NOTIFY_LIMITS
+
+// Burst (bucket capacity) and refill rate in messages per hour, 0 - unlimited
+#ifndef CONFIG_STATES_NOTIFY_LIMIT_BURST
+  #define CONFIG_STATES_NOTIFY_LIMIT_BURST 10
+#endif // CONFIG_STATES_NOTIFY_LIMIT_BURST
+#ifndef CONFIG_STATES_NOTIFY_LIMIT_RATE
+  #define CONFIG_STATES_NOTIFY_LIMIT_RATE 30
+#endif // CONFIG_STATES_NOTIFY_LIMIT_RATE
+#ifndef CONFIG_STATES_NOTIFY_LIMIT_SUMMARY
+  #define CONFIG_STATES_NOTIFY_LIMIT_SUMMARY 60
+#endif // CONFIG_STATES_NOTIFY_LIMIT_SUMMARY
+#ifndef CONFIG_NOTIFY_TELEGRAM_LIMITS_PRIORITY
+  #if defined(CONFIG_NOTIFY_TELEGRAM_MQTT_ERRORS_PRIORITY)
+    #define CONFIG_NOTIFY_TELEGRAM_LIMITS_PRIORITY CONFIG_NOTIFY_TELEGRAM_MQTT_ERRORS_PRIORITY
+  #else
+    #define CONFIG_NOTIFY_TELEGRAM_LIMITS_PRIORITY 0
+  #endif // CONFIG_NOTIFY_TELEGRAM_MQTT_ERRORS_PRIORITY
+#endif // CONFIG_NOTIFY_TELEGRAM_LIMITS_PRIORITY
+// Suppressed recovery notices are kept and sent later, when the service channel has tokens again
+#ifndef CONFIG_STATES_NOTIFY_LIMIT_DEFERRED
+  #define CONFIG_STATES_NOTIFY_LIMIT_DEFERRED 4
+#endif // CONFIG_STATES_NOTIFY_LIMIT_DEFERRED
+#ifndef CONFIG_STATES_NOTIFY_LIMIT_DEFERRED_TEXT
+  #define CONFIG_STATES_NOTIFY_LIMIT_DEFERRED_TEXT 256
+#endif // CONFIG_STATES_NOTIFY_LIMIT_DEFERRED_TEXT
+#ifndef CONFIG_MESSAGE_TG_NOTIFY_SUPPRESSED
+  #define CONFIG_MESSAGE_TG_NOTIFY_SUPPRESSED "📵 <i>%d notifications suppressed</i> (service: %d, sensors: %d, mqtt: %d, start: %d)"
+#endif // CONFIG_MESSAGE_TG_NOTIFY_SUPPRESSED
+
+// The limits are the same for all contexts, each context has its own buckets
+static uint8_t  _statesNotifyBurst[SN_MAX] = { CONFIG_STATES_NOTIFY_LIMIT_BURST, CONFIG_STATES_NOTIFY_LIMIT_BURST, CONFIG_STATES_NOTIFY_LIMIT_BURST, 3 };
+static uint16_t _statesNotifyRate[SN_MAX] = { CONFIG_STATES_NOTIFY_LIMIT_RATE, CONFIG_STATES_NOTIFY_LIMIT_RATE, CONFIG_STATES_NOTIFY_LIMIT_RATE, 6 };
+static uint32_t _statesNotifySummaryTime = 0;
+static portMUX_TYPE _statesNotifyLock = portMUX_INITIALIZER_UNLOCKED;
+
+// The start bucket survives software restarts, otherwise a restart loop would get a fresh burst on every boot.
+// Only the uptime refills it: the time spent in restarts is not counted
+#define STATES_NOTIFY_START_MAGIC 0x31534E53U  // "SNS1"
+
+typedef struct {
+  uint32_t magic;
+  states_notify_bucket_t bucket;
+} states_notify_start_rtc_t;
+
+RTC_NOINIT_ATTR static states_notify_start_rtc_t _statesNotifyStart;
+static bool _statesNotifyStartLoaded = false;
+
+typedef struct {
+  uint32_t msg_options;
+  char     text[CONFIG_STATES_NOTIFY_LIMIT_DEFERRED_TEXT];
+} states_notify_deferred_t;
+
+static states_notify_deferred_t _statesNotifyDeferred[CONFIG_STATES_NOTIFY_LIMIT_DEFERRED];
+static uint8_t _statesNotifyDeferredCount = 0;
+
+// Must be called under the lock
+static states_notify_bucket_t* statesNotifyBucket(re_states_ctx_t* ctx, states_notify_channel_t channel, int64_t now)
+{
+  if ((channel != SN_START) || !statesCtxIsDefault(ctx)) return &ctx->notify[channel];
+  if (!_statesNotifyStartLoaded) {
+    _statesNotifyStartLoaded = true;
+    states_notify_bucket_t* bucket = &_statesNotifyStart.bucket;
+    if ((_statesNotifyStart.magic == STATES_NOTIFY_START_MAGIC) && (bucket->tokens >= 0.0f) && (bucket->tokens <= _statesNotifyBurst[SN_START])) {
+      // The timer has been restarted along with the device, only the tokens are kept
+      bucket->updated = now;
+    } else {
+      memset(&_statesNotifyStart, 0, sizeof(_statesNotifyStart));
+      _statesNotifyStart.magic = STATES_NOTIFY_START_MAGIC;
+    };
+    bucket->sent = 0;
+    bucket->suppressed = 0;
+  };
+  return &_statesNotifyStart.bucket;
+}
+
+// Refill the bucket in proportion to the elapsed time, must be called under the lock
+static void statesNotifyRefill(states_notify_channel_t channel, states_notify_bucket_t* bucket, int64_t now)
+{
+  if (bucket->updated == 0) {
+    bucket->tokens = _statesNotifyBurst[channel];
+  } else {
+    bucket->tokens += (float)(now - bucket->updated) * _statesNotifyRate[channel] / 3600000000.0f;
+    if (bucket->tokens > _statesNotifyBurst[channel]) bucket->tokens = _statesNotifyBurst[channel];
+  };
+  bucket->updated = now;
+}
+
+static bool statesNotifyTake(re_states_ctx_t* ctx, states_notify_channel_t channel, bool count_suppressed)
+{
+  bool ret = true;
+  int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&_statesNotifyLock);
+  states_notify_bucket_t* bucket = statesNotifyBucket(ctx, channel, now);
+  if ((_statesNotifyBurst[channel] > 0) && (_statesNotifyRate[channel] > 0)) {
+    statesNotifyRefill(channel, bucket, now);
+    if (bucket->tokens >= 1.0f) {
+      bucket->tokens -= 1.0f;
+    } else {
+      ret = false;
+    };
+  };
+  if (ret) {
+    bucket->sent++;
+  } else if (count_suppressed) {
+    bucket->suppressed++;
+  };
+  portEXIT_CRITICAL(&_statesNotifyLock);
+  return ret;
+}
+
+static bool statesNotifyAllowed(states_notify_channel_t channel)
+{
+  return statesNotifyTake(&_statesDefault, channel, true);
+}
+
+// Sends deferred recovery notices in the order they were received, while the service channel has tokens
+static void statesNotifyDeferredFlush()
+{
+  states_notify_deferred_t item;
+  while (__atomic_load_n(&_statesNotifyDeferredCount, __ATOMIC_RELAXED) > 0) {
+    if (!statesNotifyTake(&_statesDefault, SN_SERVICE, false)) break;
+    bool found = false;
+    portENTER_CRITICAL(&_statesNotifyLock);
+    if (_statesNotifyDeferredCount > 0) {
+      found = true;
+      memcpy(&item, &_statesNotifyDeferred[0], sizeof(item));
+      _statesNotifyDeferredCount--;
+      memmove(&_statesNotifyDeferred[0], &_statesNotifyDeferred[1], _statesNotifyDeferredCount * sizeof(states_notify_deferred_t));
+    };
+    portEXIT_CRITICAL(&_statesNotifyLock);
+    if (!found) break;
+    statesTgSendMsgRaw(item.msg_options, CONFIG_TELEGRAM_DEVICE, "%s", item.text);
+  };
+}
+
+// The recovery notice is deferred instead of being dropped when the service channel is out of tokens
+static bool statesNotifyRecovery(uint32_t msg_options, const char* text)
+{
+  bool deferred = false;
+  portENTER_CRITICAL(&_statesNotifyLock);
+  // Earlier deferred notices must be sent first
+  bool pending = _statesNotifyDeferredCount > 0;
+  portEXIT_CRITICAL(&_statesNotifyLock);
+  if (pending || !statesNotifyTake(&_statesDefault, SN_SERVICE, false)) {
+    deferred = true;
+    portENTER_CRITICAL(&_statesNotifyLock);
+    if (_statesNotifyDeferredCount >= CONFIG_STATES_NOTIFY_LIMIT_DEFERRED) {
+      // The oldest notice is dropped
+      _statesNotifyDeferredCount--;
+      memmove(&_statesNotifyDeferred[0], &_statesNotifyDeferred[1], _statesNotifyDeferredCount * sizeof(states_notify_deferred_t));
+      _statesDefault.notify[SN_SERVICE].suppressed++;
+    };
+    states_notify_deferred_t* item = &_statesNotifyDeferred[_statesNotifyDeferredCount++];
+    item->msg_options = msg_options;
+    strncpy(item->text, text, sizeof(item->text) - 1);
+    item->text[sizeof(item->text) - 1] = 0;
+    portEXIT_CRITICAL(&_statesNotifyLock);
+  };
+  if (deferred) {
+    if (pending) statesNotifyDeferredFlush();
+    return true;
+  };
+  return statesTgSendMsgRaw(msg_options, CONFIG_TELEGRAM_DEVICE, "%s", text);
+}
+
+// Called every minute, reports the number of dropped messages no more often than once per CONFIG_STATES_NOTIFY_LIMIT_SUMMARY minutes
+static void statesNotifySummary()
+{
+  // The buckets are refilled every minute, so the start bucket keeps the uptime credit over a restart
+  int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&_statesNotifyLock);
+  for (uint8_t i = 0; i < SN_MAX; i++) {
+    states_notify_bucket_t* bucket = statesNotifyBucket(&_statesDefault, (states_notify_channel_t)i, now);
+    if ((_statesNotifyBurst[i] > 0) && (_statesNotifyRate[i] > 0)) {
+      statesNotifyRefill((states_notify_channel_t)i, bucket, now);
+    };
+  };
+  portEXIT_CRITICAL(&_statesNotifyLock);
+  statesNotifyDeferredFlush();
+
+  if (++_statesNotifySummaryTime < CONFIG_STATES_NOTIFY_LIMIT_SUMMARY) return;
+
+  uint32_t suppressed[SN_MAX];
+  uint32_t total = 0;
+  portENTER_CRITICAL(&_statesNotifyLock);
+  for (uint8_t i = 0; i < SN_MAX; i++) {
+    states_notify_bucket_t* bucket = statesNotifyBucket(&_statesDefault, (states_notify_channel_t)i, 0);
+    suppressed[i] = bucket->suppressed;
+    bucket->suppressed = 0;
+    total += suppressed[i];
+  };
+  portEXIT_CRITICAL(&_statesNotifyLock);
+
+  if (total > 0) {
+    _statesNotifySummaryTime = 0;
+    rlog_w(logTAG, "Notifications suppressed: %d", total);
+    statesNotifySend(MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_LIMITS_PRIORITY, false, CONFIG_TELEGRAM_DEVICE, 
+      CONFIG_MESSAGE_TG_NOTIFY_SUPPRESSED, total, suppressed[SN_SERVICE], suppressed[SN_SENSOR], suppressed[SN_MQTT_ERRORS], suppressed[SN_START]);
+  };
+}
+
+  #define STATES_NOTIFY_ALLOWED(channel) statesNotifyAllowed(channel)
+#else
+  #define STATES_NOTIFY_ALLOWED(channel) true
+#endif // CONFIG_STATES_NOTIFY_LIMITS
+
+#if CONFIG_STATES_NOTIFY_OUTBOX
+// The replayed messages are service notifications; when there are no tokens left, they wait in the outbox
+static bool statesNotifyReplayAllowed()
+{
+  #if CONFIG_STATES_NOTIFY_LIMITS
+    return statesNotifyTake(&_statesDefault, SN_SERVICE, false);
+  #else
+    return true;
+  #endif // CONFIG_STATES_NOTIFY_LIMITS
+}
+#endif // CONFIG_STATES_NOTIFY_OUTBOX
+
+#define statesTgSendMsg(channel, ...) (!STATES_STRESS_MUTED && STATES_NOTIFY_ALLOWED(channel) && statesTgSendMsgRaw(__VA_ARGS__))
+#define statesTgSend(channel, ...) (!STATES_STRESS_MUTED && STATES_NOTIFY_ALLOWED(channel) && statesTgSendRaw(__VA_ARGS__))
+
+// -- Contexts ----------------------------------------------------------------------------------------------------------
+// Notifications of an additional context never reach the delivery of the device: they pass the rate limits 
+// of that context and go to its on_notify callback
+#ifndef CONFIG_STATES_CTX_NOTIFY_TEXT
+  #define CONFIG_STATES_CTX_NOTIFY_TEXT 256
+#endif // CONFIG_STATES_CTX_NOTIFY_TEXT
+
+static bool statesCtxNotifySend(re_states_ctx_t* ctx, states_notify_channel_t channel, uint32_t msg_options, const char* msg_template, ...)
+{
+  if (ctx->on_notify == nullptr) return false;
+  #if CONFIG_STATES_NOTIFY_LIMITS
+    if (!statesNotifyTake(ctx, channel, true)) return false;
+  #endif // CONFIG_STATES_NOTIFY_LIMITS
+  char text[CONFIG_STATES_CTX_NOTIFY_TEXT];
+  va_list args;
+  va_start(args, msg_template);
+  vsnprintf(text, sizeof(text), msg_template, args);
+  va_end(args);
+  return ctx->on_notify(ctx, channel, msg_options, text, ctx->arg);
+}
+
+#define statesCtxTgSendMsg(ctx, channel, msg_options, title, msg_template, ...) (statesCtxIsDefault(ctx) \
+  ? statesTgSendMsg(channel, msg_options, title, msg_template, ##__VA_ARGS__) \
+  : statesCtxNotifySend(ctx, channel, msg_options, msg_template, ##__VA_ARGS__))
+#define statesCtxTgSend(ctx, channel, msg_kind, msg_priority, msg_alert, title, msg_template, ...) (statesCtxIsDefault(ctx) \
+  ? statesTgSend(channel, msg_kind, msg_priority, msg_alert, title, msg_template, ##__VA_ARGS__) \
+  : statesCtxNotifySend(ctx, channel, encMsgOptions(msg_kind, msg_alert, msg_priority), msg_template, ##__VA_ARGS__))
+
+// -- Formatting --------------------------------------------------------------------------------------------------------
+
+// HTTP status codes are reported by the senders as 0x7000 + status (matches ESP_ERR_HTTP_BASE)
+#define STATES_HTTP_ERR_BASE 0x7000
+
+typedef struct {
+  esp_err_t code;
+  const char* text;
+} states_err_text_t;
+
+// Must be sorted by code
+static constexpr states_err_text_t _statesErrTexts[] = {
+  { ESP_FAIL,                       "ESP_FAIL" },
+  { ESP_OK,                         "ESP_OK" },
+  { ESP_ERR_NO_MEM,                 "ESP_ERR_NO_MEM" },
+  { ESP_ERR_INVALID_ARG,            "ESP_ERR_INVALID_ARG" },
+  { ESP_ERR_INVALID_STATE,          "ESP_ERR_INVALID_STATE" },
+  { ESP_ERR_INVALID_SIZE,           "ESP_ERR_INVALID_SIZE" },
+  { ESP_ERR_NOT_FOUND,              "ESP_ERR_NOT_FOUND" },
+  { ESP_ERR_NOT_SUPPORTED,          "ESP_ERR_NOT_SUPPORTED" },
+  { ESP_ERR_TIMEOUT,                "ESP_ERR_TIMEOUT" },
+  { ESP_ERR_INVALID_RESPONSE,       "ESP_ERR_INVALID_RESPONSE" },
+  { ESP_ERR_INVALID_CRC,            "ESP_ERR_INVALID_CRC" },
+  { ESP_ERR_INVALID_VERSION,        "ESP_ERR_INVALID_VERSION" },
+  { ESP_ERR_INVALID_MAC,            "ESP_ERR_INVALID_MAC" },
+  { ESP_ERR_NOT_FINISHED,           "ESP_ERR_NOT_FINISHED" },
+  { STATES_HTTP_ERR_BASE + 300,        "Multiple Choices" },
+  { STATES_HTTP_ERR_BASE + 301,        "Moved Permanently" },
+  { STATES_HTTP_ERR_BASE + 302,        "Moved Temporarily" },
+  { STATES_HTTP_ERR_BASE + 307,        "Temporary Redirect" },
+  { STATES_HTTP_ERR_BASE + 308,        "Permanent Redirect" },
+  { STATES_HTTP_ERR_BASE + 400,        "Bad Request" },
+  { STATES_HTTP_ERR_BASE + 401,        "Unauthorized" },
+  { STATES_HTTP_ERR_BASE + 403,        "Forbidden" },
+  { STATES_HTTP_ERR_BASE + 404,        "Not Found" },
+  { STATES_HTTP_ERR_BASE + 408,        "Request Timeout" },
+  { STATES_HTTP_ERR_BASE + 429,        "Too Many Requests" },
+  { STATES_HTTP_ERR_BASE + 431,        "Request Header Fields Too Large" },
+  { STATES_HTTP_ERR_BASE + 500,        "Internal Server Error" },
+  { STATES_HTTP_ERR_BASE + 501,        "Not Implemented" },
+  { STATES_HTTP_ERR_BASE + 502,        "Bad Gateway" },
+  { STATES_HTTP_ERR_BASE + 503,        "Service Unavailable" },
+  { STATES_HTTP_ERR_BASE + 504,        "Gateway Timeout" },
+};
+static constexpr size_t _statesErrTextsCount = sizeof(_statesErrTexts) / sizeof(_statesErrTexts[0]);
+
+static constexpr bool statesErrTextsSorted(size_t index)
+{
+  return (index >= _statesErrTextsCount) || ((_statesErrTexts[index-1].code < _statesErrTexts[index].code) && statesErrTextsSorted(index + 1));
+}
+static_assert(statesErrTextsSorted(1), "_statesErrTexts must be sorted by code");
+
+// Returns the error description and the code to display (HTTP status for the HTTP range)
+static const char* statesErrorText(esp_err_t state, uint32_t* err_code)
+{
+  *err_code = ((state > STATES_HTTP_ERR_BASE + 100) && (state < 0x8000)) ? state - STATES_HTTP_ERR_BASE : state;
+  size_t lo = 0;
+  size_t hi = _statesErrTextsCount;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (_statesErrTexts[mid].code == state) {
+      return _statesErrTexts[mid].text;
+    } else if (_statesErrTexts[mid].code < state) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    };
+  };
+  return esp_err_to_name(state);
+}
+
+// Failure and recovery times of the same incident are formatted over and over again, so the last two results are kept
+typedef struct {
+  time_t time;
+  char text[CONFIG_FORMAT_STRFTIME_BUFFER_SIZE];
+} states_time_cache_t;
+
+static states_time_cache_t _statesTimeCache[2];
+static uint8_t _statesTimeCacheNext = 0;
+static portMUX_TYPE _statesTimeCacheLock = portMUX_INITIALIZER_UNLOCKED;
+
+static void statesFormatTime(time_t value, char* buffer, size_t size)
+{
+  bool found = false;
+  portENTER_CRITICAL(&_statesTimeCacheLock);
+  for (uint8_t i = 0; i < 2; i++) {
+    if ((_statesTimeCache[i].time == value) && (_statesTimeCache[i].text[0] != 0)) {
+      strncpy(buffer, _statesTimeCache[i].text, size - 1);
+      found = true;
+      break;
+    };
+  };
+  portEXIT_CRITICAL(&_statesTimeCacheLock);
+  if (found) return;
+
+  struct tm timeinfo;
+  localtime_r(&value, &timeinfo);
+  strftime(buffer, size, CONFIG_FORMAT_DTS, &timeinfo);
+
+  portENTER_CRITICAL(&_statesTimeCacheLock);
+  states_time_cache_t* slot = &_statesTimeCache[_statesTimeCacheNext];
+  _statesTimeCacheNext ^= 1;
+  slot->time = value;
+  strncpy(slot->text, buffer, sizeof(slot->text) - 1);
+  portEXIT_CRITICAL(&_statesTimeCacheLock);
+}
+
+// -- Notify ------------------------------------------------------------------------------------------------------------
+
+// Notification callback for the monitors of a context; the monitors of the default context use healthMonitorNotify()
+bool statesCtxHealthMonitorNotify(re_states_ctx_t* ctx, hm_notify_data_t *notify_data)
+{
+  if ((ctx != nullptr) && (notify_data != nullptr) && !(statesCtxIsDefault(ctx) && STATES_STRESS_MUTED)) {
+    // Format failure start time
+    char str_failure[CONFIG_FORMAT_STRFTIME_BUFFER_SIZE];
+    memset(&str_failure, 0, sizeof(str_failure));
+    statesFormatTime(notify_data->time_failure, str_failure, sizeof(str_failure));
+    
+    if (notify_data->state == ESP_OK) {
+      // Format failure end time
+      char str_recovery[CONFIG_FORMAT_STRFTIME_BUFFER_SIZE];
+      memset(&str_recovery, 0, sizeof(str_recovery));
+      statesFormatTime(notify_data->time_state, str_recovery, sizeof(str_recovery));
+
+      // Format failure duration time
+      time_t failure_duration = notify_data->time_state - notify_data->time_failure;
+      uint16_t duration_h = failure_duration / 3600;
+      uint16_t duration_m = failure_duration % 3600 / 60;
+      uint16_t duration_s = failure_duration % 3600 % 60;
+
+      // Send notify
+      if (notify_data->msg_template) {
+        #if CONFIG_STATES_NOTIFY_LIMITS
+          // Recovery notices of the device are deferred rather than dropped by the limits
+          if (statesCtxIsDefault(ctx)) {
+            char text[CONFIG_STATES_NOTIFY_LIMIT_DEFERRED_TEXT];
+            if (notify_data->object == nullptr) {
+              snprintf(text, sizeof(text), notify_data->msg_template, str_failure, str_recovery, duration_h, duration_m, duration_s);
+            } else {
+              snprintf(text, sizeof(text), notify_data->msg_template, notify_data->object, str_failure, str_recovery, duration_h, duration_m, duration_s);
+            };
+            return statesNotifyRecovery(notify_data->msg_options, text);
+          };
+        #endif // CONFIG_STATES_NOTIFY_LIMITS
+        if (notify_data->object == nullptr) {
+          return statesCtxTgSendMsg(ctx, SN_SERVICE, notify_data->msg_options, CONFIG_TELEGRAM_DEVICE, notify_data->msg_template, 
+            str_failure, str_recovery, duration_h, duration_m, duration_s);
+        } else {
+          return statesCtxTgSendMsg(ctx, SN_SERVICE, notify_data->msg_options, CONFIG_TELEGRAM_DEVICE, notify_data->msg_template, notify_data->object, 
+            str_failure, str_recovery, duration_h, duration_m, duration_s);
+        };
+      };
+    } else {
+      // Send notify
+      if (notify_data->msg_template) {
+        uint32_t err_code;
+        const char* err_text = statesErrorText(notify_data->state, &err_code);
+        if (notify_data->object == nullptr) {
+          return statesCtxTgSendMsg(ctx, SN_SERVICE, notify_data->msg_options, CONFIG_TELEGRAM_DEVICE, notify_data->msg_template, 
+            notify_data->state, err_code, err_text, str_failure);
+        } else {
+          return statesCtxTgSendMsg(ctx, SN_SERVICE, notify_data->msg_options, CONFIG_TELEGRAM_DEVICE, notify_data->msg_template, notify_data->object, 
+            notify_data->state, err_code, err_text, str_failure);
+        };
+      };
+    };
+  };
+  return false;
+}
+
+static bool healthMonitorNotify(hm_notify_data_t *notify_data)
+{
+  return statesCtxHealthMonitorNotify(&_statesDefault, notify_data);
+}
+
+// Monitors with a variable object (server, network) keep it in static memory and pass it only to the notification,
+// so that no string has to be allocated and handed over to the monitor on every event
+static bool healthMonitorNotifyObject(hm_notify_data_t *notify_data, const char* object)
+{
+  if ((notify_data != nullptr) && (notify_data->object == nullptr) && (object != nullptr) && (object[0] != 0)) {
+    notify_data->object = (char*)object;
+    bool ret = healthMonitorNotify(notify_data);
+    notify_data->object = nullptr;
+    return ret;
+  };
+  return healthMonitorNotify(notify_data);
+}
+
+// --- WiFi --------------------------------------------------------------------------------------------------------------
+#if !defined(CONFIG_WIFI_ENABLED) || (CONFIG_WIFI_ENABLED == 1)
+  #if ENABLE_NOTIFY_WIFI_STATUS
+    
+    // SSID of the last connection (up to 32 characters)
+    static char _statesWifiObject[33];
+
+    static bool healthMonitorNotifyWifi(hm_notify_data_t *notify_data)
+    {
+      return healthMonitorNotifyObject(notify_data, _statesWifiObject);
+    }
+
+    reHealthMonitor hmWifi(nullptr, HM_RECOVERY, 
+      encMsgOptions(MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_ALERT_WIFI_STATUS, CONFIG_NOTIFY_TELEGRAM_WIFI_PRIORITY), 
+      CONFIG_MESSAGE_TG_WIFI_AVAILABLE, nullptr, CONFIG_NOTIFY_TELEGRAM_WIFI_THRESOLD, healthMonitorNotifyWifi);
+
+  #endif // ENABLE_NOTIFY_WIFI_STATUS
+#endif // CONFIG_WIFI_ENABLED
+
+// --- Ethernet ----------------------------------------------------------------------------------------------------------
+#if defined(CONFIG_ETH_ENABLED) && (CONFIG_ETH_ENABLED == 1)
+  #if ENABLE_NOTIFY_ETH_STATUS
+    
+    reHealthMonitor hmEthernet(nullptr, HM_RECOVERY, 
+      encMsgOptions(MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_ALERT_ETH_STATUS, CONFIG_NOTIFY_TELEGRAM_ETH_PRIORITY), 
+      CONFIG_MESSAGE_TG_ETH_AVAILABLE, nullptr, CONFIG_NOTIFY_TELEGRAM_ETH_THRESOLD, healthMonitorNotify);
+
+  #endif // ENABLE_NOTIFY_ETH_STATUS
+#endif // CONFIG_ETH_ENABLED
+
+// --- Ping --------------------------------------------------------------------------------------------------------------
+#if ENABLE_NOTIFY_INET_STATUS
+
+  reHealthMonitor hmInet(nullptr, HM_AUTO, 
+    encMsgOptions(MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_ALERT_INET_UNAVAILABLE, CONFIG_NOTIFY_TELEGRAM_INET_PRIORITY), 
+    CONFIG_MESSAGE_TG_INET_AVAILABLE, CONFIG_MESSAGE_TG_INET_UNAVAILABLE, CONFIG_NOTIFY_TELEGRAM_INET_THRESOLD, healthMonitorNotify);
+
+#endif // ENABLE_NOTIFY_INET_STATUS
+
+// --  MQTT --------------------------------------------------------------------------------------------------------------
+#if ENABLE_NOTIFY_MQTT_STATUS
+
+  // "host:port" of each server (primary / reserved, each with an optional local address) is formatted only when it changes
+  typedef struct {
+    uint32_t port;
+    char host[sizeof(((re_mqtt_event_data_t*)nullptr)->host)];
+    char text[sizeof(((re_mqtt_event_data_t*)nullptr)->host) + 8];
+  } states_mqtt_server_t;
+
+  static states_mqtt_server_t _statesMqttServers[4];
+  // Points to the cached text of the server of the last event
+  static const char* _statesMqttObject = nullptr;
+
+  static bool healthMonitorNotifyMqtt(hm_notify_data_t *notify_data)
+  {
+    return healthMonitorNotifyObject(notify_data, _statesMqttObject);
+  }
+
+  reHealthMonitor hmMqtt(nullptr, HM_AUTO, 
+    encMsgOptions(MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_ALERT_MQTT_STATUS, CONFIG_NOTIFY_TELEGRAM_MQTT_PRIORITY),
+    CONFIG_MESSAGE_TG_MQTT_CONN_OK, CONFIG_MESSAGE_TG_MQTT_CONN_LOST, CONFIG_NOTIFY_TELEGRAM_MQTT_THRESOLD, healthMonitorNotifyMqtt);
+
+  static const char* statesMqttServerName(re_mqtt_event_data_t* data)
+  {
+    states_mqtt_server_t* server = &_statesMqttServers[(data->primary ? 0 : 2) + (data->local ? 1 : 0)];
+    if ((server->text[0] == 0) || (server->port != data->port) || (strncmp(server->host, data->host, sizeof(server->host)) != 0)) {
+      server->port = data->port;
+      strncpy(server->host, data->host, sizeof(server->host) - 1);
+      server->host[sizeof(server->host) - 1] = 0;
+      snprintf(server->text, sizeof(server->text), "%s:%d", server->host, server->port);
+    };
+    return server->text;
+  }
+
+  #if ENABLE_NOTIFY_MQTT1_PING
+    reHealthMonitor hmMqttPing1(CONFIG_MQTT1_HOST, HM_AUTO, 
+      encMsgOptions(MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_ALERT_MQTT_STATUS, CONFIG_NOTIFY_TELEGRAM_MQTT_PRIORITY),
+      CONFIG_MESSAGE_TG_HOST_AVAILABLE, CONFIG_MESSAGE_TG_HOST_UNAVAILABLE, CONFIG_NOTIFY_TELEGRAM_MQTT_PING_THRESOLD, healthMonitorNotify);
+  #endif // ENABLE_NOTIFY_MQTT1_PING
+
+  #if ENABLE_NOTIFY_MQTT2_PING
+    reHealthMonitor hmMqttPing2(CONFIG_MQTT2_HOST, HM_AUTO, 
+      encMsgOptions(MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_ALERT_MQTT_STATUS, CONFIG_NOTIFY_TELEGRAM_MQTT_PRIORITY),
+      CONFIG_MESSAGE_TG_HOST_AVAILABLE, CONFIG_MESSAGE_TG_HOST_UNAVAILABLE, CONFIG_NOTIFY_TELEGRAM_MQTT_PING_THRESOLD, healthMonitorNotify);
+  #endif // ENABLE_NOTIFY_MQTT2_PING
+#endif // ENABLE_NOTIFY_MQTT_STATUS
+
+// -- OpenMon ------------------------------------------------------------------------------------------------------------
+#if ENABLE_NOTIFY_OPENMON_STATUS
+
+  reHealthMonitor hmOpenMon("open-monitoring.online", HM_AUTO,
+    encMsgOptions(MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_ALERT_OPENMON_STATUS, CONFIG_NOTIFY_TELEGRAM_OPENMON_PRIORITY),
+    CONFIG_MESSAGE_TG_HOST_AVAILABLE, CONFIG_MESSAGE_TG_HOST_UNAVAILABLE, CONFIG_NOTIFY_TELEGRAM_OPENMON_THRESOLD, healthMonitorNotify);
+
+#endif // ENABLE_NOTIFY_OPENMON_STATUS
+
+// -- NarodMon -----------------------------------------------------------------------------------------------------------
+#if ENABLE_NOTIFY_NARODMON_STATUS
+
+  reHealthMonitor hmNarodMon("narodmon.ru", HM_AUTO, 
+    encMsgOptions(MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_ALERT_NARODMON_STATUS, CONFIG_NOTIFY_TELEGRAM_NARODMON_PRIORITY),
+    CONFIG_MESSAGE_TG_HOST_AVAILABLE, CONFIG_MESSAGE_TG_HOST_UNAVAILABLE, CONFIG_NOTIFY_TELEGRAM_NARODMON_THRESOLD, healthMonitorNotify);
+
+#endif // ENABLE_NOTIFY_NARODMON_STATUS
+
+// --  ThingSpeak --------------------------------------------------------------------------------------------------------
+#if ENABLE_NOTIFY_THINGSPEAK_STATUS
+
+  reHealthMonitor hmThingSpeak("thingspeak.com", HM_AUTO,
+    encMsgOptions(MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_ALERT_THINGSPEAK_STATUS, CONFIG_NOTIFY_TELEGRAM_THINGSPEAK_PRIORITY),
+    CONFIG_MESSAGE_TG_HOST_AVAILABLE, CONFIG_MESSAGE_TG_HOST_UNAVAILABLE, CONFIG_NOTIFY_TELEGRAM_THINGSPEAK_THRESOLD, healthMonitorNotify);
+
+#endif // ENABLE_NOTIFY_THINGSPEAK_STATUS
+
+#if CONFIG_STATES_NOTIFY_OUTBOX
+// Open failures would be forgotten on restart along with the monitors, so their start times are kept in the outbox
+static void healthMonitorsSaveIncidents()
+{
+  // Until the saved incidents are replayed, the fresh monitors know nothing about them
+  if (!statesCheck(SYSTEM_STARTED, false)) return;
+  #if ENABLE_NOTIFY_INET_STATUS
+    statesOutboxSetIncident(SI_INET, hmInet.getState() == ESP_OK ? 0 : hmInet.getTimeFailure());
+  #endif // ENABLE_NOTIFY_INET_STATUS
+  #if ENABLE_NOTIFY_MQTT_STATUS
+    statesOutboxSetIncident(SI_MQTT, hmMqtt.getState() == ESP_OK ? 0 : hmMqtt.getTimeFailure());
+  #endif // ENABLE_NOTIFY_MQTT_STATUS
+}
+#endif // CONFIG_STATES_NOTIFY_OUTBOX
+
+#if CONFIG_STATES_RTC_SNAPSHOT
+// Open failures are kept in the RTC snapshot, so that after a warm start the outage is reported from its real beginning
+static void healthMonitorsSnapshot()
+{
+  if (!statesCheck(SYSTEM_STARTED, false)) return;
+  time_t inet_failure = 0;
+  time_t mqtt_failure = 0;
+  #if ENABLE_NOTIFY_INET_STATUS
+    if (hmInet.getState() != ESP_OK) inet_failure = hmInet.getTimeFailure();
+  #endif // ENABLE_NOTIFY_INET_STATUS
+  #if ENABLE_NOTIFY_MQTT_STATUS
+    if (hmMqtt.getState() != ESP_OK) mqtt_failure = hmMqtt.getTimeFailure();
+  #endif // ENABLE_NOTIFY_MQTT_STATUS
+  statesSnapshotSetFailures(inet_failure, mqtt_failure);
+}
+
+static void healthMonitorsRestore()
+{
+  states_snapshot_t snapshot;
+  if (statesSnapshotGet(&snapshot)) {
+    #if ENABLE_NOTIFY_INET_STATUS
+      if (snapshot.inet_failure > 0) hmInet.setState(ESP_ERR_TIMEOUT, snapshot.inet_failure);
+    #endif // ENABLE_NOTIFY_INET_STATUS
+    #if ENABLE_NOTIFY_MQTT_STATUS
+      if (snapshot.mqtt_failure > 0) hmMqtt.setState(ESP_ERR_INVALID_STATE, snapshot.mqtt_failure);
+    #endif // ENABLE_NOTIFY_MQTT_STATUS
+  };
+}
+#endif // CONFIG_STATES_RTC_SNAPSHOT
+
+// -- Registry -----------------------------------------------------------------------------------------------------------
+static void healthMonitorsInit()
+{
+  #if !defined(CONFIG_WIFI_ENABLED) || (CONFIG_WIFI_ENABLED == 1)
     #if ENABLE_NOTIFY_WIFI_STATUS
-      if (setWifiState) {
-        hmWifi.setStateCustom(ESP_OK, time(nullptr), true, malloc_string(wifiGetSSID()));
+      statesCtxHealthMonitorAssign(&_statesDefault, SHM_WIFI, &hmWifi);
+    #endif // ENABLE_NOTIFY_WIFI_STATUS
+  #endif // CONFIG_WIFI_ENABLED
+  #if defined(CONFIG_ETH_ENABLED) && (CONFIG_ETH_ENABLED == 1)
+    #if ENABLE_NOTIFY_ETH_STATUS
+      statesCtxHealthMonitorAssign(&_statesDefault, SHM_ETHERNET, &hmEthernet);
+    #endif // ENABLE_NOTIFY_ETH_STATUS
+  #endif // CONFIG_ETH_ENABLED
+  #if ENABLE_NOTIFY_INET_STATUS
+    statesHealthMonitorRegister(&hmInet, 0, NETWORK_CONNECTED);
+    statesCtxHealthMonitorAssign(&_statesDefault, SHM_INET, &hmInet);
+  #endif // ENABLE_NOTIFY_INET_STATUS
+  #if ENABLE_NOTIFY_MQTT_STATUS
+    statesHealthMonitorRegister(&hmMqtt, INET_AVAILABLED, NETWORK_CONNECTED);
+    statesCtxHealthMonitorAssign(&_statesDefault, SHM_MQTT, &hmMqtt);
+  #endif // ENABLE_NOTIFY_MQTT_STATUS
+  #if ENABLE_NOTIFY_MQTT1_PING
+    statesHealthMonitorRegister(&hmMqttPing1, INET_AVAILABLED, NETWORK_CONNECTED);
+  #endif // ENABLE_NOTIFY_MQTT1_PING
+  #if ENABLE_NOTIFY_MQTT2_PING
+    statesHealthMonitorRegister(&hmMqttPing2, INET_AVAILABLED, NETWORK_CONNECTED);
+  #endif // ENABLE_NOTIFY_MQTT2_PING
+  #if ENABLE_NOTIFY_OPENMON_STATUS
+    statesHealthMonitorRegister(&hmOpenMon, INET_AVAILABLED, NETWORK_CONNECTED);
+  #endif // ENABLE_NOTIFY_OPENMON_STATUS
+  #if ENABLE_NOTIFY_NARODMON_STATUS
+    statesHealthMonitorRegister(&hmNarodMon, INET_AVAILABLED, NETWORK_CONNECTED);
+  #endif // ENABLE_NOTIFY_NARODMON_STATUS
+  #if ENABLE_NOTIFY_THINGSPEAK_STATUS
+    statesHealthMonitorRegister(&hmThingSpeak, INET_AVAILABLED, NETWORK_CONNECTED);
+  #endif // ENABLE_NOTIFY_THINGSPEAK_STATUS
+  #if CONFIG_STATES_RTC_SNAPSHOT
+    healthMonitorsRestore();
+  #endif // CONFIG_STATES_RTC_SNAPSHOT
+}
+
+// -- Notifications ------------------------------------------------------------------------------------------------------
+// Monitors are locked and unlocked by the registry when dependency bits change, only states are set here.
+// The monitors are those assigned to the context (for the default context: hmWifi, hmEthernet, hmInet and hmMqtt)
+static void healthMonitorsInetAvailable(re_states_ctx_t* ctx, bool setInetState)
+{
+  STATES_FLAP_DAMPEN(ctx, return);
+
+  reHealthMonitor* monitor = ctx->monitor_roles[SHM_INET];
+  if (monitor && setInetState) {
+    rlog_d(logTAG, "Sending notifications about the resumption of Internet access");
+    monitor->setState(ESP_OK, time(nullptr));
+  };
+}
+
+static void healthMonitorsInetUnavailable(re_states_ctx_t* ctx, esp_err_t inetState, time_t timeState)
+{
+  STATES_FLAP_DAMPEN(ctx, return);
+
+  reHealthMonitor* monitor = ctx->monitor_roles[SHM_INET];
+  if (monitor && (inetState != ESP_OK)) {
+    rlog_d(logTAG, "Sending notifications about the unavailability of the Internet");
+    monitor->setState(inetState, timeState);
+  };
+}
+
+#if !defined(CONFIG_WIFI_ENABLED) || (CONFIG_WIFI_ENABLED == 1)
+  static void healthMonitorsWiFiAvailable(re_states_ctx_t* ctx, bool setWifiState)
+  {
+    STATES_FLAP_DAMPEN(ctx, return);
+
+    reHealthMonitor* monitor = ctx->monitor_roles[SHM_WIFI];
+    if (monitor && setWifiState) {
+      rlog_d(logTAG, "Sending wifi connect notifications");
+      #if ENABLE_NOTIFY_WIFI_STATUS
+        if (statesCtxIsDefault(ctx)) {
+          const char* ssid = wifiGetSSID();
+          strncpy(_statesWifiObject, ssid ? ssid : "", sizeof(_statesWifiObject) - 1);
+          _statesWifiObject[sizeof(_statesWifiObject) - 1] = 0;
+        };
+      #endif // ENABLE_NOTIFY_WIFI_STATUS
+      monitor->setStateCustom(ESP_OK, time(nullptr), true, nullptr);
+    };
+  }
+
+  static void healthMonitorsWiFiUnavailable(re_states_ctx_t* ctx, esp_err_t wifiState)
+  {
+    STATES_FLAP_DAMPEN(ctx, return);
+
+    reHealthMonitor* monitor = ctx->monitor_roles[SHM_WIFI];
+    if (monitor && (wifiState != ESP_OK)) {
+      rlog_d(logTAG, "Sending wifi disconnect notifications");
+      monitor->setState(wifiState, time(nullptr));
+    };
+  }
+
+#endif // CONFIG_WIFI_ENABLED
+
+#if defined(CONFIG_ETH_ENABLED) && (CONFIG_ETH_ENABLED == 1)
+
+  static void healthMonitorsEthernetAvailable(re_states_ctx_t* ctx, bool setEthernetState)
+  {
+    STATES_FLAP_DAMPEN(ctx, return);
+
+    reHealthMonitor* monitor = ctx->monitor_roles[SHM_ETHERNET];
+    if (monitor && setEthernetState) {
+      rlog_d(logTAG, "Sending ethernet connect notifications");
+      monitor->setStateCustom(ESP_OK, time(nullptr), true, nullptr);
+    };
+  }
+
+  static void healthMonitorsEthernetUnavailable(re_states_ctx_t* ctx, esp_err_t ethernetState)
+  {
+    STATES_FLAP_DAMPEN(ctx, return);
+
+    reHealthMonitor* monitor = ctx->monitor_roles[SHM_ETHERNET];
+    if (monitor && (ethernetState != ESP_OK)) {
+      rlog_d(logTAG, "Sending ethernet disconnect notifications");
+      monitor->setState(ethernetState, time(nullptr));
+    };
+  }
+
+#endif // CONFIG_ETH_ENABLED)
+
+// The server of the default context is kept for the text of its notifications
+static void healthMonitorsMqttState(re_states_ctx_t* ctx, re_mqtt_event_data_t* data, esp_err_t state)
+{
+  reHealthMonitor* monitor = ctx->monitor_roles[SHM_MQTT];
+  if (monitor) {
+    #if ENABLE_NOTIFY_MQTT_STATUS
+      if (statesCtxIsDefault(ctx)) _statesMqttObject = statesMqttServerName(data);
+    #endif // ENABLE_NOTIFY_MQTT_STATUS
+    monitor->setStateCustom(state, time(nullptr), false, nullptr);
+  };
+}
+
+static void healthMonitorsMqttTimeout(re_states_ctx_t* ctx)
+{
+  reHealthMonitor* monitor = ctx->monitor_roles[SHM_MQTT];
+  if (monitor) monitor->forcedTimeout();
+}
+
+// -- Parameters ---------------------------------------------------------------------------------------------------------
+#if CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+  static uint32_t  _hmNotifyDelayFailure = CONFIG_NOTIFY_TELEGRAM_MINIMUM_FAILURE_TIME;
+  static uint8_t   _hmNotifyWifi = CONFIG_NOTIFY_TELEGRAM_WIFI_STATUS;
+  static uint8_t   _hmNotifyEthernet = CONFIG_NOTIFY_TELEGRAM_ETH_STATUS;
+  static uint8_t   _hmNotifyMqtt = CONFIG_NOTIFY_TELEGRAM_MQTT_STATUS;
+  static uint8_t   _hmNotifyMqttErrors = CONFIG_NOTIFY_TELEGRAM_MQTT_ERRORS;
+  #if CONFIG_PINGER_ENABLE
+    static uint8_t  _hmNotifyInet = CONFIG_NOTIFY_TELEGRAM_INET_UNAVAILABLE;
+  #endif // CONFIG_PINGER_ENABLE
+  #if CONFIG_OPENMON_ENABLE
+    static uint8_t  _hmNotifyOpenMon = CONFIG_NOTIFY_TELEGRAM_OPENMON_STATUS;
+  #endif // CONFIG_OPENMON_ENABLE
+  #if CONFIG_NARODMON_ENABLE
+    static uint8_t  _hmNotifyNarodMon = CONFIG_NOTIFY_TELEGRAM_NARODMON_STATUS;
+  #endif // CONFIG_NARODMON_ENABLE
+  #if CONFIG_THINGSPEAK_ENABLE
+    static uint8_t  _hmNotifyThingSpeak = CONFIG_NOTIFY_TELEGRAM_THINGSPEAK_STATUS;
+  #endif // CONFIG_THINGSPEAK_ENABLE
+  static uint8_t   _hmNotifySensors = CONFIG_NOTIFY_TELEGRAM_SENSOR_STATE;
+  #if CONFIG_SILENT_MODE_ENABLE
+    static uint8_t _hmNotifySilentMode = CONFIG_NOTIFY_TELEGRAM_SILENT_MODE;
+  #endif // CONFIG_SILENT_MODE_ENABLE
+
+  static void healthMonitorsRegisterParameters()
+  {
+    paramsGroupHandle_t pgNotify = paramsRegisterGroup(nullptr, 
+      CONFIG_STATES_NOTIFY_PGROUP_ROOT_KEY, CONFIG_STATES_NOTIFY_PGROUP_ROOT_TOPIC, CONFIG_STATES_NOTIFY_PGROUP_ROOT_FRIENDLY);
+    paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U32, nullptr, pgNotify,
+      CONFIG_NOTIFY_TELEGRAM_MINIMUM_FAILURE_TIME_KEY, CONFIG_NOTIFY_TELEGRAM_MINIMUM_FAILURE_TIME_FRIENDLY,
+      CONFIG_MQTT_PARAMS_QOS, (void*)&_hmNotifyDelayFailure);
+
+    // -- WiFi --------------------------------------------------------------------
+    #if !defined(CONFIG_WIFI_ENABLED) || (CONFIG_WIFI_ENABLED == 1)
+      hmWifi.assignParams(nullptr, &_hmNotifyWifi);
+      paramsSetLimitsU8(
+        paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U8, nullptr, pgNotify,
+          CONFIG_NOTIFY_TELEGRAM_WIFI_KEY, CONFIG_NOTIFY_TELEGRAM_WIFI_FRIENDLY,
+          CONFIG_MQTT_PARAMS_QOS, (void*)&_hmNotifyWifi),
+        0, 1);
+    #endif // CONFIG_WIFI_ENABLED    
+    
+    // -- Ethernet --------------------------------------------------------------------
+    #if defined(CONFIG_ETH_ENABLED) && (CONFIG_ETH_ENABLED == 1)
+      hmEthernet.assignParams(nullptr, &_hmNotifyEthernet);
+      paramsSetLimitsU8(
+        paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U8, nullptr, pgNotify,
+          CONFIG_NOTIFY_TELEGRAM_ETH_KEY, CONFIG_NOTIFY_TELEGRAM_ETH_FRIENDLY,
+          CONFIG_MQTT_PARAMS_QOS, (void*)&_hmNotifyEthernet),
+        0, 1);
+    #endif // CONFIG_ETH_ENABLED)
+
+    // -- Ping --------------------------------------------------------------------
+    #if CONFIG_PINGER_ENABLE
+      hmInet.assignParams(&_hmNotifyDelayFailure, &_hmNotifyInet);
+      paramsSetLimitsU8(
+        paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U8, nullptr, pgNotify,
+          CONFIG_NOTIFY_TELEGRAM_INET_KEY, CONFIG_NOTIFY_TELEGRAM_INET_FRIENDLY,
+          CONFIG_MQTT_PARAMS_QOS, (void*)&_hmNotifyInet),
+        0, 1);
+    #endif // CONFIG_PINGER_ENABLE
+
+    // -- MQTT --------------------------------------------------------------------
+    hmMqtt.assignParams(&_hmNotifyDelayFailure, &_hmNotifyMqtt);
+    #if CONFIG_PINGER_ENABLE && defined(CONFIG_MQTT1_TYPE) && CONFIG_MQTT1_PING_CHECK
+      hmMqttPing1.assignParams(&_hmNotifyDelayFailure, &_hmNotifyMqtt);
+    #endif // CONFIG_MQTT1_PING_CHECK
+    #if CONFIG_PINGER_ENABLE && defined(CONFIG_MQTT2_TYPE) && CONFIG_MQTT2_PING_CHECK
+      hmMqttPing2.assignParams(&_hmNotifyDelayFailure, &_hmNotifyMqtt);
+    #endif // CONFIG_MQTT2_PING_CHECK
+    paramsSetLimitsU8(
+      paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U8, nullptr, pgNotify,
+        CONFIG_NOTIFY_TELEGRAM_MQTT_KEY, CONFIG_NOTIFY_TELEGRAM_MQTT_FRIENDLY,
+        CONFIG_MQTT_PARAMS_QOS, (void*)&_hmNotifyMqtt),
+      0, 1);
+    paramsSetLimitsU8(
+      paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U8, nullptr, pgNotify,
+        CONFIG_NOTIFY_TELEGRAM_MQTT_ERRORS_KEY, CONFIG_NOTIFY_TELEGRAM_MQTT_ERRORS_FRIENDLY,
+        CONFIG_MQTT_PARAMS_QOS, (void*)&_hmNotifyMqttErrors),
+      0, 1);
+
+    // -- OpenMon -----------------------------------------------------------------
+    #if CONFIG_OPENMON_ENABLE
+      hmOpenMon.assignParams(&_hmNotifyDelayFailure, &_hmNotifyOpenMon);
+      paramsSetLimitsU8(
+        paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U8, nullptr, pgNotify,
+          CONFIG_NOTIFY_TELEGRAM_OPENMON_KEY, CONFIG_NOTIFY_TELEGRAM_OPENMON_FRIENDLY,
+          CONFIG_MQTT_PARAMS_QOS, (void*)&_hmNotifyOpenMon),
+        0, 1);
+    #endif // CONFIG_OPENMON_ENABLE
+
+    // -- NarodMon ----------------------------------------------------------------
+    #if CONFIG_NARODMON_ENABLE
+      hmNarodMon.assignParams(&_hmNotifyDelayFailure, &_hmNotifyNarodMon);
+      paramsSetLimitsU8(
+        paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U8, nullptr, pgNotify,
+          CONFIG_NOTIFY_TELEGRAM_NARODMON_KEY, CONFIG_NOTIFY_TELEGRAM_NARODMON_FRIENDLY,
+          CONFIG_MQTT_PARAMS_QOS, (void*)&_hmNotifyNarodMon),
+        0, 1);
+    #endif // CONFIG_NARODMON_ENABLE
+
+    // -- ThingSpeak --------------------------------------------------------------
+    #if CONFIG_THINGSPEAK_ENABLE
+      hmThingSpeak.assignParams(&_hmNotifyDelayFailure, &_hmNotifyThingSpeak);
+      paramsSetLimitsU8(
+        paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U8, nullptr, pgNotify,
+          CONFIG_NOTIFY_TELEGRAM_THINGSPEAK_KEY, CONFIG_NOTIFY_TELEGRAM_THINGSPEAK_FRIENDLY,
+          CONFIG_MQTT_PARAMS_QOS, (void*)&_hmNotifyThingSpeak),
+        0, 1);
+    #endif // CONFIG_THINGSPEAK_ENABLE
+
+    // -- Sensors -----------------------------------------------------------------
+    paramsSetLimitsU8(
+      paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U8, nullptr, pgNotify,
+        CONFIG_NOTIFY_TELEGRAM_SENSOR_KEY, CONFIG_NOTIFY_TELEGRAM_SENSOR_FRIENDLY,
+        CONFIG_MQTT_PARAMS_QOS, (void*)&_hmNotifySensors),
+
+      0, 1);
+
+    // -- Rate limits -------------------------------------------------------------
+    #if CONFIG_STATES_NOTIFY_LIMITS
+      static const char* limitBurstKeys[SN_MAX] = { "burst_service", "burst_sensor", "burst_mqtt", "burst_start" };
+      static const char* limitBurstNames[SN_MAX] = { "Burst: service", "Burst: sensors", "Burst: MQTT errors", "Burst: start" };
+      static const char* limitRateKeys[SN_MAX] = { "rate_service", "rate_sensor", "rate_mqtt", "rate_start" };
+      static const char* limitRateNames[SN_MAX] = { "Messages per hour: service", "Messages per hour: sensors", "Messages per hour: MQTT errors", "Messages per hour: start" };
+      for (uint8_t i = 0; i < SN_MAX; i++) {
+        paramsSetLimitsU8(
+          paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U8, nullptr, pgNotify,
+            limitBurstKeys[i], limitBurstNames[i],
+            CONFIG_MQTT_PARAMS_QOS, (void*)&_statesNotifyBurst[i]),
+          0, 255);
+        paramsSetLimitsU16(
+          paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U16, nullptr, pgNotify,
+            limitRateKeys[i], limitRateNames[i],
+            CONFIG_MQTT_PARAMS_QOS, (void*)&_statesNotifyRate[i]),
+          0, 3600);
+      };
+    #endif // CONFIG_STATES_NOTIFY_LIMITS
+
+    // -- Silent mode -------------------------------------------------------------
+    #if CONFIG_SILENT_MODE_ENABLE
+    paramsSetLimitsU8(
+      paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U8, nullptr, pgNotify,
+        CONFIG_NOTIFY_TELEGRAM_SILENT_MODE_KEY, CONFIG_NOTIFY_TELEGRAM_SILENT_MODE_FRIENDLY,
+        CONFIG_MQTT_PARAMS_QOS, (void*)&_hmNotifySilentMode),
+      0, 1);
+    #endif // CONFIG_SILENT_MODE_ENABLE
+  }
+#endif // CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+
+#else
+
+  #define ENABLE_NOTIFY_WIFI_STATUS 0
+  #define ENABLE_NOTIFY_ETH_STATUS 0
+  #define ENABLE_NOTIFY_INET_STATUS 0
+  #define ENABLE_NOTIFY_MQTT_STATUS 0
+  #define ENABLE_NOTIFY_MQTT_ERRORS 0
+  #define ENABLE_NOTIFY_MQTT1_PING 0
+  #define ENABLE_NOTIFY_MQTT2_PING 0
+  #define ENABLE_NOTIFY_OPENMON_STATUS 0
+  #define ENABLE_NOTIFY_NARODMON_STATUS 0
+  #define ENABLE_NOTIFY_THINGSPEAK_STATUS 0
+  #define ENABLE_NOTIFY_SENSOR_STATE 0
+  #define ENABLE_NOTIFY_SILENT_MODE 0
+  #define STATES_NOTIFY_ALLOWED(channel) true
+  #define statesNotifySend tgSend
+
+#endif // CONFIG_ENABLE_STATES_NOTIFICATIONS 
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- Debug info -------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_RESTART_DEBUG_INFO
+
+#define STATES_DEBUG_HEAP_SIZE (64 + CONFIG_FORMAT_STRFTIME_DTS_BUFFER_SIZE)
+
+static bool statesGetDebugHeap(re_restart_debug_t *debug, char* buffer, size_t size)
+{
+  if ((debug->heap_total > 0) && (debug->heap_total > debug->heap_free)) {
+    struct tm timeinfo;
+    localtime_r(&debug->heap_min_time, &timeinfo);
+    char time_buffer[CONFIG_FORMAT_STRFTIME_DTS_BUFFER_SIZE];
+    memset(&time_buffer, 0, CONFIG_FORMAT_STRFTIME_DTS_BUFFER_SIZE);
+    strftime(time_buffer, CONFIG_FORMAT_STRFTIME_DTS_BUFFER_SIZE, CONFIG_FORMAT_DTS, &timeinfo);
+
+    double heapTotal = (double)debug->heap_total / 1024;
+    double heapFree = (double)debug->heap_free / 1024;
+    double heapFreeMin = (double)debug->heap_free_min / 1024;
+
+    snprintf(buffer, size, "%.1fkB : %.1fkB (%.1f%%) : %.1fkB (%.1f%%) %s", 
+      heapTotal,
+      heapFree, 100.0 * (heapFree / heapTotal),
+      heapFreeMin, 100.0 * (heapFreeMin / heapTotal), time_buffer);
+    return true;
+  };
+  return false;
+}
+
+#if CONFIG_RESTART_DEBUG_STACK_DEPTH > 0
+
+static bool statesGetDebugTrace(re_restart_debug_t *debug, char* buffer, size_t size)
+{
+  states_buf_t buf;
+  statesBufInit(&buf, buffer, size);
+  for (uint8_t i = 0; i < CONFIG_RESTART_DEBUG_STACK_DEPTH; i++) {
+    if (debug->backtrace[i] != 0) {
+      statesBufPrintf(&buf, i > 0 ? " 0x%08x" : "0x%08x", debug->backtrace[i]);
+    } else {
+      break;
+    }
+  };
+  return buf.len > 0;
+}
+
+#endif // CONFIG_RESTART_DEBUG_STACK_DEPTH
+#endif // CONFIG_RESTART_DEBUG_INFO
+
+
+// -----------------------------------------------------------------------------------------------------------------------
+// --------------------------------------------------- Event handlers ----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+// The handlers are registered without an argument and work on the default context; an additional context is passed 
+// through the argument by statesCtxEventHandle()
+static inline re_states_ctx_t* statesCtxFromArg(void* arg)
+{
+  return arg ? (re_states_ctx_t*)arg : &_statesDefault;
+}
+
+// The start of an additional context only sets its bit, the rest (OTA, events, notification, outbox) concerns the device
+static void statesEventCheckSystemStarted(re_states_ctx_t* ctx)
+{
+  if (!statesCtxCheck(ctx, SYSTEM_STARTED, false)) {
+    if (statesCtxIsDefault(ctx)) rlog_i(logTAG, "Check system started: wifi=%d, ethernet=%d, internet=%d, time=%d, mqtt=%d", 
+      statesCtxCheck(ctx, WIFI_STA_CONNECTED, false), statesCtxCheck(ctx, ETHERNET_CONNECTED, false), statesCtxCheck(ctx, INET_AVAILABLED, false), 
+      (statesCtxCheck(ctx, TIME_SNTP_SYNC_OK, false) || statesCtxCheck(ctx, TIME_RTC_ENABLED, false)), 
+      statesCtxCheck(ctx, MQTT_CONNECTED, false));
+
+    #if CONFIG_MQTT_OTA_ENABLE
+      if (statesCtxIsDefault(ctx) && (statesCtxCheck(ctx, WIFI_STA_CONNECTED, false) || statesCtxCheck(ctx, ETHERNET_CONNECTED, false)) && statesCtxCheck(ctx, MQTT_CONNECTED, false)) {
+        statesFirmwareVerifyCompete();
+      };
+    #endif // CONFIG_MQTT_OTA_ENABLE
+
+    if ((statesCtxCheck(ctx, TIME_SNTP_SYNC_OK, false) || statesCtxCheck(ctx, TIME_RTC_ENABLED, false)) 
+     && (statesCtxCheck(ctx, WIFI_STA_CONNECTED, false) || statesCtxCheck(ctx, ETHERNET_CONNECTED, false))
+     && statesCtxCheck(ctx, INET_AVAILABLED, false) 
+     && statesCtxCheck(ctx, MQTT_CONNECTED, false)) {
+      statesCtxSet(ctx, SYSTEM_STARTED);
+      if (!statesCtxIsDefault(ctx)) return;
+      statesEventLoopPostSystem(RE_SYS_STARTED, RE_SYS_SET, false, 0);
+      #if CONFIG_TELEGRAM_ENABLE && CONFIG_NOTIFY_TELEGRAM_START
+      if (!STATES_STRESS_MUTED && STATES_NOTIFY_ALLOWED(SN_START)) {
+        #if CONFIG_RESTART_DEBUG_INFO
+          re_restart_debug_t debug = debugGet();
+          char debug_heap[STATES_DEBUG_HEAP_SIZE];
+          bool has_trace = false;
+          if (statesGetDebugHeap(&debug, debug_heap, sizeof(debug_heap))) {
+            #if CONFIG_RESTART_DEBUG_STACK_DEPTH > 0
+              char debug_trace[CONFIG_RESTART_DEBUG_STACK_DEPTH * 11 + 1];
+              has_trace = statesGetDebugTrace(&debug, debug_trace, sizeof(debug_trace));
+            #else
+              const char* debug_trace = "";
+            #endif // CONFIG_RESTART_DEBUG_STACK_DEPTH
+            if (has_trace) {
+              statesNotifySend(MK_MAIN, CONFIG_NOTIFY_TELEGRAM_START_PRIORITY, CONFIG_NOTIFY_TELEGRAM_ALERT_START, CONFIG_TELEGRAM_DEVICE, 
+                CONFIG_MESSAGE_TG_VERSION_TRACE, APP_VERSION, getResetReason(), getResetReasonRtc(0), getResetReasonRtc(1), 
+                debug_heap, debug_trace);
+            } else {
+              statesNotifySend(MK_MAIN, CONFIG_NOTIFY_TELEGRAM_START_PRIORITY, CONFIG_NOTIFY_TELEGRAM_ALERT_START, CONFIG_TELEGRAM_DEVICE, 
+                CONFIG_MESSAGE_TG_VERSION_HEAP, APP_VERSION, getResetReason(), getResetReasonRtc(0), getResetReasonRtc(1), 
+                debug_heap);
+            };
+          } else {
+            statesNotifySend(MK_MAIN, CONFIG_NOTIFY_TELEGRAM_START_PRIORITY, CONFIG_NOTIFY_TELEGRAM_ALERT_START, CONFIG_TELEGRAM_DEVICE, 
+              CONFIG_MESSAGE_TG_VERSION_DEF, APP_VERSION, getResetReason(), getResetReasonRtc(0), getResetReasonRtc(1));
+          };
+        #else
+          statesNotifySend(MK_MAIN, CONFIG_NOTIFY_TELEGRAM_START_PRIORITY, CONFIG_NOTIFY_TELEGRAM_ALERT_START, CONFIG_TELEGRAM_DEVICE, 
+            CONFIG_MESSAGE_TG_VERSION_DEF, APP_VERSION, getResetReason(), getResetReasonRtc(0), getResetReasonRtc(1));
+        #endif // CONFIG_RESTART_DEBUG_INFO
+      };
+      #endif // CONFIG_TELEGRAM_ENABLE && CONFIG_NOTIFY_TELEGRAM_START
+      #if CONFIG_ENABLE_STATES_NOTIFICATIONS && CONFIG_STATES_NOTIFY_OUTBOX
+        statesOutboxReplay(true);
+      #endif // CONFIG_STATES_NOTIFY_OUTBOX
+    };
+  };
+}
+
+#if CONFIG_STATES_FLAP_DETECTION
+
+// Once the link has calmed down, suppressed side effects are brought in line with the current state
+static void statesFlapCheck()
+{
+  if (statesCheck(NETWORK_FLAPPING, false) && statesFlapExpire()) {
+    rlog_i(logTAG, "Network state is stable again");
+    statesClear(NETWORK_FLAPPING);
+    #if CONFIG_ENABLE_STATES_NOTIFICATIONS
+      #if !defined(CONFIG_WIFI_ENABLED) || (CONFIG_WIFI_ENABLED == 1)
+        if (statesCheck(WIFI_STA_CONNECTED, false)) {
+          healthMonitorsWiFiAvailable(&_statesDefault, true);
+        } else if (statesCheck(WIFI_STA_STARTED, false)) {
+          healthMonitorsWiFiUnavailable(&_statesDefault, ESP_ERR_INVALID_STATE);
+        };
+      #endif // CONFIG_WIFI_ENABLED
+      #if defined(CONFIG_ETH_ENABLED) && (CONFIG_ETH_ENABLED == 1)
+        if (statesCheck(ETHERNET_CONNECTED, false)) {
+          healthMonitorsEthernetAvailable(&_statesDefault, true);
+        } else if (statesCheck(ETHERNET_STARTED, false)) {
+          healthMonitorsEthernetUnavailable(&_statesDefault, ESP_ERR_INVALID_STATE);
+        };
+      #endif // CONFIG_ETH_ENABLED
+      if (statesInetIsAvailabled()) {
+        healthMonitorsInetAvailable(&_statesDefault, true);
+      } else if (statesNetworkIsConnected()) {
+        healthMonitorsInetUnavailable(&_statesDefault, ESP_ERR_TIMEOUT, time(nullptr));
+      };
+      statesHealthMonitorsApply(&_statesDefault, statesGet());
+    #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+  };
+}
+
+#endif // CONFIG_STATES_FLAP_DETECTION
+
+static void statesEventHandlerSystem(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+{
+  // System started
+  if (event_id == RE_SYS_STARTED) {
+    #if CONFIG_HEAP_TRACING_STANDALONE
+      heapLeaksStart();
+    #endif // CONFIG_HEAP_TRACING_STANDALONE  
+    #if CONFIG_STATES_BOOT_TIMELINE
+      statesBootTimelineComplete();
+    #endif // CONFIG_STATES_BOOT_TIMELINE
+  }
+  // OTA
+  else if (event_id == RE_SYS_OTA) {
+    re_system_event_data_t* data = (re_system_event_data_t*)event_data;
+    if (data) {
+      statesSetBit(SYSTEM_OTA, data->type != RE_SYS_CLEAR);
+    };
+  }
+  // Error
+  else if (event_id == RE_SYS_ERROR) {
+    // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE_MODE, event_base, "RE_SYS_ERROR", data->type);
+    if (event_data) {
+      re_error_event_data_t* data = (re_error_event_data_t*)event_data;
+      statesSetError(ERR_GENERAL, data->err_code != ESP_OK);
+    };
+  }
+  // Telegram error
+  else if (event_id == RE_SYS_TELEGRAM_ERROR) {
+    // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE_MODE, event_base, "RE_SYS_TELEGRAM_ERROR", data->type);
+    if (event_data) {
+      re_error_event_data_t* data = (re_error_event_data_t*)event_data;
+      statesSetError(ERR_TELEGRAM, data->err_code != ESP_OK);
+    };
+  }
+  // OpenMon
+  else if (event_id == RE_SYS_OPENMON_ERROR) {
+    // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE_MODE, event_base, "RE_SYS_OPENMON_ERROR", data->type);
+    if (event_data) {
+      re_error_event_data_t* data = (re_error_event_data_t*)event_data;
+      statesSetError(ERR_OPENMON, data->err_code != ESP_OK);
+      #if ENABLE_NOTIFY_OPENMON_STATUS
+        hmOpenMon.setState(data->err_code, time(nullptr));
+      #endif // ENABLE_NOTIFY_OPENMON_STATUS
+    };
+  }
+  // NarodMon
+  else if (event_id == RE_SYS_NARODMON_ERROR) {
+    // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE_MODE, event_base, "RE_SYS_NARODMON_ERROR", data->type);
+    if (event_data) {
+      re_error_event_data_t* data = (re_error_event_data_t*)event_data;
+      statesSetError(ERR_NARODMON, data->err_code != ESP_OK);
+      #if ENABLE_NOTIFY_NARODMON_STATUS
+        hmNarodMon.setState(data->err_code, time(nullptr));
+      #endif // ENABLE_NOTIFY_NARODMON_STATUS
+    };
+  }
+  // ThingSpeak
+  else if (event_id == RE_SYS_THINGSPEAK_ERROR) {
+    // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE_MODE, event_base, "RE_SYS_THINGSPEAK_ERROR", data->type);
+    if (event_data) {
+      re_error_event_data_t* data = (re_error_event_data_t*)event_data;
+      statesSetError(ERR_THINGSPEAK, data->err_code != ESP_OK);
+      #if ENABLE_NOTIFY_THINGSPEAK_STATUS
+        hmThingSpeak.setState(data->err_code, time(nullptr));
+      #endif // ENABLE_NOTIFY_THINGSPEAK_STATUS
+    };
+  };
+}
+
+static void statesEventHandlerTime(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+{
+  re_states_ctx_t* ctx = statesCtxFromArg(arg);
+  // An additional context only takes the time sources, the schedule and the silent mode belong to the device
+  if (!statesCtxIsDefault(ctx) && (event_id != RE_TIME_RTC_ENABLED) && (event_id != RE_TIME_SNTP_SYNC_OK)) return;
+
+  switch (event_id) {
+    // Received time from hardware real time clock
+    case RE_TIME_RTC_ENABLED:
+      statesCtxSet(ctx, TIME_RTC_ENABLED);
+      statesEventCheckSystemStarted(ctx);
+      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_TIME_RTC_ENABLED");
+      break;
+
+    case RE_TIME_EVERY_MINUTE:
+      #if CONFIG_MQTT_OTA_ENABLE && CONFIG_OTA_VERIFY_POLICY
+        statesFirmwareVerifyCheck();
+      #endif // CONFIG_OTA_VERIFY_POLICY
+      #if CONFIG_STATES_FLAP_DETECTION
+        statesFlapCheck();
+      #endif // CONFIG_STATES_FLAP_DETECTION
+      #if CONFIG_STATES_UPLINK
+        statesUplinkEvaluate();
+      #endif // CONFIG_STATES_UPLINK
+      #if CONFIG_ENABLE_STATES_NOTIFICATIONS && CONFIG_STATES_NOTIFY_LIMITS
+        statesNotifySummary();
+      #endif // CONFIG_STATES_NOTIFY_LIMITS
+      #if CONFIG_ENABLE_STATES_NOTIFICATIONS && CONFIG_STATES_NOTIFY_OUTBOX
+        healthMonitorsSaveIncidents();
+        // Picks up what the rate limits held back
+        statesOutboxReplay(false);
+      #endif // CONFIG_STATES_NOTIFY_OUTBOX
+      #if CONFIG_STATES_RTC_SNAPSHOT
+        statesSnapshotRefresh();
+      #endif // CONFIG_STATES_RTC_SNAPSHOT
+      #if CONFIG_ENABLE_STATES_NOTIFICATIONS && CONFIG_STATES_RTC_SNAPSHOT
+        healthMonitorsSnapshot();
+      #endif // CONFIG_STATES_RTC_SNAPSHOT
+      #if CONFIG_RESTART_DEBUG_INFO && CONFIG_RESTART_DEBUG_HEAP_SIZE_SCHEDULE
+        debugHeapUpdate();
+      #endif // CONFIG_RESTART_DEBUG_HEAP_SIZE_SCHEDULE
+      #if CONFIG_HEAP_TRACING_STANDALONE
+        heapLeaksUpdate();
+      #endif // CONFIG_HEAP_TRACING_STANDALONE  
+      break;
+
+    // Received time from NTP server
+    case RE_TIME_SNTP_SYNC_OK:
+      statesCtxSet(ctx, TIME_SNTP_SYNC_OK);
+      statesEventCheckSystemStarted(ctx);
+      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "TIME_SNTP_SYNC_OK");
+      break;
+
+    #if CONFIG_SILENT_MODE_ENABLE
+    // Silent mode on
+    case RE_TIME_SILENT_MODE_ON:
+      statesSet(TIME_SILENT_MODE);
+      ledSysSetEnabled(false);
+      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_TIME_SILENT_MODE_ON");
+      #if ENABLE_NOTIFY_SILENT_MODE
+        #if CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+        if (_hmNotifySilentMode) {
+        #endif // CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+          statesTgSend(SN_SERVICE, MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_SILENT_MODE_PRIORITY, CONFIG_NOTIFY_TELEGRAM_ALERT_SILENT_MODE, CONFIG_TELEGRAM_DEVICE, 
+            CONFIG_MESSAGE_TG_SILENT_MODE_ON);
+        #if CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+        };
+        #endif // CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+      #endif // ENABLE_NOTIFY_SILENT_MODE
+      break;
+    // Silent mode off
+    case RE_TIME_SILENT_MODE_OFF:
+      statesClear(TIME_SILENT_MODE);
+      ledSysSetEnabled(true);
+      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_TIME_SILENT_MODE_OFF");
+      #if ENABLE_NOTIFY_SILENT_MODE
+        #if CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+        if (_hmNotifySilentMode) {
+        #endif // CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+          statesTgSend(SN_SERVICE, MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_SILENT_MODE_PRIORITY, CONFIG_NOTIFY_TELEGRAM_ALERT_SILENT_MODE, CONFIG_TELEGRAM_DEVICE, 
+            CONFIG_MESSAGE_TG_SILENT_MODE_OFF);
+        #if CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+        };
+        #endif // CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+      #endif // ENABLE_NOTIFY_SILENT_MODE
+      break;
+    #endif // CONFIG_SILENT_MODE_ENABLE
+
+    // Ignore...
+    default:
+      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "IGNORED");
+      break;
+  };
+}
+
+static void statesEventHandlerWiFi(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+{
+  re_states_ctx_t* ctx = statesCtxFromArg(arg);
+  switch (event_id) {
+    #if !defined(CONFIG_WIFI_ENABLED) || (CONFIG_WIFI_ENABLED == 1)
+      case RE_WIFI_STA_INIT:
+        statesCtxClear(ctx, WIFI_STA_STARTED | WIFI_STA_CONNECTED | INET_AVAILABLED | INET_SLOWDOWN | MQTT_CONNECTED);
+        // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_WIFI_STA_INIT");
+        break;
+
+      case RE_WIFI_STA_STARTED:
+        statesCtxSet(ctx, WIFI_STA_STARTED);
+        statesCtxClear(ctx, WIFI_STA_CONNECTED | INET_AVAILABLED | INET_SLOWDOWN | MQTT_CONNECTED);
+        // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_WIFI_STA_STARTED");
+        break;
+
+      case RE_WIFI_STA_GOT_IP:
+        // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_WIFI_STA_GOT_IP");
+        statesCtxSet(ctx, WIFI_STA_CONNECTED | INET_AVAILABLED);
+        statesCtxClear(ctx, INET_SLOWDOWN | MQTT_CONNECTED);
+        #if CONFIG_STATES_UPLINK
+          if (statesCtxIsDefault(ctx)) statesUplinkLink(SU_WIFI, true);
+        #endif // CONFIG_STATES_UPLINK
+        if (statesCtxIsDefault(ctx)) statesEventLoopPost(RE_WIFI_EVENTS, RE_INET_PING_OK, nullptr, 0, portMAX_DELAY);
+        #if CONFIG_ENABLE_STATES_NOTIFICATIONS
+          healthMonitorsWiFiAvailable(ctx, true);
+        #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+        statesEventCheckSystemStarted(ctx);
+        #if CONFIG_ENABLE_STATES_NOTIFICATIONS && CONFIG_STATES_NOTIFY_OUTBOX
+          if (statesCtxIsDefault(ctx)) statesOutboxReplay(false);
+        #endif // CONFIG_STATES_NOTIFY_OUTBOX
+        break;
+
+      case RE_WIFI_STA_DISCONNECTED:
+      case RE_WIFI_STA_STOPPED:
+        #if CONFIG_ENABLE_STATES_NOTIFICATIONS 
+          if (statesCtxCheck(ctx, WIFI_STA_CONNECTED, false)) {
+            healthMonitorsWiFiUnavailable(ctx, ESP_ERR_INVALID_STATE);
+          };
+        #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+        // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_WIFI_STA_DISCONNECTED / RE_WIFI_STA_STOPPED");
+        statesCtxClear(ctx, WIFI_STA_CONNECTED);
+        #if CONFIG_STATES_UPLINK
+          if (statesCtxIsDefault(ctx)) statesUplinkLink(SU_WIFI, false);
+        #endif // CONFIG_STATES_UPLINK
+        if (!statesCtxCheckAny(ctx, NETWORK_CONNECTED, false)) {
+          statesCtxClear(ctx, INET_AVAILABLED | INET_SLOWDOWN | MQTT_CONNECTED);
+        };
+        break;
+    #endif // CONFIG_WIFI_ENABLED
+
+    #if defined(CONFIG_ETH_ENABLED) && (CONFIG_ETH_ENABLED == 1)
+      case RE_ETHERNET_STARTED:
+        statesCtxSet(ctx, ETHERNET_STARTED);
+        statesCtxClear(ctx, ETHERNET_CONNECTED | INET_AVAILABLED | INET_SLOWDOWN | MQTT_CONNECTED);
+        // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_ETHERNET_STARTED");
+        break;
+
+      case RE_ETHERNET_GOT_IP:
+        // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_ETHERNET_GOT_IP");
+        statesCtxSet(ctx, ETHERNET_CONNECTED | INET_AVAILABLED);
+        statesCtxClear(ctx, INET_SLOWDOWN | MQTT_CONNECTED);
+        #if CONFIG_STATES_UPLINK
+          if (statesCtxIsDefault(ctx)) statesUplinkLink(SU_ETHERNET, true);
+        #endif // CONFIG_STATES_UPLINK
+        if (statesCtxIsDefault(ctx)) statesEventLoopPost(RE_WIFI_EVENTS, RE_INET_PING_OK, nullptr, 0, portMAX_DELAY);
+        #if CONFIG_ENABLE_STATES_NOTIFICATIONS
+          healthMonitorsEthernetAvailable(ctx, true);
+        #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+        statesEventCheckSystemStarted(ctx);
+        #if CONFIG_ENABLE_STATES_NOTIFICATIONS && CONFIG_STATES_NOTIFY_OUTBOX
+          if (statesCtxIsDefault(ctx)) statesOutboxReplay(false);
+        #endif // CONFIG_STATES_NOTIFY_OUTBOX
+        break;
+
+      case RE_ETHERNET_DISCONNECTED:
+      case RE_ETHERNET_STOPPED:
+        #if CONFIG_ENABLE_STATES_NOTIFICATIONS 
+          if (statesCtxCheck(ctx, ETHERNET_CONNECTED, false)) {
+            healthMonitorsEthernetUnavailable(ctx, ESP_ERR_INVALID_STATE);
+          };
+        #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+        // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_ETHERNET_DISCONNECTED / RE_ETHERNET_STOPPED");
+        statesCtxClear(ctx, ETHERNET_CONNECTED);
+        #if CONFIG_STATES_UPLINK
+          if (statesCtxIsDefault(ctx)) statesUplinkLink(SU_ETHERNET, false);
+        #endif // CONFIG_STATES_UPLINK
+        if (!statesCtxCheckAny(ctx, NETWORK_CONNECTED, false)) {
+          statesCtxClear(ctx, INET_AVAILABLED | INET_SLOWDOWN | MQTT_CONNECTED);
+        };
+        break;
+    #endif // CONFIG_ETH_ENABLED)
+
+    default:
+      // Ignore...
+      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "IGNORED");
+      break;
+  };
+}
+
+#if CONFIG_PINGER_ENABLE
+
+static void statesEventHandlerPing(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+{
+  re_states_ctx_t* ctx = statesCtxFromArg(arg);
+  #if CONFIG_STATES_INET_QUALITY
+    if (statesCtxIsDefault(ctx) && ((event_id == RE_PING_INET_AVAILABLE) || (event_id == RE_PING_INET_SLOWDOWN) || (event_id == RE_PING_INET_UNAVAILABLE))) {
+      statesQualityEvent(event_id, event_data);
+    };
+  #endif // CONFIG_STATES_INET_QUALITY
+  #if CONFIG_STATES_UPLINK
+    if (statesCtxIsDefault(ctx) && ((event_id == RE_PING_INET_AVAILABLE) || (event_id == RE_PING_INET_SLOWDOWN))) {
+      statesUplinkPing(event_data);
+    };
+  #endif // CONFIG_STATES_UPLINK
+  #if CONFIG_STATES_MQTT_STATS
+    if (!statesCtxIsDefault(ctx)) {
+      // The broker statistics are kept for the device only
+    } else if ((event_id == RE_PING_MQTT1_AVAILABLE) || (event_id == RE_PING_MQTT1_UNAVAILABLE)) {
+      statesMqttStatsReachable(SMB_PRIMARY, event_id == RE_PING_MQTT1_AVAILABLE);
+    } else if ((event_id == RE_PING_MQTT2_AVAILABLE) || (event_id == RE_PING_MQTT2_UNAVAILABLE)) {
+      statesMqttStatsReachable(SMB_RESERVE, event_id == RE_PING_MQTT2_AVAILABLE);
+    };
+  #endif // CONFIG_STATES_MQTT_STATS
+  switch (event_id) {
+    case RE_PING_INET_AVAILABLE: 
+      statesCtxSet(ctx, INET_AVAILABLED);
+      statesCtxClear(ctx, INET_SLOWDOWN);
+      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_PING_INET_AVAILABLE");
+      #if CONFIG_ENABLE_STATES_NOTIFICATIONS
+        if (statesCtxCheck(ctx, WIFI_STA_CONNECTED, false)) {
+          healthMonitorsInetAvailable(ctx, true);
+        };
+      #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+      if (statesCtxIsDefault(ctx)) statesEventLoopPost(RE_WIFI_EVENTS, RE_INET_PING_OK, nullptr, 0, portMAX_DELAY);
+      statesEventCheckSystemStarted(ctx);
+      #if CONFIG_ENABLE_STATES_NOTIFICATIONS && CONFIG_STATES_NOTIFY_OUTBOX
+        if (statesCtxIsDefault(ctx)) statesOutboxReplay(false);
+      #endif // CONFIG_STATES_NOTIFY_OUTBOX
+      break;
+
+    case RE_PING_INET_SLOWDOWN: {
+        statesCtxSet(ctx, INET_AVAILABLED | INET_SLOWDOWN);
+        // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_PING_INET_SLOWDOWN");
       };
-    #endif // ENABLE_NOTIFY_WIFI_STATUS
+      break;
+
+    case RE_PING_INET_UNAVAILABLE:
+      statesCtxClear(ctx, INET_AVAILABLED | INET_SLOWDOWN);
+      if (statesCtxIsDefault(ctx)) statesEventLoopPost(RE_WIFI_EVENTS, RE_INET_PING_FAILED, nullptr, 0, portMAX_DELAY);
+      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_PING_INET_UNAVAILABLE");
+      #if CONFIG_ENABLE_STATES_NOTIFICATIONS
+        if (statesCtxCheckAny(ctx, NETWORK_CONNECTED, false)) {
+          if (event_data) {
+            ping_inet_data_t* data = (ping_inet_data_t*)event_data;
+            healthMonitorsInetUnavailable(ctx, ESP_ERR_TIMEOUT, data->time_unavailable);
+          } else {
+            healthMonitorsInetUnavailable(ctx, ESP_ERR_TIMEOUT, time(nullptr));
+          };
+        };
+      #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+      break;
+
+    case RE_PING_MQTT1_AVAILABLE:
+      statesCtxSet(ctx, MQTT_1_ENABLED);
+      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_PING_MQTT1_AVAILABLE");
+      #if ENABLE_NOTIFY_MQTT1_PING
+        if (statesCtxIsDefault(ctx)) hmMqttPing1.setState(ESP_OK, time(nullptr));
+      #endif // ENABLE_NOTIFY_MQTT1_PING
+      break;
+
+    case RE_PING_MQTT2_AVAILABLE:
+      statesCtxSet(ctx, MQTT_2_ENABLED);
+      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_PING_MQTT2_AVAILABLE");
+      #if ENABLE_NOTIFY_MQTT2_PING
+        if (statesCtxIsDefault(ctx)) hmMqttPing2.setState(ESP_OK, time(nullptr));
+      #endif // ENABLE_NOTIFY_MQTT2_PING
+      break;
+
+    case RE_PING_MQTT1_UNAVAILABLE:
+      statesCtxClear(ctx, MQTT_1_ENABLED);
+      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_PING_MQTT1_UNAVAILABLE");
+      #if ENABLE_NOTIFY_MQTT1_PING
+        if (!statesCtxIsDefault(ctx)) {
+          // The monitors of the broker hosts belong to the device
+        } else if (event_data) {
+          ping_host_data_t* data = (ping_host_data_t*)event_data;
+          hmMqttPing1.setState(ESP_ERR_TIMEOUT, data->time_unavailable);
+        } else {
+          hmMqttPing1.setState(ESP_ERR_TIMEOUT, time(nullptr));
+        };         
+      #endif // ENABLE_NOTIFY_MQTT1_PING
+      break;
+
+    case RE_PING_MQTT2_UNAVAILABLE:
+      statesCtxClear(ctx, MQTT_2_ENABLED);
+      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_PING_MQTT2_UNAVAILABLE");
+      #if ENABLE_NOTIFY_MQTT2_PING
+        if (!statesCtxIsDefault(ctx)) {
+          // The monitors of the broker hosts belong to the device
+        } else if (event_data) {
+          ping_host_data_t* data = (ping_host_data_t*)event_data;
+          hmMqttPing2.setState(ESP_ERR_TIMEOUT, data->time_unavailable);
+        } else {
+          hmMqttPing2.setState(ESP_ERR_TIMEOUT, time(nullptr));
+        };         
+      #endif // ENABLE_NOTIFY_MQTT2_PING
+      break;
+
+    default:
+      // Ignore...
+      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "IGNORED");
+      break;
+  };
+}
+
+#endif // CONFIG_PINGER_ENABLE
+
+static void statesEventHandlerMqtt(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+{
+  re_states_ctx_t* ctx = statesCtxFromArg(arg);
+  #if CONFIG_STATES_MQTT_STATS
+    if (statesCtxIsDefault(ctx)) statesMqttStatsEvent(event_id, event_data);
+  #endif // CONFIG_STATES_MQTT_STATS
+  switch (event_id) {
+    case RE_MQTT_CONNECTED:
+      statesCtxSet(ctx, MQTT_CONNECTED);
+      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_MQTT_CONNECTED");
+      if (event_data) {
+        re_mqtt_event_data_t* data = (re_mqtt_event_data_t*)event_data;
+        statesCtxSetBit(ctx, MQTT_PRIMARY, data->primary);
+        statesCtxSetBit(ctx, MQTT_LOCAL, data->local);
+        #if CONFIG_ENABLE_STATES_NOTIFICATIONS
+          healthMonitorsMqttState(ctx, data, ESP_OK);
+        #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+        statesEventCheckSystemStarted(ctx);
+      };
+      break;
+
+    case RE_MQTT_CONN_LOST:
+      statesCtxClear(ctx, MQTT_CONNECTED);
+      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_MQTT_CONN_LOST");
+      if (event_data) {
+        re_mqtt_event_data_t* data = (re_mqtt_event_data_t*)event_data;
+        #if CONFIG_ENABLE_STATES_NOTIFICATIONS
+          healthMonitorsMqttState(ctx, data, ESP_ERR_INVALID_STATE);
+        #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+      };
+      break;
+
+    case RE_MQTT_CONN_FAILED:
+      statesCtxClear(ctx, MQTT_CONNECTED);
+      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_MQTT_CONN_FAILED");
+      if (event_data) {
+        re_mqtt_event_data_t* data = (re_mqtt_event_data_t*)event_data;
+        #if ENABLE_NOTIFY_MQTT_STATUS
+          healthMonitorsMqttTimeout(ctx);
+          #if CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+          if (_hmNotifyMqtt) {
+          #endif // CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+            statesCtxTgSend(ctx, SN_MQTT_ERRORS, MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_MQTT_ERRORS_PRIORITY, CONFIG_NOTIFY_TELEGRAM_ALERT_MQTT_ERRORS, CONFIG_TELEGRAM_DEVICE, 
+              CONFIG_MESSAGE_TG_MQTT_CONN_FAILED, data->host, data->port);
+          #if CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+          };
+          #endif // CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+        #endif // ENABLE_NOTIFY_MQTT_STATUS
+      };
+      break;
+
+    case RE_MQTT_SERVER_PRIMARY:
+      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_MQTT_SERVER_PRIMARY");
+      #if defined(CONFIG_MQTT1_TYPE) && ENABLE_NOTIFY_MQTT_STATUS
+        healthMonitorsMqttTimeout(ctx);
+        #if CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+        if (_hmNotifyMqtt) {
+        #endif // CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+          statesCtxTgSend(ctx, SN_MQTT_ERRORS, MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_MQTT_ERRORS_PRIORITY, CONFIG_NOTIFY_TELEGRAM_ALERT_MQTT_ERRORS, CONFIG_TELEGRAM_DEVICE, 
+            CONFIG_MESSAGE_TG_MQTT_SERVER_CHANGE_PRIMARY, 
+            #if CONFIG_MQTT1_TLS_ENABLED
+              CONFIG_MQTT1_HOST, CONFIG_MQTT1_PORT_TLS
+            #else
+              CONFIG_MQTT1_HOST, CONFIG_MQTT1_PORT_TCP
+            #endif // CONFIG_MQTT1_TLS_ENABLED
+            );
+        #if CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+        };
+        #endif // CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+      #endif // ENABLE_NOTIFY_MQTT_STATUS
+      break;
+
+    case RE_MQTT_SERVER_RESERVED:
+      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_MQTT_SERVER_RESERVED");
+      #if defined(CONFIG_MQTT2_TYPE) && ENABLE_NOTIFY_MQTT_STATUS
+        healthMonitorsMqttTimeout(ctx);
+        #if CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+        if (_hmNotifyMqtt) {
+        #endif // CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+          statesCtxTgSend(ctx, SN_MQTT_ERRORS, MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_MQTT_ERRORS_PRIORITY, CONFIG_NOTIFY_TELEGRAM_ALERT_MQTT_ERRORS, CONFIG_TELEGRAM_DEVICE, 
+            CONFIG_MESSAGE_TG_MQTT_SERVER_CHANGE_RESERVED, 
+            #if CONFIG_MQTT2_TLS_ENABLED
+              CONFIG_MQTT2_HOST, CONFIG_MQTT2_PORT_TLS
+            #else
+              CONFIG_MQTT2_HOST, CONFIG_MQTT2_PORT_TCP
+            #endif // CONFIG_MQTT2_TLS_ENABLED
+            );
+        #if CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+        };
+        #endif // CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+      #endif // ENABLE_NOTIFY_MQTT_STATUS
+      break;
+
+    case RE_MQTT_ERROR:
+      statesCtxSetErrors(ctx, ERR_MQTT);
+      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_MQTT_ERROR");
+      #if ENABLE_NOTIFY_MQTT_ERRORS
+        #if CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+        if (_hmNotifyMqttErrors) {
+        #endif // CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+          if (event_data) {
+            char* error = (char*)event_data;
+            statesCtxTgSend(ctx, SN_MQTT_ERRORS, MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_MQTT_ERRORS_PRIORITY, CONFIG_NOTIFY_TELEGRAM_ALERT_MQTT_ERRORS, CONFIG_TELEGRAM_DEVICE, 
+              CONFIG_MESSAGE_TG_MQTT_ERROR, error);
+          };
+        #if CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+        };
+        #endif // CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+      #endif // ENABLE_NOTIFY_MQTT_ERRORS
+      break;
+
+    case RE_MQTT_ERROR_CLEAR:
+      statesCtxClearErrors(ctx, ERR_MQTT);
+      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_MQTT_ERROR_CLEAR");
+      break;
+
+    default:
+      // Ignore...
+      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "IGNORED");
+      break;
+  };
+}
+
+#ifndef CONFIG_NO_SENSORS
+
+#if ENABLE_NOTIFY_SENSOR_STATE
+
+// Sensor status change notification
+static void statesSensorNotify(rSensor* sensor, sensor_status_t status)
+{
+  if (sensor == nullptr) return;
+  #if CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+  if (!_hmNotifySensors) return;
+  #endif // CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+  if (status == SENSOR_STATUS_OK) {
+    statesTgSend(SN_SENSOR, MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_SENSOR_PRIORITY, CONFIG_NOTIFY_TELEGRAM_ALERT_SENSOR_STATE, CONFIG_TELEGRAM_DEVICE, 
+      CONFIG_MESSAGE_TG_SENSOR_OK, sensor->getName());
+  } else {
+    statesTgSend(SN_SENSOR, MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_SENSOR_PRIORITY, CONFIG_NOTIFY_TELEGRAM_ALERT_SENSOR_STATE, CONFIG_TELEGRAM_DEVICE, 
+      CONFIG_MESSAGE_TG_SENSOR_ERROR, sensor->getName(), sensor->statusString(status));
+  };
+}
+
+#endif // ENABLE_NOTIFY_SENSOR_STATE
+
+#if CONFIG_STATES_SENSOR_SEVERITY
+
+/**
+ * Sensor status store: the last status, its severity and the time of change of each sensor. The number of sensors 
+ * at each severity is maintained on every change, so the worst severity is found without walking the sensors.
+ * Notifications are debounced: a change is reported only if the effective severity (below the notification 
+ * threshold it is "ok") still differs from the reported one after CONFIG_STATES_SENSOR_DEBOUNCE seconds.
+ * Sensors that do not fit into the store are reported at once, as without the store
+ * */
+
+#ifndef CONFIG_STATES_SENSORS_MAX
+  #define CONFIG_STATES_SENSORS_MAX 16
+#endif // CONFIG_STATES_SENSORS_MAX
+#ifndef CONFIG_STATES_SENSOR_DEBOUNCE
+  #define CONFIG_STATES_SENSOR_DEBOUNCE 30
+#endif // CONFIG_STATES_SENSOR_DEBOUNCE
+#ifndef CONFIG_STATES_SENSOR_NOTIFY_SEVERITY
+  #define CONFIG_STATES_SENSOR_NOTIFY_SEVERITY SSS_WARNING
+#endif // CONFIG_STATES_SENSOR_NOTIFY_SEVERITY
+
+static const char* _statesSensorSeverityNames[SSS_MAX] = { "ok", "info", "warning", "error", "critical" };
+
+typedef struct {
+  states_sensor_status_t status;
+  void*    sensor;         // rSensor, for the name in the notifications
+  uint8_t  notified;       // Effective severity that has been reported
+  bool     pending;
+  int64_t  deadline;       // esp_timer_get_time() when the pending change is reported
+} states_sensor_slot_t;
+
+static states_sensor_slot_t _statesSensors[CONFIG_STATES_SENSORS_MAX];
+static uint8_t _statesSensorsCount = 0;
+static uint8_t _statesSensorSeverities[SSS_MAX];
+static portMUX_TYPE _statesSensorsLock = portMUX_INITIALIZER_UNLOCKED;
+#if ENABLE_NOTIFY_SENSOR_STATE
+  static esp_timer_handle_t _statesSensorsTimer = nullptr;
+  static bool _statesSensorsTimerArmed = false;
+#endif // ENABLE_NOTIFY_SENSOR_STATE
+
+static states_sensor_severity_t statesSensorSeverity(sensor_status_t status)
+{
+  switch (status) {
+    case SENSOR_STATUS_OK:            return SSS_OK;
+    case SENSOR_STATUS_NO_INIT:       return SSS_INFO;
+    case SENSOR_STATUS_TIMEOUT:       
+    case SENSOR_STATUS_CRC_ERROR:     
+    case SENSOR_STATUS_NO_DATA:       return SSS_WARNING;
+    case SENSOR_STATUS_CONN_ERROR:    return SSS_CRITICAL;
+    default:                          return SSS_ERROR;
+  };
+}
+
+static inline uint8_t statesSensorEffective(uint8_t severity)
+{
+  return severity >= (uint8_t)CONFIG_STATES_SENSOR_NOTIFY_SEVERITY ? severity : (uint8_t)SSS_OK;
+}
+
+static states_sensor_slot_t* statesSensorFind(uint8_t sensor_id)
+{
+  for (uint8_t i = 0; i < _statesSensorsCount; i++) {
+    if (_statesSensors[i].status.sensor_id == sensor_id) return &_statesSensors[i];
+  };
+  return nullptr;
+}
+
+#if ENABLE_NOTIFY_SENSOR_STATE
+
+// Finds the nearest deadline, must be called with the lock held; returns the delay for the timer, 0 - nothing is pending.
+// The timer itself is started after the lock is released
+static uint64_t statesSensorsTimerDelay(int64_t now)
+{
+  int64_t deadline = INT64_MAX;
+  for (uint8_t i = 0; i < _statesSensorsCount; i++) {
+    if (_statesSensors[i].pending && (_statesSensors[i].deadline < deadline)) deadline = _statesSensors[i].deadline;
+  };
+  _statesSensorsTimerArmed = deadline < INT64_MAX;
+  if (!_statesSensorsTimerArmed) return 0;
+  return deadline > now ? (uint64_t)(deadline - now) : 1;
+}
+
+static void statesSensorsTimerEnd(void* arg)
+{
+  struct {
+    rSensor* sensor;
+    uint8_t  status;
+  } due[CONFIG_STATES_SENSORS_MAX];
+  uint8_t count = 0;
+  int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&_statesSensorsLock);
+  for (uint8_t i = 0; i < _statesSensorsCount; i++) {
+    states_sensor_slot_t* slot = &_statesSensors[i];
+    if (slot->pending && (slot->deadline <= now)) {
+      slot->pending = false;
+      uint8_t effective = statesSensorEffective(slot->status.severity);
+      // The sensor has returned to the reported state: nothing to say
+      if (effective != slot->notified) {
+        slot->notified = effective;
+        due[count].sensor = (rSensor*)slot->sensor;
+        due[count].status = slot->status.status;
+        count++;
+      };
+    };
+  };
+  uint64_t delay = statesSensorsTimerDelay(now);
+  portEXIT_CRITICAL(&_statesSensorsLock);
+  if (delay > 0) esp_timer_start_once(_statesSensorsTimer, delay);
+
+  for (uint8_t i = 0; i < count; i++) {
+    // A status below the notification threshold is reported as recovery
+    if (statesSensorEffective(statesSensorSeverity((sensor_status_t)due[i].status)) == SSS_OK) {
+      statesSensorNotify(due[i].sensor, SENSOR_STATUS_OK);
+    } else {
+      statesSensorNotify(due[i].sensor, (sensor_status_t)due[i].status);
+    };
+  };
+}
+
+#endif // ENABLE_NOTIFY_SENSOR_STATE
 
-    if (statesNetworkIsConnected()) {
-      #if ENABLE_NOTIFY_INET_STATUS
-        hmInet.unlock();
-      #endif // ENABLE_NOTIFY_INET_STATUS
+static void statesSensorUpdate(sensor_event_status_t* data)
+{
+  #if ENABLE_NOTIFY_SENSOR_STATE
+    if (_statesSensorsTimer == nullptr) {
+      esp_timer_create_args_t cfgTimer;
+      memset(&cfgTimer, 0, sizeof(cfgTimer));
+      cfgTimer.callback = statesSensorsTimerEnd;
+      cfgTimer.name = "sensors_notify";
+      RE_OK_CHECK(esp_timer_create(&cfgTimer, &_statesSensorsTimer), return);
+    };
+  #endif // ENABLE_NOTIFY_SENSOR_STATE
+
+  uint8_t severity = statesSensorSeverity((sensor_status_t)data->new_status);
+  int64_t now = esp_timer_get_time();
+  time_t time_now = time(nullptr);
+  uint64_t delay = 0;
+  portENTER_CRITICAL(&_statesSensorsLock);
+  states_sensor_slot_t* slot = statesSensorFind(data->sensor_id);
+  if (slot == nullptr) {
+    if (_statesSensorsCount >= CONFIG_STATES_SENSORS_MAX) {
+      portEXIT_CRITICAL(&_statesSensorsLock);
+      rlog_w(logTAG, "Sensor status store is full, sensor %d is not tracked", data->sensor_id);
+      #if ENABLE_NOTIFY_SENSOR_STATE
+        statesSensorNotify((rSensor*)data->sensor, (sensor_status_t)data->new_status);
+      #endif // ENABLE_NOTIFY_SENSOR_STATE
+      return;
+    };
+    // A new sensor is assumed to have been fine, as if it had been reported so
+    slot = &_statesSensors[_statesSensorsCount++];
+    memset(slot, 0, sizeof(states_sensor_slot_t));
+    slot->status.sensor_id = data->sensor_id;
+    slot->status.status = SENSOR_STATUS_OK;
+    slot->status.severity = SSS_OK;
+    _statesSensorSeverities[SSS_OK]++;
+  };
+  slot->sensor = data->sensor;
+  if (slot->status.status != data->new_status) {
+    _statesSensorSeverities[slot->status.severity]--;
+    _statesSensorSeverities[severity]++;
+    slot->status.status = data->new_status;
+    slot->status.severity = severity;
+    slot->status.changes++;
+    slot->status.time_changed = time_now;
+    #if ENABLE_NOTIFY_SENSOR_STATE
+      if (statesSensorEffective(severity) != slot->notified) {
+        // The deadline is not moved by further changes, so a sensor that keeps changing is still reported
+        if (!slot->pending) {
+          slot->pending = true;
+          slot->deadline = now + (int64_t)CONFIG_STATES_SENSOR_DEBOUNCE * 1000000;
+          if (!_statesSensorsTimerArmed) delay = statesSensorsTimerDelay(now);
+        };
+      } else {
+        slot->pending = false;
+      };
+    #endif // ENABLE_NOTIFY_SENSOR_STATE
+  };
+  portEXIT_CRITICAL(&_statesSensorsLock);
+  #if ENABLE_NOTIFY_SENSOR_STATE
+    if (delay > 0) esp_timer_start_once(_statesSensorsTimer, delay);
+  #endif // ENABLE_NOTIFY_SENSOR_STATE
+}
 
-      healthMonitorsInetAvailable(false);
+states_sensor_severity_t statesSensorsWorstSeverity()
+{
+  states_sensor_severity_t worst = SSS_OK;
+  portENTER_CRITICAL(&_statesSensorsLock);
+  for (int8_t i = SSS_MAX - 1; i > SSS_OK; i--) {
+    if (_statesSensorSeverities[i] > 0) {
+      worst = (states_sensor_severity_t)i;
+      break;
     };
-  }
+  };
+  portEXIT_CRITICAL(&_statesSensorsLock);
+  return worst;
+}
 
-  static void healthMonitorsWiFiUnavailable(esp_err_t wifiState)
-  {
-    rlog_d(logTAG, "Sending wifi disconnect notifications");
+uint8_t statesSensorsCount(states_sensor_severity_t severity)
+{
+  return severity < SSS_MAX ? __atomic_load_n(&_statesSensorSeverities[severity], __ATOMIC_RELAXED) : 0;
+}
 
-    #if ENABLE_NOTIFY_WIFI_STATUS
-      if (wifiState != ESP_OK) hmWifi.setState(wifiState, time(nullptr));
-    #endif // ENABLE_NOTIFY_WIFI_STATUS
+bool statesSensorStatusGet(uint8_t sensor_id, states_sensor_status_t* status)
+{
+  if (status == nullptr) return false;
+  portENTER_CRITICAL(&_statesSensorsLock);
+  states_sensor_slot_t* slot = statesSensorFind(sensor_id);
+  if (slot) {
+    memcpy(status, &slot->status, sizeof(states_sensor_status_t));
+  };
+  portEXIT_CRITICAL(&_statesSensorsLock);
+  return slot != nullptr;
+}
 
-    if (!statesNetworkIsConnected()) {
-      #if ENABLE_NOTIFY_INET_STATUS
-        hmInet.lock();
-      #endif // ENABLE_NOTIFY_INET_STATUS
+static void statesSensorsWriter(states_buf_t* buf, void* arg)
+{
+  states_sensor_status_t sensors[CONFIG_STATES_SENSORS_MAX];
+  portENTER_CRITICAL(&_statesSensorsLock);
+  uint8_t count = _statesSensorsCount;
+  for (uint8_t i = 0; i < count; i++) {
+    memcpy(&sensors[i], &_statesSensors[i].status, sizeof(states_sensor_status_t));
+  };
+  portEXIT_CRITICAL(&_statesSensorsLock);
 
-      healthMonitorsInetUnavailable(ESP_ERR_INVALID_STATE, 0);
-    };
-  }
+  statesBufPrintf(buf, "{\"worst\":\"%s\",\"sensors\":[", _statesSensorSeverityNames[statesSensorsWorstSeverity()]);
+  for (uint8_t i = 0; i < count; i++) {
+    statesBufPrintf(buf, "%s{\"id\":%d,\"status\":%d,\"severity\":\"%s\",\"changes\":%d,\"changed\":%lld}", i > 0 ? "," : "",
+      sensors[i].sensor_id, sensors[i].status, _statesSensorSeverityNames[sensors[i].severity], sensors[i].changes, (long long)sensors[i].time_changed);
+  };
+  statesBufPrintf(buf, "]}");
+}
 
-#endif // CONFIG_WIFI_ENABLED
+size_t statesSensorsJsonTo(char* buffer, size_t size)
+{
+  return statesBufWrite(statesSensorsWriter, nullptr, buffer, size);
+}
 
-#if defined(CONFIG_ETH_ENABLED) && (CONFIG_ETH_ENABLED == 1)
+#if !CONFIG_STATES_ZERO_HEAP
+char* statesSensorsJson()
+{
+  return statesBufMalloc(statesSensorsWriter, nullptr);
+}
+#endif // CONFIG_STATES_ZERO_HEAP
 
-  static void healthMonitorsEthernetAvailable(bool setEthernetState)
-  {
-    rlog_d(logTAG, "Sending ethernet connect notifications");
+#endif // CONFIG_STATES_SENSOR_SEVERITY
 
-    #if ENABLE_NOTIFY_ETH_STATUS
-      if (setEthernetState) {
-        hmEthernet.setStateCustom(ESP_OK, time(nullptr), true, nullptr);
-      };
-    #endif // ENABLE_NOTIFY_ETH_STATUS
+static void statesEventHandlerSensor(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+{
+  // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_SENSOR_STATUS_CHANGED");
 
-    if (statesNetworkIsConnected()) {
-      #if ENABLE_NOTIFY_INET_STATUS
-        hmInet.unlock();
-      #endif // ENABLE_NOTIFY_INET_STATUS
+  if (event_data != nullptr) {
+    sensor_event_status_t* data = (sensor_event_status_t*)event_data;
 
-      healthMonitorsInetAvailable(false);
+    // Set new status
+    switch (data->sensor_id) {
+      case 1:
+        statesSetError(ERR_SENSOR_1, ((sensor_status_t)data->new_status != SENSOR_STATUS_OK));
+        break;
+      case 2:
+        statesSetError(ERR_SENSOR_2, ((sensor_status_t)data->new_status != SENSOR_STATUS_OK));
+        break;
+      case 3:
+        statesSetError(ERR_SENSOR_3, ((sensor_status_t)data->new_status != SENSOR_STATUS_OK));
+        break;
+      case 4:
+        statesSetError(ERR_SENSOR_4, ((sensor_status_t)data->new_status != SENSOR_STATUS_OK));
+        break;
+      case 5:
+        statesSetError(ERR_SENSOR_5, ((sensor_status_t)data->new_status != SENSOR_STATUS_OK));
+        break;
+      case 6:
+        statesSetError(ERR_SENSOR_6, ((sensor_status_t)data->new_status != SENSOR_STATUS_OK));
+        break;
+      case 7:
+        statesSetError(ERR_SENSOR_7, ((sensor_status_t)data->new_status != SENSOR_STATUS_OK));
+        break;
+      default:
+        statesSetError(ERR_SENSOR_0, ((sensor_status_t)data->new_status != SENSOR_STATUS_OK));
+        break;
     };
-  }
 
-  static void healthMonitorsEthernetUnavailable(esp_err_t ethernetState)
-  {
-    rlog_d(logTAG, "Sending ethernet disconnect notifications");
+    #if CONFIG_STATES_SENSOR_SEVERITY
+      // Notifications are sent by the status store after the debounce time
+      statesSensorUpdate(data);
+    #elif ENABLE_NOTIFY_SENSOR_STATE
+      statesSensorNotify((rSensor*)data->sensor, (sensor_status_t)data->new_status);
+    #endif // ENABLE_NOTIFY_SENSOR_STATE
+  };
+}
 
-    #if ENABLE_NOTIFY_ETH_STATUS
-      if (ethernetState != ESP_OK) hmEthernet.setState(ethernetState, time(nullptr));
-    #endif // ENABLE_NOTIFY_ETH_STATUS
+#endif // CONFIG_NO_SENSORS
 
-    if (!statesNetworkIsConnected()) {
-      #if ENABLE_NOTIFY_INET_STATUS
-        hmInet.lock();
-      #endif // ENABLE_NOTIFY_INET_STATUS
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- Event dispatch ---------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
 
-      healthMonitorsInetUnavailable(ESP_ERR_INVALID_STATE, 0);
-    };
-  }
+#if CONFIG_STATES_HANDLER_STATS || CONFIG_STATES_HISTORY || CONFIG_STATES_EVENT_TRACE || CONFIG_STATES_STRESS || (CONFIG_STATES_ZERO_HEAP && CONFIG_STATES_ZERO_HEAP_CHECK)
+  #define STATES_EVENT_DISPATCH 1
+#else
+  #define STATES_EVENT_DISPATCH 0
+#endif // STATES_EVENT_DISPATCH
 
-#endif // CONFIG_ETH_ENABLED)
+#if STATES_EVENT_DISPATCH
 
-// -- Parameters ---------------------------------------------------------------------------------------------------------
-#if CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-  static uint32_t  _hmNotifyDelayFailure = CONFIG_NOTIFY_TELEGRAM_MINIMUM_FAILURE_TIME;
-  static uint8_t   _hmNotifyWifi = CONFIG_NOTIFY_TELEGRAM_WIFI_STATUS;
-  static uint8_t   _hmNotifyEthernet = CONFIG_NOTIFY_TELEGRAM_ETH_STATUS;
-  static uint8_t   _hmNotifyMqtt = CONFIG_NOTIFY_TELEGRAM_MQTT_STATUS;
-  static uint8_t   _hmNotifyMqttErrors = CONFIG_NOTIFY_TELEGRAM_MQTT_ERRORS;
+#if CONFIG_STATES_HANDLER_STATS
+
+#ifndef CONFIG_STATES_HANDLER_STATS_MAX_ID
+  #define CONFIG_STATES_HANDLER_STATS_MAX_ID 24
+#endif // CONFIG_STATES_HANDLER_STATS_MAX_ID
+#define CONFIG_STATES_HANDLER_STATS_BUCKETS 16
+
+typedef struct {
+  uint32_t count;
+  uint32_t time_max;
+  uint64_t time_total;
+  uint32_t delay_count;
+  uint32_t delay_max;
+  uint64_t delay_total;
+  uint32_t histogram[CONFIG_STATES_HANDLER_STATS_BUCKETS];
+} states_handler_stats_t;
+
+#endif // CONFIG_STATES_HANDLER_STATS
+
+typedef struct {
+  const char* name;
+  esp_event_handler_t handler;
+  esp_event_base_t base;
+  #if CONFIG_STATES_HANDLER_STATS
+    states_post_time_cb_t post_time;
+    // The last slot collects all event identifiers that do not fit into the table
+    states_handler_stats_t stats[CONFIG_STATES_HANDLER_STATS_MAX_ID + 1];
+  #endif // CONFIG_STATES_HANDLER_STATS
+} states_handler_t;
+
+static states_handler_t _statesHandlers[SH_MAX] = {
+  { "system", &statesEventHandlerSystem },
+  { "time",   &statesEventHandlerTime },
+  { "wifi",   &statesEventHandlerWiFi },
+  { "mqtt",   &statesEventHandlerMqtt },
   #if CONFIG_PINGER_ENABLE
-    static uint8_t  _hmNotifyInet = CONFIG_NOTIFY_TELEGRAM_INET_UNAVAILABLE;
+  { "ping",   &statesEventHandlerPing },
+  #else
+  { "ping",   nullptr },
   #endif // CONFIG_PINGER_ENABLE
-  #if CONFIG_OPENMON_ENABLE
-    static uint8_t  _hmNotifyOpenMon = CONFIG_NOTIFY_TELEGRAM_OPENMON_STATUS;
-  #endif // CONFIG_OPENMON_ENABLE
-  #if CONFIG_NARODMON_ENABLE
-    static uint8_t  _hmNotifyNarodMon = CONFIG_NOTIFY_TELEGRAM_NARODMON_STATUS;
-  #endif // CONFIG_NARODMON_ENABLE
-  #if CONFIG_THINGSPEAK_ENABLE
-    static uint8_t  _hmNotifyThingSpeak = CONFIG_NOTIFY_TELEGRAM_THINGSPEAK_STATUS;
-  #endif // CONFIG_THINGSPEAK_ENABLE
-  static uint8_t   _hmNotifySensors = CONFIG_NOTIFY_TELEGRAM_SENSOR_STATE;
-  #if CONFIG_SILENT_MODE_ENABLE
-    static uint8_t _hmNotifySilentMode = CONFIG_NOTIFY_TELEGRAM_SILENT_MODE;
-  #endif // CONFIG_SILENT_MODE_ENABLE
+  #ifndef CONFIG_NO_SENSORS
+  { "sensor", &statesEventHandlerSensor },
+  #else
+  { "sensor", nullptr },
+  #endif // CONFIG_NO_SENSORS
+};
 
-  static void healthMonitorsRegisterParameters()
-  {
-    paramsGroupHandle_t pgNotify = paramsRegisterGroup(nullptr, 
-      CONFIG_STATES_NOTIFY_PGROUP_ROOT_KEY, CONFIG_STATES_NOTIFY_PGROUP_ROOT_TOPIC, CONFIG_STATES_NOTIFY_PGROUP_ROOT_FRIENDLY);
-    paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U32, nullptr, pgNotify,
-      CONFIG_NOTIFY_TELEGRAM_MINIMUM_FAILURE_TIME_KEY, CONFIG_NOTIFY_TELEGRAM_MINIMUM_FAILURE_TIME_FRIENDLY,
-      CONFIG_MQTT_PARAMS_QOS, (void*)&_hmNotifyDelayFailure);
+#if CONFIG_STATES_HANDLER_STATS
 
-    // -- WiFi --------------------------------------------------------------------
-    #if !defined(CONFIG_WIFI_ENABLED) || (CONFIG_WIFI_ENABLED == 1)
-      hmWifi.assignParams(nullptr, &_hmNotifyWifi);
-      paramsSetLimitsU8(
-        paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U8, nullptr, pgNotify,
-          CONFIG_NOTIFY_TELEGRAM_WIFI_KEY, CONFIG_NOTIFY_TELEGRAM_WIFI_FRIENDLY,
-          CONFIG_MQTT_PARAMS_QOS, (void*)&_hmNotifyWifi),
-        0, 1);
-    #endif // CONFIG_WIFI_ENABLED    
-    
-    // -- Ethernet --------------------------------------------------------------------
-    #if defined(CONFIG_ETH_ENABLED) && (CONFIG_ETH_ENABLED == 1)
-      hmEthernet.assignParams(nullptr, &_hmNotifyEthernet);
-      paramsSetLimitsU8(
-        paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U8, nullptr, pgNotify,
-          CONFIG_NOTIFY_TELEGRAM_ETH_KEY, CONFIG_NOTIFY_TELEGRAM_ETH_FRIENDLY,
-          CONFIG_MQTT_PARAMS_QOS, (void*)&_hmNotifyEthernet),
-        0, 1);
-    #endif // CONFIG_ETH_ENABLED)
+// Bucket N contains durations from 2^(N-1) to 2^N-1 microseconds, the last bucket contains everything longer
+static inline uint8_t statesHandlerStatsBucket(uint32_t value)
+{
+  if (value == 0) return 0;
+  uint8_t bucket = 32 - __builtin_clz(value);
+  return bucket < CONFIG_STATES_HANDLER_STATS_BUCKETS ? bucket : CONFIG_STATES_HANDLER_STATS_BUCKETS - 1;
+}
 
-    // -- Ping --------------------------------------------------------------------
+static void statesHandlerStatsAdd(states_handler_t* handler, int32_t event_id, void* event_data, int64_t time_start, int64_t time_end)
+{
+  uint32_t duration = (uint32_t)(time_end - time_start);
+  states_handler_stats_t* stats = &handler->stats[((event_id >= 0) && (event_id < CONFIG_STATES_HANDLER_STATS_MAX_ID)) ? event_id : CONFIG_STATES_HANDLER_STATS_MAX_ID];
+  stats->count++;
+  stats->time_total += duration;
+  if (duration > stats->time_max) stats->time_max = duration;
+  stats->histogram[statesHandlerStatsBucket(duration)]++;
+
+  // Delay between posting an event and its processing, if the sender put a timestamp in it
+  if (handler->post_time) {
+    int64_t time_post = handler->post_time(event_id, event_data);
+    if ((time_post > 0) && (time_post <= time_start)) {
+      uint32_t delay = (uint32_t)(time_start - time_post);
+      stats->delay_count++;
+      stats->delay_total += delay;
+      if (delay > stats->delay_max) stats->delay_max = delay;
+    };
+  };
+}
+
+#endif // CONFIG_STATES_HANDLER_STATS
+
+#if CONFIG_STATES_ZERO_HEAP && CONFIG_STATES_ZERO_HEAP_CHECK
+
+#if !CONFIG_HEAP_USE_HOOKS
+  #error "CONFIG_STATES_ZERO_HEAP_CHECK requires CONFIG_HEAP_USE_HOOKS"
+#endif // CONFIG_HEAP_USE_HOOKS
+
+/**
+ * The heap hooks count the allocations made on the event loop task while one of the states handlers is running,
+ * any such allocation is a violation of the zero-heap profile. The hooks are weak: an application that needs its own
+ * esp_heap_trace_alloc_hook() must call statesZeroHeapAllocHook() from it
+ * */
+
+static TaskHandle_t _statesZeroHeapTask = nullptr;
+static uint32_t _statesZeroHeapAllocs = 0;
+static uint32_t _statesZeroHeapViolations = 0;
+
+void statesZeroHeapAllocHook(void* ptr, size_t size, uint32_t caps)
+{
+  if ((_statesZeroHeapTask != nullptr) && (_statesZeroHeapTask == xTaskGetCurrentTaskHandle())) {
+    _statesZeroHeapAllocs++;
+  };
+}
+
+extern "C" __attribute__((weak)) void esp_heap_trace_alloc_hook(void* ptr, size_t size, uint32_t caps)
+{
+  statesZeroHeapAllocHook(ptr, size, caps);
+}
+
+extern "C" __attribute__((weak)) void esp_heap_trace_free_hook(void* ptr)
+{
+}
+
+uint32_t statesZeroHeapViolations()
+{
+  return _statesZeroHeapViolations;
+}
+
+#endif // CONFIG_STATES_ZERO_HEAP_CHECK
+
+#if CONFIG_STATES_EVENT_TRACE
+
+/**
+ * Every event passed to the handlers is recorded into a ring buffer: the beginning of the payload is stored as is
+ * (only for the events whose payload layout is known) together with the CRC32 of the whole payload. The dump can be 
+ * replayed through the same handlers, at full speed or with the original pacing. The payloads of sensor events 
+ * contain a pointer to the sensor object, so they are replayed only on the device and session that recorded them.
+ * The events are posted to the event loop again, so all subscribers get them on the event loop task as usual;
+ * recording is paused while the replay is posting. The replay changes the real states and may send notifications, 
+ * it is intended for a bench device
+ * */
+
+#ifndef CONFIG_STATES_EVENT_TRACE_SIZE
+  #define CONFIG_STATES_EVENT_TRACE_SIZE 64
+#endif // CONFIG_STATES_EVENT_TRACE_SIZE
+static_assert((CONFIG_STATES_EVENT_TRACE_SIZE & (CONFIG_STATES_EVENT_TRACE_SIZE - 1)) == 0, "CONFIG_STATES_EVENT_TRACE_SIZE must be a power of two");
+#ifndef CONFIG_STATES_EVENT_TRACE_REPLAY_DELAY_MAX
+  #define CONFIG_STATES_EVENT_TRACE_REPLAY_DELAY_MAX 60000
+#endif // CONFIG_STATES_EVENT_TRACE_REPLAY_DELAY_MAX
+
+#define STATES_TRACE_MAGIC 0x31455453U  // "STE1"
+#define STATES_TRACE_HEADER_SIZE 12
+#define STATES_TRACE_RECORD_SIZE (17 + CONFIG_STATES_EVENT_TRACE_PAYLOAD)
+
+typedef struct {
+  uint32_t sequence;  // Index of the record + 1, 0 - the slot is empty or is being written
+  states_trace_record_t data;
+} states_trace_slot_t;
+
+typedef struct {
+  uint32_t head;      // Total number of records written
+  uint32_t session;   // Random identifier of the current session
+  states_trace_slot_t slots[CONFIG_STATES_EVENT_TRACE_SIZE];
+} states_trace_t;
+
+static states_trace_t _statesTrace;
+static bool _statesTraceReplaying = false;
+
+static void statesEventTraceInit()
+{
+  memset(&_statesTrace, 0, sizeof(_statesTrace));
+  _statesTrace.session = esp_random();
+}
+
+// Length of the payload for the events whose data is used by the handlers, 0 - no data or the layout is unknown
+static uint16_t statesEventTracePayloadLength(uint8_t handler, int32_t event_id, void* event_data)
+{
+  if (event_data == nullptr) return 0;
+  switch (handler) {
+    case SH_SYSTEM:
+      if (event_id == RE_SYS_OTA) return sizeof(re_system_event_data_t);
+      if ((event_id == RE_SYS_ERROR) || (event_id == RE_SYS_TELEGRAM_ERROR) || (event_id == RE_SYS_OPENMON_ERROR)
+       || (event_id == RE_SYS_NARODMON_ERROR) || (event_id == RE_SYS_THINGSPEAK_ERROR)) {
+        return sizeof(re_error_event_data_t);
+      };
+      break;
+    case SH_MQTT:
+      if ((event_id == RE_MQTT_CONNECTED) || (event_id == RE_MQTT_CONN_LOST) || (event_id == RE_MQTT_CONN_FAILED)) {
+        return sizeof(re_mqtt_event_data_t);
+      };
+      if (event_id == RE_MQTT_ERROR) return strnlen((char*)event_data, CONFIG_STATES_EVENT_TRACE_PAYLOAD - 1) + 1;
+      break;
     #if CONFIG_PINGER_ENABLE
-      hmInet.assignParams(&_hmNotifyDelayFailure, &_hmNotifyInet);
-      paramsSetLimitsU8(
-        paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U8, nullptr, pgNotify,
-          CONFIG_NOTIFY_TELEGRAM_INET_KEY, CONFIG_NOTIFY_TELEGRAM_INET_FRIENDLY,
-          CONFIG_MQTT_PARAMS_QOS, (void*)&_hmNotifyInet),
-        0, 1);
+    case SH_PING:
+      if ((event_id == RE_PING_INET_AVAILABLE) || (event_id == RE_PING_INET_SLOWDOWN) || (event_id == RE_PING_INET_UNAVAILABLE)) {
+        return sizeof(ping_inet_data_t);
+      };
+      return sizeof(ping_host_data_t);
+    #endif // CONFIG_PINGER_ENABLE
+    #ifndef CONFIG_NO_SENSORS
+    case SH_SENSOR:
+      return sizeof(sensor_event_status_t);
+    #endif // CONFIG_NO_SENSORS
+    default:
+      break;
+  };
+  return 0;
+}
+
+static void statesEventTraceAdd(uint8_t handler, int32_t event_id, void* event_data)
+{
+  // Events of the replay itself are not recorded
+  if (__atomic_load_n(&_statesTraceReplaying, __ATOMIC_RELAXED)) return;
+
+  uint32_t index = __atomic_fetch_add(&_statesTrace.head, 1, __ATOMIC_RELAXED);
+  states_trace_slot_t* slot = &_statesTrace.slots[index & (CONFIG_STATES_EVENT_TRACE_SIZE - 1)];
+  __atomic_store_n(&slot->sequence, 0, __ATOMIC_RELAXED);
+  // The slot is marked as being written before any of its data is changed
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  slot->data.timestamp = esp_timer_get_time();
+  slot->data.event_id = event_id;
+  slot->data.handler = handler;
+  slot->data.length = statesEventTracePayloadLength(handler, event_id, event_data);
+  memset(slot->data.payload, 0, sizeof(slot->data.payload));
+  if (slot->data.length > 0) {
+    slot->data.digest = esp_rom_crc32_le(0, (const uint8_t*)event_data, slot->data.length);
+    memcpy(slot->data.payload, event_data, slot->data.length < sizeof(slot->data.payload) ? slot->data.length : sizeof(slot->data.payload));
+  } else {
+    slot->data.digest = 0;
+  };
+  __atomic_store_n(&slot->sequence, index + 1, __ATOMIC_RELEASE);
+}
+
+void statesEventTraceClear()
+{
+  _statesTrace.head = 0;
+  memset(&_statesTrace.slots, 0, sizeof(_statesTrace.slots));
+}
+
+uint32_t statesEventTraceCount()
+{
+  uint32_t head = __atomic_load_n(&_statesTrace.head, __ATOMIC_ACQUIRE);
+  return head < CONFIG_STATES_EVENT_TRACE_SIZE ? head : CONFIG_STATES_EVENT_TRACE_SIZE;
+}
+
+size_t statesEventTraceDump(uint8_t* buffer, size_t size)
+{
+  // Header: magic (4), record size (2), record count (2), session (4), then records from old to new:
+  // timestamp (8), digest (4), event id (2), payload length (2), handler (1), payload (CONFIG_STATES_EVENT_TRACE_PAYLOAD)
+  if ((buffer == nullptr) || (size < STATES_TRACE_HEADER_SIZE)) return 0;
+
+  size_t len = STATES_TRACE_HEADER_SIZE;
+  uint16_t count = 0;
+  uint32_t head = __atomic_load_n(&_statesTrace.head, __ATOMIC_ACQUIRE);
+  uint32_t position = head > CONFIG_STATES_EVENT_TRACE_SIZE ? head - CONFIG_STATES_EVENT_TRACE_SIZE : 0;
+  while (((len + STATES_TRACE_RECORD_SIZE) <= size) && (position != __atomic_load_n(&_statesTrace.head, __ATOMIC_ACQUIRE))) {
+    states_trace_slot_t* slot = &_statesTrace.slots[position & (CONFIG_STATES_EVENT_TRACE_SIZE - 1)];
+    uint32_t sequence = ++position;
+    // Records that have been overwritten or are being written at the moment are skipped
+    states_trace_record_t rec;
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != sequence) continue;
+    memcpy(&rec, &slot->data, sizeof(states_trace_record_t));
+    // The copy must be complete before the sequence is checked again
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != sequence) continue;
+    memcpy(&buffer[len], &rec.timestamp, 8);
+    memcpy(&buffer[len + 8], &rec.digest, 4);
+    memcpy(&buffer[len + 12], &rec.event_id, 2);
+    memcpy(&buffer[len + 14], &rec.length, 2);
+    buffer[len + 16] = rec.handler;
+    memcpy(&buffer[len + 17], rec.payload, CONFIG_STATES_EVENT_TRACE_PAYLOAD);
+    len += STATES_TRACE_RECORD_SIZE;
+    count++;
+  };
+
+  uint32_t magic = STATES_TRACE_MAGIC;
+  uint16_t rsize = STATES_TRACE_RECORD_SIZE;
+  memcpy(&buffer[0], &magic, 4);
+  memcpy(&buffer[4], &rsize, 2);
+  memcpy(&buffer[6], &count, 2);
+  memcpy(&buffer[8], &_statesTrace.session, 4);
+  return len;
+}
+
+int32_t statesEventTraceReplay(const uint8_t* data, size_t size, bool realtime)
+{
+  uint32_t magic, session;
+  uint16_t rsize, count;
+  if ((data == nullptr) || (size < STATES_TRACE_HEADER_SIZE)) return -1;
+  memcpy(&magic, &data[0], 4);
+  memcpy(&rsize, &data[4], 2);
+  memcpy(&count, &data[6], 2);
+  memcpy(&session, &data[8], 4);
+  if ((magic != STATES_TRACE_MAGIC) || (rsize != STATES_TRACE_RECORD_SIZE) || (size < STATES_TRACE_HEADER_SIZE + (size_t)count * rsize)) {
+    rlog_e(logTAG, "Event trace replay: invalid dump");
+    return -1;
+  };
+
+  bool same_session = session == _statesTrace.session;
+  int32_t replayed = 0;
+  uint32_t skipped = 0;
+  int64_t prev_timestamp = 0;
+  int64_t time_start = esp_timer_get_time();
+  __atomic_store_n(&_statesTraceReplaying, true, __ATOMIC_RELAXED);
+  for (uint16_t i = 0; i < count; i++) {
+    const uint8_t* item = &data[STATES_TRACE_HEADER_SIZE + (size_t)i * rsize];
+    states_trace_record_t rec;
+    memcpy(&rec.timestamp, &item[0], 8);
+    memcpy(&rec.digest, &item[8], 4);
+    memcpy(&rec.event_id, &item[12], 2);
+    memcpy(&rec.length, &item[14], 2);
+    rec.handler = item[16];
+    memcpy(rec.payload, &item[17], CONFIG_STATES_EVENT_TRACE_PAYLOAD);
+
+    // Truncated payloads cannot be passed to the handlers, they would read past the stored data
+    if ((rec.handler >= SH_MAX) || (_statesHandlers[rec.handler].handler == nullptr) || (_statesHandlers[rec.handler].base == nullptr)
+     || (rec.length > CONFIG_STATES_EVENT_TRACE_PAYLOAD) 
+     || ((rec.length > 0) && (esp_rom_crc32_le(0, rec.payload, rec.length) != rec.digest))
+     || ((rec.handler == SH_SENSOR) && (rec.length > 0) && !same_session)) {
+      skipped++;
+      continue;
+    };
+    #if CONFIG_PINGER_ENABLE
+      // The host name is not used by the handlers and cannot be restored
+      if ((rec.handler == SH_PING) && (rec.length == sizeof(ping_host_data_t))) {
+        ((ping_host_data_t*)rec.payload)->host_name = nullptr;
+      };
     #endif // CONFIG_PINGER_ENABLE
 
-    // -- MQTT --------------------------------------------------------------------
-    hmMqtt.assignParams(&_hmNotifyDelayFailure, &_hmNotifyMqtt);
-    #if CONFIG_PINGER_ENABLE && defined(CONFIG_MQTT1_TYPE) && CONFIG_MQTT1_PING_CHECK
-      hmMqttPing1.assignParams(&_hmNotifyDelayFailure, &_hmNotifyMqtt);
-    #endif // CONFIG_MQTT1_PING_CHECK
-    #if CONFIG_PINGER_ENABLE && defined(CONFIG_MQTT2_TYPE) && CONFIG_MQTT2_PING_CHECK
-      hmMqttPing2.assignParams(&_hmNotifyDelayFailure, &_hmNotifyMqtt);
-    #endif // CONFIG_MQTT2_PING_CHECK
-    paramsSetLimitsU8(
-      paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U8, nullptr, pgNotify,
-        CONFIG_NOTIFY_TELEGRAM_MQTT_KEY, CONFIG_NOTIFY_TELEGRAM_MQTT_FRIENDLY,
-        CONFIG_MQTT_PARAMS_QOS, (void*)&_hmNotifyMqtt),
-      0, 1);
-    paramsSetLimitsU8(
-      paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U8, nullptr, pgNotify,
-        CONFIG_NOTIFY_TELEGRAM_MQTT_ERRORS_KEY, CONFIG_NOTIFY_TELEGRAM_MQTT_ERRORS_FRIENDLY,
-        CONFIG_MQTT_PARAMS_QOS, (void*)&_hmNotifyMqttErrors),
-      0, 1);
+    if (realtime && (prev_timestamp > 0) && (rec.timestamp > prev_timestamp)) {
+      int64_t delay_ms = (rec.timestamp - prev_timestamp) / 1000;
+      if (delay_ms > CONFIG_STATES_EVENT_TRACE_REPLAY_DELAY_MAX) delay_ms = CONFIG_STATES_EVENT_TRACE_REPLAY_DELAY_MAX;
+      if (delay_ms > 0) vTaskDelay(pdMS_TO_TICKS(delay_ms));
+    };
+    prev_timestamp = rec.timestamp;
+
+    if (eventLoopPost(_statesHandlers[rec.handler].base, rec.event_id, rec.length > 0 ? rec.payload : nullptr, rec.length, portMAX_DELAY)) {
+      replayed++;
+    } else {
+      skipped++;
+    };
+  };
+  __atomic_store_n(&_statesTraceReplaying, false, __ATOMIC_RELAXED);
+
+  rlog_i(logTAG, "Event trace replay: %d events posted in %lld us, %d skipped", 
+    replayed, esp_timer_get_time() - time_start, skipped);
+  return replayed;
+}
+
+#endif // CONFIG_STATES_EVENT_TRACE
+
+// All handlers are called from the same event loop task, so counters are updated without locks
+static void statesEventHandlerDispatch(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+{
+  states_handler_t* handler = (states_handler_t*)arg;
+  if ((handler == nullptr) || (handler->handler == nullptr)) return;
+
+  #if CONFIG_STATES_HISTORY
+    _statesEventTask = xTaskGetCurrentTaskHandle();
+    _statesEventHandler = handler - _statesHandlers;
+    _statesEventId = event_id;
+  #endif // CONFIG_STATES_HISTORY
+
+  #if CONFIG_STATES_EVENT_TRACE
+    statesEventTraceAdd(handler - _statesHandlers, event_id, event_data);
+  #endif // CONFIG_STATES_EVENT_TRACE
+
+  #if CONFIG_STATES_ZERO_HEAP && CONFIG_STATES_ZERO_HEAP_CHECK
+    uint32_t allocs = _statesZeroHeapAllocs;
+    _statesZeroHeapTask = xTaskGetCurrentTaskHandle();
+  #endif // CONFIG_STATES_ZERO_HEAP_CHECK
+
+  #if CONFIG_STATES_HANDLER_STATS
+    int64_t time_start = esp_timer_get_time();
+    handler->handler(nullptr, event_base, event_id, event_data);
+    statesHandlerStatsAdd(handler, event_id, event_data, time_start, esp_timer_get_time());
+  #else
+    handler->handler(nullptr, event_base, event_id, event_data);
+  #endif // CONFIG_STATES_HANDLER_STATS
+
+  #if CONFIG_STATES_ZERO_HEAP && CONFIG_STATES_ZERO_HEAP_CHECK
+    _statesZeroHeapTask = nullptr;
+    if (_statesZeroHeapAllocs != allocs) {
+      _statesZeroHeapViolations++;
+      rlog_w(logTAG, "Zero heap: %d allocation(s) in handler [%s], event_id=%d", 
+        _statesZeroHeapAllocs - allocs, handler->name, event_id);
+    };
+  #endif // CONFIG_STATES_ZERO_HEAP_CHECK
+
+  #if CONFIG_STATES_HISTORY
+    _statesEventHandler = SH_NONE;
+    _statesEventId = -1;
+  #endif // CONFIG_STATES_HISTORY
+}
+
+static bool statesEventHandlerRegisterDispatch(states_handler_index_t index, esp_event_base_t event_base, int32_t event_id)
+{
+  _statesHandlers[index].base = event_base;
+  return eventHandlerRegister(event_base, event_id, &statesEventHandlerDispatch, &_statesHandlers[index]);
+}
+
+#if CONFIG_STATES_HANDLER_STATS
+
+void statesHandlerStatsSetPostTime(esp_event_base_t event_base, states_post_time_cb_t cb_post_time)
+{
+  for (uint8_t i = 0; i < SH_MAX; i++) {
+    if (_statesHandlers[i].base == event_base) {
+      _statesHandlers[i].post_time = cb_post_time;
+    };
+  };
+}
 
-    // -- OpenMon -----------------------------------------------------------------
-    #if CONFIG_OPENMON_ENABLE
-      hmOpenMon.assignParams(&_hmNotifyDelayFailure, &_hmNotifyOpenMon);
-      paramsSetLimitsU8(
-        paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U8, nullptr, pgNotify,
-          CONFIG_NOTIFY_TELEGRAM_OPENMON_KEY, CONFIG_NOTIFY_TELEGRAM_OPENMON_FRIENDLY,
-          CONFIG_MQTT_PARAMS_QOS, (void*)&_hmNotifyOpenMon),
-        0, 1);
-    #endif // CONFIG_OPENMON_ENABLE
+void statesHandlerStatsReset()
+{
+  for (uint8_t i = 0; i < SH_MAX; i++) {
+    memset(&_statesHandlers[i].stats, 0, sizeof(_statesHandlers[i].stats));
+  };
+}
 
-    // -- NarodMon ----------------------------------------------------------------
-    #if CONFIG_NARODMON_ENABLE
-      hmNarodMon.assignParams(&_hmNotifyDelayFailure, &_hmNotifyNarodMon);
-      paramsSetLimitsU8(
-        paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U8, nullptr, pgNotify,
-          CONFIG_NOTIFY_TELEGRAM_NARODMON_KEY, CONFIG_NOTIFY_TELEGRAM_NARODMON_FRIENDLY,
-          CONFIG_MQTT_PARAMS_QOS, (void*)&_hmNotifyNarodMon),
-        0, 1);
-    #endif // CONFIG_NARODMON_ENABLE
+static void statesHandlerStatsItemJson(states_buf_t* buf, int32_t event_id, states_handler_stats_t* stats)
+{
+  statesBufPrintf(buf, "{\"id\":%d,\"count\":%u,\"total\":%llu,\"avg\":%llu,\"max\":%u,\"delay_count\":%u,\"delay_avg\":%llu,\"delay_max\":%u,\"hist\":[",
+    event_id, stats->count, stats->time_total, stats->time_total / stats->count, stats->time_max,
+    stats->delay_count, stats->delay_count > 0 ? stats->delay_total / stats->delay_count : 0, stats->delay_max);
+  for (uint8_t i = 0; i < CONFIG_STATES_HANDLER_STATS_BUCKETS; i++) {
+    statesBufPrintf(buf, i > 0 ? ",%u" : "%u", stats->histogram[i]);
+  };
+  statesBufPrintf(buf, "]}");
+}
 
-    // -- ThingSpeak --------------------------------------------------------------
-    #if CONFIG_THINGSPEAK_ENABLE
-      hmThingSpeak.assignParams(&_hmNotifyDelayFailure, &_hmNotifyThingSpeak);
-      paramsSetLimitsU8(
-        paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U8, nullptr, pgNotify,
-          CONFIG_NOTIFY_TELEGRAM_THINGSPEAK_KEY, CONFIG_NOTIFY_TELEGRAM_THINGSPEAK_FRIENDLY,
-          CONFIG_MQTT_PARAMS_QOS, (void*)&_hmNotifyThingSpeak),
-        0, 1);
-    #endif // CONFIG_THINGSPEAK_ENABLE
+static void statesHandlerStatsWriter(states_buf_t* buf, void* arg)
+{
+  bool first = true;
+  statesBufPrintf(buf, "{");
+  for (uint8_t i = 0; i < SH_MAX; i++) {
+    if (_statesHandlers[i].handler == nullptr) continue;
+
+    // Add handler to JSON object
+    statesBufPrintf(buf, "%s\"%s\":[", first ? "" : ",", _statesHandlers[i].name);
+    first = false;
+    bool first_event = true;
+    for (uint8_t j = 0; j <= CONFIG_STATES_HANDLER_STATS_MAX_ID; j++) {
+      states_handler_stats_t stats;
+      memcpy(&stats, &_statesHandlers[i].stats[j], sizeof(states_handler_stats_t));
+      if (stats.count > 0) {
+        if (!first_event) statesBufPrintf(buf, ",");
+        statesHandlerStatsItemJson(buf, j < CONFIG_STATES_HANDLER_STATS_MAX_ID ? j : -1, &stats);
+        first_event = false;
+      };
+    };
+    statesBufPrintf(buf, "]");
+  };
+  statesBufPrintf(buf, "}");
+}
 
-    // -- Sensors -----------------------------------------------------------------
-    paramsSetLimitsU8(
-      paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U8, nullptr, pgNotify,
-        CONFIG_NOTIFY_TELEGRAM_SENSOR_KEY, CONFIG_NOTIFY_TELEGRAM_SENSOR_FRIENDLY,
-        CONFIG_MQTT_PARAMS_QOS, (void*)&_hmNotifySensors),
+size_t statesHandlerStatsJsonTo(char* buffer, size_t size)
+{
+  return statesBufWrite(statesHandlerStatsWriter, nullptr, buffer, size);
+}
 
-      0, 1);
+#if !CONFIG_STATES_ZERO_HEAP
+char* statesHandlerStatsJson()
+{
+  return statesBufMalloc(statesHandlerStatsWriter, nullptr);
+}
+#endif // CONFIG_STATES_ZERO_HEAP
 
-    // -- Silent mode -------------------------------------------------------------
-    #if CONFIG_SILENT_MODE_ENABLE
-    paramsSetLimitsU8(
-      paramsRegisterValue(OPT_KIND_PARAMETER, OPT_TYPE_U8, nullptr, pgNotify,
-        CONFIG_NOTIFY_TELEGRAM_SILENT_MODE_KEY, CONFIG_NOTIFY_TELEGRAM_SILENT_MODE_FRIENDLY,
-        CONFIG_MQTT_PARAMS_QOS, (void*)&_hmNotifySilentMode),
-      0, 1);
-    #endif // CONFIG_SILENT_MODE_ENABLE
-  }
-#endif // CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+#endif // CONFIG_STATES_HANDLER_STATS
 
+  #define statesEventHandlerRegisterEx(index, event_base, event_id, event_handler) statesEventHandlerRegisterDispatch(index, event_base, event_id)
+  #define statesEventHandlerUnregisterEx(event_base, event_id, event_handler) eventHandlerUnregister(event_base, event_id, &statesEventHandlerDispatch)
 #else
+  #define statesEventHandlerRegisterEx(index, event_base, event_id, event_handler) eventHandlerRegister(event_base, event_id, event_handler, nullptr)
+  #define statesEventHandlerUnregisterEx(event_base, event_id, event_handler) eventHandlerUnregister(event_base, event_id, event_handler)
+#endif // STATES_EVENT_DISPATCH
 
-  #define ENABLE_NOTIFY_WIFI_STATUS 0
-  #define ENABLE_NOTIFY_ETH_STATUS 0
-  #define ENABLE_NOTIFY_INET_STATUS 0
-  #define ENABLE_NOTIFY_MQTT_STATUS 0
-  #define ENABLE_NOTIFY_MQTT_ERRORS 0
-  #define ENABLE_NOTIFY_MQTT1_PING 0
-  #define ENABLE_NOTIFY_MQTT2_PING 0
-  #define ENABLE_NOTIFY_OPENMON_STATUS 0
-  #define ENABLE_NOTIFY_NARODMON_STATUS 0
-  #define ENABLE_NOTIFY_THINGSPEAK_STATUS 0
-  #define ENABLE_NOTIFY_SENSOR_STATE 0
-  #define ENABLE_NOTIFY_SILENT_MODE 0
+bool statesEventHandlerRegister()
+{
+  rlog_d(logTAG, "Register system states event handlers...");
+  bool ret = statesEventHandlerRegisterEx(SH_TIME, RE_TIME_EVENTS, ESP_EVENT_ANY_ID, &statesEventHandlerTime)
+          && statesEventHandlerRegisterEx(SH_WIFI, RE_WIFI_EVENTS, ESP_EVENT_ANY_ID, &statesEventHandlerWiFi)
+          && statesEventHandlerRegisterEx(SH_MQTT, RE_MQTT_EVENTS, ESP_EVENT_ANY_ID, &statesEventHandlerMqtt)
+          #if CONFIG_PINGER_ENABLE
+            && statesEventHandlerRegisterEx(SH_PING, RE_PING_EVENTS, ESP_EVENT_ANY_ID, &statesEventHandlerPing)
+          #endif // CONFIG_PINGER_ENABLE
+          #ifndef CONFIG_NO_SENSORS
+          && statesEventHandlerRegisterEx(SH_SENSOR, RE_SENSOR_EVENTS, RE_SENSOR_STATUS_CHANGED, &statesEventHandlerSensor)
+          #endif // CONFIG_NO_SENSORS
+          && statesEventHandlerRegisterEx(SH_SYSTEM, RE_SYSTEM_EVENTS, ESP_EVENT_ANY_ID, &statesEventHandlerSystem);
+  if (ret) {
+    #if CONFIG_ENABLE_STATES_NOTIFICATIONS && CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+      healthMonitorsRegisterParameters();
+    #endif // CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+  };
+  return ret;
+}
 
-#endif // CONFIG_ENABLE_STATES_NOTIFICATIONS 
+void statesEventHandlerUnregister()
+{
+  statesEventHandlerUnregisterEx(RE_SYSTEM_EVENTS, ESP_EVENT_ANY_ID, &statesEventHandlerSystem);
+  statesEventHandlerUnregisterEx(RE_TIME_EVENTS, ESP_EVENT_ANY_ID, &statesEventHandlerTime);
+  statesEventHandlerUnregisterEx(RE_WIFI_EVENTS, ESP_EVENT_ANY_ID, &statesEventHandlerWiFi);
+  statesEventHandlerUnregisterEx(RE_MQTT_EVENTS, ESP_EVENT_ANY_ID, &statesEventHandlerMqtt);
+  #if CONFIG_PINGER_ENABLE
+    statesEventHandlerUnregisterEx(RE_PING_EVENTS, ESP_EVENT_ANY_ID, &statesEventHandlerPing);
+  #endif // CONFIG_PINGER_ENABLE
+  #ifndef CONFIG_NO_SENSORS
+    statesEventHandlerUnregisterEx(RE_SENSOR_EVENTS, RE_SENSOR_STATUS_CHANGED, &statesEventHandlerSensor);
+  #endif // CONFIG_NO_SENSORS
+  rlog_d(logTAG, "System states event handlers unregistered");
+}
+
+// Passes the event to the same handler as the event loop does, but for the given context. 
+// System and sensor events concern the device itself and are not handled for a context
+void statesCtxEventHandle(re_states_ctx_t* ctx, esp_event_base_t event_base, int32_t event_id, void* event_data)
+{
+  if ((ctx == nullptr) || (ctx->states == nullptr)) return;
+  void* arg = statesCtxIsDefault(ctx) ? nullptr : ctx;
+  if (event_base == RE_TIME_EVENTS) {
+    statesEventHandlerTime(arg, event_base, event_id, event_data);
+  } else if (event_base == RE_WIFI_EVENTS) {
+    statesEventHandlerWiFi(arg, event_base, event_id, event_data);
+  } else if (event_base == RE_MQTT_EVENTS) {
+    statesEventHandlerMqtt(arg, event_base, event_id, event_data);
+  #if CONFIG_PINGER_ENABLE
+  } else if (event_base == RE_PING_EVENTS) {
+    statesEventHandlerPing(arg, event_base, event_id, event_data);
+  #endif // CONFIG_PINGER_ENABLE
+  };
+}
 
 // -----------------------------------------------------------------------------------------------------------------------
-// ---------------------------------------------------- Debug info -------------------------------------------------------
+// ---------------------------------------------------- Stress test ------------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------
 
-#if CONFIG_RESTART_DEBUG_INFO
+#if CONFIG_STATES_STRESS
+
+/**
+ * Event storm: producer tasks generate network, time, ping and MQTT events. The events are drawn from a model of the
+ * connection, so that every sequence is one the real drivers could produce (no GOT_IP before STARTED, no MQTT
+ * connection without the internet and so on); the model also gives the bits expected at the end of the storm.
+ * In the queued mode the events are passed to the handlers by one consumer task, in the order they were generated,
+ * as the event loop does; in the direct mode every producer calls the handlers itself, so the handlers run 
+ * concurrently and the order may differ from the model, therefore a short settling sequence is passed through the 
+ * handlers before the final bits are compared. The handlers are called directly, the dispatcher statistics, history 
+ * and trace only record the event loop traffic. The invariants are checked after every event. 
+ * While the storm is running, notifications, watchdogs, event posting, the LED and NVS writes are muted, but the real states 
+ * are changed, so it is intended for a bench device
+ * */
+
+#ifndef CONFIG_STATES_STRESS_PRODUCERS_MAX
+  #define CONFIG_STATES_STRESS_PRODUCERS_MAX 4
+#endif // CONFIG_STATES_STRESS_PRODUCERS_MAX
+#ifndef CONFIG_STATES_STRESS_QUEUE
+  #define CONFIG_STATES_STRESS_QUEUE 32
+#endif // CONFIG_STATES_STRESS_QUEUE
+#ifndef CONFIG_STATES_STRESS_STACK
+  #define CONFIG_STATES_STRESS_STACK 4096
+#endif // CONFIG_STATES_STRESS_STACK
+#ifndef CONFIG_STATES_STRESS_PRIORITY
+  #define CONFIG_STATES_STRESS_PRIORITY 5
+#endif // CONFIG_STATES_STRESS_PRIORITY
+#define STATES_STRESS_LATENCY_BUCKETS 24
+
+// Bits driven by the generated events and compared at the end of the storm
+#define STATES_STRESS_BITS (WIFI_STA_STARTED | ETHERNET_STARTED | NETWORK_CONNECTED | INET_AVAILABLED | INET_SLOWDOWN \
+  | MQTT_CONNECTED | MQTT_PRIMARY | MQTT_LOCAL | MQTT_1_ENABLED | TIME_RTC_ENABLED | TIME_SNTP_SYNC_OK)
+
+typedef enum {
+  SSP_NONE = 0,
+  SSP_MQTT,
+  SSP_INET,
+  SSP_HOST
+} states_stress_payload_t;
+
+typedef struct {
+  uint8_t handler;
+  int32_t event_id;
+  states_stress_payload_t payload;
+  EventBits_t requires_all;  // The event can be generated only if all these bits are set in the model...
+  EventBits_t requires_any;  // ...and at least one of these (if any)...
+  EventBits_t forbids;       // ...and none of these
+} states_stress_event_t;
+
+typedef struct {
+  int64_t  posted;
+  uint8_t  handler;
+  int32_t  event_id;
+  states_stress_payload_t kind;
+  union {
+    re_mqtt_event_data_t mqtt;
+    #if CONFIG_PINGER_ENABLE
+      ping_inet_data_t inet;
+      ping_host_data_t host;
+    #endif // CONFIG_PINGER_ENABLE
+  } payload;
+} states_stress_item_t;
+
+typedef struct {
+  const char* name;
+  EventBits_t if_all;      // If all these bits are set...
+  EventBits_t then_any;    // ...at least one of these must be set
+} states_stress_invariant_t;
+
+static const states_stress_event_t _statesStressEvents[] = {
+  #if !defined(CONFIG_WIFI_ENABLED) || (CONFIG_WIFI_ENABLED == 1)
+  { SH_WIFI,   RE_WIFI_STA_STARTED,       SSP_NONE, 0,                  0,                 WIFI_STA_STARTED },
+  { SH_WIFI,   RE_WIFI_STA_GOT_IP,        SSP_NONE, WIFI_STA_STARTED,   0,                 WIFI_STA_CONNECTED },
+  { SH_WIFI,   RE_WIFI_STA_DISCONNECTED,  SSP_NONE, WIFI_STA_CONNECTED, 0,                 0 },
+  #endif // CONFIG_WIFI_ENABLED
+  #if defined(CONFIG_ETH_ENABLED) && (CONFIG_ETH_ENABLED == 1)
+  { SH_WIFI,   RE_ETHERNET_STARTED,       SSP_NONE, 0,                  0,                 ETHERNET_STARTED },
+  { SH_WIFI,   RE_ETHERNET_GOT_IP,        SSP_NONE, ETHERNET_STARTED,   0,                 ETHERNET_CONNECTED },
+  { SH_WIFI,   RE_ETHERNET_DISCONNECTED,  SSP_NONE, ETHERNET_CONNECTED, 0,                 0 },
+  #endif // CONFIG_ETH_ENABLED
+  { SH_TIME,   RE_TIME_RTC_ENABLED,       SSP_NONE, 0,                  0,                 TIME_RTC_ENABLED },
+  { SH_TIME,   RE_TIME_SNTP_SYNC_OK,      SSP_NONE, INET_AVAILABLED,    0,                 0 },
+  #if CONFIG_PINGER_ENABLE
+  { SH_PING,   RE_PING_INET_AVAILABLE,    SSP_INET, 0,                  NETWORK_CONNECTED, 0 },
+  { SH_PING,   RE_PING_INET_SLOWDOWN,     SSP_INET, INET_AVAILABLED,    0,                 0 },
+  { SH_PING,   RE_PING_INET_UNAVAILABLE,  SSP_INET, INET_AVAILABLED,    0,                 0 },
+  { SH_PING,   RE_PING_MQTT1_AVAILABLE,   SSP_HOST, 0,                  NETWORK_CONNECTED, MQTT_1_ENABLED },
+  { SH_PING,   RE_PING_MQTT1_UNAVAILABLE, SSP_HOST, MQTT_1_ENABLED,     0,                 0 },
+  #endif // CONFIG_PINGER_ENABLE
+  { SH_MQTT,   RE_MQTT_CONNECTED,         SSP_MQTT, INET_AVAILABLED,    0,                 MQTT_CONNECTED },
+  { SH_MQTT,   RE_MQTT_CONN_LOST,         SSP_MQTT, MQTT_CONNECTED,     0,                 0 },
+};
+#define STATES_STRESS_EVENTS (sizeof(_statesStressEvents) / sizeof(states_stress_event_t))
+
+// Brings every modelled bit to a known value, whatever order the storm was processed in
+static const states_stress_event_t _statesStressSettle[] = {
+  #if !defined(CONFIG_WIFI_ENABLED) || (CONFIG_WIFI_ENABLED == 1)
+  { SH_WIFI,   RE_WIFI_STA_STARTED,       SSP_NONE, 0, 0, 0 },
+  { SH_WIFI,   RE_WIFI_STA_GOT_IP,        SSP_NONE, 0, 0, 0 },
+  #endif // CONFIG_WIFI_ENABLED
+  #if defined(CONFIG_ETH_ENABLED) && (CONFIG_ETH_ENABLED == 1)
+  { SH_WIFI,   RE_ETHERNET_STARTED,       SSP_NONE, 0, 0, 0 },
+  { SH_WIFI,   RE_ETHERNET_GOT_IP,        SSP_NONE, 0, 0, 0 },
+  #endif // CONFIG_ETH_ENABLED
+  { SH_TIME,   RE_TIME_RTC_ENABLED,       SSP_NONE, 0, 0, 0 },
+  { SH_TIME,   RE_TIME_SNTP_SYNC_OK,      SSP_NONE, 0, 0, 0 },
+  #if CONFIG_PINGER_ENABLE
+  { SH_PING,   RE_PING_INET_AVAILABLE,    SSP_INET, 0, 0, 0 },
+  { SH_PING,   RE_PING_MQTT1_AVAILABLE,   SSP_HOST, 0, 0, 0 },
+  #endif // CONFIG_PINGER_ENABLE
+  { SH_MQTT,   RE_MQTT_CONNECTED,         SSP_MQTT, 0, 0, 0 },
+};
+#define STATES_STRESS_SETTLE (sizeof(_statesStressSettle) / sizeof(states_stress_event_t))
+
+static const states_stress_invariant_t _statesStressInvariants[] = {
+  { "inet_needs_network",  INET_AVAILABLED,  NETWORK_CONNECTED },
+  { "mqtt_needs_network",  MQTT_CONNECTED,   NETWORK_CONNECTED },
+  { "slowdown_needs_inet", INET_SLOWDOWN,    INET_AVAILABLED },
+};
+#define STATES_STRESS_INVARIANTS (sizeof(_statesStressInvariants) / sizeof(states_stress_invariant_t))
+
+typedef struct {
+  bool     running;        // Until all stress tasks have been deleted, see statesStressReap()
+  bool     started;        // Tasks wait for this flag, so that the number of producers is known to everyone
+  bool     direct;
+  uint8_t  producers;
+  uint8_t  finished;
+  uint8_t  tasks;          // Created...
+  uint8_t  exited;         // ...and suspended for good
+  uint32_t events;         // Per producer
+  uint32_t posted;
+  uint32_t processed;
+  int64_t  time_start;
+  int64_t  time_end;
+  uint32_t latency_max;
+  uint32_t latency[STATES_STRESS_LATENCY_BUCKETS];
+  uint32_t violations[STATES_STRESS_INVARIANTS];
+  uint8_t  first_invariant;
+  uint8_t  first_handler;
+  int32_t  first_event_id;
+  EventBits_t first_states;
+  EventBits_t expected;    // Final bits: by the model...
+  EventBits_t actual;      // ...and by the handlers
+} states_stress_t;
+
+static states_stress_t _statesStress;
+static portMUX_TYPE _statesStressLock = portMUX_INITIALIZER_UNLOCKED;
+static QueueHandle_t _statesStressQueue = nullptr;
+// Generation of an event and its hand-over to the queue are serialized, so that the queue keeps the model order
+static SemaphoreHandle_t _statesStressModelLock = nullptr;
+static EventBits_t _statesStressModel = 0;
+static TaskHandle_t _statesStressTasks[CONFIG_STATES_STRESS_PRODUCERS_MAX + 1];
+#if CONFIG_STATES_STATIC_ALLOCATION
+  static StaticQueue_t _statesStressQueueBuffer;
+  static uint8_t _statesStressQueueStorage[CONFIG_STATES_STRESS_QUEUE * sizeof(states_stress_item_t)];
+  static StaticSemaphore_t _statesStressModelLockBuffer;
+  static StaticTask_t _statesStressTaskBuffers[CONFIG_STATES_STRESS_PRODUCERS_MAX + 1];
+  static StackType_t _statesStressTaskStacks[CONFIG_STATES_STRESS_PRODUCERS_MAX + 1][CONFIG_STATES_STRESS_STACK];
+#endif // CONFIG_STATES_STATIC_ALLOCATION
 
-static char* statesGetDebugHeap(re_restart_debug_t *debug)
+static inline uint32_t statesStressRandom(uint32_t* seed)
 {
-  if ((debug->heap_total > 0) && (debug->heap_total > debug->heap_free)) {
-    struct tm timeinfo;
-    localtime_r(&debug->heap_min_time, &timeinfo);
-    char time_buffer[CONFIG_FORMAT_STRFTIME_DTS_BUFFER_SIZE];
-    memset(&time_buffer, 0, CONFIG_FORMAT_STRFTIME_DTS_BUFFER_SIZE);
-    strftime(time_buffer, CONFIG_FORMAT_STRFTIME_DTS_BUFFER_SIZE, CONFIG_FORMAT_DTS, &timeinfo);
+  // xorshift32
+  uint32_t x = *seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *seed = x;
+  return x;
+}
 
-    double heapTotal = (double)debug->heap_total / 1024;
-    double heapFree = (double)debug->heap_free / 1024;
-    double heapFreeMin = (double)debug->heap_free_min / 1024;
+// The same changes of the bits as the handlers make; the event ids of different bases overlap, so the handler is a part of the key
+#define STATES_STRESS_KEY(handler, event_id) (((int32_t)(handler) << 16) | (event_id))
 
-    return malloc_stringf("%.1fkB : %.1fkB (%.1f%%) : %.1fkB (%.1f%%) %s", 
-      heapTotal,
-      heapFree, 100.0 * (heapFree / heapTotal),
-      heapFreeMin, 100.0 * (heapFreeMin / heapTotal), time_buffer);
+static EventBits_t statesStressApply(EventBits_t bits, const states_stress_item_t* item)
+{
+  switch (STATES_STRESS_KEY(item->handler, item->event_id)) {
+    #if !defined(CONFIG_WIFI_ENABLED) || (CONFIG_WIFI_ENABLED == 1)
+    case STATES_STRESS_KEY(SH_WIFI, RE_WIFI_STA_STARTED):
+      return (bits | WIFI_STA_STARTED) & ~(WIFI_STA_CONNECTED | INET_AVAILABLED | INET_SLOWDOWN | MQTT_CONNECTED);
+    case STATES_STRESS_KEY(SH_WIFI, RE_WIFI_STA_GOT_IP):
+      return (bits | WIFI_STA_CONNECTED | INET_AVAILABLED) & ~(INET_SLOWDOWN | MQTT_CONNECTED);
+    case STATES_STRESS_KEY(SH_WIFI, RE_WIFI_STA_DISCONNECTED):
+      bits &= ~WIFI_STA_CONNECTED;
+      return (bits & NETWORK_CONNECTED) ? bits : bits & ~(INET_AVAILABLED | INET_SLOWDOWN | MQTT_CONNECTED);
+    #endif // CONFIG_WIFI_ENABLED
+    #if defined(CONFIG_ETH_ENABLED) && (CONFIG_ETH_ENABLED == 1)
+    case STATES_STRESS_KEY(SH_WIFI, RE_ETHERNET_STARTED):
+      return (bits | ETHERNET_STARTED) & ~(ETHERNET_CONNECTED | INET_AVAILABLED | INET_SLOWDOWN | MQTT_CONNECTED);
+    case STATES_STRESS_KEY(SH_WIFI, RE_ETHERNET_GOT_IP):
+      return (bits | ETHERNET_CONNECTED | INET_AVAILABLED) & ~(INET_SLOWDOWN | MQTT_CONNECTED);
+    case STATES_STRESS_KEY(SH_WIFI, RE_ETHERNET_DISCONNECTED):
+      bits &= ~ETHERNET_CONNECTED;
+      return (bits & NETWORK_CONNECTED) ? bits : bits & ~(INET_AVAILABLED | INET_SLOWDOWN | MQTT_CONNECTED);
+    #endif // CONFIG_ETH_ENABLED
+    case STATES_STRESS_KEY(SH_TIME, RE_TIME_RTC_ENABLED):
+      return bits | TIME_RTC_ENABLED;
+    case STATES_STRESS_KEY(SH_TIME, RE_TIME_SNTP_SYNC_OK):
+      return bits | TIME_SNTP_SYNC_OK;
+    #if CONFIG_PINGER_ENABLE
+    case STATES_STRESS_KEY(SH_PING, RE_PING_INET_AVAILABLE):
+      return (bits | INET_AVAILABLED) & ~INET_SLOWDOWN;
+    case STATES_STRESS_KEY(SH_PING, RE_PING_INET_SLOWDOWN):
+      return bits | INET_AVAILABLED | INET_SLOWDOWN;
+    case STATES_STRESS_KEY(SH_PING, RE_PING_INET_UNAVAILABLE):
+      return bits & ~(INET_AVAILABLED | INET_SLOWDOWN);
+    case STATES_STRESS_KEY(SH_PING, RE_PING_MQTT1_AVAILABLE):
+      return bits | MQTT_1_ENABLED;
+    case STATES_STRESS_KEY(SH_PING, RE_PING_MQTT1_UNAVAILABLE):
+      return bits & ~MQTT_1_ENABLED;
+    #endif // CONFIG_PINGER_ENABLE
+    case STATES_STRESS_KEY(SH_MQTT, RE_MQTT_CONNECTED):
+      bits |= MQTT_CONNECTED;
+      bits = item->payload.mqtt.primary ? bits | MQTT_PRIMARY : bits & ~MQTT_PRIMARY;
+      return item->payload.mqtt.local ? bits | MQTT_LOCAL : bits & ~MQTT_LOCAL;
+    case STATES_STRESS_KEY(SH_MQTT, RE_MQTT_CONN_LOST):
+      return bits & ~MQTT_CONNECTED;
+    default:
+      return bits;
   };
-  return nullptr;
 }
 
-#if CONFIG_RESTART_DEBUG_STACK_DEPTH > 0
+static inline bool statesStressAllowed(const states_stress_event_t* event, EventBits_t bits)
+{
+  return ((bits & event->requires_all) == event->requires_all)
+      && ((event->requires_any == 0) || (bits & event->requires_any))
+      && ((bits & event->forbids) == 0);
+}
 
-static char* statesGetDebugTrace(re_restart_debug_t *debug)
+static void statesStressFill(states_stress_item_t* item, const states_stress_event_t* event, uint32_t* seed)
 {
-  char* backtrace = nullptr;
-  char* item = nullptr;
-  char* temp = nullptr;
-  for (uint8_t i = 0; i < CONFIG_RESTART_DEBUG_STACK_DEPTH; i++) {
-    if (debug->backtrace[i] != 0) {
-      item = malloc_stringf("0x%08x", debug->backtrace[i]);
-      if (item) {
-        if (backtrace) {
-          temp = backtrace;
-          backtrace = malloc_stringf("%s %s", temp, item);
-          free(item);
-          free(temp);
-        } else {
-          backtrace = item;
-        };
-        item = nullptr;
-      };
-    } else {
+  memset(item, 0, sizeof(states_stress_item_t));
+  item->handler = event->handler;
+  item->event_id = event->event_id;
+  item->kind = event->payload;
+  switch (event->payload) {
+    case SSP_MQTT:
+      item->payload.mqtt.primary = (statesStressRandom(seed) & 1) == 0;
+      item->payload.mqtt.local = (statesStressRandom(seed) & 1) == 0;
+      strncpy(item->payload.mqtt.host, "stress", sizeof(item->payload.mqtt.host) - 1);
+      item->payload.mqtt.port = 1883;
+      break;
+    #if CONFIG_PINGER_ENABLE
+    case SSP_INET:
+      item->payload.inet.time_unavailable = time(nullptr);
+      break;
+    case SSP_HOST:
+      item->payload.host.time_unavailable = time(nullptr);
+      break;
+    #endif // CONFIG_PINGER_ENABLE
+    default:
       break;
-    }
   };
-  return backtrace;
+  item->posted = esp_timer_get_time();
 }
 
-#endif // CONFIG_RESTART_DEBUG_STACK_DEPTH
-#endif // CONFIG_RESTART_DEBUG_INFO
-
+// Picks one of the events that are valid in the current state of the model and advances the model; 
+// must be called with the model lock held
+static bool statesStressMake(states_stress_item_t* item, uint32_t* seed)
+{
+  uint8_t allowed[STATES_STRESS_EVENTS];
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < STATES_STRESS_EVENTS; i++) {
+    if (statesStressAllowed(&_statesStressEvents[i], _statesStressModel)) allowed[count++] = i;
+  };
+  if (count == 0) return false;
+  statesStressFill(item, &_statesStressEvents[allowed[statesStressRandom(seed) % count]], seed);
+  _statesStressModel = statesStressApply(_statesStressModel, item);
+  return true;
+}
 
-// -----------------------------------------------------------------------------------------------------------------------
-// --------------------------------------------------- Event handlers ----------------------------------------------------
-// -----------------------------------------------------------------------------------------------------------------------
+static void statesStressCheck(const states_stress_item_t* item)
+{
+  EventBits_t states = statesGet();
+  uint32_t latency = (uint32_t)(esp_timer_get_time() - item->posted);
+  uint8_t bucket = latency > 0 ? 32 - __builtin_clz(latency) : 0;
+  if (bucket >= STATES_STRESS_LATENCY_BUCKETS) bucket = STATES_STRESS_LATENCY_BUCKETS - 1;
+
+  portENTER_CRITICAL(&_statesStressLock);
+  _statesStress.processed++;
+  _statesStress.latency[bucket]++;
+  if (latency > _statesStress.latency_max) _statesStress.latency_max = latency;
+  for (uint8_t i = 0; i < STATES_STRESS_INVARIANTS; i++) {
+    const states_stress_invariant_t* inv = &_statesStressInvariants[i];
+    if (((states & inv->if_all) == inv->if_all) && ((states & inv->then_any) == 0)) {
+      if (_statesStress.first_invariant == 0xFF) {
+        _statesStress.first_invariant = i;
+        _statesStress.first_handler = item->handler;
+        _statesStress.first_event_id = item->event_id;
+        _statesStress.first_states = states;
+      };
+      _statesStress.violations[i]++;
+    };
+  };
+  portEXIT_CRITICAL(&_statesStressLock);
+}
 
-static void statesEventCheckSystemStarted()
+// The handlers are called directly: the dispatcher keeps its statistics without locks for the event loop task only
+static void statesStressCall(const states_stress_item_t* item)
 {
-  if (!statesCheck(SYSTEM_STARTED, false)) {
-    rlog_i(logTAG, "Check system started: wifi=%d, ethernet=%d, internet=%d, time=%d, mqtt=%d", 
-      statesCheck(WIFI_STA_CONNECTED, false), statesCheck(ETHERNET_CONNECTED, false), statesCheck(INET_AVAILABLED, false), 
-      (statesCheck(TIME_SNTP_SYNC_OK, false) || statesCheck(TIME_RTC_ENABLED, false)), 
-      statesCheck(MQTT_CONNECTED, false));
+  states_handler_t* handler = &_statesHandlers[item->handler];
+  if ((handler->handler != nullptr) && (handler->base != nullptr)) {
+    handler->handler(nullptr, handler->base, item->event_id, item->kind != SSP_NONE ? (void*)&item->payload : nullptr);
+  };
+}
 
-    #if CONFIG_MQTT_OTA_ENABLE
-      if ((statesCheck(WIFI_STA_CONNECTED, false) || statesCheck(ETHERNET_CONNECTED, false)) && statesCheck(MQTT_CONNECTED, false)) {
-        statesFirmwareVerifyCompete();
-      };
-    #endif // CONFIG_MQTT_OTA_ENABLE
+static void statesStressDispatch(const states_stress_item_t* item)
+{
+  statesStressCall(item);
+  statesStressCheck(item);
+}
 
-    if ((statesCheck(TIME_SNTP_SYNC_OK, false) || statesCheck(TIME_RTC_ENABLED, false)) 
-     && (statesCheck(WIFI_STA_CONNECTED, false) || statesCheck(ETHERNET_CONNECTED, false))
-     && statesCheck(INET_AVAILABLED, false) 
-     && statesCheck(MQTT_CONNECTED, false)) {
-      statesSet(SYSTEM_STARTED);
-      eventLoopPostSystem(RE_SYS_STARTED, RE_SYS_SET, false, 0);
-      #if CONFIG_TELEGRAM_ENABLE && CONFIG_NOTIFY_TELEGRAM_START
-        #if CONFIG_RESTART_DEBUG_INFO
-          re_restart_debug_t debug = debugGet();
-          char* debug_heap = statesGetDebugHeap(&debug);
-          char* debug_trace = nullptr;
-          if (debug_heap) {
-            #if CONFIG_RESTART_DEBUG_STACK_DEPTH > 0
-              debug_trace = statesGetDebugTrace(&debug);
-            #endif // CONFIG_RESTART_DEBUG_STACK_DEPTH
-            if (debug_trace) {
-              tgSend(MK_MAIN, CONFIG_NOTIFY_TELEGRAM_START_PRIORITY, CONFIG_NOTIFY_TELEGRAM_ALERT_START, CONFIG_TELEGRAM_DEVICE, 
-                CONFIG_MESSAGE_TG_VERSION_TRACE, APP_VERSION, getResetReason(), getResetReasonRtc(0), getResetReasonRtc(1), 
-                debug_heap, debug_trace);
-              free(debug_trace);
-            } else {
-              tgSend(MK_MAIN, CONFIG_NOTIFY_TELEGRAM_START_PRIORITY, CONFIG_NOTIFY_TELEGRAM_ALERT_START, CONFIG_TELEGRAM_DEVICE, 
-                CONFIG_MESSAGE_TG_VERSION_HEAP, APP_VERSION, getResetReason(), getResetReasonRtc(0), getResetReasonRtc(1), 
-                debug_heap);
-            };
-            free(debug_heap);
-          } else {
-            tgSend(MK_MAIN, CONFIG_NOTIFY_TELEGRAM_START_PRIORITY, CONFIG_NOTIFY_TELEGRAM_ALERT_START, CONFIG_TELEGRAM_DEVICE, 
-              CONFIG_MESSAGE_TG_VERSION_DEF, APP_VERSION, getResetReason(), getResetReasonRtc(0), getResetReasonRtc(1));
-          };
-        #else
-          tgSend(MK_MAIN, CONFIG_NOTIFY_TELEGRAM_START_PRIORITY, CONFIG_NOTIFY_TELEGRAM_ALERT_START, CONFIG_TELEGRAM_DEVICE, 
-            CONFIG_MESSAGE_TG_VERSION_DEF, APP_VERSION, getResetReason(), getResetReasonRtc(0), getResetReasonRtc(1));
-        #endif // CONFIG_RESTART_DEBUG_INFO
-      #endif // CONFIG_TELEGRAM_ENABLE && CONFIG_NOTIFY_TELEGRAM_START
+// Called when a producer (direct mode) or the consumer (queued mode) has finished, all other tasks are done by now
+static void statesStressFinish()
+{
+  if (_statesStress.direct) {
+    uint32_t seed = esp_random() | 1;
+    states_stress_item_t item;
+    for (uint8_t i = 0; i < STATES_STRESS_SETTLE; i++) {
+      statesStressFill(&item, &_statesStressSettle[i], &seed);
+      _statesStressModel = statesStressApply(_statesStressModel, &item);
+      statesStressDispatch(&item);
     };
   };
+  EventBits_t actual = statesGet() & STATES_STRESS_BITS;
+  EventBits_t expected = _statesStressModel & STATES_STRESS_BITS;
+  __atomic_store_n(&_statesStressMuted, false, __ATOMIC_RELAXED);
+  statesWatchdogsCheck(&_statesDefault);
+
+  portENTER_CRITICAL(&_statesStressLock);
+  _statesStress.expected = expected;
+  _statesStress.actual = actual;
+  _statesStress.time_end = esp_timer_get_time();
+  portEXIT_CRITICAL(&_statesStressLock);
+  if (expected == actual) {
+    rlog_i(logTAG, "Stress test completed: %d events processed in %lld us", _statesStress.processed, _statesStress.time_end - _statesStress.time_start);
+  } else {
+    rlog_e(logTAG, "Stress test completed: %d events processed in %lld us, bits 0x%.8x expected, 0x%.8x found", 
+      _statesStress.processed, _statesStress.time_end - _statesStress.time_start, expected, actual);
+  };
 }
 
-static void statesEventHandlerSystem(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+// A stress task does not delete itself: it is deleted by statesStressReap() when it is surely suspended,
+// so that its static buffers are no longer in use when the next test is started
+static void statesStressExit()
 {
-  // System started
-  if (event_id == RE_SYS_STARTED) {
-    #if CONFIG_HEAP_TRACING_STANDALONE
-      heapLeaksStart();
-    #endif // CONFIG_HEAP_TRACING_STANDALONE  
-  }
-  // OTA
-  else if (event_id == RE_SYS_OTA) {
-    re_system_event_data_t* data = (re_system_event_data_t*)event_data;
-    if (data) {
-      statesSetBit(SYSTEM_OTA, data->type != RE_SYS_CLEAR);
-    };
-  }
-  // Error
-  else if (event_id == RE_SYS_ERROR) {
-    // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE_MODE, event_base, "RE_SYS_ERROR", data->type);
-    if (event_data) {
-      re_error_event_data_t* data = (re_error_event_data_t*)event_data;
-      statesSetError(ERR_GENERAL, data->err_code != ESP_OK);
-    };
-  }
-  // Telegram error
-  else if (event_id == RE_SYS_TELEGRAM_ERROR) {
-    // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE_MODE, event_base, "RE_SYS_TELEGRAM_ERROR", data->type);
-    if (event_data) {
-      re_error_event_data_t* data = (re_error_event_data_t*)event_data;
-      statesSetError(ERR_TELEGRAM, data->err_code != ESP_OK);
+  portENTER_CRITICAL(&_statesStressLock);
+  _statesStress.exited++;
+  portEXIT_CRITICAL(&_statesStressLock);
+  vTaskSuspend(nullptr);
+}
+
+// Completes the test when all its tasks have exited
+static void statesStressReap()
+{
+  portENTER_CRITICAL(&_statesStressLock);
+  bool exited = _statesStress.running && (_statesStress.tasks > 0) && (_statesStress.exited == _statesStress.tasks);
+  portEXIT_CRITICAL(&_statesStressLock);
+  if (!exited) return;
+  for (uint8_t i = 0; i < CONFIG_STATES_STRESS_PRODUCERS_MAX + 1; i++) {
+    if ((_statesStressTasks[i] != nullptr) && (eTaskGetState(_statesStressTasks[i]) != eSuspended)) return;
+  };
+  // Only one caller deletes the tasks
+  portENTER_CRITICAL(&_statesStressLock);
+  exited = _statesStress.tasks > 0;
+  _statesStress.tasks = 0;
+  portEXIT_CRITICAL(&_statesStressLock);
+  if (!exited) return;
+  for (uint8_t i = 0; i < CONFIG_STATES_STRESS_PRODUCERS_MAX + 1; i++) {
+    if (_statesStressTasks[i] != nullptr) {
+      vTaskDelete(_statesStressTasks[i]);
+      _statesStressTasks[i] = nullptr;
     };
-  }
-  // OpenMon
-  else if (event_id == RE_SYS_OPENMON_ERROR) {
-    // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE_MODE, event_base, "RE_SYS_OPENMON_ERROR", data->type);
-    if (event_data) {
-      re_error_event_data_t* data = (re_error_event_data_t*)event_data;
-      statesSetError(ERR_OPENMON, data->err_code != ESP_OK);
-      #if ENABLE_NOTIFY_OPENMON_STATUS
-        hmOpenMon.setState(data->err_code, time(nullptr));
-      #endif // ENABLE_NOTIFY_OPENMON_STATUS
+  };
+  __atomic_store_n(&_statesStress.running, false, __ATOMIC_RELEASE);
+}
+
+static void statesStressWaitStart()
+{
+  while (!__atomic_load_n(&_statesStress.started, __ATOMIC_ACQUIRE)) {
+    vTaskDelay(1);
+  };
+}
+
+static void statesStressProducer(void* arg)
+{
+  statesStressWaitStart();
+  uint32_t seed = esp_random() | 1;
+  states_stress_item_t item;
+  for (uint32_t i = 0; i < _statesStress.events; i++) {
+    xSemaphoreTake(_statesStressModelLock, portMAX_DELAY);
+    bool made = statesStressMake(&item, &seed);
+    if (made && !_statesStress.direct) {
+      xQueueSend(_statesStressQueue, &item, portMAX_DELAY);
     };
-  }
-  // NarodMon
-  else if (event_id == RE_SYS_NARODMON_ERROR) {
-    // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE_MODE, event_base, "RE_SYS_NARODMON_ERROR", data->type);
-    if (event_data) {
-      re_error_event_data_t* data = (re_error_event_data_t*)event_data;
-      statesSetError(ERR_NARODMON, data->err_code != ESP_OK);
-      #if ENABLE_NOTIFY_NARODMON_STATUS
-        hmNarodMon.setState(data->err_code, time(nullptr));
-      #endif // ENABLE_NOTIFY_NARODMON_STATUS
+    xSemaphoreGive(_statesStressModelLock);
+    // Every producer sends a fixed number of items, so that the consumer knows when to stop
+    if (!made && !_statesStress.direct) {
+      item.kind = SSP_NONE;
+      item.handler = SH_NONE;
+      xQueueSend(_statesStressQueue, &item, portMAX_DELAY);
+      continue;
     };
-  }
-  // ThingSpeak
-  else if (event_id == RE_SYS_THINGSPEAK_ERROR) {
-    // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE_MODE, event_base, "RE_SYS_THINGSPEAK_ERROR", data->type);
-    if (event_data) {
-      re_error_event_data_t* data = (re_error_event_data_t*)event_data;
-      statesSetError(ERR_THINGSPEAK, data->err_code != ESP_OK);
-      #if ENABLE_NOTIFY_THINGSPEAK_STATUS
-        hmThingSpeak.setState(data->err_code, time(nullptr));
-      #endif // ENABLE_NOTIFY_THINGSPEAK_STATUS
+    if (made) {
+      portENTER_CRITICAL(&_statesStressLock);
+      _statesStress.posted++;
+      portEXIT_CRITICAL(&_statesStressLock);
+      if (_statesStress.direct) statesStressDispatch(&item);
     };
   };
+  portENTER_CRITICAL(&_statesStressLock);
+  bool last = ++_statesStress.finished == _statesStress.producers;
+  portEXIT_CRITICAL(&_statesStressLock);
+  if (last && _statesStress.direct) {
+    statesStressFinish();
+  };
+  statesStressExit();
 }
 
-static void statesEventHandlerTime(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+static void statesStressConsumer(void* arg)
 {
-  switch (event_id) {
-    // Received time from hardware real time clock
-    case RE_TIME_RTC_ENABLED:
-      statesSet(TIME_RTC_ENABLED);
-      statesEventCheckSystemStarted();
-      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_TIME_RTC_ENABLED");
-      break;
+  statesStressWaitStart();
+  states_stress_item_t item;
+  uint32_t total = _statesStress.events * _statesStress.producers;
+  for (uint32_t i = 0; i < total; i++) {
+    if ((xQueueReceive(_statesStressQueue, &item, portMAX_DELAY) == pdTRUE) && (item.handler != SH_NONE)) {
+      statesStressDispatch(&item);
+    };
+  };
+  statesStressFinish();
+  statesStressExit();
+}
 
-    case RE_TIME_EVERY_MINUTE:
-      #if CONFIG_RESTART_DEBUG_INFO && CONFIG_RESTART_DEBUG_HEAP_SIZE_SCHEDULE
-        debugHeapUpdate();
-      #endif // CONFIG_RESTART_DEBUG_HEAP_SIZE_SCHEDULE
-      #if CONFIG_HEAP_TRACING_STANDALONE
-        heapLeaksUpdate();
-      #endif // CONFIG_HEAP_TRACING_STANDALONE  
-      break;
+static bool statesStressTaskCreate(TaskFunction_t function, const char* name, uint8_t index)
+{
+  #if CONFIG_STATES_STATIC_ALLOCATION
+    _statesStressTasks[index] = xTaskCreateStatic(function, name, CONFIG_STATES_STRESS_STACK, nullptr, CONFIG_STATES_STRESS_PRIORITY, 
+      _statesStressTaskStacks[index], &_statesStressTaskBuffers[index]);
+  #else
+    if (xTaskCreate(function, name, CONFIG_STATES_STRESS_STACK, nullptr, CONFIG_STATES_STRESS_PRIORITY, &_statesStressTasks[index]) != pdPASS) {
+      _statesStressTasks[index] = nullptr;
+    };
+  #endif // CONFIG_STATES_STATIC_ALLOCATION
+  if (_statesStressTasks[index] == nullptr) return false;
+  portENTER_CRITICAL(&_statesStressLock);
+  _statesStress.tasks++;
+  portEXIT_CRITICAL(&_statesStressLock);
+  return true;
+}
 
-    // Received time from NTP server
-    case RE_TIME_SNTP_SYNC_OK:
-      statesSet(TIME_SNTP_SYNC_OK);
-      statesEventCheckSystemStarted();
-      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "TIME_SNTP_SYNC_OK");
-      break;
+static void statesStressAbort()
+{
+  rlog_e(logTAG, "Failed to start stress test");
+  __atomic_store_n(&_statesStressMuted, false, __ATOMIC_RELAXED);
+  // Tasks that have already been created finish on their own and are deleted by statesStressReap()
+  portENTER_CRITICAL(&_statesStressLock);
+  if (_statesStress.tasks == 0) _statesStress.running = false;
+  portEXIT_CRITICAL(&_statesStressLock);
+}
 
-    #if CONFIG_SILENT_MODE_ENABLE
-    // Silent mode on
-    case RE_TIME_SILENT_MODE_ON:
-      statesSet(TIME_SILENT_MODE);
-      ledSysSetEnabled(false);
-      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_TIME_SILENT_MODE_ON");
-      #if ENABLE_NOTIFY_SILENT_MODE
-        #if CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-        if (_hmNotifySilentMode) {
-        #endif // CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-          tgSend(MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_SILENT_MODE_PRIORITY, CONFIG_NOTIFY_TELEGRAM_ALERT_SILENT_MODE, CONFIG_TELEGRAM_DEVICE, 
-            CONFIG_MESSAGE_TG_SILENT_MODE_ON);
-        #if CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-        };
-        #endif // CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-      #endif // ENABLE_NOTIFY_SILENT_MODE
-      break;
-    // Silent mode off
-    case RE_TIME_SILENT_MODE_OFF:
-      statesClear(TIME_SILENT_MODE);
-      ledSysSetEnabled(true);
-      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_TIME_SILENT_MODE_OFF");
-      #if ENABLE_NOTIFY_SILENT_MODE
-        #if CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-        if (_hmNotifySilentMode) {
-        #endif // CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-          tgSend(MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_SILENT_MODE_PRIORITY, CONFIG_NOTIFY_TELEGRAM_ALERT_SILENT_MODE, CONFIG_TELEGRAM_DEVICE, 
-            CONFIG_MESSAGE_TG_SILENT_MODE_OFF);
-        #if CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-        };
-        #endif // CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-      #endif // ENABLE_NOTIFY_SILENT_MODE
-      break;
-    #endif // CONFIG_SILENT_MODE_ENABLE
+bool statesStressStart(uint8_t producers, uint32_t events, bool direct)
+{
+  if ((producers == 0) || (events == 0)) return false;
+  if (producers > CONFIG_STATES_STRESS_PRODUCERS_MAX) producers = CONFIG_STATES_STRESS_PRODUCERS_MAX;
+  statesStressReap();
+  portENTER_CRITICAL(&_statesStressLock);
+  if (_statesStress.running) {
+    portEXIT_CRITICAL(&_statesStressLock);
+    rlog_w(logTAG, "Stress test is already running");
+    return false;
+  };
+  memset(&_statesStress, 0, sizeof(_statesStress));
+  _statesStress.running = true;
+  _statesStress.direct = direct;
+  _statesStress.producers = producers;
+  _statesStress.events = events;
+  _statesStress.first_invariant = 0xFF;
+  _statesStress.time_start = esp_timer_get_time();
+  portEXIT_CRITICAL(&_statesStressLock);
+
+  if (_statesStressModelLock == nullptr) {
+    #if CONFIG_STATES_STATIC_ALLOCATION
+      _statesStressModelLock = xSemaphoreCreateMutexStatic(&_statesStressModelLockBuffer);
+    #else
+      _statesStressModelLock = xSemaphoreCreateMutex();
+    #endif // CONFIG_STATES_STATIC_ALLOCATION
+  };
+  if (!direct && (_statesStressQueue == nullptr)) {
+    #if CONFIG_STATES_STATIC_ALLOCATION
+      _statesStressQueue = xQueueCreateStatic(CONFIG_STATES_STRESS_QUEUE, sizeof(states_stress_item_t), _statesStressQueueStorage, &_statesStressQueueBuffer);
+    #else
+      _statesStressQueue = xQueueCreate(CONFIG_STATES_STRESS_QUEUE, sizeof(states_stress_item_t));
+    #endif // CONFIG_STATES_STATIC_ALLOCATION
+  };
 
-    // Ignore...
-    default:
-      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "IGNORED");
-      break;
+  // The model starts from the real states
+  _statesStressModel = statesGet();
+  __atomic_store_n(&_statesStressMuted, true, __ATOMIC_RELAXED);
+  if ((_statesStressModelLock == nullptr) 
+   || (!direct && ((_statesStressQueue == nullptr) || !statesStressTaskCreate(statesStressConsumer, "stress_c", 0)))) {
+    statesStressAbort();
+    return false;
+  };
+
+  // Producers that could not be created are excluded from the run
+  uint8_t created = 0;
+  for (uint8_t i = 0; i < producers; i++) {
+    if (statesStressTaskCreate(statesStressProducer, "stress_p", i + 1)) created++;
+  };
+  _statesStress.producers = created;
+  __atomic_store_n(&_statesStress.started, true, __ATOMIC_RELEASE);
+  if (created == 0) {
+    statesStressAbort();
+    return false;
   };
+  rlog_i(logTAG, "Stress test started: %d producers, %d events each, %s mode", created, events, direct ? "direct" : "queued");
+  return true;
 }
 
-static void statesEventHandlerWiFi(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+bool statesStressRunning()
 {
-  switch (event_id) {
-    #if !defined(CONFIG_WIFI_ENABLED) || (CONFIG_WIFI_ENABLED == 1)
-      case RE_WIFI_STA_INIT:
-        statesClear(WIFI_STA_STARTED | WIFI_STA_CONNECTED | INET_AVAILABLED | INET_SLOWDOWN | MQTT_CONNECTED);
-        // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_WIFI_STA_INIT");
-        wdtRestartMqttBreak();
-        break;
+  statesStressReap();
+  return __atomic_load_n(&_statesStress.running, __ATOMIC_ACQUIRE);
+}
 
-      case RE_WIFI_STA_STARTED:
-        statesSet(WIFI_STA_STARTED);
-        statesClear(WIFI_STA_CONNECTED | INET_AVAILABLED | INET_SLOWDOWN | MQTT_CONNECTED);
-        // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_WIFI_STA_STARTED");
-        wdtRestartMqttBreak();
-        break;
+// Upper bound of the latency histogram bucket that contains the given share of the events, microseconds
+static uint32_t statesStressPercentile(states_stress_t* stress, uint32_t permille)
+{
+  uint64_t target = ((uint64_t)stress->processed * permille + 999) / 1000;
+  uint64_t count = 0;
+  for (uint8_t i = 0; i < STATES_STRESS_LATENCY_BUCKETS; i++) {
+    count += stress->latency[i];
+    if ((count >= target) && (count > 0)) {
+      return i < STATES_STRESS_LATENCY_BUCKETS - 1 ? (1U << i) : stress->latency_max;
+    };
+  };
+  return 0;
+}
 
-      case RE_WIFI_STA_GOT_IP:
-        // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_WIFI_STA_GOT_IP");
-        statesSet(WIFI_STA_CONNECTED | INET_AVAILABLED);
-        statesClear(INET_SLOWDOWN | MQTT_CONNECTED);
-        eventLoopPost(RE_WIFI_EVENTS, RE_INET_PING_OK, nullptr, 0, portMAX_DELAY);
-        #if CONFIG_ENABLE_STATES_NOTIFICATIONS
-          healthMonitorsWiFiAvailable(true);
-        #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
-        statesEventCheckSystemStarted();
-        wdtRestartMqttStart();
-        break;
+static void statesStressWriter(states_buf_t* buf, void* arg)
+{
+  statesStressReap();
+  states_stress_t stress;
+  portENTER_CRITICAL(&_statesStressLock);
+  memcpy(&stress, &_statesStress, sizeof(states_stress_t));
+  portEXIT_CRITICAL(&_statesStressLock);
+
+  int64_t duration = (stress.running ? esp_timer_get_time() : stress.time_end) - stress.time_start;
+  statesBufPrintf(buf, "{\"running\":%d,\"direct\":%d,\"producers\":%d,\"posted\":%u,\"processed\":%u,\"duration_us\":%lld,\"throughput\":%llu",
+    stress.running, stress.direct, stress.producers, stress.posted, stress.processed, 
+    duration, duration > 0 ? ((uint64_t)stress.processed * 1000000ULL) / duration : 0);
+  if (!stress.running) {
+    statesBufPrintf(buf, ",\"final\":{\"expected\":\"0x%.8x\",\"actual\":\"0x%.8x\",\"mismatch\":\"0x%.8x\"}",
+      stress.expected, stress.actual, stress.expected ^ stress.actual);
+  };
+  statesBufPrintf(buf, ",\"latency\":{\"p50\":%u,\"p99\":%u,\"p999\":%u,\"max\":%u},\"invariants\":{",
+    statesStressPercentile(&stress, 500), statesStressPercentile(&stress, 990), statesStressPercentile(&stress, 999), stress.latency_max);
+  for (uint8_t i = 0; i < STATES_STRESS_INVARIANTS; i++) {
+    statesBufPrintf(buf, "%s\"%s\":%u", i > 0 ? "," : "", _statesStressInvariants[i].name, stress.violations[i]);
+  };
+  statesBufPrintf(buf, "}");
+  if (stress.first_invariant < STATES_STRESS_INVARIANTS) {
+    statesBufPrintf(buf, ",\"first_violation\":{\"invariant\":\"%s\",\"handler\":\"%s\",\"event_id\":%d,\"states\":\"0x%.8x\"}",
+      _statesStressInvariants[stress.first_invariant].name, _statesHandlers[stress.first_handler].name, 
+      stress.first_event_id, stress.first_states);
+  };
+  statesBufPrintf(buf, "}");
+}
 
-      case RE_WIFI_STA_DISCONNECTED:
-      case RE_WIFI_STA_STOPPED:
-        #if CONFIG_ENABLE_STATES_NOTIFICATIONS 
-          if (statesCheck(WIFI_STA_CONNECTED, false)) {
-            healthMonitorsWiFiUnavailable(ESP_ERR_INVALID_STATE);
-          };
-        #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
-        // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_WIFI_STA_DISCONNECTED / RE_WIFI_STA_STOPPED");
-        statesClear(WIFI_STA_CONNECTED);
-        if (!statesCheckAny(NETWORK_CONNECTED, false)) {
-          statesClear(INET_AVAILABLED | INET_SLOWDOWN | MQTT_CONNECTED);
-          wdtRestartMqttBreak();
-        };
-        wdtRestartMqttBreak();
-        break;
-    #endif // CONFIG_WIFI_ENABLED
+size_t statesStressJsonTo(char* buffer, size_t size)
+{
+  return statesBufWrite(statesStressWriter, nullptr, buffer, size);
+}
 
-    #if defined(CONFIG_ETH_ENABLED) && (CONFIG_ETH_ENABLED == 1)
-      case RE_ETHERNET_STARTED:
-        statesSet(ETHERNET_STARTED);
-        statesClear(ETHERNET_CONNECTED | INET_AVAILABLED | INET_SLOWDOWN | MQTT_CONNECTED);
-        // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_ETHERNET_STARTED");
-        wdtRestartMqttBreak();
-        break;
+#if !CONFIG_STATES_ZERO_HEAP
+char* statesStressJson()
+{
+  return statesBufMalloc(statesStressWriter, nullptr);
+}
+#endif // CONFIG_STATES_ZERO_HEAP
 
-      case RE_ETHERNET_GOT_IP:
-        // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_ETHERNET_GOT_IP");
-        statesSet(ETHERNET_CONNECTED | INET_AVAILABLED);
-        statesClear(INET_SLOWDOWN | MQTT_CONNECTED);
-        eventLoopPost(RE_WIFI_EVENTS, RE_INET_PING_OK, nullptr, 0, portMAX_DELAY);
-        #if CONFIG_ENABLE_STATES_NOTIFICATIONS
-          healthMonitorsEthernetAvailable(true);
-        #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
-        statesEventCheckSystemStarted();
-        wdtRestartMqttStart();
-        break;
+#endif // CONFIG_STATES_STRESS
 
-      case RE_ETHERNET_DISCONNECTED:
-      case RE_ETHERNET_STOPPED:
-        #if CONFIG_ENABLE_STATES_NOTIFICATIONS 
-          if (statesCheck(ETHERNET_CONNECTED, false)) {
-            healthMonitorsEthernetUnavailable(ESP_ERR_INVALID_STATE);
-          };
-        #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
-        // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_ETHERNET_DISCONNECTED / RE_ETHERNET_STOPPED");
-        statesClear(ETHERNET_CONNECTED);
-        if (!statesCheckAny(NETWORK_CONNECTED, false)) {
-          statesClear(INET_AVAILABLED | INET_SLOWDOWN | MQTT_CONNECTED);
-          wdtRestartMqttBreak();
-        };
-        break;
-    #endif // CONFIG_ETH_ENABLED)
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------------ Benchmark ------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
 
-    default:
-      // Ignore...
-      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "IGNORED");
-      break;
+#if CONFIG_STATES_BENCHMARK
+
+/**
+ * Measures the hot paths on the device itself: each case is called the given number of times in a row and the whole
+ * loop is timed once, the results are kept until the next run. Changes of the bits made by the plain cases go to 
+ * a private context, which does not feed the LED, history and notifications. With CONFIG_STATES_STRESS, the muted
+ * cases also measure ledSysBlinkAuto() and every event handler, one iteration passes the events of the handler from 
+ * the stress table through it in the table order. These cases borrow the stress test: the real states and errors are
+ * saved, the side effects are muted as during the storm, and the bits are restored after the case; history, 
+ * availability and the network statistics see the scripted events. The live traffic of the handlers is measured by 
+ * the handler statistics, which are included in the report
+ * */
+
+#ifndef CONFIG_STATES_BENCHMARK_BUFFER
+  #define CONFIG_STATES_BENCHMARK_BUFFER 2048
+#endif // CONFIG_STATES_BENCHMARK_BUFFER
+
+typedef struct {
+  const char* name;
+  void (*run)();
+  bool once;        // The operation changes some counters, so it is called only once per run
+  bool muted;       // The operation changes the real states, see statesBenchMute()
+} states_bench_case_t;
+
+typedef struct {
+  uint32_t count;
+  uint64_t time_total;
+} states_bench_result_t;
+
+static char _statesBenchBuffer[CONFIG_STATES_BENCHMARK_BUFFER];
+static re_states_ctx_t _statesBenchCtx;
+
+static void statesBenchGet() { volatile EventBits_t bits = statesGet(); (void)bits; }
+static void statesBenchCheck() { volatile bool ok = statesCheck(SYSTEM_STARTED, false); (void)ok; }
+static void statesBenchCheckErrors() { volatile bool ok = statesCheckErrorsAll(false); (void)ok; }
+static void statesBenchSet() { statesCtxSet(&_statesBenchCtx, BIT0); statesCtxClear(&_statesBenchCtx, BIT0); }
+static void statesBenchJsonStates() { statesGetJsonTo(_statesBenchBuffer, sizeof(_statesBenchBuffer)); }
+static void statesBenchJsonErrors() { statesGetErrorsJsonTo(_statesBenchBuffer, sizeof(_statesBenchBuffer)); }
+#if CONFIG_STATES_BOOT_TIMELINE
+static void statesBenchJsonBoot() { statesBootTimelineJsonTo(false, _statesBenchBuffer, sizeof(_statesBenchBuffer)); }
+#endif // CONFIG_STATES_BOOT_TIMELINE
+#if CONFIG_STATES_HANDLER_STATS
+static void statesBenchJsonHandlers() { statesHandlerStatsJsonTo(_statesBenchBuffer, sizeof(_statesBenchBuffer)); }
+#endif // CONFIG_STATES_HANDLER_STATS
+#if CONFIG_ENABLE_STATES_NOTIFICATIONS && CONFIG_STATES_NOTIFY_BACKENDS
+static void statesBenchJsonBackends() { statesNotifyBackendsJsonTo(_statesBenchBuffer, sizeof(_statesBenchBuffer)); }
+#endif // CONFIG_STATES_NOTIFY_BACKENDS
+#if CONFIG_ENABLE_STATES_NOTIFICATIONS && CONFIG_STATES_NOTIFY_OUTBOX
+static void statesBenchJsonOutbox() { statesOutboxJsonTo(_statesBenchBuffer, sizeof(_statesBenchBuffer)); }
+#endif // CONFIG_STATES_NOTIFY_OUTBOX
+
+#if CONFIG_STATES_STRESS
+
+typedef struct {
+  EventBits_t states;
+  EventBits_t errors;
+} states_bench_saved_t;
+
+// The stress test is not started while the case runs, and the case is skipped while the stress test is running
+static bool statesBenchMute(states_bench_saved_t* saved)
+{
+  statesStressReap();
+  portENTER_CRITICAL(&_statesStressLock);
+  bool busy = _statesStress.running;
+  if (!busy) _statesStress.running = true;
+  portEXIT_CRITICAL(&_statesStressLock);
+  if (busy) return false;
+  saved->states = statesGet();
+  saved->errors = statesGetErrors();
+  __atomic_store_n(&_statesStressMuted, true, __ATOMIC_RELAXED);
+  return true;
+}
+
+// The bits are restored while the side effects are still muted, then the watchdogs catch up with the restored states
+static void statesBenchUnmute(const states_bench_saved_t* saved)
+{
+  EventBits_t states = statesGet();
+  if (states & ~saved->states) statesClear(states & ~saved->states);
+  if (saved->states & ~states) statesSet(saved->states & ~states);
+  EventBits_t errors = statesGetErrors();
+  if (errors & ~saved->errors) statesClearErrors(errors & ~saved->errors);
+  if (saved->errors & ~errors) statesSetErrors(saved->errors & ~errors);
+  __atomic_store_n(&_statesStressMuted, false, __ATOMIC_RELAXED);
+  statesWatchdogsCheck(&_statesDefault);
+  portENTER_CRITICAL(&_statesStressLock);
+  _statesStress.running = false;
+  portEXIT_CRITICAL(&_statesStressLock);
+}
+
+static void statesBenchHandler(uint8_t handler)
+{
+  // The same payloads on every run
+  uint32_t seed = 1;
+  states_stress_item_t item;
+  for (uint8_t i = 0; i < STATES_STRESS_EVENTS; i++) {
+    if (_statesStressEvents[i].handler == handler) {
+      statesStressFill(&item, &_statesStressEvents[i], &seed);
+      statesStressCall(&item);
+    };
   };
 }
 
+static void statesBenchLedAuto() { ledSysBlinkAuto(); }
+static void statesBenchHandlerWiFi() { statesBenchHandler(SH_WIFI); }
+static void statesBenchHandlerTime() { statesBenchHandler(SH_TIME); }
 #if CONFIG_PINGER_ENABLE
+static void statesBenchHandlerPing() { statesBenchHandler(SH_PING); }
+#endif // CONFIG_PINGER_ENABLE
+static void statesBenchHandlerMqtt() { statesBenchHandler(SH_MQTT); }
+
+#endif // CONFIG_STATES_STRESS
+
+static const states_bench_case_t _statesBenchCases[] = {
+  { "get",            statesBenchGet,           false },
+  { "check",          statesBenchCheck,         false },
+  { "check_errors",   statesBenchCheckErrors,   false },
+  { "set_clear",      statesBenchSet,           false },
+  { "json_states",    statesBenchJsonStates,    false },
+  { "json_errors",    statesBenchJsonErrors,    false },
+  #if CONFIG_STATES_BOOT_TIMELINE
+  { "json_boot",      statesBenchJsonBoot,      false },
+  #endif // CONFIG_STATES_BOOT_TIMELINE
+  #if CONFIG_STATES_HANDLER_STATS
+  { "json_handlers",  statesBenchJsonHandlers,  false },
+  #endif // CONFIG_STATES_HANDLER_STATS
+  #if CONFIG_ENABLE_STATES_NOTIFICATIONS && CONFIG_STATES_NOTIFY_BACKENDS
+  { "json_backends",  statesBenchJsonBackends,  false },
+  #endif // CONFIG_STATES_NOTIFY_BACKENDS
+  #if CONFIG_ENABLE_STATES_NOTIFICATIONS && CONFIG_STATES_NOTIFY_OUTBOX
+  { "json_outbox",    statesBenchJsonOutbox,    false },
+  #endif // CONFIG_STATES_NOTIFY_OUTBOX
+  #if CONFIG_HEAP_TRACING_STANDALONE
+  { "leaks_scan",     heapLeaksScan,            true },
+  #endif // CONFIG_HEAP_TRACING_STANDALONE
+  #if CONFIG_STATES_STRESS
+  { "led_auto",       statesBenchLedAuto,       false, true },
+  { "handler_wifi",   statesBenchHandlerWiFi,   false, true },
+  { "handler_time",   statesBenchHandlerTime,   false, true },
+  #if CONFIG_PINGER_ENABLE
+  { "handler_ping",   statesBenchHandlerPing,   false, true },
+  #endif // CONFIG_PINGER_ENABLE
+  { "handler_mqtt",   statesBenchHandlerMqtt,   false, true },
+  #endif // CONFIG_STATES_STRESS
+};
 
-static void statesEventHandlerPing(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
-{
-  switch (event_id) {
-    case RE_PING_INET_AVAILABLE: 
-      statesSet(INET_AVAILABLED);
-      statesClear(INET_SLOWDOWN);
-      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_PING_INET_AVAILABLE");
-      #if CONFIG_ENABLE_STATES_NOTIFICATIONS
-        if (statesCheck(WIFI_STA_CONNECTED, false)) {
-          healthMonitorsInetAvailable(true);
-        };
-      #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
-      eventLoopPost(RE_WIFI_EVENTS, RE_INET_PING_OK, nullptr, 0, portMAX_DELAY);
-      statesEventCheckSystemStarted();
-      wdtRestartMqttCheck();
-      break;
+#define STATES_BENCH_CASES (sizeof(_statesBenchCases) / sizeof(states_bench_case_t))
 
-    case RE_PING_INET_SLOWDOWN: {
-        statesSet(INET_AVAILABLED | INET_SLOWDOWN);
-        // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_PING_INET_SLOWDOWN");
+static states_bench_result_t _statesBenchResults[STATES_BENCH_CASES];
+static uint32_t _statesBenchIterations = 0;
+static int32_t _statesBenchHeapDelta = 0;
+static time_t _statesBenchTime = 0;
+
+void statesBenchmarkRun(uint32_t iterations)
+{
+  if (iterations == 0) iterations = 1;
+  if (!_statesBenchCtx.states && !statesCtxInit(&_statesBenchCtx, "bench", nullptr, nullptr)) return;
+  rlog_i(logTAG, "Benchmark started: %u cases, %u iterations", (unsigned)STATES_BENCH_CASES, (unsigned)iterations);
+  size_t heap_start = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+  for (uint8_t i = 0; i < STATES_BENCH_CASES; i++) {
+    uint32_t count = _statesBenchCases[i].once ? 1 : iterations;
+    #if CONFIG_STATES_STRESS
+      states_bench_saved_t saved;
+      if (_statesBenchCases[i].muted && !statesBenchMute(&saved)) {
+        rlog_w(logTAG, "Benchmark case [%s] skipped: stress test is running", _statesBenchCases[i].name);
+        _statesBenchResults[i].time_total = 0;
+        _statesBenchResults[i].count = 0;
+        continue;
       };
-      break;
+    #endif // CONFIG_STATES_STRESS
+    int64_t time_start = esp_timer_get_time();
+    for (uint32_t j = 0; j < count; j++) {
+      _statesBenchCases[i].run();
+    };
+    _statesBenchResults[i].time_total = (uint64_t)(esp_timer_get_time() - time_start);
+    _statesBenchResults[i].count = count;
+    #if CONFIG_STATES_STRESS
+      if (_statesBenchCases[i].muted) statesBenchUnmute(&saved);
+    #endif // CONFIG_STATES_STRESS
+  };
+  _statesBenchHeapDelta = (int32_t)heap_start - (int32_t)heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+  _statesBenchIterations = iterations;
+  _statesBenchTime = time(nullptr);
+  rlog_i(logTAG, "Benchmark completed");
+}
 
-    case RE_PING_INET_UNAVAILABLE:
-      statesClear(INET_AVAILABLED | INET_SLOWDOWN);
-      eventLoopPost(RE_WIFI_EVENTS, RE_INET_PING_FAILED, nullptr, 0, portMAX_DELAY);
-      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_PING_INET_UNAVAILABLE");
-      #if CONFIG_ENABLE_STATES_NOTIFICATIONS
-        if (statesCheckAny(NETWORK_CONNECTED, false)) {
-          if (event_data) {
-            ping_inet_data_t* data = (ping_inet_data_t*)event_data;
-            healthMonitorsInetUnavailable(ESP_ERR_TIMEOUT, data->time_unavailable);
-          } else {
-            healthMonitorsInetUnavailable(ESP_ERR_TIMEOUT, time(nullptr));
-          };
-        };
-      #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
-      wdtRestartMqttCheck();
-      break;
+// Average time is given in nanoseconds, since most of the operations take less than a microsecond
+static void statesBenchmarkWriter(states_buf_t* buf, void* arg)
+{
+  statesBufPrintf(buf, "{\"time\":%lld,\"iterations\":%d,\"heap_delta\":%d,\"cases\":{", 
+    (int64_t)_statesBenchTime, _statesBenchIterations, _statesBenchHeapDelta);
+  if (_statesBenchIterations > 0) {
+    for (uint8_t i = 0; i < STATES_BENCH_CASES; i++) {
+      states_bench_result_t* result = &_statesBenchResults[i];
+      statesBufPrintf(buf, "%s\"%s\":{\"count\":%u,\"total_us\":%llu,\"avg_ns\":%llu}", i > 0 ? "," : "",
+        _statesBenchCases[i].name, result->count, result->time_total,
+        result->count > 0 ? (result->time_total * 1000) / result->count : 0);
+    };
+  };
+  statesBufPrintf(buf, "}");
+  #if CONFIG_STATES_HANDLER_STATS
+    statesBufPrintf(buf, ",\"handlers\":");
+    statesHandlerStatsWriter(buf, nullptr);
+  #endif // CONFIG_STATES_HANDLER_STATS
+  statesBufPrintf(buf, "}");
+}
 
-    case RE_PING_MQTT1_AVAILABLE:
-      statesSet(MQTT_1_ENABLED);
-      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_PING_MQTT1_AVAILABLE");
-      #if ENABLE_NOTIFY_MQTT1_PING
-        hmMqttPing1.setState(ESP_OK, time(nullptr));
-      #endif // ENABLE_NOTIFY_MQTT1_PING
-      break;
+size_t statesBenchmarkJsonTo(char* buffer, size_t size)
+{
+  return statesBufWrite(statesBenchmarkWriter, nullptr, buffer, size);
+}
 
-    case RE_PING_MQTT2_AVAILABLE:
-      statesSet(MQTT_2_ENABLED);
-      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_PING_MQTT2_AVAILABLE");
-      #if ENABLE_NOTIFY_MQTT2_PING
-        hmMqttPing2.setState(ESP_OK, time(nullptr));
-      #endif // ENABLE_NOTIFY_MQTT2_PING
-      break;
+#if !CONFIG_STATES_ZERO_HEAP
+char* statesBenchmarkJson()
+{
+  return statesBufMalloc(statesBenchmarkWriter, nullptr);
+}
+#endif // CONFIG_STATES_ZERO_HEAP
+
+#endif // CONFIG_STATES_BENCHMARK
+
+// -----------------------------------------------------------------------------------------------------------------------
+// --------------------------------------------------- Fleet simulator ---------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_STATES_FLEET_SIM
+
+/**
+ * Virtual nodes, each is a states context with its own watchdog, health monitors and notification budgets. On every 
+ * simulation tick the fault model breaks and repairs the network link, the internet and the MQTT broker of every node; 
+ * the changes are passed through the real event handlers by statesCtxEventHandle(), in the order the drivers post them. 
+ * The monitors of a node notify through statesCtxHealthMonitorNotify() and the rate limits of the node, the messages 
+ * are only counted. The MQTT watchdog of a node sets ERR_WATCHDOG, then the node is restarted: its context, watchdog 
+ * and monitors are created again. Each change of the states of a node is "published" to an in-process MQTT stand-in, 
+ * which only counts messages and bytes. The thresholds and timeouts are real seconds, so the tick period matters. 
+ * The nodes never touch the states of the device itself
+ * */
+
+#ifndef CONFIG_STATES_FLEET_NODES_MAX
+  #define CONFIG_STATES_FLEET_NODES_MAX 16
+#endif // CONFIG_STATES_FLEET_NODES_MAX
+#ifndef CONFIG_STATES_FLEET_STACK
+  #define CONFIG_STATES_FLEET_STACK 4096
+#endif // CONFIG_STATES_FLEET_STACK
+#ifndef CONFIG_STATES_FLEET_PRIORITY
+  #define CONFIG_STATES_FLEET_PRIORITY 2
+#endif // CONFIG_STATES_FLEET_PRIORITY
+#ifndef CONFIG_STATES_FLEET_WINDOW
+  #define CONFIG_STATES_FLEET_WINDOW 60
+#endif // CONFIG_STATES_FLEET_WINDOW
+#ifndef CONFIG_STATES_FLEET_MSG_PRIORITY
+  #define CONFIG_STATES_FLEET_MSG_PRIORITY 1
+#endif // CONFIG_STATES_FLEET_MSG_PRIORITY
+
+#define STATES_FLEET_NAME_PREFIX "node-"
+
+// The link of the nodes is WiFi, or Ethernet on a device without WiFi
+#if !defined(CONFIG_WIFI_ENABLED) || (CONFIG_WIFI_ENABLED == 1)
+  #define STATES_FLEET_LINK_START     RE_WIFI_STA_STARTED
+  #define STATES_FLEET_LINK_UP        RE_WIFI_STA_GOT_IP
+  #define STATES_FLEET_LINK_DOWN      RE_WIFI_STA_DISCONNECTED
+  #define STATES_FLEET_LINK_STARTED   WIFI_STA_STARTED
+  #define STATES_FLEET_LINK_CONNECTED WIFI_STA_CONNECTED
+  #define STATES_FLEET_LINK_ROLE      SHM_WIFI
+#elif defined(CONFIG_ETH_ENABLED) && (CONFIG_ETH_ENABLED == 1)
+  #define STATES_FLEET_LINK_START     RE_ETHERNET_STARTED
+  #define STATES_FLEET_LINK_UP        RE_ETHERNET_GOT_IP
+  #define STATES_FLEET_LINK_DOWN      RE_ETHERNET_DISCONNECTED
+  #define STATES_FLEET_LINK_STARTED   ETHERNET_STARTED
+  #define STATES_FLEET_LINK_CONNECTED ETHERNET_CONNECTED
+  #define STATES_FLEET_LINK_ROLE      SHM_ETHERNET
+#else
+  #error "The fleet simulator needs WiFi or Ethernet"
+#endif // CONFIG_WIFI_ENABLED
+
+#if CONFIG_ENABLE_STATES_NOTIFICATIONS
+
+typedef enum {
+  SFM_LINK = 0,
+  SFM_INET,
+  SFM_MQTT,
+  SFM_MAX
+} states_fleet_monitor_index_t;
+
+typedef struct {
+  states_monitor_role_t role;
+  hm_notify_mode_t mode;
+  const char* msg_ok;
+  const char* msg_failure;
+  bool registered;         // Locked by the registry of the node while the dependencies are not met
+  EventBits_t depends_all;
+  EventBits_t depends_any;
+} states_fleet_monitor_t;
+
+// The same roles and dependencies as the monitors of the device, the object of every message is the name of the node
+static const states_fleet_monitor_t _statesFleetMonitors[SFM_MAX] = {
+  { STATES_FLEET_LINK_ROLE, HM_RECOVERY, 
+    "%s: network restored, lost at %s, restored at %s, %.2d:%.2d:%.2d", nullptr, 
+    false, 0, 0 },
+  { SHM_INET, HM_AUTO, 
+    "%s: internet restored, lost at %s, restored at %s, %.2d:%.2d:%.2d", "%s: internet unavailable, error %d (%d %s) since %s", 
+    true, 0, NETWORK_CONNECTED },
+  { SHM_MQTT, HM_AUTO, 
+    "%s: broker restored, lost at %s, restored at %s, %.2d:%.2d:%.2d", "%s: broker unavailable, error %d (%d %s) since %s", 
+    true, INET_AVAILABLED, NETWORK_CONNECTED },
+};
+
+#endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+
+typedef struct {
+  re_states_ctx_t ctx;
+  char name[12];
+  bool primary;            // Broker of the next connection
+  bool up;                 // The context and the services of the node exist
+  bool alive;              // The monitors of the node may notify
+  bool reboot;             // Set when the watchdog of the node has expired
+  uint32_t notifications;
+  #if CONFIG_ENABLE_STATES_NOTIFICATIONS
+    alignas(reHealthMonitor) uint8_t monitors[SFM_MAX][sizeof(reHealthMonitor)];
+  #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+} states_fleet_node_t;
 
-    case RE_PING_MQTT1_UNAVAILABLE:
-      statesClear(MQTT_1_ENABLED);
-      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_PING_MQTT1_UNAVAILABLE");
-      #if ENABLE_NOTIFY_MQTT1_PING
-        if (event_data) {
-          ping_host_data_t* data = (ping_host_data_t*)event_data;
-          hmMqttPing1.setState(ESP_ERR_TIMEOUT, data->time_unavailable);
-        } else {
-          hmMqttPing1.setState(ESP_ERR_TIMEOUT, time(nullptr));
-        };         
-      #endif // ENABLE_NOTIFY_MQTT1_PING
-      break;
+typedef struct {
+  bool     running;
+  bool     stop;
+  uint16_t nodes;
+  uint32_t ticks;
+  uint32_t tick;
+  states_fleet_model_t model;
+  uint16_t online;         // Nodes connected to the broker at the last tick
+  uint16_t online_min;
+  uint32_t events;         // Events passed through the handlers of the nodes
+  uint32_t publishes;
+  uint32_t publish_bytes;
+  uint32_t dropped;        // Changes made while the node was not connected to the broker
+  uint32_t failovers;
+  uint32_t restarts;
+  #if CONFIG_ENABLE_STATES_NOTIFICATIONS
+    uint32_t notify[SN_MAX];
+    uint32_t notify_bytes;
+    uint32_t suppressed;     // By the rate limits of the nodes that have been restarted or stopped...
+    uint32_t node_suppressed;// ...and of the nodes that are up
+    uint32_t node_peak;      // Notifications of the noisiest node
+    uint32_t window_count;   // Notifications of the fleet in the current window...
+    uint32_t window_peak;    // ...and the maximum of all windows
+    int64_t  window_start;
+  #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+  int64_t  time_start;
+  int64_t  time_end;
+} states_fleet_t;
+
+static states_fleet_t _statesFleet;
+static portMUX_TYPE _statesFleetLock = portMUX_INITIALIZER_UNLOCKED;
+static uint16_t _statesFleetNodesCount = 0;
+#if CONFIG_STATES_STATIC_ALLOCATION
+  static states_fleet_node_t _statesFleetNodes[CONFIG_STATES_FLEET_NODES_MAX];
+  static StaticTask_t _statesFleetTaskBuffer;
+  static StackType_t _statesFleetTaskStack[CONFIG_STATES_FLEET_STACK];
+#else
+  static states_fleet_node_t* _statesFleetNodes = nullptr;
+#endif // CONFIG_STATES_STATIC_ALLOCATION
 
-    case RE_PING_MQTT2_UNAVAILABLE:
-      statesClear(MQTT_2_ENABLED);
-      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_PING_MQTT2_UNAVAILABLE");
-      #if ENABLE_NOTIFY_MQTT2_PING
-        if (event_data) {
-          ping_host_data_t* data = (ping_host_data_t*)event_data;
-          hmMqttPing2.setState(ESP_ERR_TIMEOUT, data->time_unavailable);
-        } else {
-          hmMqttPing2.setState(ESP_ERR_TIMEOUT, time(nullptr));
-        };         
-      #endif // ENABLE_NOTIFY_MQTT2_PING
-      break;
+static inline uint32_t statesFleetRandom(uint32_t* seed)
+{
+  // xorshift32
+  uint32_t x = *seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *seed = x;
+  return x;
+}
 
-    default:
-      // Ignore...
-      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "IGNORED");
-      break;
+static inline bool statesFleetChance(uint32_t* seed, uint16_t permille)
+{
+  return (permille > 0) && ((statesFleetRandom(seed) % 1000) < permille);
+}
+
+// -- MQTT stand-in ------------------------------------------------------------------------------------------------------
+// The node publishes its states and errors to "fleet/<node>/states" and "fleet/<node>/errors"
+static void statesFleetPublish(re_states_ctx_t* ctx, states_group_t group, EventBits_t bits_old, EventBits_t bits_new, void* arg)
+{
+  states_fleet_node_t* node = (states_fleet_node_t*)arg;
+  if ((group == SG_ERRORS) && (bits_new & ~bits_old & ERR_WATCHDOG)) {
+    // The node is restarted by the simulation task, not in the timer callback
+    __atomic_store_n(&node->reboot, true, __ATOMIC_RELEASE);
+  };
+  char topic[32];
+  char payload[16];
+  int topic_len = snprintf(topic, sizeof(topic), "fleet/%s/%s", node->name, group == SG_ERRORS ? "errors" : "states");
+  int payload_len = snprintf(payload, sizeof(payload), "0x%.8x", (uint32_t)bits_new);
+  bool connected = statesCtxCheck(ctx, MQTT_CONNECTED, false);
+  portENTER_CRITICAL(&_statesFleetLock);
+  if (connected) {
+    _statesFleet.publishes++;
+    _statesFleet.publish_bytes += topic_len + payload_len;
+  } else {
+    _statesFleet.dropped++;
   };
+  portEXIT_CRITICAL(&_statesFleetLock);
 }
 
-#endif // CONFIG_PINGER_ENABLE
+// -- Notifications ------------------------------------------------------------------------------------------------------
+#if CONFIG_ENABLE_STATES_NOTIFICATIONS
 
-static void statesEventHandlerMqtt(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+// Messages that passed the rate limits of the node
+static bool statesFleetNotify(re_states_ctx_t* ctx, states_notify_channel_t channel, uint32_t msg_options, const char* text, void* arg)
 {
-  switch (event_id) {
-    case RE_MQTT_CONNECTED:
-      statesSet(MQTT_CONNECTED);
-      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_MQTT_CONNECTED");
-      wdtRestartMqttBreak();
-      if (event_data) {
-        re_mqtt_event_data_t* data = (re_mqtt_event_data_t*)event_data;
-        statesSetBit(MQTT_PRIMARY, data->primary);
-        statesSetBit(MQTT_LOCAL, data->local);
-        #if ENABLE_NOTIFY_MQTT_STATUS
-          hmMqtt.setStateCustom(ESP_OK, time(nullptr), false, malloc_stringf("%s:%d", data->host, data->port));
-        #endif // ENABLE_NOTIFY_MQTT_STATUS
-        statesEventCheckSystemStarted();
-      };
-      break;
-
-    case RE_MQTT_CONN_LOST:
-      statesClear(MQTT_CONNECTED);
-      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_MQTT_CONN_LOST");
-      wdtRestartMqttStart();
-      if (event_data) {
-        re_mqtt_event_data_t* data = (re_mqtt_event_data_t*)event_data;
-        #if ENABLE_NOTIFY_MQTT_STATUS
-          hmMqtt.setStateCustom(ESP_ERR_INVALID_STATE, time(nullptr), false, malloc_stringf("%s:%d", data->host, data->port));
-        #endif // ENABLE_NOTIFY_MQTT_STATUS
-      };
-      break;
+  states_fleet_node_t* node = (states_fleet_node_t*)arg;
+  size_t len = strlen(text);
+  int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&_statesFleetLock);
+  node->notifications++;
+  if (node->notifications > _statesFleet.node_peak) _statesFleet.node_peak = node->notifications;
+  _statesFleet.notify[channel]++;
+  _statesFleet.notify_bytes += len;
+  if ((now - _statesFleet.window_start) >= (int64_t)CONFIG_STATES_FLEET_WINDOW * 1000000) {
+    _statesFleet.window_start = now;
+    _statesFleet.window_count = 0;
+  };
+  _statesFleet.window_count++;
+  if (_statesFleet.window_count > _statesFleet.window_peak) _statesFleet.window_peak = _statesFleet.window_count;
+  portEXIT_CRITICAL(&_statesFleetLock);
+  return true;
+}
 
-    case RE_MQTT_CONN_FAILED:
-      statesClear(MQTT_CONNECTED);
-      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_MQTT_CONN_FAILED");
-      wdtRestartMqttStart();
-      if (event_data) {
-        re_mqtt_event_data_t* data = (re_mqtt_event_data_t*)event_data;
-        #if ENABLE_NOTIFY_MQTT_STATUS
-          hmMqtt.forcedTimeout();
-          #if CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-          if (_hmNotifyMqtt) {
-          #endif // CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-            tgSend(MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_MQTT_ERRORS_PRIORITY, CONFIG_NOTIFY_TELEGRAM_ALERT_MQTT_ERRORS, CONFIG_TELEGRAM_DEVICE, 
-              CONFIG_MESSAGE_TG_MQTT_CONN_FAILED, data->host, data->port);
-          #if CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-          };
-          #endif // CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-        #endif // ENABLE_NOTIFY_MQTT_STATUS
-      };
-      break;
+// The monitors share one callback, the node is found by its name, which is the object of the monitor
+static bool statesFleetMonitorNotify(hm_notify_data_t* notify_data)
+{
+  if ((notify_data == nullptr) || (notify_data->object == nullptr)) return false;
+  size_t prefix = strlen(STATES_FLEET_NAME_PREFIX);
+  if (strncmp(notify_data->object, STATES_FLEET_NAME_PREFIX, prefix) != 0) return false;
+  uint32_t index = strtoul(notify_data->object + prefix, nullptr, 10);
+  if (index >= __atomic_load_n(&_statesFleetNodesCount, __ATOMIC_ACQUIRE)) return false;
+  states_fleet_node_t* node = &_statesFleetNodes[index];
+  if (!__atomic_load_n(&node->alive, __ATOMIC_ACQUIRE) || (strcmp(notify_data->object, node->name) != 0)) return false;
+  return statesCtxHealthMonitorNotify(&node->ctx, notify_data);
+}
 
-    case RE_MQTT_SERVER_PRIMARY:
-      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_MQTT_SERVER_PRIMARY");
-      #if defined(CONFIG_MQTT1_TYPE) && ENABLE_NOTIFY_MQTT_STATUS
-        hmMqtt.forcedTimeout();
-        #if CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-        if (_hmNotifyMqtt) {
-        #endif // CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-          tgSend(MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_MQTT_ERRORS_PRIORITY, CONFIG_NOTIFY_TELEGRAM_ALERT_MQTT_ERRORS, CONFIG_TELEGRAM_DEVICE, 
-            CONFIG_MESSAGE_TG_MQTT_SERVER_CHANGE_PRIMARY, 
-            #if CONFIG_MQTT1_TLS_ENABLED
-              CONFIG_MQTT1_HOST, CONFIG_MQTT1_PORT_TLS
-            #else
-              CONFIG_MQTT1_HOST, CONFIG_MQTT1_PORT_TCP
-            #endif // CONFIG_MQTT1_TLS_ENABLED
-            );
-        #if CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-        };
-        #endif // CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-      #endif // ENABLE_NOTIFY_MQTT_STATUS
-      break;
+static uint32_t statesFleetSuppressed(states_fleet_node_t* node)
+{
+  uint32_t suppressed = 0;
+  for (uint8_t i = 0; i < SN_MAX; i++) {
+    suppressed += node->ctx.notify[i].suppressed;
+  };
+  return suppressed;
+}
 
-    case RE_MQTT_SERVER_RESERVED:
-      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_MQTT_SERVER_RESERVED");
-      #if defined(CONFIG_MQTT2_TYPE) && ENABLE_NOTIFY_MQTT_STATUS
-        hmMqtt.forcedTimeout();
-        #if CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-        if (_hmNotifyMqtt) {
-        #endif // CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-          tgSend(MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_MQTT_ERRORS_PRIORITY, CONFIG_NOTIFY_TELEGRAM_ALERT_MQTT_ERRORS, CONFIG_TELEGRAM_DEVICE, 
-            CONFIG_MESSAGE_TG_MQTT_SERVER_CHANGE_RESERVED, 
-            #if CONFIG_MQTT2_TLS_ENABLED
-              CONFIG_MQTT2_HOST, CONFIG_MQTT2_PORT_TLS
-            #else
-              CONFIG_MQTT2_HOST, CONFIG_MQTT2_PORT_TCP
-            #endif // CONFIG_MQTT2_TLS_ENABLED
-            );
-        #if CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-        };
-        #endif // CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-      #endif // ENABLE_NOTIFY_MQTT_STATUS
-      break;
+#endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
 
-    case RE_MQTT_ERROR:
-      statesSetErrors(ERR_MQTT);
-      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_MQTT_ERROR");
-      #if ENABLE_NOTIFY_MQTT_ERRORS
-        #if CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-        if (_hmNotifyMqttErrors) {
-        #endif // CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-          if (event_data) {
-            char* error = (char*)event_data;
-            tgSend(MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_MQTT_ERRORS_PRIORITY, CONFIG_NOTIFY_TELEGRAM_ALERT_MQTT_ERRORS, CONFIG_TELEGRAM_DEVICE, 
-              CONFIG_MESSAGE_TG_MQTT_ERROR, error);
-          };
-        #if CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-        };
-        #endif // CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-      #endif // ENABLE_NOTIFY_MQTT_ERRORS
-      break;
+// -- Nodes --------------------------------------------------------------------------------------------------------------
+static void statesFleetEvent(states_fleet_node_t* node, esp_event_base_t event_base, int32_t event_id, void* event_data)
+{
+  statesCtxEventHandle(&node->ctx, event_base, event_id, event_data);
+  portENTER_CRITICAL(&_statesFleetLock);
+  _statesFleet.events++;
+  portEXIT_CRITICAL(&_statesFleetLock);
+}
 
-    case RE_MQTT_ERROR_CLEAR:
-      statesClearErrors(ERR_MQTT);
-      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_MQTT_ERROR_CLEAR");
-      break;
+static void statesFleetMqttEvent(states_fleet_node_t* node, int32_t event_id)
+{
+  re_mqtt_event_data_t data;
+  memset(&data, 0, sizeof(data));
+  data.primary = node->primary;
+  data.local = false;
+  strncpy(data.host, node->primary ? "primary.fleet" : "reserve.fleet", sizeof(data.host) - 1);
+  data.port = 1883;
+  statesFleetEvent(node, RE_MQTT_EVENTS, event_id, &data);
+}
 
-    default:
-      // Ignore...
-      // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "IGNORED");
-      break;
+// The MQTT client reports the loss of the connection before the link or the internet goes down
+static void statesFleetMqttLost(states_fleet_node_t* node)
+{
+  if (statesCtxCheck(&node->ctx, MQTT_CONNECTED, false)) {
+    statesFleetMqttEvent(node, RE_MQTT_CONN_LOST);
   };
 }
 
-#ifndef CONFIG_NO_SENSORS
+static void statesFleetNodeDown(states_fleet_node_t* node)
+{
+  if (!node->up) return;
+  __atomic_store_n(&node->alive, false, __ATOMIC_RELEASE);
+  #if CONFIG_ENABLE_STATES_NOTIFICATIONS
+    uint32_t suppressed = statesFleetSuppressed(node);
+    portENTER_CRITICAL(&_statesFleetLock);
+    _statesFleet.suppressed += suppressed;
+    portEXIT_CRITICAL(&_statesFleetLock);
+    for (uint8_t i = 0; i < SFM_MAX; i++) {
+      reHealthMonitor* monitor = (reHealthMonitor*)node->monitors[i];
+      statesCtxHealthMonitorUnregister(&node->ctx, monitor);
+      monitor->~reHealthMonitor();
+    };
+  #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+  statesCtxFree(&node->ctx);
+  node->up = false;
+}
 
-static void statesEventHandlerSensor(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+// Creates the context and the services of the node and boots it, connected or not
+static bool statesFleetNodeUp(states_fleet_node_t* node, const states_fleet_model_t* model, bool connect)
 {
-  // rlog_w(logTAG, DEBUG_LOG_EVENT_MESSAGE, event_base, "RE_SENSOR_STATUS_CHANGED");
+  if (!statesCtxInit(&node->ctx, node->name, statesFleetPublish, node)) return false;
+  #if CONFIG_ENABLE_STATES_NOTIFICATIONS
+    statesCtxSetNotify(&node->ctx, statesFleetNotify);
+    for (uint8_t i = 0; i < SFM_MAX; i++) {
+      const states_fleet_monitor_t* item = &_statesFleetMonitors[i];
+      reHealthMonitor* monitor = new (node->monitors[i]) reHealthMonitor(node->name, item->mode, 
+        encMsgOptions(MK_SERVICE, item->mode != HM_RECOVERY, CONFIG_STATES_FLEET_MSG_PRIORITY), 
+        item->msg_ok, item->msg_failure, model->alert_threshold, statesFleetMonitorNotify);
+      if (item->registered) {
+        statesCtxHealthMonitorRegister(&node->ctx, monitor, item->depends_all, item->depends_any);
+      };
+      statesCtxHealthMonitorAssign(&node->ctx, item->role, monitor);
+    };
+  #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+  node->up = true;
+  if (model->watchdog_timeout > 0) {
+    states_watchdog_t wdt;
+    memset(&wdt, 0, sizeof(wdt));
+    wdt.name = "fleet_mqtt";
+    wdt.group = SG_STATES;
+    wdt.ok_all = MQTT_CONNECTED;
+    wdt.armed_all = STATES_FLEET_LINK_STARTED;
+    wdt.timeout = model->watchdog_timeout;
+    wdt.action = SWA_ERROR;
+    wdt.error_bits = ERR_WATCHDOG;
+    if (statesCtxWatchdogAdd(&node->ctx, &wdt) < 0) {
+      statesFleetNodeDown(node);
+      return false;
+    };
+  };
+  __atomic_store_n(&node->alive, true, __ATOMIC_RELEASE);
 
-  if (event_data != nullptr) {
-    sensor_event_status_t* data = (sensor_event_status_t*)event_data;
+  statesFleetEvent(node, RE_TIME_EVENTS, RE_TIME_SNTP_SYNC_OK, nullptr);
+  statesFleetEvent(node, RE_WIFI_EVENTS, STATES_FLEET_LINK_START, nullptr);
+  if (connect) {
+    statesFleetEvent(node, RE_WIFI_EVENTS, STATES_FLEET_LINK_UP, nullptr);
+    statesFleetMqttEvent(node, RE_MQTT_CONNECTED);
+  };
+  return true;
+}
 
-    // Set new status
-    switch (data->sensor_id) {
-      case 1:
-        statesSetError(ERR_SENSOR_1, ((sensor_status_t)data->new_status != SENSOR_STATUS_OK));
-        break;
-      case 2:
-        statesSetError(ERR_SENSOR_2, ((sensor_status_t)data->new_status != SENSOR_STATUS_OK));
-        break;
-      case 3:
-        statesSetError(ERR_SENSOR_3, ((sensor_status_t)data->new_status != SENSOR_STATUS_OK));
-        break;
-      case 4:
-        statesSetError(ERR_SENSOR_4, ((sensor_status_t)data->new_status != SENSOR_STATUS_OK));
-        break;
-      case 5:
-        statesSetError(ERR_SENSOR_5, ((sensor_status_t)data->new_status != SENSOR_STATUS_OK));
-        break;
-      case 6:
-        statesSetError(ERR_SENSOR_6, ((sensor_status_t)data->new_status != SENSOR_STATUS_OK));
-        break;
-      case 7:
-        statesSetError(ERR_SENSOR_7, ((sensor_status_t)data->new_status != SENSOR_STATUS_OK));
-        break;
-      default:
-        statesSetError(ERR_SENSOR_0, ((sensor_status_t)data->new_status != SENSOR_STATUS_OK));
-        break;
+// One tick of the fault model, returns true if the node is connected to the broker
+static bool statesFleetStep(states_fleet_node_t* node, const states_fleet_model_t* model, uint32_t* seed)
+{
+  re_states_ctx_t* ctx = &node->ctx;
+
+  if (__atomic_exchange_n(&node->reboot, false, __ATOMIC_ACQ_REL)) {
+    statesFleetNodeDown(node);
+    portENTER_CRITICAL(&_statesFleetLock);
+    _statesFleet.restarts++;
+    portEXIT_CRITICAL(&_statesFleetLock);
+    if (!statesFleetNodeUp(node, model, false)) {
+      rlog_e(logTAG, "Failed to restart virtual node [%s]", node->name);
+    };
+  };
+  if (!node->up) return false;
+
+  // Network link, the address also brings the internet
+  EventBits_t states = statesCtxGet(ctx);
+  if (states & STATES_FLEET_LINK_CONNECTED) {
+    if (statesFleetChance(seed, model->flap)) {
+      statesFleetMqttLost(node);
+      statesFleetEvent(node, RE_WIFI_EVENTS, STATES_FLEET_LINK_DOWN, nullptr);
     };
+  } else if (statesFleetChance(seed, model->recovery)) {
+    statesFleetEvent(node, RE_WIFI_EVENTS, STATES_FLEET_LINK_UP, nullptr);
+  };
 
-    #if ENABLE_NOTIFY_SENSOR_STATE
-      // Sensor status change notification
-      #if CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-      if (_hmNotifySensors) {
-      #endif // CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-        rSensor* sensor = (rSensor*)data->sensor;
-        if ((sensor_status_t)data->new_status == SENSOR_STATUS_OK) {
-          tgSend(MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_SENSOR_PRIORITY, CONFIG_NOTIFY_TELEGRAM_ALERT_SENSOR_STATE, CONFIG_TELEGRAM_DEVICE, 
-            CONFIG_MESSAGE_TG_SENSOR_OK, sensor->getName());
-        } else {
-          tgSend(MK_SERVICE, CONFIG_NOTIFY_TELEGRAM_SENSOR_PRIORITY, CONFIG_NOTIFY_TELEGRAM_ALERT_SENSOR_STATE, CONFIG_TELEGRAM_DEVICE, 
-            CONFIG_MESSAGE_TG_SENSOR_ERROR, sensor->getName(), sensor->statusString((sensor_status_t)data->new_status));
+  // Internet
+  #if CONFIG_PINGER_ENABLE
+    states = statesCtxGet(ctx);
+    if (states & STATES_FLEET_LINK_CONNECTED) {
+      if (states & INET_AVAILABLED) {
+        if (statesFleetChance(seed, model->loss)) {
+          statesFleetMqttLost(node);
+          ping_inet_data_t data;
+          memset(&data, 0, sizeof(data));
+          data.time_unavailable = time(nullptr);
+          statesFleetEvent(node, RE_PING_EVENTS, RE_PING_INET_UNAVAILABLE, &data);
         };
-      #if CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+      } else if (statesFleetChance(seed, model->recovery)) {
+        statesFleetEvent(node, RE_PING_EVENTS, RE_PING_INET_AVAILABLE, nullptr);
       };
-      #endif // CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-    #endif // ENABLE_NOTIFY_SENSOR_STATE
+    };
+  #endif // CONFIG_PINGER_ENABLE
+
+  // Broker: the client switches to the other broker and connects to it later
+  states = statesCtxGet(ctx);
+  if (states & INET_AVAILABLED) {
+    if (states & MQTT_CONNECTED) {
+      if (statesFleetChance(seed, model->failover)) {
+        statesFleetMqttLost(node);
+        node->primary = !node->primary;
+        statesFleetEvent(node, RE_MQTT_EVENTS, node->primary ? RE_MQTT_SERVER_PRIMARY : RE_MQTT_SERVER_RESERVED, nullptr);
+        portENTER_CRITICAL(&_statesFleetLock);
+        _statesFleet.failovers++;
+        portEXIT_CRITICAL(&_statesFleetLock);
+      };
+    } else if (statesFleetChance(seed, model->recovery)) {
+      statesFleetMqttEvent(node, RE_MQTT_CONNECTED);
+    };
   };
+
+  return statesCtxCheck(ctx, MQTT_CONNECTED, false);
 }
 
-#endif // CONFIG_NO_SENSORS
+static void statesFleetFree(uint16_t nodes)
+{
+  for (uint16_t i = 0; i < nodes; i++) {
+    statesFleetNodeDown(&_statesFleetNodes[i]);
+  };
+  __atomic_store_n(&_statesFleetNodesCount, 0, __ATOMIC_RELEASE);
+  #if !CONFIG_STATES_STATIC_ALLOCATION
+    free(_statesFleetNodes);
+    _statesFleetNodes = nullptr;
+  #endif // CONFIG_STATES_STATIC_ALLOCATION
+}
 
-bool statesEventHandlerRegister()
+static void statesFleetTask(void* arg)
 {
-  rlog_d(logTAG, "Register system states event handlers...");
-  bool ret = eventHandlerRegister(RE_TIME_EVENTS, ESP_EVENT_ANY_ID, &statesEventHandlerTime, nullptr)
-          && eventHandlerRegister(RE_WIFI_EVENTS, ESP_EVENT_ANY_ID, &statesEventHandlerWiFi, nullptr)
-          && eventHandlerRegister(RE_MQTT_EVENTS, ESP_EVENT_ANY_ID, &statesEventHandlerMqtt, nullptr)
-          #if CONFIG_PINGER_ENABLE
-            && eventHandlerRegister(RE_PING_EVENTS, ESP_EVENT_ANY_ID, &statesEventHandlerPing, nullptr)
-          #endif // CONFIG_PINGER_ENABLE
-          #ifndef CONFIG_NO_SENSORS
-          && eventHandlerRegister(RE_SENSOR_EVENTS, RE_SENSOR_STATUS_CHANGED, &statesEventHandlerSensor, nullptr)
-          #endif // CONFIG_NO_SENSORS
-          && eventHandlerRegister(RE_SYSTEM_EVENTS, ESP_EVENT_ANY_ID, &statesEventHandlerSystem, nullptr);
-  if (ret) {
-    #if CONFIG_ENABLE_STATES_NOTIFICATIONS && CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
-      healthMonitorsRegisterParameters();
-    #endif // CONFIG_NOTIFY_TELEGRAM_CUSTOMIZABLE
+  uint32_t seed = esp_random() | 1;
+  states_fleet_model_t model = _statesFleet.model;
+  uint16_t nodes = _statesFleet.nodes;
+  TickType_t period = pdMS_TO_TICKS(model.tick_ms) > 0 ? pdMS_TO_TICKS(model.tick_ms) : 1;
+  uint32_t tick = 0;
+  while ((tick < _statesFleet.ticks) && !__atomic_load_n(&_statesFleet.stop, __ATOMIC_ACQUIRE)) {
+    tick++;
+    uint16_t online = 0;
+    #if CONFIG_ENABLE_STATES_NOTIFICATIONS
+      uint32_t suppressed = 0;
+    #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+    for (uint16_t i = 0; i < nodes; i++) {
+      if (statesFleetStep(&_statesFleetNodes[i], &model, &seed)) online++;
+      #if CONFIG_ENABLE_STATES_NOTIFICATIONS
+        if (_statesFleetNodes[i].up) suppressed += statesFleetSuppressed(&_statesFleetNodes[i]);
+      #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+    };
+    portENTER_CRITICAL(&_statesFleetLock);
+    _statesFleet.tick = tick;
+    _statesFleet.online = online;
+    if (online < _statesFleet.online_min) _statesFleet.online_min = online;
+    #if CONFIG_ENABLE_STATES_NOTIFICATIONS
+      _statesFleet.node_suppressed = suppressed;
+    #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+    portEXIT_CRITICAL(&_statesFleetLock);
+    vTaskDelay(period);
   };
-  return ret;
+
+  statesFleetFree(nodes);
+  portENTER_CRITICAL(&_statesFleetLock);
+  #if CONFIG_ENABLE_STATES_NOTIFICATIONS
+    _statesFleet.node_suppressed = 0;
+  #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+  _statesFleet.time_end = esp_timer_get_time();
+  _statesFleet.running = false;
+  portEXIT_CRITICAL(&_statesFleetLock);
+  rlog_i(logTAG, "Fleet simulation completed: %d nodes, %d ticks", nodes, tick);
+  vTaskDelete(nullptr);
 }
 
-void statesEventHandlerUnregister()
+bool statesFleetStart(uint16_t nodes, const states_fleet_model_t* model, uint32_t ticks)
 {
-  eventHandlerUnregister(RE_SYSTEM_EVENTS, ESP_EVENT_ANY_ID, &statesEventHandlerSystem);
-  eventHandlerUnregister(RE_TIME_EVENTS, ESP_EVENT_ANY_ID, &statesEventHandlerTime);
-  eventHandlerUnregister(RE_WIFI_EVENTS, ESP_EVENT_ANY_ID, &statesEventHandlerWiFi);
-  eventHandlerUnregister(RE_MQTT_EVENTS, ESP_EVENT_ANY_ID, &statesEventHandlerMqtt);
-  #if CONFIG_PINGER_ENABLE
-    eventHandlerUnregister(RE_PING_EVENTS, ESP_EVENT_ANY_ID, &statesEventHandlerPing);
-  #endif // CONFIG_PINGER_ENABLE
-  #ifndef CONFIG_NO_SENSORS
-    eventHandlerUnregister(RE_SENSOR_EVENTS, RE_SENSOR_STATUS_CHANGED, &statesEventHandlerSensor);
-  #endif // CONFIG_NO_SENSORS
-  rlog_d(logTAG, "System states event handlers unregistered");
-}
\ No newline at end of file
+  if ((nodes == 0) || (model == nullptr) || (ticks == 0)) return false;
+  if (nodes > CONFIG_STATES_FLEET_NODES_MAX) nodes = CONFIG_STATES_FLEET_NODES_MAX;
+  portENTER_CRITICAL(&_statesFleetLock);
+  if (_statesFleet.running) {
+    portEXIT_CRITICAL(&_statesFleetLock);
+    rlog_w(logTAG, "Fleet simulation is already running");
+    return false;
+  };
+  memset(&_statesFleet, 0, sizeof(_statesFleet));
+  _statesFleet.running = true;
+  portEXIT_CRITICAL(&_statesFleetLock);
+
+  #if !CONFIG_STATES_STATIC_ALLOCATION
+    _statesFleetNodes = (states_fleet_node_t*)calloc(nodes, sizeof(states_fleet_node_t));
+    if (_statesFleetNodes == nullptr) {
+      rlog_e(logTAG, "Failed to allocate %d virtual nodes", nodes);
+      _statesFleet.running = false;
+      return false;
+    };
+  #else
+    memset(_statesFleetNodes, 0, sizeof(_statesFleetNodes));
+  #endif // CONFIG_STATES_STATIC_ALLOCATION
+  for (uint16_t i = 0; i < nodes; i++) {
+    snprintf(_statesFleetNodes[i].name, sizeof(_statesFleetNodes[i].name), STATES_FLEET_NAME_PREFIX "%u", i);
+    _statesFleetNodes[i].primary = true;
+  };
+  __atomic_store_n(&_statesFleetNodesCount, nodes, __ATOMIC_RELEASE);
+
+  _statesFleet.ticks = ticks;
+  _statesFleet.model = *model;
+  _statesFleet.time_start = esp_timer_get_time();
+  #if CONFIG_ENABLE_STATES_NOTIFICATIONS
+    _statesFleet.window_start = _statesFleet.time_start;
+  #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+
+  // The fleet starts online, a node that could not be created stays down for the whole run
+  uint16_t created = 0;
+  for (uint16_t i = 0; i < nodes; i++) {
+    if (statesFleetNodeUp(&_statesFleetNodes[i], model, true)) created++;
+  };
+  _statesFleet.nodes = nodes;
+  _statesFleet.online_min = created;
+  bool started = created > 0;
+  if (started) {
+    #if CONFIG_STATES_STATIC_ALLOCATION
+      started = xTaskCreateStatic(statesFleetTask, "states_fleet", CONFIG_STATES_FLEET_STACK, nullptr, CONFIG_STATES_FLEET_PRIORITY, 
+        _statesFleetTaskStack, &_statesFleetTaskBuffer) != nullptr;
+    #else
+      started = xTaskCreate(statesFleetTask, "states_fleet", CONFIG_STATES_FLEET_STACK, nullptr, CONFIG_STATES_FLEET_PRIORITY, nullptr) == pdPASS;
+    #endif // CONFIG_STATES_STATIC_ALLOCATION
+  };
+  if (!started) {
+    rlog_e(logTAG, "Failed to start fleet simulation");
+    statesFleetFree(nodes);
+    _statesFleet.running = false;
+    return false;
+  };
+  rlog_i(logTAG, "Fleet simulation started: %d of %d nodes, %d ticks of %d ms", created, nodes, ticks, model->tick_ms);
+  return true;
+}
+
+void statesFleetStop()
+{
+  __atomic_store_n(&_statesFleet.stop, true, __ATOMIC_RELEASE);
+}
+
+bool statesFleetRunning()
+{
+  return __atomic_load_n(&_statesFleet.running, __ATOMIC_ACQUIRE);
+}
+
+static void statesFleetWriter(states_buf_t* buf, void* arg)
+{
+  states_fleet_t fleet;
+  portENTER_CRITICAL(&_statesFleetLock);
+  memcpy(&fleet, &_statesFleet, sizeof(states_fleet_t));
+  portEXIT_CRITICAL(&_statesFleetLock);
+
+  int64_t duration = (fleet.running ? esp_timer_get_time() : fleet.time_end) - fleet.time_start;
+  statesBufPrintf(buf, "{\"running\":%d,\"nodes\":%d,\"tick\":%u,\"ticks\":%u,\"duration_us\":%lld,\"online\":%d,\"online_min\":%d,\"events\":%u",
+    fleet.running, fleet.nodes, fleet.tick, fleet.ticks, duration, fleet.online, fleet.online_min, fleet.events);
+  statesBufPrintf(buf, ",\"model\":{\"loss\":%d,\"flap\":%d,\"failover\":%d,\"recovery\":%d,\"tick_ms\":%u,\"alert_threshold\":%u,\"watchdog_timeout\":%u}",
+    fleet.model.loss, fleet.model.flap, fleet.model.failover, fleet.model.recovery, fleet.model.tick_ms, fleet.model.alert_threshold, 
+    fleet.model.watchdog_timeout);
+  statesBufPrintf(buf, ",\"mqtt\":{\"messages\":%u,\"bytes\":%u,\"dropped\":%u,\"failovers\":%u}", 
+    fleet.publishes, fleet.publish_bytes, fleet.dropped, fleet.failovers);
+  #if CONFIG_ENABLE_STATES_NOTIFICATIONS
+    statesBufPrintf(buf, ",\"notify\":{\"service\":%u,\"mqtt_errors\":%u,\"bytes\":%u,\"suppressed\":%u,\"node_peak\":%u,\"window\":%d,\"window_peak\":%u}",
+      fleet.notify[SN_SERVICE], fleet.notify[SN_MQTT_ERRORS], fleet.notify_bytes, fleet.suppressed + fleet.node_suppressed, fleet.node_peak, 
+      CONFIG_STATES_FLEET_WINDOW, fleet.window_peak);
+  #endif // CONFIG_ENABLE_STATES_NOTIFICATIONS
+  statesBufPrintf(buf, ",\"restarts\":%u}", fleet.restarts);
+}
+
+size_t statesFleetJsonTo(char* buffer, size_t size)
+{
+  return statesBufWrite(statesFleetWriter, nullptr, buffer, size);
+}
+
+#if !CONFIG_STATES_ZERO_HEAP
+char* statesFleetJson()
+{
+  return statesBufMalloc(statesFleetWriter, nullptr);
+}
+#endif // CONFIG_STATES_ZERO_HEAP
+
+#endif // CONFIG_STATES_FLEET_SIM